@@ -9,6 +9,9 @@
 #include "tsc.h"
 #include <asm/param.h>
 #include <sched.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/wait.h>
 #include "common.h"
 
 /*
@@ -31,22 +34,113 @@ measurements? How does it compare to what you were told about time slices in you
 previous OS course?
 */
 
-int main(int argc, const char *argv[])
+// Scheduling policies that can be requested with -s
+static const struct
 {
-  int cycles, i, s;
+  const char *name;
+  int policy;
+} policies[] = {
+    {"other", SCHED_OTHER},
+    {"batch", SCHED_BATCH},
+    {"idle", SCHED_IDLE},
+    {"fifo", SCHED_FIFO},
+    {"rr", SCHED_RR},
+};
+
+#define NUM_POLICIES (sizeof(policies) / sizeof(policies[0]))
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-n <processes>] [-N <child nice>] [-s other|batch|idle|fifo|rr] [-r <rt priority>] [-c <cpu>] [periods]\n", name);
+  fprintf(stderr, "Exits with status 2 if the requested policy or nice value is not permitted\n");
+}
+
+// Set the scheduling policy of the calling process (inherited by children across fork)
+static int set_policy(const char *name, int rt_priority)
+{
+  unsigned int i;
+  struct sched_param param = {0};
+
+  for (i = 0; i < NUM_POLICIES; i++)
+  {
+    if (strcmp(policies[i].name, name) == 0)
+    {
+      if (policies[i].policy == SCHED_FIFO || policies[i].policy == SCHED_RR)
+      {
+        param.sched_priority = rt_priority;
+      }
+      return sched_setscheduler(0, policies[i].policy, &param);
+    }
+  }
+
+  errno = EINVAL;
+  return -1;
+}
+
+int main(int argc, char *argv[])
+{
+  int cycles, i, s, opt;
   int num_periods = 10;
+  int num_procs = 2;
+  int child_nice = 0;
+  int rt_priority = 1;
+  int cpu = 1;
+  const char *policy = "other";
 
-  if (argc == 2)
+  while ((opt = getopt(argc, argv, "n:N:s:r:c:h")) != -1)
   {
-    num_periods = atoi(argv[1]);
+    switch (opt)
+    {
+    case 'n':
+      num_procs = atoi(optarg);
+      break;
+    case 'N':
+      child_nice = atoi(optarg);
+      break;
+    case 's':
+      policy = optarg;
+      break;
+    case 'r':
+      rt_priority = atoi(optarg);
+      break;
+    case 'c':
+      cpu = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      exit(1);
+    }
   }
 
-  u_int64_t a[num_periods * 2];
-  u_int64_t astart, istart, iend;
-  int fork_num = 1;
+  if (optind < argc)
+  {
+    num_periods = atoi(argv[optind]);
+  }
 
-  if (set_affinity(1) == -1)
+  if (num_procs < 1 || num_periods < 1)
   {
+    usage(argv[0]);
+    exit(1);
+  }
+
+  timeline *t;
+  u_int64_t *residuals;
+  char name[32];
+
+  if (set_affinity(cpu) == -1)
+  {
+    exit(1);
+  }
+
+  if (set_policy(policy, rt_priority) == -1)
+  {
+    perror("sched_setscheduler");
+    exit(errno == EPERM ? 2 : 1);
+  }
+
+  if ((t = timeline_create(num_procs, num_periods)) == NULL)
+  {
+    perror("mmap");
     exit(1);
   }
 
@@ -54,9 +148,10 @@ int main(int argc, const char *argv[])
 
   uint64_t threshold = find_page_time();
 
+  // All participants share this counter base, so their timestamps are directly comparable
   start_counter();
 
-  for (i = 0; i < fork_num; i++)
+  for (i = 1; i < num_procs; i++)
   {
     pid_t pid = fork();
 
@@ -67,19 +162,57 @@ int main(int argc, const char *argv[])
     else if (pid == 0)
     {
       // Child process
-      astart = inactive_periods(num_periods, threshold, a);
-      print_output(cycles, astart, num_periods, a, " child");
+      if (child_nice != 0)
+      {
+        errno = 0;
+        if (nice(child_nice) == -1 && errno != 0)
+        {
+          perror("nice");
+          exit(2);
+        }
+      }
+
+      timeline_record(t, i, threshold);
       return 0;
     }
   }
 
   // Parent Process
-  for (i = 0; i < fork_num; i++)
+  timeline_record(t, 0, threshold);
+
+  for (i = 1; i < num_procs; i++)
   {
-    astart = inactive_periods(num_periods, threshold, a);
-    print_output(cycles, astart, num_periods, a, " parent");
-    pid_t pid = wait(&s);
+    if (wait(&s) > 0 && WIFEXITED(s) && WEXITSTATUS(s) != 0)
+    {
+      exit(WEXITSTATUS(s));
+    }
   }
 
+  // All participants are done, so the whole timeline can be printed and analyzed
+  printf("Config: processes %d, periods %d, policy %s, child nice %d, cycles per ms %d\n",
+         num_procs, num_periods, policy, child_nice, cycles);
+
+  for (i = 0; i < num_procs; i++)
+  {
+    if (i == 0)
+    {
+      snprintf(name, sizeof(name), " parent");
+    }
+    else if (num_procs == 2)
+    {
+      snprintf(name, sizeof(name), " child");
+    }
+    else
+    {
+      snprintf(name, sizeof(name), " child%d", i);
+    }
+    print_output(cycles, t->astart[i], num_periods, timeline_samples(t, i), name);
+  }
+
+  residuals = malloc(num_procs * num_periods * sizeof(u_int64_t));
+  print_switches(cycles, analyze_switches(t, residuals), residuals);
+
+  free(residuals);
+  timeline_destroy(t);
   return 0;
 }
@@ -9,6 +9,9 @@
 #include "tsc.h"
 #include <asm/param.h>
 #include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "common.h"
 
 #define SLEEP_TIME 1E8L
 #define NUM_TRIALS 5L
@@ -99,6 +102,68 @@ u_int64_t inactive_periods(int num, u_int64_t threshold, u_int64_t *samples)
   return first_period;
 }
 
+// Current time of the given clock, in nanoseconds
+long long get_time_ns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+// Fills cpus with the CPUs of a NUMA node (from its sysfs cpulist, e.g. "0-3,8-11");
+// returns the number of CPUs, or -1 if the node does not exist
+int numa_node_cpus(int node, int *cpus, int max)
+{
+  char path[64];
+  int n = 0, first, last;
+  FILE *f;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+  if ((f = fopen(path, "r")) == NULL)
+  {
+    return -1;
+  }
+  while (fscanf(f, "%d", &first) == 1)
+  {
+    last = first;
+    if (fscanf(f, "-%d", &last) != 1)
+    {
+      last = first;
+    }
+    for (; first <= last && n < max; first++)
+    {
+      cpus[n++] = first;
+    }
+    if (fgetc(f) != ',')
+    {
+      break;
+    }
+  }
+  fclose(f);
+  return n;
+}
+
+int numa_num_nodes()
+{
+  int cpu, nodes = 0;
+  while (numa_node_cpus(nodes, &cpu, 1) >= 0)
+  {
+    nodes++;
+  }
+  return nodes;
+}
+
+// Binds the pages of [p, p + length) to a NUMA node (before they are first touched)
+int numa_bind(void *p, size_t length, int node)
+{
+  unsigned long mask = 1UL << node;
+  return syscall(SYS_mbind, p, length, MPOL_BIND, &mask, sizeof(mask) * 8, 0);
+}
+
 // Print: printf("%" PRIu64 "\n", a);
 
 uint64_t find_page_time()
@@ -155,3 +220,163 @@ int set_affinity(int cpu)
   CPU_SET(cpu, &set);
   return sched_setaffinity(getpid(), sizeof(cpu_set_t), &set);
 }
+
+/*
+A timeline shared by all processes taking part in an experiment. It lives in a
+single shared anonymous mapping created before fork, so every participant records
+its inactive periods directly into it and the parent sees all of them once the
+children exit. Timestamps are relative to the counter base set by start_counter()
+before forking, which the children inherit, so they are directly comparable.
+*/
+timeline *timeline_create(int num_procs, int num_periods)
+{
+  size_t size = sizeof(timeline) + num_procs * sizeof(u_int64_t) * (2 + 2 * num_periods);
+  timeline *t = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (t == MAP_FAILED)
+  {
+    return NULL;
+  }
+
+  t->num_procs = num_procs;
+  t->num_periods = num_periods;
+  t->size = size;
+  t->astart = (u_int64_t *)(t + 1);
+  t->aend = t->astart + num_procs;
+  t->samples = t->aend + num_procs;
+  return t;
+}
+
+void timeline_destroy(timeline *t)
+{
+  munmap(t, t->size);
+}
+
+u_int64_t *timeline_samples(timeline *t, int proc)
+{
+  return t->samples + 2 * (size_t)t->num_periods * proc;
+}
+
+// Record num_periods inactive periods of the calling process into the timeline
+void timeline_record(timeline *t, int proc, u_int64_t threshold)
+{
+  t->astart[proc] = inactive_periods(t->num_periods, threshold, timeline_samples(t, proc));
+  t->aend[proc] = get_counter();
+}
+
+typedef struct
+{
+  u_int64_t start;
+  int proc;
+} run_start;
+
+static int compare_run_start(const void *a, const void *b)
+{
+  const run_start *x = a, *y = b;
+  return (x->start > y->start) - (x->start < y->start);
+}
+
+/*
+Every inactive gap of a process that overlaps active periods of other processes
+contains at least two context switches (away from the process and back to it).
+Whatever part of the gap was not spent running the other processes is switch
+overhead; dividing it by the number of switches in the gap gives one residual
+sample per gap. Gaps in which no other participant ran are interrupts (or
+unrelated load) and are ignored. Returns the number of residuals written to
+residuals (which must hold num_procs * num_periods entries), sorted.
+*/
+int analyze_switches(timeline *t, u_int64_t *residuals)
+{
+  int p, q, j, k, n = 0;
+  int max_runs = t->num_procs * (t->num_periods + 1);
+  run_start *runs = malloc(max_runs * sizeof(run_start));
+
+  for (p = 0; p < t->num_procs; p++)
+  {
+    u_int64_t *gaps = timeline_samples(t, p);
+
+    for (j = 0; j < t->num_periods; j++)
+    {
+      u_int64_t g0 = gaps[2 * j], g1 = gaps[(2 * j) + 1];
+      u_int64_t busy = 0;
+      int num_runs = 0;
+
+      for (q = 0; q < t->num_procs; q++)
+      {
+        u_int64_t *s = timeline_samples(t, q);
+        u_int64_t astart = t->astart[q];
+
+        if (q == p)
+        {
+          continue;
+        }
+
+        // Active period k of q spans [astart, s[2k]]; the next one starts at s[2k + 1]
+        // and the last one ends when q stopped recording
+        for (k = 0; k <= t->num_periods; astart = s[(2 * k) + 1], k++)
+        {
+          u_int64_t aend = k < t->num_periods ? s[2 * k] : t->aend[q];
+          u_int64_t from = astart > g0 ? astart : g0;
+          u_int64_t to = aend < g1 ? aend : g1;
+
+          if (from >= to)
+          {
+            continue;
+          }
+          busy += to - from;
+          runs[num_runs].start = from;
+          runs[num_runs].proc = q;
+          num_runs++;
+        }
+      }
+
+      if (num_runs == 0 || busy >= g1 - g0)
+      {
+        continue;
+      }
+
+      // Consecutive active periods of the same process are one run (split by an interrupt)
+      qsort(runs, num_runs, sizeof(run_start), compare_run_start);
+      int switches = 2;
+      for (k = 1; k < num_runs; k++)
+      {
+        if (runs[k].proc != runs[k - 1].proc)
+        {
+          switches++;
+        }
+      }
+
+      residuals[n++] = (g1 - g0 - busy) / switches;
+    }
+  }
+
+  free(runs);
+  quick_sort(residuals, n);
+  return n;
+}
+
+// Print the residual switch overhead samples and a summary of their distribution
+void print_switches(uint64_t cycles, int n, u_int64_t *residuals)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+  {
+    printf("Residual %d: %ju cycles (%.3Lf us)\n", i, residuals[i], (long double)residuals[i] * 1000 / cycles);
+  }
+
+  if (n > 0)
+  {
+    printf("Switch overhead: %d samples, min %.3Lf us, p10 %.3Lf us, median %.3Lf us, p90 %.3Lf us, max %.3Lf us\n", n,
+           (long double)residuals[0] * 1000 / cycles,
+           (long double)residuals[n / 10] * 1000 / cycles,
+           (long double)residuals[n / 2] * 1000 / cycles,
+           (long double)residuals[(9 * n) / 10] * 1000 / cycles,
+           (long double)residuals[n - 1] * 1000 / cycles);
+  }
+  else
+  {
+    printf("Switch overhead: 0 samples\n");
+  }
+
+  fflush(stdout);
+}
@@ -1,5 +1,29 @@
 extern void quick_sort(u_int64_t *a, u_int64_t n);
 extern u_int64_t inactive_periods(int num, u_int64_t threshold, u_int64_t *samples);
+extern void print_output(uint64_t cycles, u_int64_t astart, int s, u_int64_t *a, char *name);
 extern uint64_t find_page_time();
 extern int set_affinity(int cpu);
+extern uint64_t get_cpu_freq();
 extern uint64_t get_gpu_freq();
+extern long long get_time_ns(clockid_t clock);
+extern int numa_node_cpus(int node, int *cpus, int max);
+extern int numa_num_nodes();
+extern int numa_bind(void *p, size_t length, int node);
+
+// Activity of all processes in an experiment, in memory shared across fork
+typedef struct
+{
+  int num_procs;
+  int num_periods;
+  size_t size;
+  u_int64_t *astart;  // start of the first active period of each process
+  u_int64_t *aend;    // end of the last active period of each process
+  u_int64_t *samples; // 2 * num_periods inactive period bounds per process
+} timeline;
+
+extern timeline *timeline_create(int num_procs, int num_periods);
+extern void timeline_destroy(timeline *t);
+extern u_int64_t *timeline_samples(timeline *t, int proc);
+extern void timeline_record(timeline *t, int proc, u_int64_t threshold);
+extern int analyze_switches(timeline *t, u_int64_t *residuals);
+extern void print_switches(uint64_t cycles, int n, u_int64_t *residuals);
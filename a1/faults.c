@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "common.h"
+
+/*
+Measures the cost of first-touch page faults, which dominate the warm-up of
+allocators and in-memory stores:
+
+  4k       minor fault per 4 KB page (transparent huge pages disabled)
+  thp      fault per 2 MB transparent huge page (MADV_HUGEPAGE)
+  populate mmap and madvise(MADV_POPULATE_WRITE) of the whole region, per 4 KB page
+  touch    mmap followed by a touch loop, per 4 KB page (compare with populate)
+  refault  refault per 4 KB page after madvise(MADV_DONTNEED) (and the madvise itself)
+  numa     first touch from the CPUs of node 0 of memory bound to each node
+
+Every test runs at 1..N threads. Each thread faults its own part of one shared
+region, so all of them contend on the same mm (page table and mmap locks), as
+the threads of a server warming up would. The cost of touching already-mapped
+memory is measured and subtracted from the touch figures (4k, thp, touch,
+refault, numa), so they are the fault cost only; populate and the madvise of
+refault are timed as a whole.
+*/
+
+#define PAGE_SIZE_4K 4096UL
+#define PAGE_SIZE_2M (2UL * 1024 * 1024)
+#define MAX_CPUS 1024
+
+typedef struct
+{
+  char *base;           // this thread's part of the region
+  size_t length;
+  size_t stride;        // touch one byte per stride
+  long long elapsed;    // ns spent by this thread in the measured step
+  int cpu;              // CPU to run on (-1: don't pin)
+} fault_args;
+
+static pthread_barrier_t barrier;
+static void *(*step)(fault_args *);
+
+static void touch(char *base, size_t length, size_t stride)
+{
+  size_t off;
+  for (off = 0; off < length; off += stride)
+  {
+    ((volatile char *)base)[off]++;
+  }
+}
+
+static void *step_touch(fault_args *a)
+{
+  touch(a->base, a->length, a->stride);
+  return NULL;
+}
+
+static void *step_dontneed(fault_args *a)
+{
+  madvise(a->base, a->length, MADV_DONTNEED);
+  return NULL;
+}
+
+static void *thread_f(void *arg)
+{
+  fault_args *a = arg;
+
+  if (a->cpu >= 0)
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(a->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+
+  pthread_barrier_wait(&barrier);
+  long long start = get_time_ns(CLOCK_MONOTONIC);
+  step(a);
+  a->elapsed = get_time_ns(CLOCK_MONOTONIC) - start;
+  return NULL;
+}
+
+// Run fn on all threads at once, each on its own part of the region; returns the slowest thread's time
+static long long run_threads(void *(*fn)(fault_args *), fault_args *args, int num_threads)
+{
+  pthread_t threads[num_threads];
+  long long slowest = 0;
+  int i;
+
+  step = fn;
+  pthread_barrier_init(&barrier, NULL, num_threads);
+  for (i = 0; i < num_threads; i++)
+  {
+    pthread_create(&threads[i], NULL, thread_f, &args[i]);
+  }
+  for (i = 0; i < num_threads; i++)
+  {
+    pthread_join(threads[i], NULL);
+    if (args[i].elapsed > slowest)
+    {
+      slowest = args[i].elapsed;
+    }
+  }
+  pthread_barrier_destroy(&barrier);
+  return slowest;
+}
+
+// Threads are pinned round-robin to the given CPUs (not pinned if there are none)
+static void split(fault_args *args, int num_threads, char *base, size_t length, size_t stride, const int *cpus,
+                  int num_cpus)
+{
+  size_t part = (length / num_threads) / stride * stride;
+  int i;
+
+  for (i = 0; i < num_threads; i++)
+  {
+    args[i].base = base + i * part;
+    args[i].length = part;
+    args[i].stride = stride;
+    args[i].cpu = num_cpus > 0 ? cpus[i % num_cpus] : -1;
+  }
+}
+
+static char *map(size_t length, int populate, int advice)
+{
+  // Reserve more than needed so the region can be aligned to a huge page boundary, then trim the excess; only the
+  // final region is made accessible, so nothing outside of it is ever populated
+  char *raw = mmap(NULL, length + PAGE_SIZE_2M, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (raw == MAP_FAILED)
+  {
+    perror("mmap");
+    exit(1);
+  }
+  char *p = (char *)(((uintptr_t)raw + PAGE_SIZE_2M - 1) & ~(PAGE_SIZE_2M - 1));
+  if (p > raw)
+  {
+    munmap(raw, p - raw);
+  }
+  munmap(p + length, raw + PAGE_SIZE_2M - p);
+
+  if (mprotect(p, length, PROT_READ | PROT_WRITE) == -1)
+  {
+    perror("mprotect");
+    exit(1);
+  }
+  if (advice >= 0)
+  {
+    madvise(p, length, advice);
+  }
+  // Prefault the whole region in one call, as MAP_POPULATE would, after the advice has been applied
+  if (populate && madvise(p, length, MADV_POPULATE_WRITE) == -1)
+  {
+    perror("madvise(MADV_POPULATE_WRITE)");
+    exit(1);
+  }
+  return p;
+}
+
+static void unmap(char *p, size_t length)
+{
+  munmap(p, length);
+}
+
+static void report(const char *test, const char *variant, int num_threads, size_t length, size_t page,
+                   long long fault_ns, long long mapped_ns)
+{
+  size_t pages = length / page;
+  long long net = fault_ns > mapped_ns ? fault_ns - mapped_ns : 0;
+
+  printf("Test %s%s, threads %d: %zu pages of %zu KB, %.1f ns per page (%.1f ns per 4 KB), %.2f GB/s\n",
+         test, variant, num_threads, pages, page / 1024, (double)net * num_threads / pages,
+         (double)net * num_threads / (length / PAGE_SIZE_4K), (double)length / fault_ns);
+  fflush(stdout);
+}
+
+// First touch of a fresh region, minus the cost of touching it again once mapped
+static void test_first_touch(const char *test, int num_threads, size_t length, size_t page, int advice)
+{
+  fault_args args[num_threads];
+  char *p = map(length, 0, advice);
+
+  split(args, num_threads, p, length, page, NULL, 0);
+  long long fault_ns = run_threads(step_touch, args, num_threads);
+  long long mapped_ns = run_threads(step_touch, args, num_threads);
+  report(test, "", num_threads, length, page, fault_ns, mapped_ns);
+  unmap(p, length);
+}
+
+static void *step_populate(fault_args *a)
+{
+  a->base = map(a->length, 1, MADV_NOHUGEPAGE);
+  return NULL;
+}
+
+static void *step_map_touch(fault_args *a)
+{
+  a->base = map(a->length, 0, MADV_NOHUGEPAGE);
+  touch(a->base, a->length, a->stride);
+  return NULL;
+}
+
+// Populating a region in one call against mmap and a touch loop, each thread mapping its own region
+static void test_populate(int num_threads, size_t length)
+{
+  fault_args args[num_threads];
+  int i;
+
+  split(args, num_threads, NULL, length, PAGE_SIZE_4K, NULL, 0);
+  long long populate_ns = run_threads(step_populate, args, num_threads);
+  long long mapped_ns = run_threads(step_touch, args, num_threads);
+  report("populate", "", num_threads, length, PAGE_SIZE_4K, populate_ns, 0);
+  for (i = 0; i < num_threads; i++)
+  {
+    unmap(args[i].base, args[i].length);
+  }
+
+  long long touch_ns = run_threads(step_map_touch, args, num_threads);
+  report("touch", "", num_threads, length, PAGE_SIZE_4K, touch_ns, mapped_ns);
+  for (i = 0; i < num_threads; i++)
+  {
+    unmap(args[i].base, args[i].length);
+  }
+}
+
+// Refault after MADV_DONTNEED, which is what a scavenging allocator pays on reuse
+static void test_refault(int num_threads, size_t length)
+{
+  fault_args args[num_threads];
+  char *p = map(length, 0, MADV_NOHUGEPAGE);
+
+  split(args, num_threads, p, length, PAGE_SIZE_4K, NULL, 0);
+  run_threads(step_touch, args, num_threads);
+  long long mapped_ns = run_threads(step_touch, args, num_threads);
+  long long dontneed_ns = run_threads(step_dontneed, args, num_threads);
+  long long refault_ns = run_threads(step_touch, args, num_threads);
+
+  report("refault", "", num_threads, length, PAGE_SIZE_4K, refault_ns, mapped_ns);
+  report("refault", " (madvise)", num_threads, length, PAGE_SIZE_4K, dontneed_ns, 0);
+  unmap(p, length);
+}
+
+// First touch from the CPUs of node 0 (one thread per CPU, as far as there are enough) of memory bound to each node
+// in turn
+static void test_numa(int num_threads, size_t length)
+{
+  fault_args args[num_threads];
+  int cpus[MAX_CPUS];
+  int num_cpus = numa_node_cpus(0, cpus, MAX_CPUS);
+  int node;
+  int nodes = numa_num_nodes();
+  char variant[32];
+
+  for (node = 0; node < nodes; node++)
+  {
+    char *p = map(length, 0, MADV_NOHUGEPAGE);
+
+    if (numa_bind(p, length, node) == -1)
+    {
+      perror("mbind");
+      unmap(p, length);
+      return;
+    }
+
+    split(args, num_threads, p, length, PAGE_SIZE_4K, cpus, num_cpus);
+    long long fault_ns = run_threads(step_touch, args, num_threads);
+    long long mapped_ns = run_threads(step_touch, args, num_threads);
+    snprintf(variant, sizeof(variant), " (node 0 -> %d)", node);
+    report("numa", variant, num_threads, length, PAGE_SIZE_4K, fault_ns, mapped_ns);
+    unmap(p, length);
+  }
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-t <test>[,<test>...]] [-s <region MB>] [-T <max threads>]\n", name);
+  fprintf(stderr, "Tests: 4k, thp, populate, refault, numa (default: all; populate also runs touch)\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const char *tests = "4k,thp,populate,refault,numa";
+  size_t length = 256UL * 1024 * 1024;
+  int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt, n;
+
+  while ((opt = getopt(argc, argv, "t:s:T:h")) != -1)
+  {
+    switch (opt)
+    {
+    case 't':
+      tests = optarg;
+      break;
+    case 's':
+      length = (size_t)atoi(optarg) * 1024 * 1024;
+      break;
+    case 'T':
+      max_threads = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      exit(1);
+    }
+  }
+
+  if (length < PAGE_SIZE_2M || max_threads < 1)
+  {
+    usage(argv[0]);
+    exit(1);
+  }
+  length &= ~(PAGE_SIZE_2M - 1);
+
+  printf("Config: region %zu MB, threads 1..%d\n", length >> 20, max_threads);
+
+  // Powers of two, always finishing with the full thread count
+  for (n = 1; n <= max_threads; n = (n < max_threads && n * 2 > max_threads) ? max_threads : n * 2)
+  {
+    if (strstr(tests, "4k"))
+    {
+      test_first_touch("4k", n, length, PAGE_SIZE_4K, MADV_NOHUGEPAGE);
+    }
+    if (strstr(tests, "thp"))
+    {
+      test_first_touch("thp", n, length, PAGE_SIZE_2M, MADV_HUGEPAGE);
+    }
+    if (strstr(tests, "populate"))
+    {
+      test_populate(n, length);
+    }
+    if (strstr(tests, "refault"))
+    {
+      test_refault(n, length);
+    }
+    if (strstr(tests, "numa"))
+    {
+      test_numa(n, length);
+    }
+  }
+
+  return 0;
+}
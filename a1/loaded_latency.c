@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "common.h"
+
+/*
+Measures memory latency under load, in the style of Intel MLC's loaded latency
+mode: one pinned thread chases pointers through a randomly linked buffer (so
+every load misses the caches and cannot be prefetched), while N other threads
+stream through their own buffers, pausing for a configurable delay after every
+chunk to throttle the bandwidth they inject. Sweeping the delay from large to 0
+gives the latency vs bandwidth curve, from idle latency up to saturation.
+
+All threads run on the CPUs of one node and all buffers are bound to one node;
+every (CPU node, memory node) pairing is measured, so remote accesses and the
+interconnect show up as separate curves.
+*/
+
+#define LINE_SIZE 64
+#define CHUNK_LINES 64          // lines streamed between two throttling delays
+#define MAX_CPUS 1024
+
+typedef struct
+{
+  char *base;
+  size_t length;
+  int cpu;
+  volatile u_int64_t bytes;     // streamed so far, read by the latency thread
+  char pad[LINE_SIZE];
+} bw_args;
+
+static volatile int stop;
+static volatile int delay;
+static int write_traffic;
+
+static void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __asm__ __volatile__("pause");
+#else
+  __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static void pin(int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static char *map(size_t length, int node)
+{
+  char *p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+  {
+    perror("mmap");
+    exit(1);
+  }
+  // Huge pages keep TLB misses out of the latency figures where available
+  madvise(p, length, MADV_HUGEPAGE);
+  if (numa_bind(p, length, node) == -1)
+  {
+    perror("mbind");
+    exit(1);
+  }
+  return p;
+}
+
+static void *bw_thread(void *arg)
+{
+  bw_args *a = arg;
+  size_t lines = a->length / LINE_SIZE;
+  size_t line = 0, i;
+  u_int64_t sum = 0;
+  int d;
+
+  pin(a->cpu);
+  while (!stop)
+  {
+    volatile u_int64_t *p = (volatile u_int64_t *)(a->base + line * LINE_SIZE);
+    for (i = 0; i < CHUNK_LINES; i++, p += LINE_SIZE / sizeof(u_int64_t))
+    {
+      if (write_traffic)
+      {
+        *p += 1;
+      }
+      else
+      {
+        sum += *p;
+      }
+    }
+    line = (line + CHUNK_LINES) % lines;
+    a->bytes += CHUNK_LINES * LINE_SIZE * (write_traffic ? 2 : 1);
+
+    for (d = delay; d > 0; d--)
+    {
+      cpu_relax();
+    }
+  }
+  return (void *)(uintptr_t)sum;
+}
+
+// Links the lines of the buffer into one cycle in random order; returns its start
+static void **build_chain(char *base, size_t length)
+{
+  size_t lines = length / LINE_SIZE;
+  size_t *order = malloc(lines * sizeof(size_t));
+  size_t i, j, t;
+
+  for (i = 0; i < lines; i++)
+  {
+    order[i] = i;
+  }
+  srand(469);
+  for (i = lines - 1; i > 0; i--)
+  {
+    j = (((size_t)rand() << 31) ^ rand()) % (i + 1);
+    t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+  for (i = 0; i < lines; i++)
+  {
+    *(void **)(base + order[i] * LINE_SIZE) = base + order[(i + 1) % lines] * LINE_SIZE;
+  }
+
+  void **start = (void **)(base + order[0] * LINE_SIZE);
+  free(order);
+  return start;
+}
+
+// Chases pointers for at least duration ns; returns the number of loads and their elapsed time
+static void **chase(void **p, long long duration, u_int64_t *loads, long long *elapsed)
+{
+  long long start = get_time_ns(CLOCK_MONOTONIC);
+  int i;
+
+  *loads = 0;
+  do
+  {
+    for (i = 0; i < 1024; i++)
+    {
+      p = (void **)*p;
+      p = (void **)*p;
+      p = (void **)*p;
+      p = (void **)*p;
+    }
+    *loads += 4096;
+    *elapsed = get_time_ns(CLOCK_MONOTONIC) - start;
+  } while (*elapsed < duration);
+  return p;
+}
+
+static u_int64_t total_bytes(bw_args *args, int n)
+{
+  u_int64_t bytes = 0;
+  int i;
+  for (i = 0; i < n; i++)
+  {
+    bytes += args[i].bytes;
+  }
+  return bytes;
+}
+
+// One point of the curve: latency while num_bw threads stream with the given delay
+static void **measure(void **chain, bw_args *args, int num_bw, int d, long long duration,
+                      int cpu_node, int mem_node)
+{
+  pthread_t threads[num_bw > 0 ? num_bw : 1];
+  struct timespec warmup = {0, 100000000};
+  u_int64_t loads, bytes;
+  long long elapsed, start;
+  int i;
+
+  stop = 0;
+  delay = d;
+  for (i = 0; i < num_bw; i++)
+  {
+    pthread_create(&threads[i], NULL, bw_thread, &args[i]);
+  }
+  nanosleep(&warmup, NULL);
+
+  bytes = total_bytes(args, num_bw);
+  start = get_time_ns(CLOCK_MONOTONIC);
+  chain = chase(chain, duration, &loads, &elapsed);
+  bytes = total_bytes(args, num_bw) - bytes;
+  elapsed = get_time_ns(CLOCK_MONOTONIC) - start;
+
+  stop = 1;
+  for (i = 0; i < num_bw; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+
+  if (num_bw == 0)
+  {
+    printf("Pairing cpu node %d, memory node %d, bw threads 0, delay idle: ", cpu_node, mem_node);
+  }
+  else
+  {
+    printf("Pairing cpu node %d, memory node %d, bw threads %d, delay %d: ", cpu_node, mem_node, num_bw, d);
+  }
+  // The latency thread's own traffic is one line per load
+  printf("bandwidth %.2f GB/s, latency %.1f ns\n", (double)(bytes + loads * LINE_SIZE) / elapsed,
+         (double)elapsed / loads);
+  fflush(stdout);
+  return chain;
+}
+
+static void run_pairing(int cpu_node, int mem_node, int num_bw, size_t chain_length, size_t bw_length,
+                        const char *delays, long long duration)
+{
+  int cpus[MAX_CPUS];
+  int num_cpus = numa_node_cpus(cpu_node, cpus, MAX_CPUS);
+  bw_args *args = calloc(num_bw > 0 ? num_bw : 1, sizeof(bw_args));
+  const char *d;
+  int i;
+
+  if (num_cpus <= 0)
+  {
+    fprintf(stderr, "Node %d has no CPUs, skipped\n", cpu_node);
+    free(args);
+    return;
+  }
+  if (num_bw > 0 && num_cpus == 1)
+  {
+    fprintf(stderr, "Node %d has a single CPU, bandwidth threads share it with the latency thread\n", cpu_node);
+  }
+
+  // The latency thread takes the first CPU of the node, the bandwidth threads the others
+  pin(cpus[0]);
+  char *chain_base = map(chain_length, mem_node);
+  void **chain = build_chain(chain_base, chain_length);
+
+  for (i = 0; i < num_bw; i++)
+  {
+    args[i].length = bw_length;
+    args[i].base = map(bw_length, mem_node);
+    args[i].cpu = num_cpus > 1 ? cpus[1 + i % (num_cpus - 1)] : cpus[0];
+    memset(args[i].base, 1, bw_length);
+  }
+
+  chain = measure(chain, args, 0, 0, duration, cpu_node, mem_node);
+  for (d = delays; d != NULL && num_bw > 0; d = strchr(d, ','), d = d ? d + 1 : NULL)
+  {
+    chain = measure(chain, args, num_bw, atoi(d), duration, cpu_node, mem_node);
+  }
+
+  for (i = 0; i < num_bw; i++)
+  {
+    munmap(args[i].base, bw_length);
+  }
+  munmap(chain_base, chain_length);
+  free(args);
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-T <bw threads>] [-d <delay>[,<delay>...]] [-c <cpu node>] [-m <memory node>] "
+          "[-s <latency buffer MB>] [-S <bw buffer MB>] [-t <ms per point>] [-w]\n", name);
+  fprintf(stderr, "Delays are pause iterations per %d streamed lines, largest (lightest load) first.\n", CHUNK_LINES);
+  fprintf(stderr, "-w streams read-modify-writes (1:1 read/write) instead of reads.\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const char *delays = "20000,10000,5000,2000,1000,500,200,100,50,20,0";
+  size_t chain_length = 256UL * 1024 * 1024;
+  size_t bw_length = 64UL * 1024 * 1024;
+  int num_bw = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  int cpu_node = -1, mem_node = -1;
+  long long duration = 200000000;
+  int opt, nodes, c, m;
+
+  while ((opt = getopt(argc, argv, "T:d:c:m:s:S:t:wh")) != -1)
+  {
+    switch (opt)
+    {
+    case 'T':
+      num_bw = atoi(optarg);
+      break;
+    case 'd':
+      delays = optarg;
+      break;
+    case 'c':
+      cpu_node = atoi(optarg);
+      break;
+    case 'm':
+      mem_node = atoi(optarg);
+      break;
+    case 's':
+      chain_length = (size_t)atoi(optarg) * 1024 * 1024;
+      break;
+    case 'S':
+      bw_length = (size_t)atoi(optarg) * 1024 * 1024;
+      break;
+    case 't':
+      duration = atoll(optarg) * 1000000;
+      break;
+    case 'w':
+      write_traffic = 1;
+      break;
+    default:
+      usage(argv[0]);
+      exit(1);
+    }
+  }
+
+  if (num_bw < 0 || chain_length < LINE_SIZE || bw_length < CHUNK_LINES * LINE_SIZE || duration <= 0)
+  {
+    usage(argv[0]);
+    exit(1);
+  }
+  bw_length -= bw_length % (CHUNK_LINES * LINE_SIZE);
+
+  if ((nodes = numa_num_nodes()) == 0)
+  {
+    fprintf(stderr, "No NUMA nodes found in /sys/devices/system/node\n");
+    exit(1);
+  }
+
+  printf("Config: nodes %d, bw threads %d, latency buffer %zu MB, bw buffer %zu MB, traffic %s\n", nodes, num_bw,
+         chain_length >> 20, bw_length >> 20, write_traffic ? "1:1 read/write" : "read");
+
+  for (c = 0; c < nodes; c++)
+  {
+    for (m = 0; m < nodes; m++)
+    {
+      if ((cpu_node < 0 || cpu_node == c) && (mem_node < 0 || mem_node == m))
+      {
+        run_pairing(c, m, num_bw, chain_length, bw_length, delays, duration);
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include "common.h"
+
+/*
+Measures how precisely a thread can wait for a requested interval with the
+different sleep and timer primitives. For every method, timer slack setting and
+requested interval, the wakeup overshoot (actual elapsed time minus the requested
+interval) is collected into a log2 histogram, and the CPU time consumed per wait
+is reported so that the cheapest method meeting a latency target can be chosen.
+
+Elapsed time is measured with CLOCK_MONOTONIC (served from the vDSO, ~20 ns per
+reading), which is also the clock all the timers below are armed against.
+*/
+
+#define NSEC_PER_SEC 1000000000LL
+#define NUM_BUCKETS 32
+
+// Requested intervals, in nanoseconds
+static const long long intervals[] = {
+    1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000,
+    1000000, 2000000, 5000000, 10000000, 20000000, 50000000, 100000000};
+
+#define NUM_INTERVALS (sizeof(intervals) / sizeof(intervals[0]))
+
+static int timer_fd = -1;
+static int epoll_fd = -1;
+
+// How long before the deadline the hybrid method stops sleeping and starts spinning
+static long long spin_margin = 50000;
+
+static struct timespec to_timespec(long long ns)
+{
+  struct timespec ts = {ns / NSEC_PER_SEC, ns % NSEC_PER_SEC};
+  return ts;
+}
+
+static void wait_nanosleep(long long start, long long interval)
+{
+  struct timespec ts = to_timespec(interval);
+  (void)start;
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+    ;
+}
+
+static void wait_clock_nanosleep(long long start, long long interval)
+{
+  struct timespec ts = to_timespec(start + interval);
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+static void wait_timerfd(long long start, long long interval)
+{
+  struct itimerspec its = {{0, 0}, to_timespec(start + interval)};
+  uint64_t expirations;
+
+  timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+  while (read(timer_fd, &expirations, sizeof(expirations)) == -1 && errno == EINTR)
+    ;
+}
+
+// epoll_wait only takes milliseconds; epoll_pwait2 (Linux 5.11) takes a timespec
+static void wait_epoll(long long start, long long interval)
+{
+  struct epoll_event event;
+  (void)start;
+#ifdef SYS_epoll_pwait2
+  static int have_pwait2 = 1;
+  if (have_pwait2)
+  {
+    struct timespec ts = to_timespec(interval);
+    if (syscall(SYS_epoll_pwait2, epoll_fd, &event, 1, &ts, NULL, 0) >= 0 || errno != ENOSYS)
+    {
+      return;
+    }
+    have_pwait2 = 0;
+  }
+#endif
+  epoll_wait(epoll_fd, &event, 1, (int)((interval + 999999) / 1000000));
+}
+
+static void wait_hybrid(long long start, long long interval)
+{
+  long long deadline = start + interval;
+
+  if (interval > spin_margin)
+  {
+    struct timespec ts = to_timespec(deadline - spin_margin);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+  }
+  while (get_time_ns(CLOCK_MONOTONIC) < deadline)
+    ;
+}
+
+static void wait_spin(long long start, long long interval)
+{
+  while (get_time_ns(CLOCK_MONOTONIC) < start + interval)
+    ;
+}
+
+static const struct
+{
+  const char *name;
+  void (*wait)(long long start, long long interval);
+} methods[] = {
+    {"nanosleep", wait_nanosleep},
+    {"clock_nanosleep", wait_clock_nanosleep},
+    {"timerfd", wait_timerfd},
+    {"epoll", wait_epoll},
+    {"hybrid", wait_hybrid},
+    {"spin", wait_spin},
+};
+
+#define NUM_METHODS (sizeof(methods) / sizeof(methods[0]))
+
+// Returns true if name is one of the comma-separated entries of list (NULL selects all)
+static int selected(const char *list, const char *name)
+{
+  size_t len = strlen(name);
+
+  while (list != NULL)
+  {
+    if (strncmp(list, name, len) == 0 && (list[len] == ',' || list[len] == '\0'))
+    {
+      return 1;
+    }
+    if ((list = strchr(list, ',')) != NULL)
+    {
+      list++;
+    }
+    else
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int bucket_of(long long overshoot)
+{
+  int b = 0;
+  while (overshoot > 1 && b < NUM_BUCKETS - 1)
+  {
+    overshoot >>= 1;
+    b++;
+  }
+  return b;
+}
+
+static int compare_ll(const void *a, const void *b)
+{
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+static void run(int m, const char *slack, long long interval, int samples, long long *overshoot)
+{
+  long long histogram[NUM_BUCKETS] = {0};
+  long long cpu_start, cpu_total;
+  int i, b;
+
+  cpu_start = get_time_ns(CLOCK_THREAD_CPUTIME_ID);
+  for (i = 0; i < samples; i++)
+  {
+    long long start = get_time_ns(CLOCK_MONOTONIC);
+    methods[m].wait(start, interval);
+    overshoot[i] = get_time_ns(CLOCK_MONOTONIC) - start - interval;
+  }
+  cpu_total = get_time_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+
+  for (i = 0; i < samples; i++)
+  {
+    histogram[bucket_of(overshoot[i] > 0 ? overshoot[i] : 0)]++;
+  }
+  qsort(overshoot, samples, sizeof(long long), compare_ll);
+
+  printf("Method %s, slack %s, interval %lld ns: samples %d, min %lld ns, median %lld ns, p99 %lld ns, max %lld ns, cpu %lld ns per wait\n",
+         methods[m].name, slack, interval, samples, overshoot[0], overshoot[samples / 2],
+         overshoot[(samples * 99) / 100], overshoot[samples - 1], cpu_total / samples);
+
+  for (b = 0; b < NUM_BUCKETS; b++)
+  {
+    if (histogram[b] != 0)
+    {
+      printf("Histogram %s, slack %s, interval %lld ns: overshoot < %lld ns: %lld\n",
+             methods[m].name, slack, interval, 2LL << b, histogram[b]);
+    }
+  }
+
+  fflush(stdout);
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-m <method>[,<method>...]] [-n <samples>] [-t <max interval ns>] [-s <spin margin ns>] [-S default|min|both] [-c <cpu>]\n", name);
+  fprintf(stderr, "Methods: nanosleep, clock_nanosleep, timerfd, epoll, hybrid, spin (default: all)\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const char *method_list = NULL;
+  const char *slack_mode = "both";
+  long long max_interval = 100000000;
+  int samples = 1000;
+  int cpu = -1;
+  int opt, m, s;
+  unsigned int i;
+
+  while ((opt = getopt(argc, argv, "m:n:t:s:S:c:h")) != -1)
+  {
+    switch (opt)
+    {
+    case 'm':
+      method_list = optarg;
+      break;
+    case 'n':
+      samples = atoi(optarg);
+      break;
+    case 't':
+      max_interval = atoll(optarg);
+      break;
+    case 's':
+      spin_margin = atoll(optarg);
+      break;
+    case 'S':
+      slack_mode = optarg;
+      break;
+    case 'c':
+      cpu = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      exit(1);
+    }
+  }
+
+  if (samples < 1)
+  {
+    usage(argv[0]);
+    exit(1);
+  }
+
+  if (cpu >= 0 && set_affinity(cpu) == -1)
+  {
+    perror("sched_setaffinity");
+    exit(1);
+  }
+
+  if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, 0)) == -1 ||
+      (epoll_fd = epoll_create1(0)) == -1)
+  {
+    perror("timerfd_create/epoll_create1");
+    exit(1);
+  }
+
+  long long *overshoot = malloc(samples * sizeof(long long));
+  long default_slack = prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+
+  printf("Config: samples %d, spin margin %lld ns, default timer slack %ld ns\n", samples, spin_margin, default_slack);
+
+  // Slack setting 0 is the inherited default, 1 is the minimum (1 ns)
+  for (s = 0; s < 2; s++)
+  {
+    const char *slack = s == 0 ? "default" : "min";
+    if (strcmp(slack_mode, "both") != 0 && strcmp(slack_mode, slack) != 0)
+    {
+      continue;
+    }
+    prctl(PR_SET_TIMERSLACK, s == 0 ? default_slack : 1, 0, 0, 0);
+
+    for (m = 0; m < (int)NUM_METHODS; m++)
+    {
+      if (!selected(method_list, methods[m].name))
+      {
+        continue;
+      }
+
+      for (i = 0; i < NUM_INTERVALS && intervals[i] <= max_interval; i++)
+      {
+        // Keep the long intervals from dominating the run time
+        int n = samples;
+        while (n > 10 && n * intervals[i] > 5 * NSEC_PER_SEC)
+        {
+          n /= 2;
+        }
+        run(m, slack, intervals[i], n, overshoot);
+      }
+    }
+  }
+
+  free(overshoot);
+  close(epoll_fd);
+  close(timer_fd);
+  return 0;
+}
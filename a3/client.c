@@ -70,25 +70,51 @@ static op_type get_op_type(char type)
 	}
 }
 
-// Maximum length of a string describing an operation
-#define MAX_STR_LEN 2048
-
-// Keys and values used by this client are non-empty null-terminated strings
+// Keys and values used by this client are non-empty null-terminated strings (of any length, up to MAX_VALUE_SIZE for
+// values, so they are allocated on the heap)
 // " " is a special value for CHECK operations meaning that the key shouldn't exist
 typedef struct _operation {
-	char key[MAX_STR_LEN];
-	char value[MAX_STR_LEN];
+	char *key;
+	char *value;
 	char type;// noop/get/put/check
 	int count;
 	int index;// corresponds to line number in the operation file
 } operation;
 
 typedef struct _result {
-	char value[MAX_STR_LEN];
+	char *value;// NULL if no value was received
 	op_status status;
 } result;
 
+static void free_operation(operation *op)
+{
+	free(op->key);
+	free(op->value);
+	op->key = op->value = NULL;
+}
+
+// Copy an operation, with its own key and value; returns false on failure
+static bool copy_operation(operation *dst, const operation *src)
+{
+	*dst = *src;
+	dst->key = strdup(src->key);
+	dst->value = strdup(src->value);
+	if ((dst->key == NULL) || (dst->value == NULL)) {
+		perror("strdup");
+		free_operation(dst);
+		return false;
+	}
+	return true;
+}
+
+static void free_result(result *res)
+{
+	free(res->value);
+	res->value = NULL;
+}
+
 // Read a key-value operation from the given string. Returns false if the input doesn't match the format
+// On success, the key and value of the operation are allocated and must be freed with free_operation()
 static bool parse_operation(const char *str, operation *op)
 {
 	assert(str != NULL);
@@ -99,16 +125,25 @@ static bool parse_operation(const char *str, operation *op)
 	//
 	// NOTE: no need to limit the length of strings being read since both the 'op->key'
 	//       and 'op->value' buffers have the same length as the whole input string
+	size_t len = strlen(str);
+	op->key = calloc(len + 1, 1);
+	op->value = calloc(len + 1, 1);
+	if ((op->key == NULL) || (op->value == NULL)) {
+		perror("calloc");
+		free_operation(op);
+		return false;
+	}
+
 	int matches_num = sscanf(str, " %c \"%[^\"]\" \"%[^\"]\" %d", &(op->type), op->key, op->value, &(op->count));
 	if (matches_num < 1) {// no type
-		return false;
+		goto fail;
 	}
 
 	if (matches_num < 4) {// count not specified
 		op->count = 1;
 	}
 	if (op->count <= 0) {
-		return false;
+		goto fail;
 	}
 
 	// " " is a special value; set it to an empty string for simplicity
@@ -117,110 +152,428 @@ static bool parse_operation(const char *str, operation *op)
 		op->value[0] = '\0';
 	}
 
+	bool valid = false;
 	switch (op->type) {
 		case OP_TYPE_NOOP :
-		case OP_TYPE_GET  : return  matches_num >= 2;// no value needed (unless need to specify count)
-		case OP_TYPE_CHECK: return  matches_num >= 3;
-		case OP_TYPE_PUT  : return (matches_num >= 3) && (op->value[0] != '\0');// value must be non-empty
-		default           : return false;
+		case OP_TYPE_GET  : valid =  matches_num >= 2; break;// no value needed (unless need to specify count)
+		case OP_TYPE_CHECK: valid =  matches_num >= 3; break;
+		case OP_TYPE_PUT  : valid = (matches_num >= 3) && (op->value[0] != '\0'); break;// value must be non-empty
+		default           : break;
+	}
+	if (valid) {
+		return true;
 	}
+
+fail:
+	free_operation(op);
+	return false;
 }
 
 
-// Contact metadata server and obtain server info for a given key
-// Returns a socket fd connected to the server
-static int get_key_server(const char key[KEY_SIZE])
+// Connections to the metadata server and to the key-value servers are persistent: they are opened on first use,
+// shared by all operations, and only closed (to be reopened by the next operation) when they fail
+
+// Socket connected to the metadata server; -1 if not connected
+static int mserver_fd = -1;
+
+// Maximum number of key-value servers this client keeps connections to
+#define MAX_SERVER_CONNECTIONS 64
+
+typedef struct _server_connection {
+	char host_name[HOST_NAME_MAX];
+	uint16_t port;
+	int fd;// -1 if not connected
+} server_connection;
+
+static server_connection server_connections[MAX_SERVER_CONNECTIONS];
+static int num_server_connections = 0;
+
+// Id of the next request sent by this client (unique per client, so responses can be matched with requests)
+static uint32_t next_req_id = 1;
+
+// Get the connection to a key-value server, connecting to it if needed; returns NULL on failure
+static server_connection *get_server_connection(const char *host_name, uint16_t port)
 {
-	assert(key != NULL);
+	assert(host_name != NULL);
 
-	int mserver_fd = connect_to_server(mserver_host_name, mserver_port);
-	if (mserver_fd < 0) {
-		return -1;
+	server_connection *conn = NULL;
+	for (int i = 0; i < num_server_connections; i++) {
+		if ((server_connections[i].port == port) && (strcmp(server_connections[i].host_name, host_name) == 0)) {
+			conn = &(server_connections[i]);
+			break;
+		}
 	}
 
-	locate_request request = {0};
-	request.hdr.type = MSG_LOCATE_REQ;
-	memcpy(request.key, key, KEY_SIZE);
+	if (conn == NULL) {
+		if (num_server_connections == MAX_SERVER_CONNECTIONS) {
+			fprintf(stderr, "Too many key-value server connections\n");
+			return NULL;
+		}
+		conn = &(server_connections[num_server_connections++]);
+		strncpy(conn->host_name, host_name, sizeof(conn->host_name) - 1);
+		conn->port = port;
+		conn->fd = -1;
+	}
+
+	if ((conn->fd == -1) && ((conn->fd = connect_to_server(host_name, port)) < 0)) {
+		conn->fd = -1;
+		return NULL;
+	}
+	return conn;
+}
+
+// Close all connections
+static void close_connections()
+{
+	close_safe(&mserver_fd);
+	for (int i = 0; i < num_server_connections; i++) {
+		close_safe(&(server_connections[i].fd));
+	}
+}
+
+
+// Maximum number of operations sent to the servers before waiting for their responses
+#define PIPELINE_DEPTH 32
+
+// An operation in a pipelined batch
+typedef struct _pending_operation {
+	const operation *op;
+	char key[KEY_SIZE];
+	uint32_t req_id;// of the request currently in flight
+	server_connection *conn;// NULL if the key-value server isn't known (or the request couldn't be sent)
+	bool done;// response received
+	result res;
+} pending_operation;
+
+// Find the operation in a batch that is waiting for the response with given request id
+static pending_operation *find_pending(pending_operation *batch, int num_ops, uint32_t req_id)
+{
+	for (int i = 0; i < num_ops; i++) {
+		if (batch[i].req_id == req_id) {
+			return &(batch[i]);
+		}
+	}
+	return NULL;
+}
+
+// Routing table obtained from the metadata server; keys are routed locally with it, and it is only fetched again
+// when a server rejects a request (or can't be reached), i.e. when the routing may have changed
+static char routing_buffer[MAX_MSG_LEN];
+static routing_response *routing = (routing_response*)routing_buffer;
+static bool routing_valid = false;
+
+// Get the routing table from the metadata server; returns false on failure
+static bool fetch_routing_table()
+{
+	if ((mserver_fd == -1) && ((mserver_fd = connect_to_server(mserver_host_name, mserver_port)) < 0)) {
+		mserver_fd = -1;
+		return false;
+	}
+
+	routing_request request = {0};
+	request.hdr.type = MSG_ROUTING_REQ;
+	request.hdr.req_id = next_req_id++;
+	uint32_t req_id = request.hdr.req_id;
 
 	char recv_buffer[MAX_MSG_LEN] = {0};
 	if (!send_msg(mserver_fd, &request, sizeof(request)) ||
-	    !recv_msg(mserver_fd, recv_buffer, sizeof(recv_buffer), MSG_LOCATE_RESP))
+	    !recv_msg(mserver_fd, recv_buffer, sizeof(recv_buffer), MSG_ROUTING_RESP))
 	{
-		close(mserver_fd);
-		return -1;
+		close_safe(&mserver_fd);
+		return false;
 	}
 
-	close(mserver_fd);// one request per connection
-	locate_response *response = (locate_response*)recv_buffer;
-	log_write("Key %s is stored on %s:%d\n", key_to_str(key), response->host_name, response->port);
+	routing_response *response = (routing_response*)recv_buffer;
+	if (response->hdr.req_id != req_id) {
+		fprintf(stderr, "Unexpected ROUTING response id %u\n", response->hdr.req_id);
+		close_safe(&mserver_fd);
+		return false;
+	}
+
+	memcpy(routing_buffer, recv_buffer, response->hdr.length);
+	routing_valid = true;
+	log_write("Routing table epoch %u, %hu servers\n", routing->epoch, routing->num_servers);
+	return true;
+}
+
+// Find the key-value server for a key in the routing table and get a connection to it; returns NULL on failure
+// (or if requests for the key can't be sent at the moment)
+static server_connection *route_key(const char key[KEY_SIZE])
+{
+	assert(key != NULL);
+	assert(routing_valid);
 
-	return connect_to_server(response->host_name, response->port);
+	const routing_entry *entry = &(routing->servers[key_server_id(key, routing->num_servers)]);
+	if (entry->paused) {
+		return NULL;
+	}
+
+	const routing_entry *server = &(routing->servers[entry->serving_sid]);
+	log_write("Key %s is stored on %s:%d\n", key_to_str(key), server->host_name, server->port);
+	return get_server_connection(server->host_name, server->port);
 }
 
-// Send a GET/PUT operation to the server (connected to via server_fd) and get reply back
-// Fills the result with the server's response
-// Returns true if the operation was successfully executed (but not necessarily with a SUCCESS status)
-// If the server fails to respond, fills the result status with SERVER_FAILURE and returns false
-static bool send_operation(int server_fd, const char key[KEY_SIZE], const operation* op, result* res)
+// Send a GET/PUT operation to the server (connected to via server_fd), without waiting for the reply
+// Returns false if the request couldn't be sent
+static bool send_operation(int server_fd, const char key[KEY_SIZE], const operation* op, uint32_t req_id)
 {
 	assert(key != NULL);
 	assert(op  != NULL);
-	assert(res != NULL);
 
-	char send_buffer[MAX_MSG_LEN] = {0};
-	operation_request *request = (operation_request*)send_buffer;
-	request->hdr.type = MSG_OPERATION_REQ;
-	request->type = get_op_type(op->type);
-	memcpy(request->key, key, KEY_SIZE);
+	operation_request request = {0};
+	request.hdr.type = MSG_OPERATION_REQ;
+	request.hdr.req_id = req_id;
+	request.type = get_op_type(op->type);
+	memcpy(request.key, key, KEY_SIZE);
 
-	// Need to copy the value, only for PUT operations
-	int value_sz = 0;
-	if (request->type == OP_PUT) {
+	// The value (only for PUT operations) is sent straight from the operation, without copying it
+	size_t value_sz = 0;
+	if (request.type == OP_PUT) {
 		value_sz = strlen(op->value) + 1;
-		strncpy(request->value, op->value, value_sz);
 	}
 
-	char recv_buffer[MAX_MSG_LEN] = {0};
-	if (!send_msg(server_fd, request, sizeof(*request) + value_sz) ||
-	    !recv_msg(server_fd, recv_buffer, sizeof(recv_buffer), MSG_OPERATION_RESP))
-	{
-		res->status = SERVER_FAILURE;
+	return send_msg_value(server_fd, &request, sizeof(request), op->value, value_sz);
+}
+
+// Send the GET (or PUT) operation batch[first], along with the following operations of the batch of the same type
+// that go to the same server and are not sent yet, in one MULTI request (or on its own if there are no others); they
+// all get the given request id. Returns false if the request couldn't be sent
+static bool send_multi_operation(pending_operation *batch, int num_ops, int first, uint32_t req_id)
+{
+	pending_operation *p = &(batch[first]);
+	op_type type = get_op_type(p->op->type);
+	assert((type == OP_GET) || (type == OP_PUT));
+
+	int count = 0;
+	size_t length = sizeof(multi_request);
+	for (int i = first; (i < num_ops) && (count < MULTI_MAX_OPS); i++) {
+		pending_operation *q = &(batch[i]);
+		if ((q->conn != p->conn) || (q->req_id != 0) || (get_op_type(q->op->type) != type)) {
+			continue;
+		}
+		size_t record_length = sizeof(multi_op) + ((type == OP_PUT) ? strlen(q->op->value) + 1 : 0);
+		if (length + record_length > MAX_DATA_MSG_LEN) {
+			break;
+		}
+		q->req_id = req_id;
+		length += record_length;
+		count++;
+	}
+	if (count == 1) {
+		return send_operation(p->conn->fd, p->key, p->op, req_id);
+	}
+
+	multi_request *request = malloc(length);
+	if (request == NULL) {
+		perror("malloc");
+		return false;
+	}
+	memset(request, 0, sizeof(*request));
+	request->hdr.type = MSG_MULTI_REQ;
+	request->hdr.req_id = req_id;
+	request->type = type;
+	request->num_ops = count;
+
+	size_t pos = 0;
+	for (int i = first; (i < num_ops) && (pos < length - sizeof(multi_request)); i++) {
+		pending_operation *q = &(batch[i]);
+		if ((q->req_id != req_id) || (q->conn != p->conn)) {
+			continue;
+		}
+		multi_op *op = (multi_op*)(request->ops + pos);
+		memcpy(op->key, q->key, KEY_SIZE);
+		op->value_sz = (type == OP_PUT) ? strlen(q->op->value) + 1 : 0;
+		memcpy(op->value, q->op->value, op->value_sz);
+		pos += sizeof(multi_op) + op->value_sz;
+	}
+
+	bool result = send_msg(p->conn->fd, request, length);
+	free(request);
+	return result;
+}
+
+// Fill the result of an operation of a batch
+static void set_result(pending_operation *p, op_status status, const char *value, size_t value_sz)
+{
+	p->res.status = status;
+	if ((p->res.value = strndup(value, value_sz)) == NULL) {
+		perror("strndup");
+		p->res.status = SERVER_FAILURE;
+	}
+	p->done = true;
+}
+
+// Fill the results of the operations of a batch that were sent in one MULTI request (in the order of the batch)
+// Returns false if the response doesn't match them (the connection is then closed)
+static bool process_multi_response(server_connection *conn, pending_operation *batch, int num_ops,
+                                   const multi_response *response)
+{
+	int num_results = 0;
+	size_t pos = 0;
+	for (int i = 0; i < num_ops; i++) {
+		pending_operation *p = &(batch[i]);
+		if (p->req_id != response->hdr.req_id) {
+			continue;
+		}
+		if ((p->conn != conn) || p->done || (num_results == response->num_results)) {
+			break;
+		}
+
+		const multi_result *result = (const multi_result*)(response->results + pos);
+		set_result(p, result->status, result->value, result->value_sz);
+		pos += sizeof(multi_result) + result->value_sz;
+		num_results++;
+	}
+
+	if (num_results != response->num_results) {
+		fprintf(stderr, "Unexpected MULTI response id %u\n", response->hdr.req_id);
+		close_safe(&(conn->fd));
+		return false;
+	}
+	return true;
+}
+
+// Receive the next response from a key-value server and fill the result of the matching operation in the batch
+// Returns false if the connection failed (it is then closed)
+static bool recv_operation_response(server_connection *conn, pending_operation *batch, int num_ops)
+{
+	assert(conn != NULL);
+
+	// The buffer grows to the largest response received so far
+	static char *recv_buffer = NULL;
+	static size_t recv_buffer_size = 0;
+	if (!recv_msg_alloc(conn->fd, &recv_buffer, &recv_buffer_size, -1)) {
+		close_safe(&(conn->fd));
+		return false;
+	}
+
+	msg_type type = ((msg_hdr*)recv_buffer)->type;
+	if (type == MSG_MULTI_RESP) {
+		return process_multi_response(conn, batch, num_ops, (multi_response*)recv_buffer);
+	}
+	if (type != MSG_OPERATION_RESP) {
+		fprintf(stderr, "Wrong message type: %s (expected %s)\n", msg_type_str[type], msg_type_str[MSG_OPERATION_RESP]);
+		close_safe(&(conn->fd));
 		return false;
 	}
 
 	operation_response *response = (operation_response*)recv_buffer;
-	res->status = response->status;
-	value_sz = response->hdr.length - sizeof(operation_response);
-	strncpy(res->value, response->value, value_sz);
+	pending_operation *p = find_pending(batch, num_ops, response->hdr.req_id);
+	if ((p == NULL) || (p->conn != conn) || p->done) {
+		fprintf(stderr, "Unexpected OPERATION response id %u\n", response->hdr.req_id);
+		close_safe(&(conn->fd));
+		return false;
+	}
+
+	set_result(p, response->status, response->value, response->hdr.length - sizeof(operation_response));
+	return true;
+}
 
+// Returns true if an operation of a batch failed and needs to be retried
+static bool operation_failed(const pending_operation *p)
+{
 	// A key-value server can return the SERVER_FAILURE status even if it's alive
 	// (e.g. if it fails to forward a PUT operation to its secondary replica)
-	return res->status != SERVER_FAILURE;
+	return !p->done || (p->res.status == SERVER_FAILURE) || (p->res.status == WRONG_SERVER);
 }
 
-// Contact the metadata server, contact the key-value server, get response
-static bool execute_operation(const operation *op, result *res)
+// Route the keys, contact the key-value servers, get responses, for a batch of operations
+// All requests of the batch are sent before waiting for any response; keys in a batch must be distinct
+// (apart from repetitions of the same operation), since requests for different keys can complete in any order
+static void execute_batch(pending_operation *batch, int num_ops)
 {
-	assert(op != NULL);
+	assert(batch != NULL);
+
+	for (int i = 0; i < num_ops; i++) {
+		batch[i].req_id = 0;
+		batch[i].conn = NULL;
+		batch[i].done = false;
+		free_result(&(batch[i].res));
+		batch[i].res.status = SERVER_FAILURE;
+	}
 
-	char *key = (char*)md5sum((unsigned char*)op->key, 0);
-	log_write("\"%s\" -> %s\n", op->key, key_to_str(key));
+	// Route the keys, fetching the routing table first if needed
+	if (routing_valid || fetch_routing_table()) {
+		for (int i = 0; i < num_ops; i++) {
+			batch[i].conn = route_key(batch[i].key);
+		}
+	}
 
-	int server_fd = get_key_server(key);
-	if (server_fd < 0) {
-		free(key);
-		return false;
+	// Send all requests; the GETs (and the PUTs) that go to the same server are sent together in MULTI requests
+	for (int i = 0; i < num_ops; i++) {
+		pending_operation *p = &(batch[i]);
+		if ((p->conn == NULL) || (p->conn->fd == -1)) {
+			p->conn = NULL;
+			continue;
+		}
+		if (p->req_id != 0) {
+			continue;// sent along with an earlier operation
+		}
+
+		uint32_t req_id = next_req_id++;
+		bool sent;
+		if (get_op_type(p->op->type) == OP_NOOP) {
+			p->req_id = req_id;
+			sent = send_operation(p->conn->fd, p->key, p->op, req_id);
+		} else {
+			sent = send_multi_operation(batch, num_ops, i, req_id);
+		}
+		if (!sent) {
+			close_safe(&(p->conn->fd));
+			p->conn = NULL;
+		}
+	}
+
+	// Collect the responses (in whatever order each server sends them)
+	for (int i = 0; i < num_ops; i++) {
+		server_connection *conn = batch[i].conn;
+		while ((conn != NULL) && (conn->fd != -1) && !batch[i].done) {
+			recv_operation_response(conn, batch, num_ops);
+		}
+	}
+
+	// If the routing may have changed, get a new routing table before retrying
+	for (int i = 0; i < num_ops; i++) {
+		if (operation_failed(&(batch[i]))) {
+			routing_valid = false;
+		}
 	}
+}
+
+// Route the key, contact the key-value server, get response (the previous value in the result is freed)
+static bool execute_operation(const operation *op, result *res)
+{
+	assert(op != NULL);
 
-	bool result = send_operation(server_fd, key, op, res);
+	pending_operation p = {0};
+	p.op = op;
+	char *key = (char*)md5sum((unsigned char*)op->key, 0);
+	memcpy(p.key, key, KEY_SIZE);
 	free(key);
-	close(server_fd);// one request per connection
-	return result;
+	log_write("\"%s\" -> %s\n", op->key, key_to_str(p.key));
+
+	execute_batch(&p, 1);
+	free_result(res);
+	*res = p.res;
+	return !operation_failed(&p);
 }
 
 // Time (in seconds) between reconnection attempts
 static const int retry_interval = 1;
 
+// Wait before retrying failed operations; if they were only rejected by servers that don't own their keys anymore
+// (WRONG_SERVER), the routing table is fetched right away, and if it has changed, they are retried without waiting
+static void wait_retry(bool wrong_server_only)
+{
+	if (wrong_server_only) {
+		uint32_t epoch = routing->epoch;
+		if (fetch_routing_table() && (routing->epoch != epoch)) {
+			return;
+		}
+	}
+	sleep(retry_interval);
+}
+
 // If the key-value server times out or fails, retry the metadata server
 static bool execute_operation_retry(const operation *op, result *res, int attempts)
 {
@@ -230,7 +583,7 @@ static bool execute_operation_retry(const operation *op, result *res, int attemp
 		}
 		if (i < attempts - 1) {
 			log_write("Failed to execute operation, retrying...\n");
-			sleep(retry_interval);
+			wait_retry(res->status == WRONG_SERVER);
 		}
 	}
 
@@ -309,18 +662,74 @@ static void prompt(FILE *input)
 // The number of attempts to execute the operation before giving up
 static const int max_attempts = 10;
 
+// Operations whose requests are currently pipelined
+static operation batch_ops[PIPELINE_DEPTH];
+static int num_batch_ops = 0;
+static pending_operation batch[PIPELINE_DEPTH];
+static int batch_size = 0;
+
+// Execute the current batch and check the results, in the order of the operations; returns true if no failures occured
+static bool flush_batch()
+{
+	bool success = true;
+	if (batch_size == 0) {
+		return success;
+	}
+
+	execute_batch(batch, batch_size);
+
+	// Operations that failed are retried one at a time
+	bool failed = false;
+	bool wrong_server_only = true;
+	for (int i = 0; i < batch_size; i++) {
+		if (operation_failed(&(batch[i]))) {
+			failed = true;
+			wrong_server_only &= batch[i].done && (batch[i].res.status == WRONG_SERVER);
+		}
+	}
+	if (failed) {
+		log_write("Failed to execute operation, retrying...\n");
+		wait_retry(wrong_server_only);
+	}
+
+	for (int i = 0; i < batch_size; i++) {
+		pending_operation *p = &(batch[i]);
+		result res = p->res;
+		p->res.value = NULL;
+		if (!operation_failed(p) || execute_operation_retry(p->op, &res, max_attempts - 1)) {
+			if (!check_operation_result(p->op, &res)) {
+				success = false;
+			}
+		} else {
+			fprintf(stderr, "Operation #%d failed with: %s\n", p->op->index, op_status_str[res.status]);
+			log_write("Operation #%d failed with: %s\n", p->op->index, op_status_str[res.status]);
+			success = false;
+		}
+		free_result(&res);
+	}
+
+	for (int i = 0; i < num_batch_ops; i++) {
+		free_operation(&(batch_ops[i]));
+	}
+	num_batch_ops = 0;
+	batch_size = 0;
+	return success;
+}
+
 // Read and execute a set of operations from given input stream; returns true if no failures occured
+// Operations read from a file are pipelined, PIPELINE_DEPTH at a time; interactive input is executed line by line
 static bool execute_operations(FILE *input)
 {
 	assert(input != NULL);
 	bool success = true;
 
 	int index = 1;
-	char line[MAX_STR_LEN] = "";
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
 	prompt(input);
-	while (fgets(line, sizeof(line), input) != NULL) {
+	while ((len = getline(&line, &line_size, input)) > 0) {
 		// Remove trailing '\n'
-		size_t len = strnlen(line, sizeof(line));
 		if (line[len - 1] == '\n') {
 			line[len - 1] = '\0';
 		}
@@ -343,24 +752,47 @@ static bool execute_operations(FILE *input)
 			printf("#%d: %c \"%s\" \"%s\" %d\n", op.index, op.type, op.key, op.value, op.count);
 		}
 
+		char *key = (char*)md5sum((unsigned char*)op.key, 0);
+		log_write("\"%s\" -> %s\n", op.key, key_to_str(key));
+
+		// Operations on the same key must complete in order, so they can't be in the same batch
+		for (int i = 0; i < batch_size; i++) {
+			if (memcmp(batch[i].key, key, KEY_SIZE) == 0) {
+				success &= flush_batch();
+				break;
+			}
+		}
+
 		// Execute the operation (possibly multiple times)
 		for (int i = 0; i < op.count; i++) {
-			result res = {0};
-			if (execute_operation_retry(&op, &res, max_attempts)) {
-				if (!check_operation_result(&op, &res)) {
+			if (batch_size == PIPELINE_DEPTH) {
+				success &= flush_batch();
+			}
+			// Repetitions of the operation within a batch share one copy of it
+			if ((num_batch_ops == 0) || (batch_ops[num_batch_ops - 1].index != op.index)) {
+				if (!copy_operation(&(batch_ops[num_batch_ops]), &op)) {
 					success = false;
+					break;
 				}
-			} else {
-				fprintf(stderr, "Operation #%d failed with: %s\n", op.index, op_status_str[res.status]);
-				log_write("Operation #%d failed with: %s\n", op.index, op_status_str[res.status]);
-				success = false;
+				num_batch_ops++;
 			}
+			pending_operation *p = &(batch[batch_size++]);
+			p->op = &(batch_ops[num_batch_ops - 1]);
+			memcpy(p->key, key, KEY_SIZE);
+		}
+		free(key);
+		free_operation(&op);
+
+		if (input == stdin) {
+			success &= flush_batch();
 		}
 
 	next:
 		prompt(input);
 	}
 
+	success &= flush_batch();
+	free(line);
 	printf("\n");
 	return success;
 }
@@ -392,6 +824,8 @@ int main(int argc, char **argv)
 		success = execute_operations(stdin);
 	}
 
+	close_connections();
+
 	// Return 0 only if no failures occured
 	return success ? 0 : 1;
 }
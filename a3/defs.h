@@ -26,6 +26,25 @@ typedef enum {
 	MSG_SERVER_CTRL_REQ,
 	MSG_SERVER_CTRL_RESP,
 
+	// Getting the routing table (locations of all key-value servers)
+	MSG_ROUTING_REQ,
+	MSG_ROUTING_RESP,
+
+	// Replicating PUTs from a primary key set to its other copy
+	MSG_REPLICATION_REQ,
+	MSG_REPLICATION_ACK,
+
+	// Transferring a whole key set to a recovering server (acknowledged with MSG_REPLICATION_ACK)
+	MSG_BULK_REQ,
+
+	// Comparing the digests of key ranges with a recovering server (to only transfer the ranges that differ)
+	MSG_DIGEST_REQ,
+	MSG_DIGEST_RESP,
+
+	// GET/PUT operations on many keys at once
+	MSG_MULTI_REQ,
+	MSG_MULTI_RESP,
+
 	MSG_TYPE_MAX,
 // "packed" enum means that it has the least possible (hence platform-independent) size, 1 byte in this case
 } __attribute__((packed)) msg_type;
@@ -45,21 +64,42 @@ static const char *msg_type_str[MSG_TYPE_MAX] = {
 	"MSERVER CTRL request",
 
 	"SERVER CTRL request",
-	"SERVER CTRL response"
+	"SERVER CTRL response",
+
+	"ROUTING request",
+	"ROUTING response",
+
+	"REPLICATION request",
+	"REPLICATION ack",
+
+	"BULK request",
+
+	"DIGEST request",
+	"DIGEST response",
+
+	"MULTI request",
+	"MULTI response"
 };
 
 
-// A "magic number" in the message header (for checking consistency)
-#define HDR_MAGIC 0x7B
+// A "magic number" in the message header (for checking consistency); it also tells the version of the framing:
+// version 2 has 32-bit message lengths (version 1, with 16-bit lengths, used 0x7B)
+#define HDR_MAGIC 0x7C
 
-// Maximum length of a message
+// Maximum length of a message, apart from those that carry values (see MAX_DATA_MSG_LEN)
 #define MAX_MSG_LEN 2048
 
+// Bulk transfer messages are filled up to this length (unless a single PUT is longer)
+#define MAX_BULK_MSG_LEN (64 * 1024)
+
 // A common header for all messages
+// Connections are persistent and requests can be pipelined: the sender picks a request id, and the response to a
+// request carries the same id (responses are not necessarily sent in the order of the requests)
 typedef struct _msg_hdr {
 	char magic;
 	msg_type type;
-	uint16_t length;
+	uint32_t length;
+	uint32_t req_id;
 // "packed" struct means there is no padding between the fields (so that the layout is platform-independent)
 } __attribute__((packed)) msg_hdr;
 
@@ -81,6 +121,36 @@ typedef struct _locate_response {
 } __attribute__((packed)) locate_response;
 
 
+// "Routing" request: get the locations of all key-value servers, so that clients can route keys by themselves
+// The metadata server increments the epoch whenever the routing changes (a server fails, recovers, or its key set is
+// switched); a client keeps using its copy until a server rejects a request with the WRONG_SERVER status
+
+// Maximum length of a host name in the routing table
+#define ROUTING_HOST_NAME_LEN 64
+
+typedef struct _routing_entry {
+	char host_name[ROUTING_HOST_NAME_LEN];
+	uint16_t port;// client port
+	uint8_t state;// kv_server_state
+	uint8_t paused;// non-zero if requests for the key set of this server must not be sent (it is being switched)
+	uint16_t serving_sid;// the server currently serving the key set of this server (itself or its secondary)
+} __attribute__((packed)) routing_entry;
+
+typedef struct _routing_request {
+	msg_hdr hdr;
+} __attribute__((packed)) routing_request;
+
+typedef struct _routing_response {
+	msg_hdr hdr;
+	uint32_t epoch;
+	uint16_t num_servers;
+	routing_entry servers[];
+} __attribute__((packed)) routing_response;
+
+// Maximum number of servers that fit into a routing table
+#define ROUTING_MAX_SERVERS ((MAX_MSG_LEN - sizeof(routing_response)) / sizeof(routing_entry))
+
+
 // Key-value server request - GET or PUT operation
 
 // Operation types
@@ -109,6 +179,7 @@ typedef enum {
 	SERVER_FAILURE,
 	KEY_NOT_FOUND,
 	OUT_OF_SPACE,// not enough memory to store an item
+	WRONG_SERVER,// the server doesn't serve the key (the client's routing table is stale)
 
 	OP_STATUS_MAX
 } __attribute__((packed)) op_status;
@@ -119,7 +190,8 @@ static const char *op_status_str[OP_STATUS_MAX] = {
 
 	"Server failure",
 	"Key not found",
-	"Out of space"
+	"Out of space",
+	"Wrong server"
 };
 
 typedef struct _operation_request {
@@ -136,6 +208,119 @@ typedef struct _operation_response {
 } __attribute__((packed)) operation_response;
 
 
+// Replication stream: the server that updates a key set sends the PUTs to the server that stores the other copy
+// Every PUT gets the next sequence number of the stream (starting from 1 on every connection). A request carries a
+// burst of consecutive PUTs, packed as replication_put records, which the receiver applies in order. An ack carries
+// the sequence number of the last PUT applied so far (acks are cumulative), the status of the PUTs it covers, and the
+// PUTs of a replication request that failed with another status (those of a bulk request only fail the whole ack).
+// A PUT also carries the version that the primary server assigned to it, which the copy stores along with the value.
+
+typedef struct _replication_put {
+	char key[KEY_SIZE];
+	uint64_t version;
+	uint32_t value_sz;
+	char value[];
+} __attribute__((packed)) replication_put;
+
+typedef struct _replication_request {
+	msg_hdr hdr;
+	uint64_t first_seq;
+	uint16_t num_puts;
+	char puts[];// replication_put records
+} __attribute__((packed)) replication_request;
+
+typedef struct _replication_failure {
+	uint64_t seq;
+	op_status status;
+} __attribute__((packed)) replication_failure;
+
+// Maximum number of failures listed in an ack: the most PUTs a replication request can carry
+#define REPL_ACK_MAX_FAILURES ((MAX_MSG_LEN - sizeof(replication_request)) / sizeof(replication_put))
+
+typedef struct _replication_ack {
+	msg_hdr hdr;
+	uint64_t seq;
+	op_status status;// of the PUTs covered by the ack that are not listed in failures
+	uint16_t num_failures;
+	replication_failure failures[];// in sequence number order
+} __attribute__((packed)) replication_ack;
+
+// A bulk request is part of the transfer of a key set to a recovering server; it carries many more PUTs than a
+// replication request, and belongs to the same stream (so it shares the sequence numbers and the acks). total_puts
+// is the number of keys in the whole set, so that the receiver can size its table before inserting them.
+typedef struct _bulk_request {
+	msg_hdr hdr;
+	uint64_t first_seq;
+	uint64_t total_puts;
+	uint16_t num_puts;
+	char puts[];// replication_put records
+} __attribute__((packed)) bulk_request;
+
+// Maximum size of a value
+#define MAX_VALUE_SIZE (16 * 1024 * 1024)
+
+// Maximum length of the messages that carry values (OPERATION, REPLICATION/BULK and MULTI requests, OPERATION and
+// MULTI responses)
+// Replication requests are filled up to MAX_MSG_LEN, and bulk requests up to MAX_BULK_MSG_LEN, but a PUT of a larger
+// value is sent in a request of its own
+#define MAX_DATA_MSG_LEN (sizeof(bulk_request) + sizeof(replication_put) + MAX_VALUE_SIZE)
+
+
+// Multi-key operations: a MULTI request carries the GETs (MGET) or the PUTs (MPUT) of up to MULTI_MAX_OPS keys served
+// by the same server, and the response carries their results in the same order. Every key succeeds or fails on its
+// own (e.g. with WRONG_SERVER if the client's routing table is stale). GET records have no value. The results of GETs
+// whose values don't fit into the response (MAX_DATA_MSG_LEN bytes) fail with SERVER_FAILURE.
+
+typedef struct _multi_op {
+	char key[KEY_SIZE];
+	uint32_t value_sz;
+	char value[];
+} __attribute__((packed)) multi_op;
+
+typedef struct _multi_request {
+	msg_hdr hdr;
+	op_type type;// OP_GET or OP_PUT
+	uint16_t num_ops;
+	char ops[];// multi_op records
+} __attribute__((packed)) multi_request;
+
+typedef struct _multi_result {
+	op_status status;
+	uint32_t value_sz;
+	char value[];
+} __attribute__((packed)) multi_result;
+
+typedef struct _multi_response {
+	msg_hdr hdr;
+	uint16_t num_results;
+	char results[];// multi_result records
+} __attribute__((packed)) multi_response;
+
+#define MULTI_MAX_OPS 256
+
+
+// Digests of key ranges: every server keeps a Merkle tree over the key ranges of each of its sets (see merkle.h).
+// A server about to resynchronize a set with a recovering server asks it for the digests of some tree nodes
+// (starting from the root, then the children of the nodes that differ), and only transfers the keys in the ranges
+// whose digests differ. set_id is the id of the primary server of the set.
+
+typedef struct _digest_request {
+	msg_hdr hdr;
+	uint16_t set_id;
+	uint16_t num_nodes;
+	uint16_t nodes[];
+} __attribute__((packed)) digest_request;
+
+typedef struct _digest_response {
+	msg_hdr hdr;
+	uint16_t num_nodes;
+	uint64_t digests[];// in the order of the nodes in the request
+} __attribute__((packed)) digest_response;
+
+// Maximum number of nodes in a digest request
+#define DIGEST_MAX_NODES ((MAX_MSG_LEN - sizeof(digest_response)) / sizeof(uint64_t))
+
+
 // Control requests serviced by the metadata server
 
 // Request types (as described in the assignment handout)
@@ -148,6 +333,8 @@ typedef enum {
 	UPDATED_SECONDARY,
 	UPDATE_SECONDARY_FAILED,
 
+	REGISTER,// sent once by a starting server, when it is ready
+
 	MSERVER_CTRLREQ_TYPE_MAX
 } __attribute__((packed)) mserver_ctrlreq_type;
 
@@ -159,13 +346,18 @@ static const char *mserver_ctrlreq_type_str[MSERVER_CTRLREQ_TYPE_MAX] = {
 	"UPDATE-PRIMARY failed",
 
 	"UPDATED-SECONDARY",
-	"UPDATE-SECONDARY failed"
+	"UPDATE-SECONDARY failed",
+
+	"REGISTER"
 };
 
 typedef struct _mserver_ctrl_request {
 	msg_hdr hdr;
 	mserver_ctrlreq_type type;
 	uint16_t server_id;
+	// Latest versions of the server's sets (0 if empty), for choosing between delta and full resynchronization
+	uint64_t primary_version;
+	uint64_t secondary_version;
 } __attribute__((packed)) mserver_ctrl_request;
 
 
@@ -197,6 +389,20 @@ static const char *server_ctrlreq_type_str[SERVER_CTRLREQ_TYPE_MAX] = {
 	"SHUTDOWN"
 };
 
+// How a set is sent to a recovering server (for UPDATE_{PRIMARY|SECONDARY} requests)
+typedef enum {
+	RESYNC_FULL,// all keys
+	RESYNC_DELTA,// only the key ranges whose digests differ
+
+	RESYNC_MODE_MAX
+} __attribute__((packed)) resync_mode;
+
+__attribute__((unused))
+static const char *resync_mode_str[RESYNC_MODE_MAX] = {
+	"full",
+	"delta"
+};
+
 // Request status
 typedef enum {
 	CTRLREQ_SUCCESS,
@@ -214,6 +420,7 @@ static const char *server_ctrlreq_status_str[SERVER_CTRLREQ_STATUS_MAX] = {
 typedef struct _server_ctrl_request {
 	msg_hdr hdr;
 	server_ctrlreq_type type;
+	resync_mode resync;
 	// Server location (for {SET|UPDATE}_{PRIMARY|SECONDARY} requests)
 	uint16_t port;
 	char host_name[];
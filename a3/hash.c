@@ -1,239 +1,1342 @@
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "hash.h"
 
 
-// Initialize a hash table with given size; returns true on success
-bool hash_init(hash_table *table, size_t size)
+// Control byte values; full slots store the 7-bit h2 of the key hash (0..127)
+#define CTRL_EMPTY   ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+
+// Maximum load (full slots + tombstones) before a shard is resized: 7/8
+#define MAX_LOAD_NUM 7
+#define MAX_LOAD_DEN 8
+
+// A shard is shrunk when its load drops below a quarter of the maximum load
+#define SHRINK_LOAD_DIV 4
+
+
+// Hash function
+// Keys are MD5 digests, but key_server_id() partitions them between servers by their last byte, so all the
+// keys stored on one server share it; only the first 8 bytes are used here. They are still run through a
+// 64-bit finalizer (from MurmurHash3) so that every hash bit depends on every key bit, whatever the keys are.
+static uint64_t hash_f(const char key[KEY_SIZE])
+{
+	assert(key != NULL);
+
+	uint64_t h;
+	memcpy(&h, key, sizeof(h));
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// Key comparison function
+static bool equals_f(const char key1[KEY_SIZE], const char key2[KEY_SIZE])
+{
+	assert(key1 != NULL);
+	assert(key2 != NULL);
+
+	return (key1 == key2) || (memcmp(key1, key2, KEY_SIZE) == 0);
+}
+
+
+// The shard is selected by the top bits of the hash, the group by the bits above h2, h2 by the low 7 bits
+static hash_shard *get_shard(const hash_table *table, uint64_t h)
 {
 	assert(table != NULL);
-	assert(size != 0);
+	return &(table->shards[(h >> 58) & (table->num_shards - 1)]);
+}
 
-	if ((table->buckets = malloc(size * sizeof(hash_bucket))) == NULL) {
-		perror("malloc");
-		return false;
+static size_t h1(uint64_t h)
+{
+	return (size_t)(h >> 7);
+}
+
+static int8_t h2(uint64_t h)
+{
+	return (int8_t)(h & 0x7F);
+}
+
+
+static void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+// Begin a modification of a shard (the shard must be locked)
+static void write_begin(hash_shard *shard)
+{
+	__atomic_store_n(&(shard->seq), shard->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// End a modification of a shard
+static void write_end(hash_shard *shard)
+{
+	__atomic_store_n(&(shard->seq), shard->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Begin a lock-free read of a shard; returns the sequence number to validate the read against
+static uint32_t read_begin(const hash_shard *shard)
+{
+	uint32_t seq;
+	while ((seq = __atomic_load_n(&(shard->seq), __ATOMIC_ACQUIRE)) & 1) {
+		cpu_relax();
 	}
+	return seq;
+}
+
+// Returns true if nothing read since read_begin() returned seq has been modified
+static bool read_valid(const hash_shard *shard, uint32_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&(shard->seq), __ATOMIC_RELAXED) == seq;
+}
+
+
+// Reader ids are per thread and shared by all tables; an id is released when its thread exits (outside of any read,
+// so its epoch is 0 in every table), and reused by the next thread that reads
+static pthread_mutex_t reader_ids_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool reader_id_used[HASH_MAX_READERS];
+static volatile int num_reader_ids = 0;// ids below this one may be in use
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t reader_key;
+static __thread int reader_id = -1;
 
-	table->size = size;
-	for (size_t i = 0; i < size; i++) {
-		dlist_init(&(table->buckets[i].entries));
-		pthread_mutex_init(&(table->buckets[i].lock), NULL);
+static void release_reader_id(void *arg)
+{
+	int id = (int)(intptr_t)arg - 1;
+
+	pthread_mutex_lock(&reader_ids_lock);
+	reader_id_used[id] = false;
+	pthread_mutex_unlock(&reader_ids_lock);
+}
+
+static void create_reader_key()
+{
+	if ((errno = pthread_key_create(&reader_key, release_reader_id)) != 0) {
+		perror("pthread_key_create");
+		abort();
 	}
-	return true;
 }
 
-// Free resources used by a hash table
-void hash_cleanup(hash_table *table)
+static int acquire_reader_id()
 {
-	assert(table != NULL);
+	pthread_once(&reader_key_once, create_reader_key);
 
-	for (size_t i = 0; i < table->size; i++) {
-		hash_bucket *bucket = &(table->buckets[i]);
-		while (!dlist_is_empty(&(bucket->entries))) {
-			dlist_entry *l_entry = dlist_remove_head(&(bucket->entries));
-			hash_entry *h_entry = container_of(l_entry, hash_entry, list_entry);
-			free(h_entry);
+	int id = HASH_MAX_READERS;
+	pthread_mutex_lock(&reader_ids_lock);
+	for (int i = 0; i < HASH_MAX_READERS; i++) {
+		if (!reader_id_used[i]) {
+			reader_id_used[i] = true;
+			id = i;
+			break;
 		}
-		pthread_mutex_destroy(&(bucket->lock));
 	}
+	if ((id < HASH_MAX_READERS) && (id >= num_reader_ids)) {
+		__atomic_store_n(&num_reader_ids, id + 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&reader_ids_lock);
 
-	free(table->buckets);
-	table->buckets = NULL;
-	table->size = 0;
+	// The destructor is only called for a non-NULL value, hence the + 1
+	if ((id < HASH_MAX_READERS) && ((errno = pthread_setspecific(reader_key, (void*)(intptr_t)(id + 1))) != 0)) {
+		perror("pthread_setspecific");
+	}
+	return id;
+}
+
+// Returns the calling thread's reader state, or NULL if there are too many reader threads
+static hash_reader *get_reader(hash_table *table)
+{
+	if (reader_id < 0) {
+		reader_id = acquire_reader_id();
+	}
+	return (reader_id < HASH_MAX_READERS) ? &(table->readers[reader_id]) : NULL;
 }
 
+static void reader_enter(hash_table *table, hash_reader *reader)
+{
+	__atomic_store_n(&(reader->epoch), __atomic_load_n(&(table->epoch), __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+	// The announcement must be visible before anything is read from the table
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
 
-// Hash function
-static size_t hash_f(const char key[KEY_SIZE], size_t size)
+static void reader_exit(hash_reader *reader)
 {
-	assert(key != NULL);
-	assert(size > 0);
+	__atomic_store_n(&(reader->epoch), 0, __ATOMIC_RELEASE);
+}
 
-	size_t h = 0;
-	for (int i = 0; i < KEY_SIZE; i++) {
-		h += key[i];
+// Free the retired allocations of a shard that no reader can still see (the shard must be locked)
+static void reclaim(hash_table *table, hash_shard *shard)
+{
+	int num_readers = __atomic_load_n(&num_reader_ids, __ATOMIC_RELAXED);
+
+	// Readers that entered in an epoch later than the one an allocation was retired in cannot see it
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	uint64_t min_epoch = UINT64_MAX;
+	for (int i = 0; i < num_readers; i++) {
+		uint64_t epoch = __atomic_load_n(&(table->readers[i].epoch), __ATOMIC_ACQUIRE);
+		if ((epoch != 0) && (epoch < min_epoch)) {
+			min_epoch = epoch;
+		}
 	}
-	return h % size;
+
+	size_t kept = 0;
+	for (size_t i = 0; i < shard->num_retired; i++) {
+		if (shard->retired[i].epoch < min_epoch) {
+			slab_free(&(table->pool), shard->retired[i].ptr, shard->retired[i].size);
+		} else {
+			shard->retired[kept++] = shard->retired[i];
+		}
+	}
+	shard->num_retired = kept;
 }
 
-// Key comparison function
-static bool equals_f(const char key1[KEY_SIZE], const char key2[KEY_SIZE])
+// Free what can be freed from the retired allocations of all shards; used when the memory limit is reached
+// (the given shard must be locked; other shards that are locked by someone else are skipped)
+static void reclaim_all(hash_table *table, hash_shard *locked_shard)
 {
-	assert(key1 != NULL);
-	assert(key2 != NULL);
+	for (size_t i = 0; i < table->num_shards; i++) {
+		hash_shard *shard = &(table->shards[i]);
+		if (shard == locked_shard) {
+			reclaim(table, shard);
+		} else if ((shard->num_retired > 0) && (pthread_mutex_trylock(&(shard->lock)) == 0)) {
+			reclaim(table, shard);
+			pthread_mutex_unlock(&(shard->lock));
+		}
+	}
+}
 
-	return (key1 == key2) || (memcmp(key1, key2, KEY_SIZE) == 0);
+// Free an allocation that has just been unlinked from a shard once no reader can still see it
+static void retire(hash_table *table, hash_shard *shard, void *ptr, size_t size)
+{
+	if (ptr == NULL) {
+		return;
+	}
+	uint64_t epoch = __atomic_fetch_add(&(table->epoch), 1, __ATOMIC_SEQ_CST);
+
+	if (shard->num_retired == shard->max_retired) {
+		size_t max_retired = (shard->max_retired == 0) ? HASH_RECLAIM_BATCH : shard->max_retired * 2;
+		hash_retired *retired = realloc(shard->retired, max_retired * sizeof(hash_retired));
+		if (retired == NULL) {
+			// Out of memory for the list; wait for the readers instead
+			perror("realloc");
+			do {
+				reclaim(table, shard);
+				cpu_relax();
+			} while (shard->num_retired == shard->max_retired);
+		} else {
+			shard->retired = retired;
+			shard->max_retired = max_retired;
+		}
+	}
+	shard->retired[shard->num_retired].ptr = ptr;
+	shard->retired[shard->num_retired].size = size;
+	shard->retired[shard->num_retired].epoch = epoch;
+	shard->num_retired++;
+
+	if (shard->num_retired % HASH_RECLAIM_BATCH == 0) {
+		reclaim(table, shard);
+	}
 }
 
 
-// Get bucket index for a key
-static size_t get_index(const hash_table *table, const char key[KEY_SIZE])
+// Bit i of the result is set if control byte i of the group equals c
+static uint32_t group_match(const int8_t *group, int8_t c)
 {
-	assert(table != NULL);
+#ifdef __SSE2__
+	__m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+	return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(c)));
+#else
+	uint32_t mask = 0;
+	for (int i = 0; i < HASH_GROUP_SIZE; i++) {
+		mask |= (uint32_t)(group[i] == c) << i;
+	}
+	return mask;
+#endif
+}
 
-	size_t result = hash_f(key, table->size);
-	assert(result < table->size);
-	return result;
+// Bit i of the result is set if slot i of the group is empty or deleted (control byte is negative)
+static uint32_t group_match_free(const int8_t *group)
+{
+#ifdef __SSE2__
+	__m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+	return (uint32_t)_mm_movemask_epi8(ctrl);
+#else
+	uint32_t mask = 0;
+	for (int i = 0; i < HASH_GROUP_SIZE; i++) {
+		mask |= (uint32_t)(group[i] < 0) << i;
+	}
+	return mask;
+#endif
+}
+
+
+// Allocate empty control and slot arrays with given number of groups
+static bool alloc_array(slab_pool *pool, hash_array *array, size_t num_groups)
+{
+	size_t capacity = num_groups * HASH_GROUP_SIZE;
+
+	int8_t *ctrl = slab_alloc(pool, capacity);
+	hash_slot *slots = slab_alloc(pool, capacity * sizeof(hash_slot));
+	if ((ctrl == NULL) || (slots == NULL)) {
+		slab_free(pool, ctrl, capacity);
+		slab_free(pool, slots, capacity * sizeof(hash_slot));
+		return false;
+	}
+	memset(ctrl, CTRL_EMPTY, capacity);
+
+	array->num_groups = num_groups;
+	array->count = 0;
+	array->deleted = 0;
+	array->ctrl = ctrl;
+	array->slots = slots;
+	return true;
+}
+
+static void clear_array(hash_array *array)
+{
+	array->ctrl = NULL;
+	array->slots = NULL;
+	array->num_groups = 0;
+	array->count = 0;
+	array->deleted = 0;
+}
+
+static void free_array(slab_pool *pool, hash_array *array)
+{
+	size_t capacity = array->num_groups * HASH_GROUP_SIZE;
+	slab_free(pool, array->ctrl, capacity);
+	slab_free(pool, array->slots, capacity * sizeof(hash_slot));
+	clear_array(array);
+}
+
+static size_t capacity(const hash_array *array)
+{
+	return array->num_groups * HASH_GROUP_SIZE;
 }
 
-// Find a hash entry with given key in a bucket
-static hash_entry *get_entry(const hash_bucket *bucket, const char key[KEY_SIZE])
+// Find the slot holding a key; returns its index or -1
+static ssize_t find_slot(const hash_array *array, const char key[KEY_SIZE], uint64_t h)
 {
-	assert(bucket != NULL);
+	size_t mask = array->num_groups - 1;
+	size_t g = h1(h) & mask;
 
-	for (dlist_entry *e = bucket->entries.head; e != &(bucket->entries); e = e->next) {
-		hash_entry *entry = container_of(e, hash_entry, list_entry);
-		if (equals_f(entry->key, key)) {
-			return entry;
+	// Triangular probing over groups visits every group when their number is a power of 2
+	for (size_t i = 1; i <= array->num_groups; i++) {
+		const int8_t *group = array->ctrl + g * HASH_GROUP_SIZE;
+
+		for (uint32_t m = group_match(group, h2(h)); m != 0; m &= m - 1) {
+			size_t index = g * HASH_GROUP_SIZE + __builtin_ctz(m);
+			if (equals_f(array->slots[index].key, key)) {
+				return index;
+			}
+		}
+		if (group_match(group, CTRL_EMPTY) != 0) {
+			return -1;
 		}
+		g = (g + i) & mask;
 	}
-	return NULL;
+	return -1;
 }
 
-// Create a new hash entry and put it into the bucket
-static hash_entry *put_new_entry(hash_bucket *bucket, const char key[KEY_SIZE], void *value, size_t value_sz)
+// Find an empty or deleted slot for a key that is not in the array; returns its index
+static size_t find_free_slot(const hash_array *array, uint64_t h)
 {
-	assert(key != NULL);
-	assert(value != NULL);
+	size_t mask = array->num_groups - 1;
+	size_t g = h1(h) & mask;
 
-	hash_entry *entry = malloc(sizeof(hash_entry));
-	if (entry == NULL) {
-		perror("malloc");
-		return NULL;
+	// There is always a free slot since the load is kept below 1
+	for (size_t i = 1;; i++) {
+		uint32_t m = group_match_free(array->ctrl + g * HASH_GROUP_SIZE);
+		if (m != 0) {
+			return g * HASH_GROUP_SIZE + __builtin_ctz(m);
+		}
+		g = (g + i) & mask;
+	}
+}
+
+// Mark a free slot as holding a key with given hash
+static void fill_slot(hash_array *array, size_t index, uint64_t h)
+{
+	if (array->ctrl[index] == CTRL_DELETED) {
+		array->deleted--;
 	}
+	array->ctrl[index] = h2(h);
+	array->count++;
+}
 
-	memcpy(entry->key, key, KEY_SIZE);
-	entry->value = value;
-	entry->value_sz = value_sz;
+// Mark a full slot as free
+static void erase_slot(hash_array *array, size_t index)
+{
+	// A slot in a group that still has an empty slot can become empty again, since no probe sequence
+	// continues past that group; otherwise it must stay a tombstone
+	size_t g = index / HASH_GROUP_SIZE;
+	if (group_match(array->ctrl + g * HASH_GROUP_SIZE, CTRL_EMPTY) != 0) {
+		array->ctrl[index] = CTRL_EMPTY;
+	} else {
+		array->ctrl[index] = CTRL_DELETED;
+		array->deleted++;
+	}
+	array->count--;
+}
 
-	//dlist_insert_tail(&(bucket->entries), &(entry->list_entry));
-	dlist_insert_head(&(bucket->entries), &(entry->list_entry));
-	return entry;
+
+static bool is_resizing(const hash_shard *shard)
+{
+	return shard->old.ctrl != NULL;
 }
 
-// Update an exising hash entry with a new value, and obtain the old value
-static void update_entry(hash_entry *entry, void *value, size_t value_sz, void **old_value, size_t *old_value_sz)
+// Move up to num_groups groups of the old array into the current one; frees the old array when done
+static void migrate(hash_table *table, hash_shard *shard, size_t num_groups)
 {
-	assert(entry != NULL);
-	assert(value != NULL);
+	for (; is_resizing(shard) && (num_groups > 0); num_groups--) {
+		size_t start = shard->migrate_pos * HASH_GROUP_SIZE;
+		for (size_t i = start; i < start + HASH_GROUP_SIZE; i++) {
+			if (shard->old.ctrl[i] < 0) {
+				continue;
+			}
+			uint64_t h = hash_f(shard->old.slots[i].key);
+			size_t index = find_free_slot(&(shard->cur), h);
+			shard->cur.slots[index] = shard->old.slots[i];
+			fill_slot(&(shard->cur), index, h);
+			shard->old.ctrl[i] = CTRL_DELETED;
+			shard->old.count--;
+		}
 
-	if (old_value != NULL) {
-		assert(old_value_sz != NULL);
-		*old_value = entry->value;
-		*old_value_sz = entry->value_sz;
+		if (++shard->migrate_pos == shard->old.num_groups) {
+			hash_array old = shard->old;
+			clear_array(&(shard->old));
+			retire(table, shard, old.ctrl, capacity(&old));
+			retire(table, shard, old.slots, capacity(&old) * sizeof(hash_slot));
+		}
 	}
-	entry->value = value;
-	entry->value_sz = value_sz;
 }
 
-// Remove a hash entry and obtain its old value
-static void remove_entry(hash_entry *entry, void **old_value, size_t *old_value_sz)
+// Start moving the entries of a shard into a new array with given number of groups (dropping tombstones)
+static bool start_resize(hash_table *table, hash_shard *shard, size_t num_groups)
 {
-	assert(entry != NULL);
+	assert(!is_resizing(shard));
+
+	hash_array array;
+	if (!alloc_array(&(table->pool), &array, num_groups)) {
+		return false;
+	}
+	shard->old = shard->cur;
+	shard->cur = array;
+	shard->migrate_pos = 0;
+	return true;
+}
+
+// Find the array and slot holding a key; returns the slot index or -1
+static ssize_t lookup(hash_shard *shard, const char key[KEY_SIZE], uint64_t h, hash_array **array)
+{
+	ssize_t index = find_slot(&(shard->cur), key, h);
+	if (index >= 0) {
+		*array = &(shard->cur);
+		return index;
+	}
+	if (is_resizing(shard) && ((index = find_slot(&(shard->old), key, h)) >= 0)) {
+		*array = &(shard->old);
+		return index;
+	}
+	return -1;
+}
+
+// Make room for one more entry in the current array (which must eventually take all the entries of the
+// old one too), growing the shard if it is mostly full or just dropping tombstones otherwise
+static bool reserve_slot(hash_table *table, hash_shard *shard)
+{
+	hash_array *cur = &(shard->cur);
+	if ((cur->count + cur->deleted + shard->old.count + 1) * MAX_LOAD_DEN <= capacity(cur) * MAX_LOAD_NUM) {
+		return true;
+	}
+
+	// Only one resize can be in progress; this is rare since it takes many inserts to fill the new array
+	migrate(table, shard, SIZE_MAX);
+	if ((cur->count + cur->deleted + 1) * MAX_LOAD_DEN <= capacity(cur) * MAX_LOAD_NUM) {
+		return true;
+	}
+
+	bool grow = (cur->count + 1) * MAX_LOAD_DEN * 2 > capacity(cur) * MAX_LOAD_NUM;
+	return start_resize(table, shard, grow ? cur->num_groups * 2 : cur->num_groups);
+}
+
+// Start shrinking the shard if it has become mostly empty; failing to do so is harmless
+static void maybe_shrink(hash_table *table, hash_shard *shard)
+{
+	hash_array *cur = &(shard->cur);
+	if (!is_resizing(shard) && (cur->num_groups > shard->min_groups) &&
+	    (cur->count * MAX_LOAD_DEN * SHRINK_LOAD_DIV < capacity(cur) * MAX_LOAD_NUM))
+	{
+		start_resize(table, shard, cur->num_groups / 2);
+	}
+}
+
+
+static bool is_inline(size_t value_sz)
+{
+	return value_sz <= HASH_INLINE_VALUE_SIZE;
+}
+
+static void *slot_value(hash_slot *slot)
+{
+	return is_inline(slot->value_sz) ? slot->value.data : slot->value.ptr->data;
+}
 
-	dlist_remove_entry(&(entry->list_entry));
+// Size of the allocation of an out of line value
+static size_t value_alloc_size(size_t value_sz)
+{
+	return sizeof(hash_value) + value_sz;
+}
+
+// Check if an out of line value lives in foreign memory (see hash_set_foreign_memory())
+static bool is_foreign(const hash_table *table, const hash_value *value)
+{
+	return ((const char*)value >= table->foreign_base) &&
+	       ((const char*)value < table->foreign_base + table->foreign_length);
+}
+
+// Store a copy of a value in a slot, or the foreign value itself if it is not NULL (value is then its data); returns
+// false if out of memory
+static bool set_value(hash_table *table, hash_shard *shard, hash_slot *slot, const void *value, size_t value_sz,
+                      hash_value *foreign)
+{
+	if (is_inline(value_sz)) {
+		memcpy(slot->value.data, value, value_sz);
+	} else if (foreign != NULL) {
+		slot->value.ptr = foreign;
+	} else {
+		hash_value *copy = slab_alloc(&(table->pool), value_alloc_size(value_sz));
+		if (copy == NULL) {
+			// Retired values may be holding the memory; try again after freeing them
+			reclaim_all(table, shard);
+			copy = slab_alloc(&(table->pool), value_alloc_size(value_sz));
+		}
+		if (copy == NULL) {
+			return false;
+		}
+		copy->refs = 1;// the table's
+		memcpy(copy->data, value, value_sz);
+		slot->value.ptr = copy;
+	}
+	slot->value_sz = value_sz;
+	return true;
+}
+
+// Record a modified key in the delta log of a shard, if a snapshot iteration is capturing its modifications
+static void record_delta(hash_shard *shard, const char key[KEY_SIZE])
+{
+	if (!shard->capturing) {
+		return;
+	}
+
+	if (shard->delta_len == shard->delta_size) {
+		size_t delta_size = (shard->delta_size == 0) ? HASH_DELTA_LOCKED_KEYS : shard->delta_size * 2;
+		void *delta = realloc(shard->delta, delta_size * KEY_SIZE);
+		if (delta == NULL) {
+			perror("realloc");
+			shard->delta_lost = true;
+			return;
+		}
+		shard->delta = delta;
+		shard->delta_size = delta_size;
+	}
+	memcpy(shard->delta[shard->delta_len++], key, KEY_SIZE);
+}
+
+// Copy the value stored in a slot to the heap for the caller, if requested
+static bool copy_old_value(hash_slot *slot, void **old_value, size_t *old_value_sz)
+{
 	if (old_value != NULL) {
 		assert(old_value_sz != NULL);
-		*old_value = entry->value;
-		*old_value_sz = entry->value_sz;
+		// Allocate at least one byte so that an empty old value is still distinguishable from none
+		if ((*old_value = malloc(slot->value_sz + 1)) == NULL) {
+			perror("malloc");
+			return false;
+		}
+		memcpy(*old_value, slot_value(slot), slot->value_sz);
+		*old_value_sz = slot->value_sz;
+	}
+	return true;
+}
+
+// Drop a reference to an out of line value, and retire it if it was the last one (the shard must be locked); lock-free
+// readers may still be taking a reference to it, so it is only freed once they are done
+static void unref_value(hash_table *table, hash_shard *shard, hash_value *value, size_t value_sz)
+{
+	if ((__atomic_sub_fetch(&(value->refs), 1, __ATOMIC_ACQ_REL) == 0) && !is_foreign(table, value)) {
+		retire(table, shard, value, value_alloc_size(value_sz));
+	}
+}
+
+// Take a reference to an out of line value, unless its last one has already been dropped; the value must not have
+// been freed yet (i.e. it was read by a lock-free reader, or the shard is locked)
+static bool ref_value(hash_value *value)
+{
+	uint32_t refs = __atomic_load_n(&(value->refs), __ATOMIC_RELAXED);
+	do {
+		if (refs == 0) {
+			return false;
+		}
+	} while (!__atomic_compare_exchange_n(&(value->refs), &refs, refs + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return true;
+}
+
+// Release an out of line value that is no longer referenced by the shard
+static void release_value(hash_table *table, hash_shard *shard, hash_slot *slot)
+{
+	if (!is_inline(slot->value_sz)) {
+		unref_value(table, shard, slot->value.ptr, slot->value_sz);
+	}
+}
+
+
+// Initialize a hash table with room for about size keys before it needs to grow; returns true on success
+bool hash_init(hash_table *table, size_t size)
+{
+	assert(table != NULL);
+	assert(size != 0);
+
+	if (!slab_init(&(table->pool), 0)) {
+		return false;
+	}
+	if ((table->shards = calloc(HASH_NUM_SHARDS, sizeof(hash_shard))) == NULL) {
+		perror("calloc");
+		slab_cleanup(&(table->pool));
+		return false;
+	}
+	table->num_shards = HASH_NUM_SHARDS;
+
+	if ((table->readers = calloc(HASH_MAX_READERS, sizeof(hash_reader))) == NULL) {
+		perror("calloc");
+		hash_cleanup(table);
+		return false;
+	}
+	table->epoch = 1;
+	table->merkle = NULL;
+	table->foreign_base = NULL;
+	table->foreign_length = 0;
+
+	// Round the per-shard capacity up to a power of 2 number of groups at the maximum load
+	size_t per_shard = (size / HASH_NUM_SHARDS) * MAX_LOAD_DEN / MAX_LOAD_NUM;
+	size_t num_groups = 1;
+	while (num_groups * HASH_GROUP_SIZE < per_shard) {
+		num_groups *= 2;
+	}
+
+	for (size_t i = 0; i < table->num_shards; i++) {
+		hash_shard *shard = &(table->shards[i]);
+		if (!alloc_array(&(table->pool), &(shard->cur), num_groups)) {
+			hash_cleanup(table);
+			return false;
+		}
+		shard->min_groups = num_groups;
+		pthread_mutex_init(&(shard->lock), NULL);
+	}
+	return true;
+}
+
+// Free the values stored in an array (except foreign ones), and the array itself
+static void cleanup_array(hash_table *table, hash_array *array)
+{
+	for (size_t i = 0; i < capacity(array); i++) {
+		hash_slot *slot = &(array->slots[i]);
+		if ((array->ctrl[i] >= 0) && !is_inline(slot->value_sz) && !is_foreign(table, slot->value.ptr)) {
+			slab_free(&(table->pool), slot->value.ptr, value_alloc_size(slot->value_sz));
+		}
+	}
+	free_array(&(table->pool), array);
+}
+
+// Free resources used by a hash table (including the stored values)
+void hash_cleanup(hash_table *table)
+{
+	assert(table != NULL);
+
+	for (size_t i = 0; i < table->num_shards; i++) {
+		hash_shard *shard = &(table->shards[i]);
+		if (shard->cur.ctrl == NULL) {
+			continue;
+		}
+
+		cleanup_array(table, &(shard->cur));
+		if (is_resizing(shard)) {
+			cleanup_array(table, &(shard->old));
+		}
+		for (size_t j = 0; j < shard->num_retired; j++) {
+			slab_free(&(table->pool), shard->retired[j].ptr, shard->retired[j].size);
+		}
+		free(shard->retired);
+		free(shard->delta);
+		pthread_mutex_destroy(&(shard->lock));
 	}
-	free(entry);
+
+	free(table->shards);
+	table->shards = NULL;
+	table->num_shards = 0;
+	free(table->readers);
+	table->readers = NULL;
+	slab_cleanup(&(table->pool));
+}
+
+// Limit the memory used by a hash table (0 for unlimited); puts that would exceed it fail
+void hash_set_memory_limit(hash_table *table, size_t limit)
+{
+	assert(table != NULL);
+	table->pool.limit = limit;
 }
 
+// Get the memory used by a hash table, in bytes
+size_t hash_memory_used(const hash_table *table)
+{
+	assert(table != NULL);
+	return table->pool.reserved;
+}
 
-// Lock a particular key (lock corresponding hash bucket)
+// Let a table store values that live in memory it doesn't own; not synchronized (the table should be empty)
+void hash_set_foreign_memory(hash_table *table, const void *base, size_t length)
+{
+	assert(table != NULL);
+	table->foreign_base = base;
+	table->foreign_length = length;
+}
+
+// Keep a Merkle tree up to date with the versions of the keys in the table
+void hash_set_merkle(hash_table *table, merkle_tree *merkle)
+{
+	assert(table != NULL);
+	table->merkle = merkle;
+}
+
+// Get the number of keys stored in a hash table; synchronized (but only a snapshot if the table is being modified)
+size_t hash_count(hash_table *table)
+{
+	assert(table != NULL);
+
+	size_t count = 0;
+	for (size_t i = 0; i < table->num_shards; i++) {
+		hash_shard *shard = &(table->shards[i]);
+		pthread_mutex_lock(&(shard->lock));
+		count += shard->cur.count + shard->old.count;
+		pthread_mutex_unlock(&(shard->lock));
+	}
+	return count;
+}
+
+// Grow a hash table ahead of time so that it holds about size keys without resizing again; synchronized
+bool hash_reserve(hash_table *table, size_t size)
+{
+	assert(table != NULL);
+
+	// Same sizing as in hash_init()
+	size_t per_shard = (size / table->num_shards) * MAX_LOAD_DEN / MAX_LOAD_NUM;
+	size_t num_groups = 1;
+	while (num_groups * HASH_GROUP_SIZE < per_shard) {
+		num_groups *= 2;
+	}
+
+	bool result = true;
+	for (size_t i = 0; result && (i < table->num_shards); i++) {
+		hash_shard *shard = &(table->shards[i]);
+		pthread_mutex_lock(&(shard->lock));
+
+		if (shard->cur.num_groups < num_groups) {
+			write_begin(shard);
+			// Only one resize can be in progress; the entries of the new array then move over incrementally
+			migrate(table, shard, SIZE_MAX);
+			result = start_resize(table, shard, num_groups);
+			write_end(shard);
+		}
+
+		pthread_mutex_unlock(&(shard->lock));
+	}
+	return result;
+}
+
+
+// Lock a particular key (lock corresponding shard)
 void hash_lock(hash_table *table, const char key[KEY_SIZE])
 {
-	size_t index = get_index(table, key);
-	hash_bucket *bucket = &(table->buckets[index]);
-	pthread_mutex_lock(&(bucket->lock));
+	hash_shard *shard = get_shard(table, hash_f(key));
+	pthread_mutex_lock(&(shard->lock));
 }
 
-// Unlock a particular key (unlock corresponding hash bucket)
+// Unlock a particular key (unlock corresponding shard)
 void hash_unlock(hash_table *table, const char key[KEY_SIZE])
 {
-	size_t index = get_index(table, key);
-	hash_bucket *bucket = &(table->buckets[index]);
-	pthread_mutex_unlock(&(bucket->lock));
+	hash_shard *shard = get_shard(table, hash_f(key));
+	pthread_mutex_unlock(&(shard->lock));
 }
 
 
-// Get value for a key; returns true on success; not synchronized
+// Get value for a key; returns true on success; not synchronized (the key must be locked)
 bool hash_get(hash_table *table, const char key[KEY_SIZE], void **value, size_t *value_sz)
 {
 	assert(value != NULL);
 	assert(value_sz != NULL);
 
-	size_t index = get_index(table, key);
-	hash_bucket *bucket = &(table->buckets[index]);
-	hash_entry *entry = get_entry(bucket, key);
+	uint64_t h = hash_f(key);
+	hash_shard *shard = get_shard(table, h);
 
-	if (entry == NULL) {
+	hash_array *array;
+	ssize_t index = lookup(shard, key, h, &array);
+	if (index < 0) {
 		return false;
 	}
-	*value = entry->value;
-	*value_sz = entry->value_sz;
+	hash_slot *slot = &(array->slots[index]);
+	*value = slot_value(slot);
+	*value_sz = slot->value_sz;
 	return true;
 }
 
-// Put a new value for a key and obtain the old value (if any); returns true on success; not synchronized
-bool hash_put(hash_table *table, const char key[KEY_SIZE], void *value, size_t value_sz,
-              void **old_value, size_t *old_value_sz)
+// Copy the value for a key (up to buffer_sz bytes) into buffer and get its full size; returns true on success;
+// synchronized, but never takes a lock: it can run concurrently with modifications of the same key
+bool hash_get_copy(hash_table *table, const char key[KEY_SIZE], void *buffer, size_t buffer_sz, size_t *value_sz)
 {
-	size_t index = get_index(table, key);
-	hash_bucket *bucket = &(table->buckets[index]);
+	assert(buffer != NULL);
+	assert(value_sz != NULL);
 
-	hash_entry *entry = get_entry(bucket, key);
-	if (entry != NULL) {
-		update_entry(entry, value, value_sz, old_value, old_value_sz);
-		return true;
+	uint64_t h = hash_f(key);
+	hash_shard *shard = get_shard(table, h);
+
+	hash_reader *reader = get_reader(table);
+	if (reader == NULL) {
+		// Too many reader threads; fall back to locking
+		void *value;
+		pthread_mutex_lock(&(shard->lock));
+		bool found = hash_get(table, key, &value, value_sz);
+		if (found) {
+			memcpy(buffer, value, (*value_sz < buffer_sz) ? *value_sz : buffer_sz);
+		}
+		pthread_mutex_unlock(&(shard->lock));
+		return found;
+	}
+
+	// Everything reached through the shard stays allocated until reader_exit(); the sequence number is
+	// checked before any pointer or size read from the shard is used, so a torn read is never followed
+	bool found;
+	reader_enter(table, reader);
+	for (;;) {
+		uint32_t seq = read_begin(shard);
+		hash_array cur = shard->cur;
+		hash_array old = shard->old;
+		if (!read_valid(shard, seq)) {
+			continue;
+		}
+
+		ssize_t index = find_slot(&cur, key, h);
+		hash_array *array = &cur;
+		if ((index < 0) && (old.ctrl != NULL)) {
+			index = find_slot(&old, key, h);
+			array = &old;
+		}
+		if (index < 0) {
+			if (!read_valid(shard, seq)) {
+				continue;
+			}
+			found = false;
+			break;
+		}
+
+		hash_slot *slot = &(array->slots[index]);
+		size_t size = slot->value_sz;
+		const void *value = is_inline(size) ? slot->value.data : slot->value.ptr->data;
+		if (!read_valid(shard, seq)) {
+			continue;
+		}
+		memcpy(buffer, value, (size < buffer_sz) ? size : buffer_sz);
+		if (!read_valid(shard, seq)) {
+			continue;
+		}
+		*value_sz = size;
+		found = true;
+		break;
+	}
+	reader_exit(reader);
+	return found;
+}
+
+// Take a reference to the value stored in a slot (or copy it into the reference if it is inline); returns false if the
+// value has already been released (it was replaced meanwhile)
+static bool get_slot_ref(hash_slot *slot, size_t value_sz, hash_value *value, hash_ref *ref)
+{
+	if (is_inline(value_sz)) {
+		memcpy(ref->inline_data, slot->value.data, value_sz);
+		ref->value = NULL;
+	} else if (ref_value(value)) {
+		ref->value = value;
+	} else {
+		return false;
+	}
+	ref->value_sz = value_sz;
+	return true;
+}
+
+// Get a reference to the value for a key; returns true on success; synchronized, but never takes a lock
+bool hash_get_ref(hash_table *table, const char key[KEY_SIZE], hash_ref *ref)
+{
+	assert(ref != NULL);
+
+	uint64_t h = hash_f(key);
+	hash_shard *shard = get_shard(table, h);
+	ref->table = table;
+	ref->shard = shard;
+
+	hash_reader *reader = get_reader(table);
+	if (reader == NULL) {
+		// Too many reader threads; fall back to locking
+		pthread_mutex_lock(&(shard->lock));
+		hash_array *array;
+		ssize_t index = lookup(shard, key, h, &array);
+		if (index >= 0) {
+			hash_slot *slot = &(array->slots[index]);
+			bool referenced = get_slot_ref(slot, slot->value_sz, slot->value.ptr, ref);
+			assert(referenced);
+			(void)referenced;
+		}
+		pthread_mutex_unlock(&(shard->lock));
+		return index >= 0;
+	}
+
+	// Same as hash_get_copy(), except that an out of line value is referenced instead of copied: it can't be freed
+	// before reader_exit(), and once referenced, it stays allocated even if it is replaced
+	bool found;
+	reader_enter(table, reader);
+	for (;;) {
+		uint32_t seq = read_begin(shard);
+		hash_array cur = shard->cur;
+		hash_array old = shard->old;
+		if (!read_valid(shard, seq)) {
+			continue;
+		}
+
+		ssize_t index = find_slot(&cur, key, h);
+		hash_array *array = &cur;
+		if ((index < 0) && (old.ctrl != NULL)) {
+			index = find_slot(&old, key, h);
+			array = &old;
+		}
+		if (index < 0) {
+			if (!read_valid(shard, seq)) {
+				continue;
+			}
+			found = false;
+			break;
+		}
+
+		hash_slot *slot = &(array->slots[index]);
+		size_t size = slot->value_sz;
+		hash_value *value = slot->value.ptr;
+		if (!read_valid(shard, seq)) {
+			continue;
+		}
+		if (!get_slot_ref(slot, size, value, ref)) {
+			continue;
+		}
+		if (is_inline(size) && !read_valid(shard, seq)) {
+			continue;
+		}
+		found = true;
+		break;
 	}
+	reader_exit(reader);
+	return found;
+}
+
+// Get the value of a reference
+const void *hash_ref_data(const hash_ref *ref)
+{
+	assert(ref != NULL);
+	return (ref->value != NULL) ? ref->value->data : ref->inline_data;
+}
+
+// Release a reference obtained with hash_get_ref(); synchronized
+void hash_release_ref(hash_ref *ref)
+{
+	assert(ref != NULL);
+
+	if (ref->value == NULL) {
+		return;
+	}
+	// Only the last reference (if the table has dropped its own) needs the lock, to retire the value (unless it lives
+	// in foreign memory, which the table never frees)
+	if ((__atomic_sub_fetch(&(ref->value->refs), 1, __ATOMIC_ACQ_REL) == 0) && !is_foreign(ref->table, ref->value)) {
+		pthread_mutex_lock(&(ref->shard->lock));
+		retire(ref->table, ref->shard, ref->value, value_alloc_size(ref->value_sz));
+		pthread_mutex_unlock(&(ref->shard->lock));
+	}
+	ref->value = NULL;
+}
+
+// Prefetch the control bytes and the first slots of the first group probed for a key; never takes a lock, and
+// prefetching an address that is no longer valid doesn't fault
+void hash_prefetch(hash_table *table, const char key[KEY_SIZE])
+{
+	uint64_t h = hash_f(key);
+	hash_shard *shard = get_shard(table, h);
+
+	int8_t *ctrl = __atomic_load_n(&(shard->cur.ctrl), __ATOMIC_RELAXED);
+	hash_slot *slots = __atomic_load_n(&(shard->cur.slots), __ATOMIC_RELAXED);
+	size_t num_groups = __atomic_load_n(&(shard->cur.num_groups), __ATOMIC_RELAXED);
+	if ((ctrl == NULL) || (num_groups == 0)) {
+		return;
+	}
+	size_t g = h1(h) & (num_groups - 1);
+	__builtin_prefetch(ctrl + g * HASH_GROUP_SIZE);
+	__builtin_prefetch(slots + g * HASH_GROUP_SIZE);
+}
+
+// Get the version of a key; returns true on success; not synchronized
+bool hash_get_version(hash_table *table, const char key[KEY_SIZE], uint64_t *version)
+{
+	assert(version != NULL);
+
+	uint64_t h = hash_f(key);
+	hash_shard *shard = get_shard(table, h);
 
-	if (!put_new_entry(bucket, key, value, value_sz)) {
+	hash_array *array;
+	ssize_t index = lookup(shard, key, h, &array);
+	if (index < 0) {
 		return false;
 	}
+	*version = array->slots[index].version;
+	return true;
+}
+
+// Put a copy of a value (or a foreign value, see set_value()) for a key and obtain the old value (if any); returns
+// true on success
+static bool put(hash_table *table, const char key[KEY_SIZE], const void *value, size_t value_sz, hash_value *foreign,
+                uint64_t version, void **old_value, size_t *old_value_sz)
+{
+
+	uint64_t h = hash_f(key);
+	hash_shard *shard = get_shard(table, h);
+	bool result = false;
+
+	write_begin(shard);
+	migrate(table, shard, HASH_MIGRATE_GROUPS);
+
+	hash_array *array;
+	ssize_t index = lookup(shard, key, h, &array);
+	if (index >= 0) {
+		// Keep the old value until the new one is stored, so that a failed update changes nothing
+		hash_slot *slot = &(array->slots[index]);
+		hash_slot old = *slot;
+		if (!set_value(table, shard, slot, value, value_sz, foreign)) {
+			goto end;
+		}
+		if (!copy_old_value(&old, old_value, old_value_sz)) {
+			// Could not copy the old value out; report it as absent
+			*old_value = NULL;
+			*old_value_sz = 0;
+		}
+		release_value(table, shard, &old);
+		slot->version = version;
+		if (table->merkle != NULL) {
+			merkle_update(table->merkle, key, old.version, version);
+		}
+		record_delta(shard, key);
+		result = true;
+		goto end;
+	}
+
+	if (!reserve_slot(table, shard)) {
+		goto end;
+	}
+	size_t free_index = find_free_slot(&(shard->cur), h);
+	hash_slot *slot = &(shard->cur.slots[free_index]);
+	if (!set_value(table, shard, slot, value, value_sz, foreign)) {
+		goto end;
+	}
+	memcpy(slot->key, key, KEY_SIZE);
+	slot->version = version;
+	fill_slot(&(shard->cur), free_index, h);
+	if (table->merkle != NULL) {
+		merkle_update(table->merkle, key, 0, version);
+	}
+	record_delta(shard, key);
+
 	if (old_value != NULL) {
 		assert(old_value_sz != NULL);
 		*old_value = NULL;
 		*old_value_sz = 0;
 	}
-	return true;
+	result = true;
+
+end:
+	write_end(shard);
+	return result;
+}
+
+// Put a copy of a value for a key and obtain the old value (if any); returns true on success; not synchronized
+bool hash_put(hash_table *table, const char key[KEY_SIZE], const void *value, size_t value_sz, uint64_t version,
+              void **old_value, size_t *old_value_sz)
+{
+	assert(value != NULL);
+	assert(version != 0);
+
+	return put(table, key, value, value_sz, NULL, version, old_value, old_value_sz);
+}
+
+// Put a foreign value for a key without copying it (unless it is small enough to be stored inline); not synchronized
+bool hash_put_foreign(hash_table *table, const char key[KEY_SIZE], hash_value *value, size_t value_sz,
+                      uint64_t version)
+{
+	assert(value != NULL);
+	assert(version != 0);
+	assert(is_inline(value_sz) || (is_foreign(table, value) && (value->refs == 1)));
+
+	return put(table, key, value->data, value_sz, value, version, NULL, NULL);
 }
 
 // Remove a key and obtain the old value (if any); returns true on success; not synchronized
 bool hash_remove(hash_table *table, const char key[KEY_SIZE], void **old_value, size_t *old_value_sz)
 {
-	size_t index = get_index(table, key);
-	hash_bucket *bucket = &(table->buckets[index]);
+	uint64_t h = hash_f(key);
+	hash_shard *shard = get_shard(table, h);
+	bool result = false;
 
-	hash_entry *entry = get_entry(bucket, key);
-	if (entry == NULL) {
-		return false;
+	write_begin(shard);
+	migrate(table, shard, HASH_MIGRATE_GROUPS);
+
+	hash_array *array;
+	ssize_t index = lookup(shard, key, h, &array);
+	if ((index < 0) || !copy_old_value(&(array->slots[index]), old_value, old_value_sz)) {
+		goto end;
 	}
+	erase_slot(array, index);
+	release_value(table, shard, &(array->slots[index]));
+	if (table->merkle != NULL) {
+		merkle_update(table->merkle, key, array->slots[index].version, 0);
+	}
+	record_delta(shard, key);
 
-	remove_entry(entry, old_value, old_value_sz);
-	return true;
+	maybe_shrink(table, shard);
+	result = true;
+
+end:
+	write_end(shard);
+	return result;
 }
 
 
-// Iterate through all keys, calling iterator(key, value, value_sz, arg) for each key; synchronized
+// Call iterator for every key stored in an array
+static void iterate_array(hash_array *array, hash_iterator *iterator, void *arg)
+{
+	for (size_t i = 0; i < capacity(array); i++) {
+		if (array->ctrl[i] >= 0) {
+			hash_slot *slot = &(array->slots[i]);
+			iterator(slot->key, slot_value(slot), slot->value_sz, slot->version, arg);
+		}
+	}
+}
+
+// Iterate through all keys, calling iterator(key, value, value_sz, version, arg) for each key; synchronized
 void hash_iterate(hash_table *table, hash_iterator *iterator, void *arg)
 {
 	assert(table != NULL);
 	assert(iterator != NULL);
 
-	for (size_t i = 0; i < table->size; i++) {
-		hash_bucket *bucket = &(table->buckets[i]);
-		pthread_mutex_lock(&(bucket->lock));
+	for (size_t i = 0; i < table->num_shards; i++) {
+		hash_shard *shard = &(table->shards[i]);
+		pthread_mutex_lock(&(shard->lock));
 
-		for (dlist_entry *e = bucket->entries.head; e != &(bucket->entries); e = e->next) {
-			hash_entry *entry = container_of(e, hash_entry, list_entry);
-			iterator(entry->key, entry->value, entry->value_sz, arg);
+		iterate_array(&(shard->cur), iterator, arg);
+		if (is_resizing(shard)) {
+			iterate_array(&(shard->old), iterator, arg);
 		}
 
-		pthread_mutex_unlock(&(bucket->lock));
+		pthread_mutex_unlock(&(shard->lock));
+	}
+}
+
+// Take a reference to the out of line value of a slot copied into a snapshot (the shard must be locked, so the table
+// still holds its own), so that it stays allocated until the iterator has seen it
+static void ref_slot(hash_slot *slot)
+{
+	if (!is_inline(slot->value_sz)) {
+		__atomic_add_fetch(&(slot->value.ptr->refs), 1, __ATOMIC_RELAXED);
+	}
+}
+
+// Drop the reference taken by ref_slot() (the shard must not be locked); see hash_release_ref()
+static void unref_slot(hash_table *table, hash_shard *shard, hash_slot *slot)
+{
+	if (is_inline(slot->value_sz)) {
+		return;
+	}
+	hash_value *value = slot->value.ptr;
+	if ((__atomic_sub_fetch(&(value->refs), 1, __ATOMIC_ACQ_REL) == 0) && !is_foreign(table, value)) {
+		pthread_mutex_lock(&(shard->lock));
+		retire(table, shard, value, value_alloc_size(slot->value_sz));
+		pthread_mutex_unlock(&(shard->lock));
+	}
+}
+
+// Copy the full slots of an array to the end of a snapshot, referencing their values
+static size_t copy_array(const hash_array *array, hash_slot *snapshot)
+{
+	size_t count = 0;
+	for (size_t i = 0; i < capacity(array); i++) {
+		if (array->ctrl[i] >= 0) {
+			snapshot[count] = array->slots[i];
+			ref_slot(&(snapshot[count++]));
+		}
 	}
+	return count;
+}
+
+// Call iterator for every slot of a snapshot, and drop the references to their values (the shard must not be locked)
+static void iterate_snapshot(hash_table *table, hash_shard *shard, hash_slot *snapshot, size_t count,
+                             hash_iterator *iterator, void *arg)
+{
+	for (size_t i = 0; i < count; i++) {
+		iterator(snapshot[i].key, slot_value(&(snapshot[i])), snapshot[i].value_sz, snapshot[i].version, arg);
+		unref_slot(table, shard, &(snapshot[i]));
+	}
+}
+
+// Copy the slots of the keys in the delta log of a shard into snapshot (which must have room for delta_len slots),
+// referencing their values, and empty the log (the shard must be locked); returns the number of slots copied
+static size_t take_delta(hash_shard *shard, hash_slot *snapshot)
+{
+	size_t count = 0;
+	for (size_t i = 0; i < shard->delta_len; i++) {
+		uint64_t h = hash_f(shard->delta[i]);
+		hash_array *array;
+		ssize_t index = lookup(shard, shard->delta[i], h, &array);
+		if (index < 0) {
+			continue;// removed
+		}
+		snapshot[count] = array->slots[index];
+		ref_slot(&(snapshot[count++]));
+	}
+	shard->delta_len = 0;
+	return count;
+}
+
+// Snapshot iteration of one shard, passing on the keys modified meanwhile if capture is true; the iterator is never
+// called with the shard locked. Returns false if out of memory
+static bool iterate_shard_snapshot(hash_table *table, hash_shard *shard, hash_iterator *iterator, void *arg,
+                                   bool capture)
+{
+	pthread_mutex_lock(&(shard->lock));
+	size_t count = shard->cur.count + shard->old.count;
+	hash_slot *snapshot = malloc((count + 1) * sizeof(hash_slot));
+	if (snapshot == NULL) {
+		pthread_mutex_unlock(&(shard->lock));
+		perror("malloc");
+		return false;
+	}
+
+	// The copies reference their out of line values, which stay allocated even if they are replaced meanwhile
+	count = copy_array(&(shard->cur), snapshot);
+	if (is_resizing(shard)) {
+		count += copy_array(&(shard->old), snapshot + count);
+	}
+	if (capture) {
+		shard->capturing = true;
+		shard->delta_len = 0;
+		shard->delta_lost = false;
+	}
+	pthread_mutex_unlock(&(shard->lock));
+
+	iterate_snapshot(table, shard, snapshot, count, iterator, arg);
+	if (!capture) {
+		free(snapshot);
+		return true;
+	}
+
+	// Pass on the keys modified meanwhile, in rounds, until few are left; the last ones are copied as capturing
+	// stops, so the later modifications are left to the caller
+	bool result = true;
+	for (int round = 0;; round++) {
+		pthread_mutex_lock(&(shard->lock));
+
+		bool last = (shard->delta_len <= HASH_DELTA_LOCKED_KEYS) || (round == HASH_DELTA_MAX_ROUNDS);
+		hash_slot *delta_snapshot = realloc(snapshot, (shard->delta_len + 1) * sizeof(hash_slot));
+		if (delta_snapshot == NULL) {
+			perror("realloc");
+			shard->delta_lost = true;
+			last = true;
+		} else {
+			snapshot = delta_snapshot;
+			count = take_delta(shard, snapshot);
+		}
+
+		if (last) {
+			shard->capturing = false;
+			if (shard->delta_lost) {
+				result = false;
+			}
+			free(shard->delta);
+			shard->delta = NULL;
+			shard->delta_len = 0;
+			shard->delta_size = 0;
+		}
+		pthread_mutex_unlock(&(shard->lock));
+
+		if (delta_snapshot != NULL) {
+			iterate_snapshot(table, shard, snapshot, count, iterator, arg);
+		}
+		if (last) {
+			break;
+		}
+	}
+
+	free(snapshot);
+	return result;
+}
+
+// Iterate through all keys without blocking writers for long; returns false if some modifications may be missed
+bool hash_iterate_snapshot(hash_table *table, hash_iterator *iterator, void *arg)
+{
+	assert(table != NULL);
+	assert(iterator != NULL);
+
+	bool result = true;
+	for (size_t i = 0; i < table->num_shards; i++) {
+		if (!iterate_shard_snapshot(table, &(table->shards[i]), iterator, arg, true)) {
+			result = false;
+		}
+	}
+	return result;
+}
+
+// Iterate through all keys without blocking writers for long, or recording their modifications
+bool hash_iterate_copy(hash_table *table, hash_iterator *iterator, void *arg)
+{
+	assert(table != NULL);
+	assert(iterator != NULL);
+
+	for (size_t i = 0; i < table->num_shards; i++) {
+		if (!iterate_shard_snapshot(table, &(table->shards[i]), iterator, arg, false)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Check if a modification of a key is recorded by a snapshot iteration in progress; not synchronized
+bool hash_capturing(hash_table *table, const char key[KEY_SIZE])
+{
+	assert(table != NULL);
+	return get_shard(table, hash_f(key))->capturing;
 }
@@ -2,59 +2,231 @@
 #define _HASH_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
 
 #include "defs.h"
-#include "dlist.h"
-
-
-typedef struct _hash_entry {
-	dlist_entry list_entry;
+#include "merkle.h"
+#include "slab.h"
+
+
+// Open addressing hash table (SwissTable-style). Each shard is an array of slots plus an array of
+// control bytes, one per slot: the low 7 bits of the key hash for a full slot, or EMPTY/DELETED.
+// Lookups probe groups of 16 control bytes at a time (with SSE2 where available) and only compare
+// keys for slots whose control byte matches, so a GET touches one or two cache lines of metadata
+// and the slot itself. Keys are stored inline; values up to HASH_INLINE_VALUE_SIZE bytes are
+// stored inline too, larger ones are allocated out of line (and reference counted, see hash_value).
+// Arrays and out of line values are allocated from a per-table slab pool, which also enforces the table's memory
+// limit (values can also be used in place in memory the table doesn't own, see hash_put_foreign()). Every key
+// carries the version of its last update (chosen by the caller), and a table can keep a Merkle tree of the versions
+// of its keys up to date.
+
+#define HASH_GROUP_SIZE 16
+#define HASH_INLINE_VALUE_SIZE 24
+
+// Number of independently locked shards; a power of 2
+#define HASH_NUM_SHARDS 64
+
+// Maximum number of threads that can use hash_get_copy() without locking; any others lock the shard
+#define HASH_MAX_READERS 128
+
+// Number of retired allocations a shard accumulates before it tries to free them
+#define HASH_RECLAIM_BATCH 32
+
+// Number of groups moved from the old array to the new one by every modification while a shard is resized
+#define HASH_MIGRATE_GROUPS 4
+
+// A snapshot iteration delivers the keys modified during the iteration of a shard in rounds, until few enough are left
+// to stop recording the modifications (or it has taken too many rounds)
+#define HASH_DELTA_LOCKED_KEYS 64
+#define HASH_DELTA_MAX_ROUNDS 8
+
+// An out of line value. The table holds one reference to it, and hash_get_ref() takes more, so that the value can be
+// used without copying it and without holding the lock (e.g. sent straight to a socket); replacing or removing the
+// key only drops the table's reference, and the value is freed with the last one. Values are never modified in place
+typedef struct _hash_value {
+	volatile uint32_t refs;
+	char data[];
+} hash_value;
+
+typedef struct _hash_slot {
 	char key[KEY_SIZE];
-	void *value;// must be != NULL
+	union {
+		char data[HASH_INLINE_VALUE_SIZE];
+		hash_value *ptr;
+	} value;
 	size_t value_sz;
-} hash_entry;
-
-typedef struct _hash_bucket {
-	dlist entries;
+	uint64_t version;
+} hash_slot;
+
+typedef struct _hash_array {
+	size_t num_groups;// capacity is num_groups * HASH_GROUP_SIZE; a power of 2
+	size_t count;// full slots
+	size_t deleted;// tombstones
+	int8_t *ctrl;
+	hash_slot *slots;
+} hash_array;
+
+// Lock-free readers announce the epoch they started in; memory unlinked by writers (out of line values,
+// arrays left behind by a resize) is only freed once every reader that might still see it has finished
+typedef struct _hash_reader {
+	volatile uint64_t epoch;// 0 if not reading
+	char pad[64 - sizeof(uint64_t)];
+} hash_reader;
+
+typedef struct _hash_retired {
+	void *ptr;
+	size_t size;
+	uint64_t epoch;// table epoch when ptr was unlinked
+} hash_retired;
+
+// A shard grows, shrinks or drops its tombstones incrementally: a new array is allocated and the entries
+// of the old one are moved over a few groups at a time by subsequent modifications, so no operation
+// ever rehashes the whole shard. While this is in progress, a key can be in either array.
+// Writers hold the shard lock and bump seq to an odd value for the duration of a modification; readers
+// check seq before and after reading, and retry if it was odd or has changed.
+typedef struct _hash_shard {
 	pthread_mutex_t lock;
-} hash_bucket;
+	volatile uint32_t seq;
+	hash_array cur;
+	hash_array old;// ctrl == NULL if not resizing
+	size_t migrate_pos;// next group of old to move
+	size_t min_groups;// never shrink below the initial size
+	hash_retired *retired;// waiting to be freed
+	size_t num_retired;
+	size_t max_retired;
+	// Keys modified since the shard was copied by a snapshot iteration (only recorded while capturing)
+	bool capturing;
+	bool delta_lost;// a key could not be recorded
+	char (*delta)[KEY_SIZE];
+	size_t delta_len;
+	size_t delta_size;
+} hash_shard;
 
 typedef struct _hash_table {
-	size_t size;
-	hash_bucket *buckets;
+	size_t num_shards;
+	hash_shard *shards;
+	volatile uint64_t epoch;
+	hash_reader *readers;
+	slab_pool pool;
+	merkle_tree *merkle;// NULL if none
+	// Memory holding foreign values (see hash_put_foreign()); empty if none
+	const char *foreign_base;
+	size_t foreign_length;
 } hash_table;
 
+// A reference to the value of a key, obtained with hash_get_ref()
+typedef struct _hash_ref {
+	hash_table *table;
+	hash_shard *shard;
+	hash_value *value;// NULL for an inline value (copied into inline_data)
+	size_t value_sz;
+	char inline_data[HASH_INLINE_VALUE_SIZE];
+} hash_ref;
 
-// Initialize a hash table with given size; returns true on success
+
+// Initialize a hash table with room for about size keys before it needs to grow; returns true on success
 bool hash_init(hash_table *table, size_t size);
 
-// Free resources used by a hash table
+// Free resources used by a hash table (including the stored values); all references must have been released
 void hash_cleanup(hash_table *table);
 
+// Limit the memory used by a hash table (0 for unlimited); puts that would exceed it fail
+void hash_set_memory_limit(hash_table *table, size_t limit);
+
+// Get the memory used by a hash table, in bytes
+size_t hash_memory_used(const hash_table *table);
+
+// Keep a Merkle tree up to date with the versions of the keys in the table (from now on; the table should be empty);
+// a tree can be shared by several tables
+void hash_set_merkle(hash_table *table, merkle_tree *merkle);
+
+// Let a table store values that live in memory it doesn't own, between base and base + length (e.g. a mapped file,
+// see hash_put_foreign()); the table should be empty, and the memory must stay valid until hash_cleanup()
+void hash_set_foreign_memory(hash_table *table, const void *base, size_t length);
+
+// Get the number of keys stored in a hash table; synchronized
+size_t hash_count(hash_table *table);
 
-// Lock a particular key (lock corresponding hash bucket)
+// Grow a hash table ahead of time so that it holds about size keys without resizing (e.g. before a bulk insert);
+// returns true on success (failing is harmless: the table still grows as needed); synchronized
+bool hash_reserve(hash_table *table, size_t size);
+
+
+// Lock a particular key (lock corresponding shard)
 void hash_lock(hash_table *table, const char key[KEY_SIZE]);
 
-// Unlock a particular key (unlock corresponding hash bucket)
+// Unlock a particular key (unlock corresponding shard)
 void hash_unlock(hash_table *table, const char key[KEY_SIZE]);
 
 
-// Get value for a key; returns true on success; not synchronized
+// Get value for a key; returns true on success; not synchronized (the key must be locked)
+// The value points into the table and is only valid until the key is next modified
 bool hash_get(hash_table *table, const char key[KEY_SIZE], void **value, size_t *value_sz);
 
-// Put a new value for a key and obtain the old value (if any); returns true on success; not synchronized
-bool hash_put(hash_table *table, const char key[KEY_SIZE], void *value, size_t value_sz,
+// Copy the value for a key (up to buffer_sz bytes) into buffer and get its full size; returns true on success;
+// synchronized, but never takes a lock: it can run concurrently with modifications of the same key
+bool hash_get_copy(hash_table *table, const char key[KEY_SIZE], void *buffer, size_t buffer_sz, size_t *value_sz);
+
+// Get a reference to the value for a key, that stays valid (and unchanged) until hash_release_ref() even if the key
+// is modified or removed meanwhile (small values are copied into the reference instead); returns true on success;
+// synchronized, but never takes a lock, like hash_get_copy()
+bool hash_get_ref(hash_table *table, const char key[KEY_SIZE], hash_ref *ref);
+
+// Get the value of a reference (ref->value_sz bytes)
+const void *hash_ref_data(const hash_ref *ref);
+
+// Release a reference obtained with hash_get_ref(); synchronized (locks the shard if the value has to be freed)
+void hash_release_ref(hash_ref *ref);
+
+// Prefetch the table metadata of a key, ahead of looking it up (e.g. for each key of a batch before looking them up
+// in turn); it may read a stale array, which is harmless
+void hash_prefetch(hash_table *table, const char key[KEY_SIZE]);
+
+// Get the version of a key; returns true on success; not synchronized (the key must be locked)
+bool hash_get_version(hash_table *table, const char key[KEY_SIZE], uint64_t *version);
+
+// Put a copy of a value for a key with the given version (!= 0) and obtain the old value (if any; must be freed by
+// the caller); returns true on success; not synchronized
+bool hash_put(hash_table *table, const char key[KEY_SIZE], const void *value, size_t value_sz, uint64_t version,
               void **old_value, size_t *old_value_sz);
 
-// Remove a key and obtain the old value (if any); returns true on success; not synchronized
+// Put a value for a key with the given version (!= 0) without copying it: value is already laid out as an out of
+// line value (with refs == 1) in the table's foreign memory, and is used in place (small values are still copied
+// into the slot). Foreign values are not counted in the memory used, and are never freed; returns true on success;
+// not synchronized
+bool hash_put_foreign(hash_table *table, const char key[KEY_SIZE], hash_value *value, size_t value_sz,
+                      uint64_t version);
+
+// Remove a key and obtain the old value (if any; must be freed by the caller); returns true on success;
+// not synchronized
 bool hash_remove(hash_table *table, const char key[KEY_SIZE], void **old_value, size_t *old_value_sz);
 
 
-typedef void hash_iterator(const char key[KEY_SIZE], void *value, size_t value_sz, void *arg);
+typedef void hash_iterator(const char key[KEY_SIZE], void *value, size_t value_sz, uint64_t version, void *arg);
 
-// Iterate through all keys, calling iterator(key, value, value_sz, arg) for each key; synchronized
+// Iterate through all keys, calling iterator(key, value, value_sz, version, arg) for each key; synchronized
 void hash_iterate(hash_table *table, hash_iterator *iterator, void *arg);
 
+// Same as hash_iterate(), but each shard is only locked while its slots are copied (the copies hold references to
+// their values until the iterator has seen them), and the iterator is never called with a shard locked, so it can
+// take its time without blocking writers. The keys modified after their shard was copied are recorded in a delta log,
+// and passed to the iterator again with their latest value once the copy is done; the last few are copied as the
+// recording stops (see hash_capturing()), so the caller must handle the modifications after that itself, and the
+// iterator may see a key after the caller has handled a later modification of it (the versions tell them apart).
+// Keys removed meanwhile are not reported. Only one snapshot iteration of a table can run at a time.
+// Returns false if out of memory (some keys or modifications may have been missed)
+bool hash_iterate_snapshot(hash_table *table, hash_iterator *iterator, void *arg);
+
+// Same as hash_iterate_snapshot(), but the keys modified after their shard was copied are not passed on again: the
+// iterator gets every key as it was at some point after the call (e.g. for a caller that logs the modifications
+// itself). It doesn't interfere with a snapshot iteration, and runs concurrently with one
+// Returns false if out of memory (some keys may have been missed)
+bool hash_iterate_copy(hash_table *table, hash_iterator *iterator, void *arg);
+
+// Check if a modification of a key is recorded by a snapshot iteration in progress (and so will be passed to its
+// iterator); not synchronized (the key must be locked)
+bool hash_capturing(hash_table *table, const char key[KEY_SIZE]);
+
 
 #endif// _HASH_H_
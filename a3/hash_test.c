@@ -0,0 +1,153 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+
+
+// Checks of hash table behaviour that the cluster tests can't reach deterministically; exits with 1 on failure
+
+static int failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+static void make_key(char key[KEY_SIZE], int i)
+{
+	memset(key, 0, KEY_SIZE);
+	snprintf(key, KEY_SIZE, "key%d", i);
+}
+
+// A GET in progress while a PUT overwrites a key whose value is used in place from foreign memory (e.g. a mapped
+// snapshot): releasing the last reference must leave the value alone, since the table doesn't own it
+static void test_foreign_overwrite_during_get()
+{
+	// Laid out as a snapshot heap: each value starts with the table's reference (refs == 1), 8-byte aligned
+	static const size_t sizes[] = { 100, 1500, 4000 };
+	const int num_values = sizeof(sizes) / sizeof(sizes[0]);
+	size_t offsets[num_values];
+	size_t length = 0;
+	for (int i = 0; i < num_values; i++) {
+		offsets[i] = length;
+		length += (sizeof(hash_value) + sizes[i] + 7) & ~(size_t)7;
+	}
+	char *heap = malloc(length);
+	char *copy = malloc(length);
+	if ((heap == NULL) || (copy == NULL)) {
+		perror("malloc");
+		exit(1);
+	}
+
+	hash_table table;
+	if (!hash_init(&table, 16)) {
+		exit(1);
+	}
+	hash_set_foreign_memory(&table, heap, length);
+
+	char key[KEY_SIZE];
+	for (int i = 0; i < num_values; i++) {
+		hash_value *value = (hash_value*)(heap + offsets[i]);
+		value->refs = 1;
+		memset(value->data, 'a' + i, sizes[i]);
+		make_key(key, i);
+		CHECK(hash_put_foreign(&table, key, value, sizes[i], 1));
+	}
+
+	for (int i = 0; i < num_values; i++) {
+		make_key(key, i);
+		hash_ref ref;
+		CHECK(hash_get_ref(&table, key, &ref));
+		CHECK(ref.value == (hash_value*)(heap + offsets[i]));
+
+		char new_value[64];
+		memset(new_value, 'z', sizeof(new_value));
+		CHECK(hash_put(&table, key, new_value, sizeof(new_value), 2, NULL, NULL));
+
+		// The reference still reads the old value, and dropping it frees nothing
+		size_t used = hash_memory_used(&table);
+		memcpy(copy, heap, length);
+		CHECK(((const char*)hash_ref_data(&ref))[0] == 'a' + i);
+		hash_release_ref(&ref);
+		CHECK(hash_memory_used(&table) == used);
+		CHECK(((hash_value*)(heap + offsets[i]))->refs == 0);
+		CHECK(memcmp(copy + offsets[i] + sizeof(hash_value), heap + offsets[i] + sizeof(hash_value), sizes[i]) == 0);
+	}
+
+	// The table still allocates normally
+	for (int i = num_values; i < num_values + 1000; i++) {
+		char value[200];
+		memset(value, 'x', sizeof(value));
+		make_key(key, i);
+		CHECK(hash_put(&table, key, value, sizeof(value), 1, NULL, NULL));
+	}
+	CHECK(hash_count(&table) == (size_t)num_values + 1000);
+
+	hash_cleanup(&table);
+	free(copy);
+	free(heap);
+}
+
+typedef struct _iterate_args {
+	hash_table *table;
+	int seen;
+	int puts;
+} iterate_args;
+
+// Overwrites the keys it is passed, which would deadlock if it was called with their shard locked
+static void put_back_f(const char key[KEY_SIZE], void *value, size_t value_sz, uint64_t version, void *arg)
+{
+	iterate_args *args = arg;
+	args->seen++;
+	if (args->puts > 0) {
+		args->puts--;
+		CHECK(hash_put(args->table, key, value, value_sz, version + 1, NULL, NULL));
+	}
+}
+
+// A snapshot iteration never calls the iterator with a shard locked, including for the keys modified meanwhile
+static void test_snapshot_iteration_unlocked()
+{
+	const int num_keys = 5000;
+	hash_table table;
+	if (!hash_init(&table, num_keys)) {
+		exit(1);
+	}
+
+	char key[KEY_SIZE];
+	char value[100];
+	memset(value, 'v', sizeof(value));
+	for (int i = 0; i < num_keys; i++) {
+		make_key(key, i);
+		CHECK(hash_put(&table, key, value, (i % 2 == 0) ? sizeof(value) : 8, 1, NULL, NULL));
+	}
+
+	iterate_args args = { &table, 0, 3 * num_keys };
+	CHECK(hash_iterate_snapshot(&table, put_back_f, &args));
+	CHECK(args.seen >= num_keys);
+
+	args.seen = 0;
+	args.puts = num_keys;
+	CHECK(hash_iterate_copy(&table, put_back_f, &args));
+	CHECK(args.seen == num_keys);
+
+	hash_cleanup(&table);
+}
+
+int main()
+{
+	test_foreign_overwrite_during_get();
+	test_snapshot_iteration_unlocked();
+
+	if (failures > 0) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf("All hash table checks passed\n");
+	return 0;
+}
@@ -0,0 +1,73 @@
+#include <assert.h>
+#include <string.h>
+
+#include "merkle.h"
+
+
+// 64-bit finalizer (from MurmurHash3)
+static uint64_t mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// Hash of a (key, version) pair
+static uint64_t entry_hash(const char key[KEY_SIZE], uint64_t version)
+{
+	uint64_t k[2];
+	memcpy(k, key, sizeof(k));
+	return mix(mix(k[0] ^ version) ^ k[1]);
+}
+
+
+void merkle_init(merkle_tree *tree)
+{
+	assert(tree != NULL);
+	memset(tree, 0, sizeof(*tree));
+}
+
+// Keys are MD5 digests; bytes 12-13 are neither used by key_server_id() nor by key_shard_id()
+int merkle_range(const char key[KEY_SIZE])
+{
+	assert(key != NULL);
+
+	uint16_t r;
+	memcpy(&r, key + 12, sizeof(r));
+	return r & (MERKLE_LEAVES - 1);
+}
+
+void merkle_update(merkle_tree *tree, const char key[KEY_SIZE], uint64_t old_version, uint64_t new_version)
+{
+	assert(tree != NULL);
+	assert(key != NULL);
+
+	uint64_t delta = 0;
+	if (old_version != 0) {
+		delta ^= entry_hash(key, old_version);
+	}
+	if (new_version != 0) {
+		delta ^= entry_hash(key, new_version);
+	}
+	__atomic_xor_fetch(&(tree->leaves[merkle_range(key)]), delta, __ATOMIC_RELAXED);
+}
+
+void merkle_build(merkle_tree *tree, uint64_t nodes[MERKLE_NODES])
+{
+	assert(tree != NULL);
+	assert(nodes != NULL);
+
+	for (int i = 0; i < MERKLE_LEAVES; i++) {
+		nodes[MERKLE_LEAVES + i] = __atomic_load_n(&(tree->leaves[i]), __ATOMIC_RELAXED);
+	}
+	// Empty subtrees have a zero digest, like empty ranges
+	for (int n = MERKLE_LEAVES - 1; n >= 1; n--) {
+		uint64_t left = nodes[2 * n];
+		uint64_t right = nodes[2 * n + 1];
+		nodes[n] = ((left | right) == 0) ? 0 : mix(left ^ mix(right + n));
+	}
+	nodes[0] = 0;
+}
@@ -0,0 +1,38 @@
+#ifndef _MERKLE_H_
+#define _MERKLE_H_
+
+#include <stdint.h>
+
+#include "defs.h"
+
+
+// Merkle tree over the key ranges of a set. The key space is split into MERKLE_LEAVES ranges (by key bits that
+// don't depend on the server or shard a key belongs to, so all servers split a set the same way). The digest of a
+// range is the XOR of the hashes of the (key, version) pairs in it, so it is updated in place by every PUT, and
+// two copies of a set that hold the same versions of the same keys in a range have the same digest. Inner nodes
+// are only computed when the tree is compared with another one. Nodes are numbered like in a binary heap: the root
+// is 1, the children of node n are 2n and 2n + 1, and the leaves are MERKLE_LEAVES to MERKLE_NODES - 1.
+
+#define MERKLE_LEAVES 4096// a power of 2
+#define MERKLE_NODES (2 * MERKLE_LEAVES)
+
+typedef struct _merkle_tree {
+	uint64_t leaves[MERKLE_LEAVES];// updated atomically, so that different shards can share a tree
+} merkle_tree;
+
+
+// Initialize an empty tree
+void merkle_init(merkle_tree *tree);
+
+// Get the range (leaf index, from 0 to MERKLE_LEAVES - 1) that a key belongs to
+int merkle_range(const char key[KEY_SIZE]);
+
+// Account for a key changing from old_version to new_version (0 if the key is not there before/after); synchronized
+void merkle_update(merkle_tree *tree, const char key[KEY_SIZE], uint64_t old_version, uint64_t new_version);
+
+// Compute the digests of all the nodes (nodes[0] is unused); synchronized, but only a snapshot if the tree is being
+// updated
+void merkle_build(merkle_tree *tree, uint64_t nodes[MERKLE_NODES]);
+
+
+#endif// _MERKLE_H_
@@ -12,9 +12,12 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 
 #include "defs.h"
+#include "phi.h"
 #include "util.h"
+#include "wal.h"
 
 
 // Program arguments
@@ -27,32 +30,71 @@ static uint16_t servers_port = 0;
 static char cfg_file_name[PATH_MAX] = "";
 
 // Timeout for detecting server failures; you might want to adjust this default value
+// A server is normally detected as failed much earlier, once its heartbeats are late enough (see phi_threshold)
 static const int default_server_timeout = 3;
 static int server_timeout = 0;
 
+// Interval between heartbeat messages sent by the key-value servers (in ms)
+static const int default_heartbeat_interval = 100;
+static int heartbeat_interval = 0;
+
+// Suspicion level (see phi.h) at which a server is detected as failed
+static const double default_phi_threshold = 8.0;
+static double phi_threshold = 0;
+
+// Lower bound on the deviation of heartbeat inter-arrival times assumed by the failure detector (in ms), so that
+// a server whose heartbeats are very regular is not suspected as soon as one is slightly late (e.g. when the
+// machine is busy); with the defaults, a server is detected as failed after ~0.7 s of silence
+static const double heartbeat_min_stddev = 100.0;
+
 // Log file name
 static char log_file_name[PATH_MAX] = "";
 
+// Memory limit passed on to key-value servers (in MB); 0 if unlimited
+static int server_memory_limit = 0;
+
+// Serve clients of key-value servers with io_uring instead of epoll
+static bool server_io_uring = false;
+
+// Durability of the PUTs to key-value servers (see wal.h); each server logs them to server_<server id>.wal
+static wal_durability server_durability = WAL_NONE;
+
 
 static void usage(char **argv)
 {
 	printf("usage: %s -c <client port> -s <servers port> -C <config file> "
-	       "[-t <timeout (seconds)> -l <log file>]\n", argv[0]);
+	       "[-t <timeout (seconds)> -i <heartbeat interval (ms)> -p <phi threshold> -l <log file> "
+	       "-L <server memory limit (MB)> -U -W none|async|sync]\n", argv[0]);
 	printf("Default timeout is %d seconds\n", default_server_timeout);
+	printf("Default heartbeat interval is %d ms, and a server is detected as failed once phi reaches %.1f\n",
+	       default_heartbeat_interval, default_phi_threshold);
 	printf("If the log file (-l) is not specified, log output is written to stdout\n");
+	printf("-U makes the key-value servers serve their clients with io_uring instead of epoll\n");
+	printf("-W makes the key-value servers log PUTs to disk, and replay them when restarted (default is none)\n");
 }
 
 // Returns false if the arguments are invalid
 static bool parse_args(int argc, char **argv)
 {
 	char option;
-	while ((option = getopt(argc, argv, "c:s:C:l:t:")) != -1) {
+	while ((option = getopt(argc, argv, "c:s:C:l:t:i:p:L:UW:")) != -1) {
 		switch(option) {
 			case 'c': clients_port = atoi(optarg); break;
 			case 's': servers_port = atoi(optarg); break;
 			case 'l': strncpy(log_file_name, optarg, PATH_MAX); break;
 			case 'C': strncpy(cfg_file_name, optarg, PATH_MAX); break;
 			case 't': server_timeout = atoi(optarg); break;
+			case 'i': heartbeat_interval = atoi(optarg); break;
+			case 'p': phi_threshold = atof(optarg); break;
+			case 'L': server_memory_limit = atoi(optarg); break;
+			case 'U': server_io_uring = true; break;
+			case 'W':
+				for (server_durability = 0; server_durability < WAL_DURABILITY_MAX; server_durability++) {
+					if (strcmp(optarg, wal_durability_str[server_durability]) == 0) {
+						break;
+					}
+				}
+				break;
 			default:
 				fprintf(stderr, "Invalid option: -%c\n", option);
 				return false;
@@ -60,8 +102,12 @@ static bool parse_args(int argc, char **argv)
 	}
 
 	server_timeout = (server_timeout != 0) ? server_timeout : default_server_timeout;
+	heartbeat_interval = (heartbeat_interval != 0) ? heartbeat_interval : default_heartbeat_interval;
+	phi_threshold = (phi_threshold != 0) ? phi_threshold : default_phi_threshold;
 
-	return (clients_port != 0) && (servers_port != 0) && (cfg_file_name[0] != '\0');
+	return (clients_port != 0) && (servers_port != 0) && (cfg_file_name[0] != '\0') &&
+	       (server_timeout > 0) && (heartbeat_interval > 0) && (phi_threshold > 0) &&
+	       (server_durability < WAL_DURABILITY_MAX);
 }
 
 
@@ -69,12 +115,16 @@ static bool parse_args(int argc, char **argv)
 static char mserver_host_name[HOST_NAME_MAX] = "";
 
 // Sockets for incoming connections from clients and servers
-static int clients_fd = -1;
 static int servers_fd = -1;
+// UDP socket for heartbeat messages from servers (bound to the same port as servers_fd)
+static int heartbeat_fd = -1;
+
+// Maximum number of connected clients
+#define MAX_CLIENT_SESSIONS 65536
 
-// Store socket fds for all connected clients, up to MAX_CLIENT_SESSIONS
-#define MAX_CLIENT_SESSIONS 1000
-static int client_fd_table[MAX_CLIENT_SESSIONS];
+// Event loop serving client connections, with one thread per CPU
+static event_loop *client_loop = NULL;
+static int num_client_threads = 1;
 
 // Structure describing a key-value server state
 typedef struct _server_node {
@@ -94,11 +144,14 @@ typedef struct _server_node {
 	pid_t pid;
 
 	// Fields for additional server state information
-	time_t last_heartbeat;
+	phi_detector heartbeats;
 	kv_server_state state;
 	bool updated_primary;
 	bool updated_secondary;
 	bool ignore_put;
+	// Latest versions of the server's sets, as last reported by the server
+	uint64_t primary_version;
+	uint64_t secondary_version;
 } server_node;
 
 // Total number of servers
@@ -106,8 +159,15 @@ static int num_servers = 0;
 // Server state information
 static server_node *server_nodes = NULL;
 
-static time_t curtime = NULL;
-static pthread_t client_thread;
+// Version of the routing table, incremented whenever it changes
+static uint32_t routing_epoch = 1;
+
+// Get the host name clients connect to for a server (extract the host name from "user@host")
+static const char *server_host_name(int server_id)
+{
+	char *at = strchr(server_nodes[server_id].host_name, '@');
+	return (at == NULL) ? server_nodes[server_id].host_name : (at + 1);
+}
 
 // Read the configuration file, fill in the server_nodes array
 // Returns false if the configuration is invalid
@@ -125,8 +185,8 @@ static bool read_config_file()
 		goto end;
 	}
 
-	// Need at least 3 servers to avoid cross-replication
-	if (num_servers < 3) {
+	// Need at least 3 servers to avoid cross-replication, and all of them must fit into the routing table
+	if ((num_servers < 3) || (num_servers > (int)ROUTING_MAX_SERVERS)) {
 		fprintf(stderr, "Invalid number of servers: %d\n", num_servers);
 		goto end;
 	}
@@ -150,10 +210,18 @@ static bool read_config_file()
 			goto end;
 		}
 
+		if (strlen(server_host_name(i)) >= ROUTING_HOST_NAME_LEN) {
+			fprintf(stderr, "Host name too long: %s\n", node->host_name);
+			free(server_nodes);
+			server_nodes = NULL;
+			goto end;
+		}
+
 		node->sid = i;
 		node->socket_fd_in = -1;
 		node->socket_fd_out = -1;
 		node->pid = 0;
+		phi_init(&(node->heartbeats), heartbeat_interval, heartbeat_min_stddev);
 	}
 
 	// Print server configuration
@@ -176,8 +244,8 @@ static bool init_servers();
 // Initialize and start the metadata server
 static bool init_mserver()
 {
-	for (int i = 0; i < MAX_CLIENT_SESSIONS; i++) {
-		client_fd_table[i] = -1;
+	if ((num_client_threads = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+		num_client_threads = 1;
 	}
 
 	// Get the host name that server is running on
@@ -186,8 +254,10 @@ static bool init_mserver()
 	}
 	log_write("%s Metadata server starts on host: %s\n", current_time_str(), mserver_host_name);
 
-	// Create sockets for incoming connections from servers
-	if ((servers_fd = create_server(servers_port, num_servers + 1, NULL)) < 0) {
+	// Create sockets for incoming connections and heartbeats from servers
+	if (((servers_fd = create_server(servers_port, num_servers + 1, NULL)) < 0) ||
+	    ((heartbeat_fd = create_udp_server(servers_port)) < 0))
+	{
 		goto cleanup;
 	}
 
@@ -196,10 +266,7 @@ static bool init_mserver()
 		goto cleanup;
 	}
 
-	// Create sockets for incoming connections from clients
-	if ((clients_fd = create_server(clients_port, MAX_CLIENT_SESSIONS, NULL)) < 0) {
-		goto cleanup;
-	}
+	// Client connections are accepted by the client event loop, started in run_mserver_loop()
 
 	log_write("Metadata server initialized\n");
 	return true;
@@ -212,13 +279,12 @@ cleanup:
 // Cleanup and release all the resources
 static void cleanup()
 {
-	close_safe(&clients_fd);
-	close_safe(&servers_fd);
+	// Stop serving clients (and close the listening sockets)
+	event_loop_stop(client_loop);
+	client_loop = NULL;
 
-	// Close all client connections
-	for (int i = 0; i < MAX_CLIENT_SESSIONS; i++) {
-		close_safe(&(client_fd_table[i]));
-	}
+	close_safe(&servers_fd);
+	close_safe(&heartbeat_fd);
 
 	if (server_nodes != NULL) {
 		for (int i = 0; i < num_servers; i++) {
@@ -245,11 +311,6 @@ static void cleanup()
 		free(server_nodes);
 		server_nodes = NULL;
 	}
-
-	// Cancel threads
-	if (client_thread) {
-		pthread_cancel(client_thread);
-	}
 }
 
 
@@ -301,9 +362,26 @@ static char **get_spawn_cmd(int sid)
 	cmd[++i] = strdup("-n");
 	cmd[++i] = malloc(8); sprintf(cmd[i], "%d", num_servers);
 
+	cmd[++i] = strdup("-i");
+	cmd[++i] = malloc(12); sprintf(cmd[i], "%d", heartbeat_interval);
+
 	cmd[++i] = strdup("-l");
 	cmd[++i] = malloc(20); sprintf(cmd[i], "server_%d.log", sid);
 
+	if (server_memory_limit != 0) {
+		cmd[++i] = strdup("-L");
+		cmd[++i] = malloc(12); sprintf(cmd[i], "%d", server_memory_limit);
+	}
+
+	if (server_io_uring) {
+		cmd[++i] = strdup("-U");
+	}
+
+	if (server_durability != WAL_NONE) {
+		cmd[++i] = strdup("-W");
+		cmd[++i] = strdup(wal_durability_str[server_durability]);
+	}
+
 	cmd[++i] = NULL;
 	assert(i < max_cmd_length);
 	return cmd;
@@ -370,6 +448,18 @@ static int spawn_server(int sid)
 		return -1;
 	}
 
+	// Wait for the server to be ready; it tells what versions of its sets it has (e.g. none if it starts empty)
+	char buffer[MAX_MSG_LEN];
+	mserver_ctrl_request *request = (mserver_ctrl_request*)buffer;
+	if (!recv_msg(node->socket_fd_in, buffer, sizeof(buffer), MSG_MSERVER_CTRL_REQ) || (request->type != REGISTER)) {
+		close_safe(&(node->socket_fd_in));
+		close_safe(&(node->socket_fd_out));
+		kill_safe(&(node->pid), 1);
+		return -1;
+	}
+	node->primary_version = request->primary_version;
+	node->secondary_version = request->secondary_version;
+
 	return 0;
 }
 
@@ -408,6 +498,21 @@ static bool send_set_secondary(int sid)
 	return true;
 }
 
+// Maximum number of versions that a recovering server's copy of a set can be behind for a delta resync
+static const uint64_t max_delta_resync_gap = 1000000;
+
+// Choose how to send a set to a recovering server, given the latest versions of the set on both servers
+// An empty copy, or one too far behind (most ranges would differ anyway) is resynchronized in full
+static resync_mode choose_resync(uint64_t source_version, uint64_t target_version)
+{
+	if ((target_version == 0) || (target_version > source_version) ||
+	    (source_version - target_version > max_delta_resync_gap))
+	{
+		return RESYNC_FULL;
+	}
+	return RESYNC_DELTA;
+}
+
 static bool send_request(int sid, int sid2, server_ctrlreq_type ctrlreq_type)
 {
 	char buffer[MAX_MSG_LEN] = {0};
@@ -417,6 +522,13 @@ static bool send_request(int sid, int sid2, server_ctrlreq_type ctrlreq_type)
 	request->hdr.type = MSG_SERVER_CTRL_REQ;
 	request->type = ctrlreq_type;
 
+	// sid sends sid2 its secondary set (sid2's primary set) for UPDATE_PRIMARY, or its primary set for UPDATE_SECONDARY
+	if (ctrlreq_type == UPDATE_PRIMARY) {
+		request->resync = choose_resync(server_nodes[sid].secondary_version, server_nodes[sid2].primary_version);
+	} else if (ctrlreq_type == UPDATE_SECONDARY) {
+		request->resync = choose_resync(server_nodes[sid].primary_version, server_nodes[sid2].secondary_version);
+	}
+
 	int host_name_len = 0;
 	if (ctrlreq_type != SWITCH_PRIMARY) {
 		server_node *secondary_node = &(server_nodes[sid2]);
@@ -466,44 +578,87 @@ static bool init_servers()
 	return true;
 }
 
-// Connection will be closed after calling this function regardless of result
-static void process_client_message(int fd)
+// Get the server currently serving the key set of a given server
+static int serving_server_id(int server_id)
 {
-	// log_write("%s Receiving a client message\n", current_time_str());
-
-	// Read and parse the message
-	locate_request request = {0};
-	if (!recv_msg(fd, &request, sizeof(request), MSG_LOCATE_REQ)) {
-		return;
-	}
-
-	// Determine which server is responsible for the requested key
-	int server_id = key_server_id(request.key, num_servers);
-
 	// Redirect client requests to the secondary replica while the primary is being recovered
 	if (server_nodes[server_id].state != KV_SERVER_ONLINE) {
-		server_id = secondary_server_id(server_id, num_servers);
+		return secondary_server_id(server_id, num_servers);
 	}
+	return server_id;
+}
+
+// Record a change in the routing (server states or which server serves which key set)
+static void routing_changed()
+{
+	routing_epoch++;
+	log_write("%s Routing epoch %u\n", current_time_str(), routing_epoch);
+}
+
+// Returns false if the request couldn't be answered (so the connection will be closed)
+static bool process_locate_request(connection *conn, const locate_request *request)
+{
+	// Determine which server is responsible for the requested key
+	int server_id = serving_server_id(key_server_id(request->key, num_servers));
 
+	// Requests for the set being switched are not answered; closing the connection makes the client fail the
+	// request (and any others it has in flight) and retry later
 	if (server_nodes[server_id].ignore_put) {
-		return;
+		return false;
 	}
 
 	// Fill in the response with the key-value server location information
 	char buffer[MAX_MSG_LEN] = {0};
 	locate_response *response = (locate_response*)buffer;
 	response->hdr.type = MSG_LOCATE_RESP;
+	response->hdr.req_id = request->hdr.req_id;
 	response->port = server_nodes[server_id].cport;
 
-	// Extract the host name from "user@host"
-	char *at = strchr(server_nodes[server_id].host_name, '@');
-	char *host = (at == NULL) ? server_nodes[server_id].host_name : (at + 1);
-
+	const char *host = server_host_name(server_id);
 	int host_name_len = strlen(host) + 1;
 	strncpy(response->host_name, host, host_name_len);
 
 	// Reply to the client
-	send_msg(fd, response, sizeof(*response) + host_name_len);
+	return conn_send_msg(conn, response, sizeof(*response) + host_name_len);
+}
+
+static bool process_routing_request(connection *conn, const routing_request *request)
+{
+	char buffer[MAX_MSG_LEN] = {0};
+	routing_response *response = (routing_response*)buffer;
+	response->hdr.type = MSG_ROUTING_RESP;
+	response->hdr.req_id = request->hdr.req_id;
+	response->epoch = routing_epoch;
+	response->num_servers = num_servers;
+
+	for (int i = 0; i < num_servers; i++) {
+		routing_entry *entry = &(response->servers[i]);
+		snprintf(entry->host_name, sizeof(entry->host_name), "%s", server_host_name(i));
+		entry->port = server_nodes[i].cport;
+		entry->state = server_nodes[i].state;
+		entry->serving_sid = serving_server_id(i);
+		entry->paused = server_nodes[entry->serving_sid].ignore_put;
+	}
+
+	return conn_send_msg(conn, response, sizeof(*response) + num_servers * sizeof(routing_entry));
+}
+
+// Called by the client event loop for every message received from a client
+// Returns false if the message was invalid (so the connection will be closed)
+// Client connections are persistent: a client can send any number of LOCATE/ROUTING requests over one connection
+static bool process_client_message(connection *conn, void *msg)
+{
+	// log_write("%s Receiving a client message\n", current_time_str());
+
+	msg_hdr *hdr = msg;
+	switch (hdr->type) {
+		case MSG_LOCATE_REQ : return process_locate_request (conn, msg);
+		case MSG_ROUTING_REQ: return process_routing_request(conn, msg);
+
+		default:
+			fprintf(stderr, "Metadata server: Invalid client message type %s\n", msg_type_str[hdr->type]);
+			return false;
+	}
 }
 
 static void handle_switch_primary(int Saa, int Sb) {
@@ -511,6 +666,7 @@ static void handle_switch_primary(int Saa, int Sb) {
 	// over as primary for X) is finalized. It can still service client requests for any other keys
 	server_nodes[Saa].ignore_put = true;
 	server_nodes[Sb].ignore_put = true;
+	routing_changed();
 
 	// 13. M sends Sb a SWITCH PRIMARY message, to indicate that it should flush
 	// any in-flight PUT requests and ignore any further PUT requests for set X
@@ -526,6 +682,53 @@ static void handle_switch_primary(int Saa, int Sb) {
 	server_nodes[Sb].ignore_put = false;
 
 	server_nodes[Saa].state = KV_SERVER_ONLINE;
+	routing_changed();
+}
+
+// Current time for the failure detector (in ms)
+static double current_time_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Time of the last failure detection check (in ms)
+static double last_check_time = 0;
+
+// Returns true if the loop was held up for a while (e.g. by a recovery, which waits for the servers), so that the
+// heartbeats that arrived meanwhile were not received in time, and the time since the last one is meaningless
+static bool loop_stalled(double now)
+{
+	return (last_check_time != 0) && (now - last_check_time > 2 * heartbeat_interval);
+}
+
+static void process_heartbeat(const mserver_ctrl_request *request, double now)
+{
+	server_node *node = &(server_nodes[request->server_id]);
+	if (loop_stalled(now)) {
+		phi_restart(&(node->heartbeats), now);
+	} else {
+		phi_heartbeat(&(node->heartbeats), now);
+	}
+	node->primary_version = request->primary_version;
+	node->secondary_version = request->secondary_version;
+}
+
+// Process all the heartbeat messages received on the UDP socket
+static void process_heartbeats()
+{
+	char buffer[MAX_MSG_LEN];
+	mserver_ctrl_request *request = (mserver_ctrl_request*)buffer;
+
+	// Stops once there are no more datagrams (or at an invalid one; the rest are read on the next call)
+	while (recv_datagram(heartbeat_fd, buffer, sizeof(buffer), MSG_MSERVER_CTRL_REQ)) {
+		if ((request->type != HEARTBEAT) || (request->server_id >= num_servers)) {
+			fprintf(stderr, "Metadata server: Invalid heartbeat message\n");
+			continue;
+		}
+		process_heartbeat(request, current_time_ms());
+	}
 }
 
 // Returns false if the message was invalid (so the connection will be closed)
@@ -543,7 +746,14 @@ static bool process_server_message(int fd)
 	// Read and process the message
 	switch (request->type) {
 		case HEARTBEAT: {
-			server_nodes[request->server_id].last_heartbeat = curtime;
+			// Heartbeats are normally sent over UDP, but are accepted over the connection as well
+			process_heartbeat(request, current_time_ms());
+			break;
+		}
+
+		case REGISTER: {
+			// Only expected while the server is being spawned
+			fprintf(stderr, "Metadata server: Unexpected REGISTER from server %d\n", request->server_id);
 			break;
 		}
 
@@ -593,73 +803,30 @@ static bool process_server_message(int fd)
 }
 
 
-static const int select_timeout_interval = 2; // in seconds
-static const int heartbeat_check_diff = 3;    // in seconds
-
-static void *process_client_task(void *args)
-{
-	// Usual preparation stuff for select()
-	fd_set rset, allset;
-	FD_ZERO(&allset);
-	FD_SET(clients_fd, &allset);
-
-	int maxfd = clients_fd;
-
-	for (;;) {
-		rset = allset;
-
-		struct timeval time_out;
-		time_out.tv_sec = select_timeout_interval;
-		time_out.tv_usec = 0;
-
-		// Wait with timeout (in order to be able to handle asynchronous events such as heartbeat messages)
-		int num_ready_fds = select(maxfd + 1, &rset, NULL, NULL, &time_out);
-		if (num_ready_fds < 0) {
-			perror("select");
-			return false;
-		}
-
-		if (num_ready_fds <= 0) {
-			continue;
-		}
-
-		// Incoming connection from a client
-		if (FD_ISSET(clients_fd, &rset)) {
-			int fd_idx = accept_connection(clients_fd, client_fd_table, MAX_CLIENT_SESSIONS);
-			if (fd_idx >= 0) {
-				FD_SET(client_fd_table[fd_idx], &allset);
-				maxfd = max(maxfd, client_fd_table[fd_idx]);
-			}
-
-			if (--num_ready_fds <= 0) {
-				continue;
-			}
-		}
-
-		// Check for any messages from connected clients
-		for (int i = 0; i < MAX_CLIENT_SESSIONS; i++) {
-			if ((client_fd_table[i] != -1) && FD_ISSET(client_fd_table[i], &rset)) {
-				process_client_message(client_fd_table[i]);
-				// Close connection after processing (semantics are "one connection per request")
-				FD_CLR(client_fd_table[i], &allset);
-				close_safe(&(client_fd_table[i]));
-
-				if (--num_ready_fds <= 0 ) {
-					break;
-				}
-			}
-		}
-	}
-
-	return NULL;
-}
-
 // Returns false if stopped due to errors, true if shutdown was requested
 static bool run_mserver_loop()
 {
-	// Spawn a new thread to handle client requests
-	if (pthread_create(&client_thread, NULL, process_client_task, NULL)) {
-		perror("run_mserver_loop: client thread create\n");
+	// Start the event loop threads that handle client requests
+	if ((client_loop = event_loop_start(clients_port, num_client_threads, MAX_CLIENT_SESSIONS, EVENT_BACKEND_EPOLL,
+	                                    process_client_message)) == NULL)
+	{
+		return false;
+	}
+
+	// Failure detection checks are driven by a periodic timer, twice per heartbeat interval
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (timer_fd < 0) {
+		perror("timerfd_create");
+		return false;
+	}
+	long check_interval_ns = max(heartbeat_interval * 1000000L / 2, 1000000L);
+	struct itimerspec timer_spec = {0};
+	timer_spec.it_interval.tv_sec = check_interval_ns / 1000000000L;
+	timer_spec.it_interval.tv_nsec = check_interval_ns % 1000000000L;
+	timer_spec.it_value = timer_spec.it_interval;
+	if (timerfd_settime(timer_fd, 0, &timer_spec, NULL) < 0) {
+		perror("timerfd_settime");
+		close(timer_fd);
 		return false;
 	}
 
@@ -669,6 +836,8 @@ static bool run_mserver_loop()
 	// End-of-file on stdin (e.g. Ctrl+D in a terminal) is used to request shutdown
 	FD_SET(fileno(stdin), &allset);
 	FD_SET(servers_fd, &allset);
+	FD_SET(heartbeat_fd, &allset);
+	FD_SET(timer_fd, &allset);
 
 	int max_server_fd = -1;
 	for (int i = 0; i < num_servers; i++) {
@@ -676,35 +845,58 @@ static bool run_mserver_loop()
 		max_server_fd = max(max_server_fd, server_nodes[i].socket_fd_in);
 	}
 
-	int maxfd = max(servers_fd, max_server_fd);
+	int maxfd = max(max(servers_fd, heartbeat_fd), max(timer_fd, max_server_fd));
+	bool result = false;
 
 	// Metadata server sits in an infinite loop waiting for incoming connections from clients
 	// and for incoming messages from already connected servers and clients
 	for (;;) {
 		rset = allset;
 
-		struct timeval time_out;
-		time_out.tv_sec = select_timeout_interval;
-		time_out.tv_usec = 0;
-
-		// Wait with timeout (in order to be able to handle asynchronous events such as heartbeat messages)
-		int num_ready_fds = select(maxfd + 1, &rset, NULL, NULL, &time_out);
+		// Wait for messages, or for the timer
+		int num_ready_fds = select(maxfd + 1, &rset, NULL, NULL, NULL);
 		if (num_ready_fds < 0) {
 			perror("select");
-			return false;
+			break;
 		}
 
-		// Failure detection and recovery
-		curtime = time(NULL);
+		// Receive the heartbeats before checking if they are late
+		if (FD_ISSET(heartbeat_fd, &rset)) {
+			process_heartbeats();
+			num_ready_fds--;
+		}
 
-		// Need to go through the list of servers and figure out which servers have not sent a heartbeat message yet
-		// within the timeout interval. Keep information in the server_node structure regarding when was the last
-		// heartbeat received from a server and compare to current time. Initiate recovery if discovered a failure.
-		for (int i = 0; i < num_servers; i++) {
-			server_node *node = &(server_nodes[i]);
+		if (FD_ISSET(timer_fd, &rset)) {
+			uint64_t expirations;
+			if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+				perror("read");
+			}
+			num_ready_fds--;
+
+			// Failure detection and recovery
+			double now = current_time_ms();
+			bool stalled = loop_stalled(now);
+			last_check_time = now;
+
+			// Need to go through the list of servers and figure out which servers have been silent for too long,
+			// given how regularly their heartbeats usually arrive. Initiate recovery if discovered a failure.
+			for (int i = 0; i < num_servers; i++) {
+				server_node *node = &(server_nodes[i]);
+				if (!phi_monitored(&(node->heartbeats))) {
+					continue;
+				}
+				if (stalled) {
+					phi_restart(&(node->heartbeats), now);
+					continue;
+				}
 
-			if (node->last_heartbeat && (difftime(curtime, node->last_heartbeat) > heartbeat_check_diff)) {
-				log_write("Node %d heartbeat check failed at %s\n", node->sid, current_time_str());
+				double phi = phi_value(&(node->heartbeats), now);
+				double silence = now - node->heartbeats.last_arrival;
+				if ((phi < phi_threshold) && (silence < server_timeout * 1000.0)) {
+					continue;
+				}
+				log_write("Node %d heartbeat check failed at %s (phi = %.1f after %.0f ms)\n",
+				          node->sid, current_time_str(), phi, silence);
 
 				// Mark timed out node as failed
 				node->state = KV_SERVER_FAILED;
@@ -721,6 +913,8 @@ static bool run_mserver_loop()
 				// 1. M detects failure, spawns a new server Saa to replace the failed server Sa
 				if (spawn_server(Saa) < 0) {
 					fprintf(stderr, "Spawning reconstruction server %d failed\n", node->sid);
+					// Try again once the server would have been detected as failed again
+					phi_restart(&(node->heartbeats), current_time_ms());
 					continue;
 				}
 
@@ -733,12 +927,15 @@ static bool run_mserver_loop()
 				server_nodes[Saa].cport = cport_temp;
 				server_nodes[Saa].mport = mport_temp;
 
-				server_nodes[Saa].last_heartbeat = curtime;
+				// The replacement server is monitored from now on (it sends heartbeats once it has registered)
+				phi_init(&(server_nodes[Saa].heartbeats), heartbeat_interval, heartbeat_min_stddev);
+				phi_restart(&(server_nodes[Saa].heartbeats), current_time_ms());
 				server_nodes[Saa].state = KV_SERVER_RECON;
 
 				server_nodes[Saa].updated_primary = false;
 				server_nodes[Saa].updated_secondary = false;
 				server_nodes[Saa].ignore_put = false;
+				routing_changed();
 
 				// 2. M sends Sb a UPDATE-PRIMARY message containing information on Saa
 				int Sb = secondary_server_id(Saa, num_servers);
@@ -766,7 +963,8 @@ static bool run_mserver_loop()
 		if (FD_ISSET(fileno(stdin), &rset)) {
 			char buffer[1024];
 			if (fgets(buffer, sizeof(buffer), stdin) == NULL) {
-				return true;
+				result = true;
+				break;
 			}
 		}
 
@@ -786,6 +984,9 @@ static bool run_mserver_loop()
 			}
 		}
 	}
+
+	close(timer_fd);
+	return result;
 }
 
 
@@ -0,0 +1,78 @@
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include "phi.h"
+
+
+static void add_interval(phi_detector *detector, double interval)
+{
+	if (detector->num_intervals == PHI_WINDOW) {
+		double old = detector->intervals[detector->next_interval];
+		detector->sum -= old;
+		detector->sum_sq -= old * old;
+	} else {
+		detector->num_intervals++;
+	}
+
+	detector->intervals[detector->next_interval] = interval;
+	detector->next_interval = (detector->next_interval + 1) % PHI_WINDOW;
+	detector->sum += interval;
+	detector->sum_sq += interval * interval;
+}
+
+// Until real heartbeats are received, assume that they arrive every interval ms, give or take a quarter of it
+void phi_init(phi_detector *detector, double interval, double min_stddev)
+{
+	assert(detector != NULL);
+	assert(interval > 0);
+
+	memset(detector, 0, sizeof(*detector));
+	detector->min_stddev = min_stddev;
+	add_interval(detector, interval - interval / 4);
+	add_interval(detector, interval + interval / 4);
+}
+
+void phi_heartbeat(phi_detector *detector, double now)
+{
+	assert(detector != NULL);
+
+	if (detector->last_arrival != 0) {
+		add_interval(detector, fmax(now - detector->last_arrival, 0.0));
+	}
+	detector->last_arrival = now;
+}
+
+void phi_restart(phi_detector *detector, double now)
+{
+	assert(detector != NULL);
+	detector->last_arrival = now;
+}
+
+bool phi_monitored(const phi_detector *detector)
+{
+	assert(detector != NULL);
+	return detector->last_arrival != 0;
+}
+
+// Uses the logistic approximation of the normal CDF from "A simple approximation to the normal distribution"
+// (Bowling et al.), so that phi doesn't saturate for a long silence
+double phi_value(const phi_detector *detector, double now)
+{
+	assert(detector != NULL);
+
+	if (detector->last_arrival == 0) {
+		return 0;
+	}
+
+	double mean = detector->sum / detector->num_intervals;
+	double variance = detector->sum_sq / detector->num_intervals - mean * mean;
+	double stddev = fmax(sqrt(fmax(variance, 0.0)), detector->min_stddev);
+
+	double y = (now - detector->last_arrival - mean) / stddev;
+	double e = exp(-y * (1.5976 + 0.070566 * y * y));
+	if (y > 0) {
+		return -log10(e / (1.0 + e));
+	}
+	return -log10(1.0 - 1.0 / (1.0 + e));
+}
@@ -0,0 +1,45 @@
+#ifndef _PHI_H_
+#define _PHI_H_
+
+#include <stdbool.h>
+
+
+// Phi-accrual failure detector for a server that sends periodic heartbeats. Instead of a yes/no answer after a fixed
+// timeout, it gives a suspicion level phi that grows with the time since the last heartbeat, relative to the recent
+// distribution of heartbeat inter-arrival times (approximated by a normal distribution): phi = -log10(probability
+// that the next heartbeat is still to come). E.g. phi = 8 means that there is a 1e-8 chance that a heartbeat this
+// late is only delayed. The inter-arrival times of the last PHI_WINDOW heartbeats are kept. All times are in ms.
+
+#define PHI_WINDOW 128
+
+typedef struct _phi_detector {
+	double intervals[PHI_WINDOW];// ring buffer
+	int num_intervals;
+	int next_interval;
+	double sum;// of the intervals in the window
+	double sum_sq;// of their squares
+
+	double min_stddev;// to not suspect a server too early if its heartbeats are very regular
+	double last_arrival;// 0 if the server is not monitored (yet)
+} phi_detector;
+
+
+// Initialize a detector for heartbeats sent every interval ms; the server is not monitored until phi_restart() or
+// the first phi_heartbeat()
+void phi_init(phi_detector *detector, double interval, double min_stddev);
+
+// Record a heartbeat that arrived at the given time
+void phi_heartbeat(phi_detector *detector, double now);
+
+// Start monitoring the server as if a heartbeat arrived at the given time, without recording an inter-arrival time
+// (e.g. when the heartbeats could not be received for a while, so the time since the last one is meaningless)
+void phi_restart(phi_detector *detector, double now);
+
+// Returns true if the server is monitored
+bool phi_monitored(const phi_detector *detector);
+
+// Get the suspicion level at the given time (0 if the server is not monitored)
+double phi_value(const phi_detector *detector, double now);
+
+
+#endif// _PHI_H_
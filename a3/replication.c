@@ -0,0 +1,416 @@
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include "replication.h"
+#include "util.h"
+
+
+bool repl_init(repl_stream *stream)
+{
+	assert(stream != NULL);
+
+	memset(stream, 0, sizeof(*stream));
+	stream->fd = -1;
+	stream->last_req = -1;
+
+	if ((errno = pthread_mutex_init(&(stream->lock), NULL)) != 0) {
+		perror("pthread_mutex_init");
+		return false;
+	}
+	if ((errno = pthread_cond_init(&(stream->cond), NULL)) != 0) {
+		perror("pthread_cond_init");
+		pthread_mutex_destroy(&(stream->lock));
+		return false;
+	}
+	return true;
+}
+
+void repl_cleanup(repl_stream *stream)
+{
+	assert(stream != NULL);
+
+	repl_close(stream);
+	free(stream->queue);
+	stream->queue = NULL;
+	pthread_cond_destroy(&(stream->cond));
+	pthread_mutex_destroy(&(stream->lock));
+}
+
+
+// Take the waiters of the PUTs up to seq (all of them if seq == UINT64_MAX); must be called with the lock held
+static repl_waiter *take_waiters(repl_stream *stream, uint64_t seq)
+{
+	repl_waiter *head = stream->waiters_head;
+	repl_waiter *last = NULL;
+	for (repl_waiter *w = head; (w != NULL) && (w->seq <= seq); w = w->next) {
+		last = w;
+	}
+	if (last == NULL) {
+		return NULL;
+	}
+
+	stream->waiters_head = last->next;
+	if (stream->waiters_head == NULL) {
+		stream->waiters_tail = NULL;
+	}
+	last->next = NULL;
+	return head;
+}
+
+// Notify a list of waiters; must be called without the lock held (the callbacks may add new PUTs)
+static void notify_waiters(repl_waiter *waiters, op_status status)
+{
+	while (waiters != NULL) {
+		repl_waiter *next = waiters->next;
+		waiters->done(waiters, status);
+		waiters = next;
+	}
+}
+
+// Notify the waiters of the PUTs covered by an ack, each with its own status; must be called without the lock held
+static void notify_acked(repl_waiter *waiters, const replication_ack *ack)
+{
+	int f = 0;
+	while (waiters != NULL) {
+		repl_waiter *next = waiters->next;
+		while ((f < ack->num_failures) && (ack->failures[f].seq < waiters->seq)) {
+			f++;
+		}
+		bool failed = (f < ack->num_failures) && (ack->failures[f].seq == waiters->seq);
+		waiters->done(waiters, failed ? ack->failures[f].status : ack->status);
+		waiters = next;
+	}
+}
+
+// Mark the connection as lost (if it wasn't already closed) and wake everyone up; must be called with the lock held
+static void connection_lost(repl_stream *stream)
+{
+	if (stream->running) {
+		log_write("Replication connection lost\n");
+		stream->running = false;
+		stream->failed = true;
+		// Unblock the other thread
+		shutdown(stream->fd, SHUT_RDWR);
+	}
+	pthread_cond_broadcast(&(stream->cond));
+}
+
+// Sends the queued requests, taking all of them at once
+static void *sender_thread_f(void *arg)
+{
+	repl_stream *stream = arg;
+
+	// The buffer that was sent last, reused as the queue next time
+	char *spare = NULL;
+	size_t spare_size = 0;
+
+	pthread_mutex_lock(&(stream->lock));
+	for (;;) {
+		// While the stream is corked, wait for a full request
+		while (stream->running &&
+		       ((stream->queue_len == 0) || ((stream->corked > 0) && (stream->queue_len < MAX_MSG_LEN))))
+		{
+			pthread_cond_wait(&(stream->cond), &(stream->lock));
+		}
+		if (!stream->running) {
+			break;
+		}
+
+		// Swap the buffers; PUTs added from now on go into new requests
+		char *requests = stream->queue;
+		size_t length = stream->queue_len;
+		size_t size = stream->queue_size;
+		stream->queue = spare;
+		stream->queue_size = spare_size;
+		stream->queue_len = 0;
+		stream->last_req = -1;
+		spare = requests;
+		spare_size = size;
+		int fd = stream->fd;
+		pthread_mutex_unlock(&(stream->lock));
+
+		bool ok = true;
+		for (size_t pos = 0; ok && (pos < length); ) {
+			size_t msg_length = ((msg_hdr*)(requests + pos))->length;
+			ok = send_msg(fd, requests + pos, msg_length);
+			pos += msg_length;
+		}
+
+		pthread_mutex_lock(&(stream->lock));
+		if (!ok) {
+			connection_lost(stream);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&(stream->lock));
+
+	free(spare);
+	return NULL;
+}
+
+// Reads the acks and notifies the waiters of the acknowledged PUTs
+static void *receiver_thread_f(void *arg)
+{
+	repl_stream *stream = arg;
+
+	for (;;) {
+		char buffer[MAX_MSG_LEN];
+		if (!recv_msg(stream->fd, buffer, sizeof(buffer), MSG_REPLICATION_ACK)) {
+			break;
+		}
+		replication_ack *ack = (replication_ack*)buffer;
+
+		pthread_mutex_lock(&(stream->lock));
+		if ((ack->seq <= stream->acked_seq) || (ack->seq >= stream->next_seq)) {
+			fprintf(stderr, "Invalid replication ack %" PRIu64 " (acknowledged %" PRIu64 ", sent %" PRIu64 ")\n",
+			        ack->seq, stream->acked_seq, stream->next_seq - 1);
+			pthread_mutex_unlock(&(stream->lock));
+			break;
+		}
+		stream->acked_seq = ack->seq;
+		if ((ack->status != SUCCESS) || (ack->num_failures > 0)) {
+			stream->failed = true;
+		}
+		repl_waiter *waiters = take_waiters(stream, ack->seq);
+		pthread_cond_broadcast(&(stream->cond));
+		pthread_mutex_unlock(&(stream->lock));
+
+		notify_acked(waiters, ack);
+	}
+
+	// The PUTs that were not acknowledged fail
+	pthread_mutex_lock(&(stream->lock));
+	connection_lost(stream);
+	repl_waiter *waiters = take_waiters(stream, UINT64_MAX);
+	pthread_mutex_unlock(&(stream->lock));
+
+	notify_waiters(waiters, SERVER_FAILURE);
+	return NULL;
+}
+
+bool repl_open(repl_stream *stream, int fd)
+{
+	assert(stream != NULL);
+	assert(fd >= 0);
+
+	repl_close(stream);
+
+	pthread_mutex_lock(&(stream->lock));
+	stream->fd = fd;
+	stream->running = true;
+	stream->next_seq = 1;
+	stream->acked_seq = 0;
+	stream->failed = false;
+	stream->queue_len = 0;
+	stream->last_req = -1;
+
+	if ((errno = pthread_create(&(stream->sender), NULL, sender_thread_f, stream)) != 0) {
+		perror("pthread_create");
+		goto failed;
+	}
+	if ((errno = pthread_create(&(stream->receiver), NULL, receiver_thread_f, stream)) != 0) {
+		perror("pthread_create");
+		stream->running = false;
+		pthread_cond_broadcast(&(stream->cond));
+		pthread_mutex_unlock(&(stream->lock));
+		pthread_join(stream->sender, NULL);
+		pthread_mutex_lock(&(stream->lock));
+		goto failed;
+	}
+
+	pthread_mutex_unlock(&(stream->lock));
+	return true;
+
+failed:
+	stream->running = false;
+	close_safe(&(stream->fd));
+	pthread_mutex_unlock(&(stream->lock));
+	return false;
+}
+
+void repl_close(repl_stream *stream)
+{
+	assert(stream != NULL);
+
+	pthread_mutex_lock(&(stream->lock));
+	if (stream->fd < 0) {
+		pthread_mutex_unlock(&(stream->lock));
+		return;
+	}
+
+	// Shutting the socket down makes the receiver thread fail the unacknowledged PUTs and exit
+	stream->running = false;
+	shutdown(stream->fd, SHUT_RDWR);
+	pthread_cond_broadcast(&(stream->cond));
+	pthread_mutex_unlock(&(stream->lock));
+
+	pthread_join(stream->sender, NULL);
+	pthread_join(stream->receiver, NULL);
+
+	pthread_mutex_lock(&(stream->lock));
+	close_safe(&(stream->fd));
+	pthread_mutex_unlock(&(stream->lock));
+}
+
+// Make room for length more bytes in the queue; must be called with the lock held
+static bool reserve_queue(repl_stream *stream, size_t length)
+{
+	if (stream->queue_len + length <= stream->queue_size) {
+		return true;
+	}
+
+	size_t size = (stream->queue_size * 2 > stream->queue_len + length)
+	            ? stream->queue_size * 2 : stream->queue_len + length;
+	char *queue = realloc(stream->queue, size);
+	if (queue == NULL) {
+		perror("realloc");
+		return false;
+	}
+	stream->queue = queue;
+	stream->queue_size = size;
+	return true;
+}
+
+// Add a PUT to the open request of the given type, or to a new one; total_puts is only used for bulk requests
+static bool add_put(repl_stream *stream, msg_type type, uint64_t total_puts, const char key[KEY_SIZE],
+                    const void *value, size_t value_sz, uint64_t version, repl_waiter *waiter)
+{
+	assert(stream != NULL);
+	assert(key != NULL);
+	assert(value != NULL);
+
+	size_t header_length = (type == MSG_BULK_REQ) ? sizeof(bulk_request) : sizeof(replication_request);
+	size_t max_length = (type == MSG_BULK_REQ) ? MAX_BULK_MSG_LEN : MAX_MSG_LEN;
+	size_t record_length = sizeof(replication_put) + value_sz;
+	assert(header_length + record_length <= MAX_DATA_MSG_LEN);
+
+	pthread_mutex_lock(&(stream->lock));
+
+	// The bulk transfer waits until the receiver catches up; client PUTs never wait here (their senders hold key
+	// locks), they are bounded by the client requests waiting for their acks instead
+	while (stream->running && (type == MSG_BULK_REQ) && (stream->next_seq - 1 - stream->acked_seq >= REPL_WINDOW)) {
+		pthread_cond_wait(&(stream->cond), &(stream->lock));
+	}
+	if (!stream->running) {
+		pthread_mutex_unlock(&(stream->lock));
+		return false;
+	}
+
+	// Start a new request if there is no open one of this type or the PUT doesn't fit into it (a PUT that doesn't
+	// fit into an empty request goes into one of its own)
+	bool was_empty = (stream->queue_len == 0);
+	msg_hdr *hdr = (stream->last_req >= 0) ? (msg_hdr*)(stream->queue + stream->last_req) : NULL;
+	if ((hdr == NULL) || (hdr->type != type) || (hdr->length + record_length > max_length)) {
+		if (!reserve_queue(stream, header_length)) {
+			pthread_mutex_unlock(&(stream->lock));
+			return false;
+		}
+		hdr = (msg_hdr*)(stream->queue + stream->queue_len);
+		memset(hdr, 0, header_length);
+		hdr->type = type;
+		hdr->length = header_length;
+		if (type == MSG_BULK_REQ) {
+			((bulk_request*)hdr)->first_seq = stream->next_seq;
+			((bulk_request*)hdr)->total_puts = total_puts;
+		} else {
+			((replication_request*)hdr)->first_seq = stream->next_seq;
+		}
+		stream->last_req = stream->queue_len;
+		stream->queue_len += header_length;
+	}
+
+	if (!reserve_queue(stream, record_length)) {
+		pthread_mutex_unlock(&(stream->lock));
+		return false;
+	}
+	replication_put *put = (replication_put*)(stream->queue + stream->queue_len);
+	memcpy(put->key, key, KEY_SIZE);
+	put->version = version;
+	put->value_sz = value_sz;
+	memcpy(put->value, value, value_sz);
+	stream->queue_len += record_length;
+
+	// The queue may have moved
+	hdr = (msg_hdr*)(stream->queue + stream->last_req);
+	hdr->length += record_length;
+	if (type == MSG_BULK_REQ) {
+		((bulk_request*)hdr)->num_puts++;
+	} else {
+		((replication_request*)hdr)->num_puts++;
+	}
+
+	uint64_t seq = stream->next_seq++;
+	if (waiter != NULL) {
+		waiter->seq = seq;
+		waiter->next = NULL;
+		if (stream->waiters_tail != NULL) {
+			stream->waiters_tail->next = waiter;
+		} else {
+			stream->waiters_head = waiter;
+		}
+		stream->waiters_tail = waiter;
+	}
+
+	// Wake the sender up if it is waiting for something to send
+	if (was_empty || ((stream->corked > 0) && (stream->queue_len >= MAX_MSG_LEN))) {
+		pthread_cond_broadcast(&(stream->cond));
+	}
+	pthread_mutex_unlock(&(stream->lock));
+	return true;
+}
+
+bool repl_put(repl_stream *stream, const char key[KEY_SIZE], const void *value, size_t value_sz, uint64_t version,
+              repl_waiter *waiter)
+{
+	return add_put(stream, MSG_REPLICATION_REQ, 0, key, value, value_sz, version, waiter);
+}
+
+bool repl_put_bulk(repl_stream *stream, uint64_t total_puts, const char key[KEY_SIZE], const void *value,
+                   size_t value_sz, uint64_t version)
+{
+	return add_put(stream, MSG_BULK_REQ, total_puts, key, value, value_sz, version, NULL);
+}
+
+// The number of PUTs held back is bounded by a request, far below REPL_WINDOW, so a bulk transfer never waits for acks
+// of PUTs that a corked stream holds back
+void repl_cork(repl_stream *stream)
+{
+	assert(stream != NULL);
+
+	pthread_mutex_lock(&(stream->lock));
+	stream->corked++;
+	pthread_mutex_unlock(&(stream->lock));
+}
+
+void repl_uncork(repl_stream *stream)
+{
+	assert(stream != NULL);
+
+	pthread_mutex_lock(&(stream->lock));
+	assert(stream->corked > 0);
+	if (--stream->corked == 0) {
+		pthread_cond_broadcast(&(stream->cond));
+	}
+	pthread_mutex_unlock(&(stream->lock));
+}
+
+bool repl_flush(repl_stream *stream)
+{
+	assert(stream != NULL);
+
+	pthread_mutex_lock(&(stream->lock));
+	while (stream->running && (stream->acked_seq + 1 < stream->next_seq)) {
+		pthread_cond_wait(&(stream->cond), &(stream->lock));
+	}
+	bool result = !stream->failed;
+	stream->failed = false;
+	pthread_mutex_unlock(&(stream->lock));
+	return result;
+}
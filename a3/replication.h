@@ -0,0 +1,97 @@
+#ifndef _REPLICATION_H_
+#define _REPLICATION_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "defs.h"
+
+
+// Replication stream: sends the PUTs of a key set to the server that stores its other copy, without waiting for
+// each one to be acknowledged. PUTs are numbered in the order they are added and packed into REPLICATION requests;
+// while a request is being written, the PUTs added meanwhile fill up the next one, so bursts travel in few frames.
+// A separate thread reads the cumulative acks and notifies the waiters of the acknowledged PUTs. Adding a PUT never
+// waits for acks, since it is done with the key locked; the unacknowledged PUTs of clients are bounded by the client
+// requests that wait for them. The bulk transfer (see below) waits for acks instead, so a slow receiver makes it wait
+// rather than queueing a whole key set.
+// If the connection is lost, the unacknowledged PUTs fail, and PUTs added later are not replicated.
+// The transfer of a whole key set to a recovering server uses the same stream (so it is ordered with the PUTs of
+// clients), but its PUTs are packed into much larger BULK requests, so that it takes few frames and acks.
+
+// Maximum number of PUTs sent but not yet acknowledged when bulk PUTs are added (enough to keep several bulk requests
+// in flight)
+#define REPL_WINDOW 16384
+
+// Notified when a PUT is acknowledged (or fails); usually embedded into a larger structure
+typedef struct _repl_waiter repl_waiter;
+struct _repl_waiter {
+	repl_waiter *next;
+	uint64_t seq;
+	// Called from the stream's threads; status is SUCCESS or the failure reported by the receiver
+	void (*done)(repl_waiter *waiter, op_status status);
+};
+
+typedef struct _repl_stream {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;// signalled when PUTs are added or acknowledged, and when the connection is closed or lost
+	int fd;// -1 if not connected
+	bool running;// the connection is usable (not closed or lost)
+	bool failed;// a PUT failed since the last repl_flush()
+	int corked;// repl_cork() calls not yet matched by repl_uncork()
+
+	uint64_t next_seq;// assigned to the next PUT
+	uint64_t acked_seq;// all PUTs up to this one are acknowledged
+
+	// Requests waiting to be sent (in host byte order); the last one is still open for more PUTs if last_req != -1
+	char *queue;
+	size_t queue_len;
+	size_t queue_size;
+	ssize_t last_req;
+
+	// Waiters of the unacknowledged PUTs, in sequence number order
+	repl_waiter *waiters_head;
+	repl_waiter *waiters_tail;
+
+	pthread_t sender;
+	pthread_t receiver;
+} repl_stream;
+
+
+// Initialize a stream (not connected); returns true on success
+bool repl_init(repl_stream *stream);
+
+// Close the connection (if any) and free resources used by a stream
+void repl_cleanup(repl_stream *stream);
+
+// Start replicating over a connection (the stream takes ownership of fd); the previous connection is closed first
+// Returns true on success
+bool repl_open(repl_stream *stream, int fd);
+
+// Close the connection; unacknowledged PUTs fail
+void repl_close(repl_stream *stream);
+
+// Add a PUT (with the version assigned to it) to the stream, without waiting for acks; waiter (if not NULL) is notified
+// when it is acknowledged. Returns false if the stream is not connected (the PUT is not replicated, and the waiter is never notified)
+bool repl_put(repl_stream *stream, const char key[KEY_SIZE], const void *value, size_t value_sz, uint64_t version,
+              repl_waiter *waiter);
+
+// Add a PUT that is part of the transfer of a whole key set of total_puts keys (this is just a hint for the
+// receiver), first waiting while REPL_WINDOW PUTs are unacknowledged; returns false if the stream is not connected
+bool repl_put_bulk(repl_stream *stream, uint64_t total_puts, const char key[KEY_SIZE], const void *value,
+                   size_t value_sz, uint64_t version);
+
+// Hold the PUTs added from now on back until the matching repl_uncork() (or until they fill a request), so that a
+// batch of PUTs added one at a time (e.g. each with its key locked) travels in one frame; calls can be nested, and
+// made by several threads at once
+void repl_cork(repl_stream *stream);
+void repl_uncork(repl_stream *stream);
+
+// Wait until all PUTs added so far are acknowledged or the connection is lost
+// Returns false if any PUT failed since the previous call
+bool repl_flush(repl_stream *stream);
+
+
+#endif// _REPLICATION_H_
@@ -2,8 +2,11 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <pthread.h>
+#include <stddef.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,7 +19,11 @@
 
 #include "defs.h"
 #include "hash.h"
+#include "merkle.h"
+#include "replication.h"
+#include "snapshot.h"
 #include "util.h"
+#include "wal.h"
 
 
 // Program arguments
@@ -37,19 +44,47 @@ static int num_servers = 0;
 // Log file name
 static char log_file_name[PATH_MAX] = "";
 
+// Memory limit for stored keys and values in MB (split between the primary and secondary sets); 0 if unlimited
+static int memory_limit = 0;
+
+// Event loop backend for client connections (-U selects io_uring, with a fallback to epoll if it is not supported)
+static event_backend client_backend = EVENT_BACKEND_EPOLL;
+
+// Interval between heartbeat messages to the metadata server (in ms)
+static const int default_heartbeat_interval = 100;
+static int heartbeat_interval = 0;
+
+// Durability of client PUTs (see wal.h), and the file of the write-ahead log (server_<server id>.wal by default)
+static wal_durability durability = WAL_NONE;
+static char wal_file_name[PATH_MAX] = "";
+
+// Interval between snapshots of the sets (in seconds; 0 to never take any), kept in <WAL file>.snap
+static const int default_snapshot_interval = 60;
+static int snapshot_interval = -1;
+static char snapshot_file_name[PATH_MAX] = "";
+
 
 static void usage(char **argv)
 {
 	printf("usage: %s -h <mserver host> -m <mserver port> -c <clients port> -s <servers port> "
-	       "-M <mservers port> -S <server id> -n <num servers> [-l <log file>]\n", argv[0]);
+	       "-M <mservers port> -S <server id> -n <num servers> [-l <log file>] [-L <memory limit (MB)>] "
+	       "[-i <heartbeat interval (ms)>] [-U] [-W none|async|sync] [-w <WAL file>] [-T <snapshot interval (s)>]\n",
+	       argv[0]);
 	printf("If the log file (-l) is not specified, log output is written to stdout\n");
+	printf("If the memory limit (-L) is not specified, memory use is unlimited\n");
+	printf("Default heartbeat interval is %d ms\n", default_heartbeat_interval);
+	printf("-U serves clients with io_uring instead of epoll\n");
+	printf("-W logs PUTs to a write-ahead log, replayed on startup; with sync, PUTs complete once they are on disk\n");
+	printf("Default durability is none, and the default WAL file is server_<server id>.wal\n");
+	printf("With a WAL, the sets are saved to <WAL file>.snap every %d s by default (0 disables snapshots)\n",
+	       default_snapshot_interval);
 }
 
 // Returns false if the arguments are invalid
 static bool parse_args(int argc, char **argv)
 {
 	char option;
-	while ((option = getopt(argc, argv, "h:m:c:s:M:S:n:l:")) != -1) {
+	while ((option = getopt(argc, argv, "h:m:c:s:M:S:n:l:L:i:UW:w:T:")) != -1) {
 		switch(option) {
 			case 'h': strncpy(mserver_host_name, optarg, HOST_NAME_MAX); break;
 			case 'm': mserver_port  = atoi(optarg); break;
@@ -59,109 +94,297 @@ static bool parse_args(int argc, char **argv)
 			case 'S': server_id     = atoi(optarg); break;
 			case 'n': num_servers   = atoi(optarg); break;
 			case 'l': strncpy(log_file_name, optarg, PATH_MAX); break;
+			case 'L': memory_limit  = atoi(optarg); break;
+			case 'i': heartbeat_interval = atoi(optarg); break;
+			case 'U': client_backend = EVENT_BACKEND_IO_URING; break;
+			case 'W':
+				for (durability = 0; durability < WAL_DURABILITY_MAX; durability++) {
+					if (strcmp(optarg, wal_durability_str[durability]) == 0) {
+						break;
+					}
+				}
+				break;
+			case 'w': snprintf(wal_file_name, sizeof(wal_file_name), "%s", optarg); break;
+			case 'T': snapshot_interval = atoi(optarg); break;
 			default:
 				fprintf(stderr, "Invalid option: -%c\n", option);
 				return false;
 		}
 	}
 
+	heartbeat_interval = (heartbeat_interval != 0) ? heartbeat_interval : default_heartbeat_interval;
+	if (wal_file_name[0] == '\0') {
+		snprintf(wal_file_name, sizeof(wal_file_name), "server_%d.wal", server_id);
+	}
+	snapshot_interval = (snapshot_interval >= 0) ? snapshot_interval : default_snapshot_interval;
+	int snapshot_name_len = snprintf(snapshot_file_name, sizeof(snapshot_file_name), "%s.snap", wal_file_name);
+
 	return (mserver_host_name[0] != '\0') && (mserver_port != 0) && (clients_port != 0) && (servers_port != 0) &&
-	       (mservers_port != 0) && (num_servers >= 3) && (server_id >= 0) && (server_id < num_servers);
+	       (mservers_port != 0) && (num_servers >= 3) && (server_id >= 0) && (server_id < num_servers) &&
+	       (memory_limit >= 0) && (heartbeat_interval > 0) && (durability < WAL_DURABILITY_MAX) &&
+	       (snapshot_name_len < (int)sizeof(snapshot_file_name));
 }
 
 
 // Socket for sending requests to the metadata server
 static int mserver_fd_out = -1;
+// UDP socket for sending heartbeat messages to the metadata server (to the same port)
+static int mserver_heartbeat_fd = -1;
 // Socket for receiving requests from the metadata server
 static int mserver_fd_in = -1;
 
-// Sockets for listening for incoming connections from clients, servers and mserver
-static int my_clients_fd = -1;
+// Sockets for listening for incoming connections from servers and mserver
 static int my_servers_fd = -1;
 static int my_mservers_fd = -1;
 
-// Store fds for all connected clients, up to MAX_CLIENT_SESSIONS
-#define MAX_CLIENT_SESSIONS 1000
-static int client_fd_table[MAX_CLIENT_SESSIONS];
-
-// Store fds for connected servers
+// Maximum number of connected clients
+#define MAX_CLIENT_SESSIONS 65536
+
+// Event loop serving client connections, with one thread per CPU (each pinned to its CPU)
+static event_loop *client_loop = NULL;
+static int num_client_threads = 1;
+
+// Receiving side of a replication stream from another server. Acks that wait for the log are sent by its writer
+// thread, so the receiver is shared with them: it holds the connection's reference (dropped when the main thread is
+// done with it) and one per ack waiting, and the fd is closed with the last one, so an ack never goes to a reused fd
+typedef struct _repl_receiver {
+	int fd;
+	uint64_t next_seq;// expected for the next PUT
+	bool presized;// the tables were sized for a bulk transfer
+	volatile int refs;
+	volatile int deferred_acks;// waiting for the log; acks go out in order, so the next ones wait behind them
+} repl_receiver;
+
+// An ack waiting for the PUTs it covers to be durable
+typedef struct _deferred_ack {
+	wal_waiter wal;
+	repl_receiver *receiver;
+	size_t length;
+	char buffer[];
+} deferred_ack;
+
+// Store fds for connected servers, and the state of the replication stream received on each (NULL if none)
 static int server_fd_table[4] = {-1, -1, -1, -1};
-
-
-// Storage for primary key set
-hash_table primary_hash = {0};
-
-// Storage for secondary key set
-hash_table secondary_hash = {0};
+static repl_receiver *server_receivers[4];
+
+
+// Key-value storage, split into one shard per client event loop thread (i.e. per CPU)
+// A client request is executed by the thread that owns the shard of its key; requests received by another thread
+// are passed to the owner as event loop tasks, and the response is passed back the same way. So the hash tables of
+// a shard (and their slab memory) are only ever used by one core on the client request path.
+// The owner still locks the key for a PUT, since other threads modify the tables too: the main thread applies the PUTs
+// replicated from the other copy of a set (including a bulk transfer), the snapshot and resync iterations record the
+// keys modified while they copy a shard, and a value is retired by whichever thread releases its last reference (see
+// hash_release_ref()). Handing replicated PUTs to the owners as well would make each ack wait for all the shards its
+// batch touches and still leave the others, so the lock stays; it is uncontended on the client request path. The log
+// is replayed on startup, before the client threads start.
+typedef struct _kv_shard {
+	hash_table primary_hash;// storage for primary key set
+	hash_table secondary_hash;// storage for secondary key set
+	volatile uint32_t seq;// odd while the owner thread executes a client request (see set_state())
+} kv_shard;
+
+static kv_shard *shards = NULL;
+static int num_shards = 0;
+
+// Every PUT to a set gets a new version, greater than that of any PUT to the set seen so far; the copies of a set
+// store the versions assigned by the server that acts as its primary, so their Merkle trees can be compared
+static volatile uint64_t primary_version = 0;
+static volatile uint64_t secondary_version = 0;
+static merkle_tree primary_merkle;
+static merkle_tree secondary_merkle;
+
+// Key ranges (Merkle tree leaves) of a set sent to a recovering server by a delta resync
+typedef struct _resync_ranges {
+	bool differ[MERKLE_LEAVES];
+	uint64_t compared[MERKLE_NODES];// digests of this server's tree when it was compared with the other one
+} resync_ranges;
+
+// Ranges of each set being sent by a delta resync; NULL if none, or if all keys are sent
+static resync_ranges *volatile primary_resync_ranges = NULL;
+static resync_ranges *volatile secondary_resync_ranges = NULL;
+
+// Write-ahead log of the PUTs applied to both sets (only open if durability is not WAL_NONE)
+static wal server_wal;
+static bool wal_running = false;
+
+// Snapshots of both sets, that the log is replayed on top of: taken by a background thread if the log has grown
+// since the last one. The snapshot mapped on startup holds values that the tables use in place
+static snapshot server_snapshot;
+static uint64_t snapshot_wal_offset = 0;// of the last snapshot
+static pthread_t snapshot_thread;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snapshot_cond = PTHREAD_COND_INITIALIZER;// signalled when snapshot_stop is set
+static volatile bool snapshot_stop = false;
+
+// Completion of a client PUT: once the replica acknowledges it and, with WAL_SYNC durability, once it is logged
+// (whichever comes last); usually embedded into a larger structure
+typedef struct _put_waiter put_waiter;
+struct _put_waiter {
+	repl_waiter repl;
+	wal_waiter wal;
+	int pending;// events still to come, plus one while the PUT is being executed
+	op_status status;// the first failure, if any
+	// Called from the replication stream's or the log's threads; status is SUCCESS or SERVER_FAILURE
+	void (*done)(put_waiter *waiter, op_status status);
+};
+
+// A client request that is not completed right away: executed by the thread that owns the shard of its key on
+// behalf of the connection's thread, and/or (for PUTs) waiting for the replica to acknowledge the update and for the
+// log to make it durable
+typedef struct _client_request {
+	event_task task;// must be the first member
+	put_waiter waiter;
+	connection *conn;
+	int conn_thread;
+	int shard_id;
+	size_t resp_length;
+	char resp_buffer[sizeof(operation_response)];
+	hash_ref resp_value;// of a GET, sent after resp_buffer
+	char req_buffer[];
+} client_request;
+
+// A multi-key client request: the operations on the keys of each shard are executed in one pass by the thread that
+// owns the shard, and the response is sent by the connection's thread once all of them are completed
+typedef struct _client_multi client_multi;
+
+typedef struct _multi_slot {
+	put_waiter waiter;// of a PUT; must be the first member
+	client_multi *multi;
+	const multi_op *op;
+	int shard_id;
+	op_status status;
+	hash_ref value;// of a GET
+} multi_slot;
+
+typedef struct _multi_part {
+	event_task task;// must be the first member
+	client_multi *multi;
+	int shard_id;
+} multi_part;
+
+struct _client_multi {
+	event_task task;// must be the first member; sends the response
+	connection *conn;
+	int conn_thread;
+	int pending;// operations not completed yet
+	multi_request *request;// points to req_buffer
+	multi_slot *slots;// one per operation
+	multi_part *parts;// one per shard
+	char req_buffer[];
+};
 
 // Primary server (the one that stores the primary copy for this server's secondary key set)
+// PUTs to the secondary set are replicated to it while it is being rebuilt (when this server acts as its primary)
 static int primary_sid = -1;
-static int primary_fd = -1;
+static repl_stream primary_stream;
 
 // Secondary server (the one that stores the secondary copy for this server's primary key set)
 static int secondary_sid = -1;
-static int secondary_fd = -1;
-
+static repl_stream secondary_stream;
 
-static pthread_t client_thread;
 
 // Period heartbeat messages
-static const int heartbeat_interval = 1;  // in seconds
 static pthread_t heartbeat_thread;
 
 // For recovery flow
+// Client requests read the state without locking; transitions are serialized by state_lock (see set_state())
 pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;  // For updating state
-static kv_server_state state;
+static volatile kv_server_state state;
 static bool send_primary;
 static pthread_t send_replacement_primary_thread;
 static pthread_t send_replacement_secondary_thread;
 
 
 static void cleanup();
+static op_status apply_replicated_put(const replication_put *put, bool only_newer);
+static void release_receiver(repl_receiver *receiver);
 
 static const int hash_size = 65536;
+static const int min_shard_hash_size = 1024;
 
 
+// Publish a new state and wait until every client request that might have seen the previous one has completed
+// (like an RCU grace period), so that requests executed after the call return all see the new state
+// Must be called with state_lock held
+static void set_state(kv_server_state new_state)
+{
+	__atomic_store_n(&state, new_state, __ATOMIC_SEQ_CST);
+
+	// A request makes its shard's seq odd before reading the state, so a shard whose seq is even (or has changed)
+	// is either idle or running a request that started after the store above
+	for (int i = 0; i < num_shards; i++) {
+		uint32_t seq = __atomic_load_n(&(shards[i].seq), __ATOMIC_SEQ_CST);
+		if (seq % 2 == 1) {
+			while (__atomic_load_n(&(shards[i].seq), __ATOMIC_ACQUIRE) == seq) {
+				sched_yield();
+			}
+		}
+	}
+}
+
+
+// Make sure that a set's version is at least the given one (e.g. one received from the set's primary)
+static void raise_version(volatile uint64_t *set_version, uint64_t version)
+{
+	uint64_t cur = __atomic_load_n(set_version, __ATOMIC_RELAXED);
+	while ((cur < version) &&
+	       !__atomic_compare_exchange_n(set_version, &cur, version, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Send a control request to the metadata server (over a given socket), with the versions of this server's sets
+static bool send_mserver_request(int fd, mserver_ctrlreq_type type)
+{
+	mserver_ctrl_request request = {0};
+	request.hdr.type = MSG_MSERVER_CTRL_REQ;
+	request.type = type;
+	request.server_id = server_id;
+	request.primary_version = __atomic_load_n(&primary_version, __ATOMIC_RELAXED);
+	request.secondary_version = __atomic_load_n(&secondary_version, __ATOMIC_RELAXED);
+	return send_msg(fd, &request, sizeof(request));
+}
+
 // Sends periodic heartbeat messages to metadata server
+// They go over UDP, so that a heartbeat is never delayed behind other requests (or a lost one behind a retransmit)
 static void *heartbeat_task(void *args)
 {
+	struct timespec interval = {heartbeat_interval / 1000, (heartbeat_interval % 1000) * 1000000L};
 	for (;;) {
-		mserver_ctrl_request request = {0};
-		request.hdr.type = MSG_MSERVER_CTRL_REQ;
-		request.type = HEARTBEAT;
-		request.server_id = server_id;
-		send_msg(mserver_fd_out, &request, sizeof(request));
+		send_mserver_request(mserver_heartbeat_fd, HEARTBEAT);
 
-		sleep(heartbeat_interval);
+		nanosleep(&interval, NULL);
 	}
 
 	return NULL;
 }
 
-static void send_table_iterator_f(const char key[KEY_SIZE], void *value, size_t value_sz, void *arg)
+// Check if the PUT to a key (that is locked) of the set stored in a table is going to be sent to a recovering
+// server by the transfer of the set (and so it doesn't need to be forwarded)
+static bool sent_by_transfer(hash_table *table, resync_ranges *ranges, const char key[KEY_SIZE])
 {
-	(void)arg;
+	return hash_capturing(table, key) && ((ranges == NULL) || ranges->differ[merkle_range(key)]);
+}
 
-	// Package key/value into request packet
-	char buffer[MAX_MSG_LEN] = {0};
-	operation_request *request = (operation_request *)buffer;
-	request->hdr.type = MSG_OPERATION_REQ;
-	request->type = OP_PUT;
-	memcpy(request->key, key, KEY_SIZE);
-	strncpy(request->value, value, value_sz);
-
-	// Send PUT request to new server (Saa)
-	int new_fd = send_primary ? secondary_fd : primary_fd;
-	char recv_buffer[MAX_MSG_LEN] = {0};
-	if (!send_msg(new_fd, request, sizeof(*request) + value_sz) ||
-	    !recv_msg(new_fd, recv_buffer, sizeof(recv_buffer), MSG_OPERATION_RESP))
-	{
-		// Just die if something went wrong
-		exit(1);
+typedef struct _send_table_args {
+	repl_stream *stream;
+	uint64_t total_puts;
+	resync_ranges *ranges;// NULL if sending all keys
+} send_table_args;
+
+static void send_table_iterator_f(const char key[KEY_SIZE], void *value, size_t value_sz, uint64_t version,
+                                  void *arg)
+{
+	send_table_args *args = arg;
+
+	// Only the ranges that differ are sent by a delta resync
+	if ((args->ranges != NULL) && !args->ranges->differ[merkle_range(key)]) {
+		return;
 	}
 
-	operation_response *response = (operation_response *)recv_buffer;
-	if (response->status != SUCCESS) {
+	// Send PUT to new server (Saa) in bulk requests, on the replication stream that client PUTs are forwarded on
+	// meanwhile (so the receiver applies them in the same order as this server did)
+	if (!repl_put_bulk(args->stream, args->total_puts, key, value, value_sz, version)) {
+		// Just die if something went wrong
 		exit(1);
 	}
 }
@@ -171,27 +394,141 @@ static void *send_table_task(void *arg)
 {
 	(void)arg;
 
-	hash_table *table = send_primary ? &primary_hash : &secondary_hash;
-	hash_iterate(table, send_table_iterator_f, NULL);
+	send_table_args args = {0};
+	args.stream = send_primary ? &secondary_stream : &primary_stream;
+	args.ranges = send_primary ? primary_resync_ranges : secondary_resync_ranges;
+
+	// A delta resync also sends the ranges that changed between the comparison of the digests and the moment
+	// client PUTs started being forwarded
+	if (args.ranges != NULL) {
+		uint64_t *nodes = malloc(MERKLE_NODES * sizeof(uint64_t));
+		if (nodes == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		merkle_build(send_primary ? &primary_merkle : &secondary_merkle, nodes);
+		for (int i = 0; i < MERKLE_LEAVES; i++) {
+			if (nodes[MERKLE_LEAVES + i] != args.ranges->compared[MERKLE_LEAVES + i]) {
+				args.ranges->differ[i] = true;
+			}
+		}
+		free(nodes);
+	}
+
+	// Tell the receiver how large the set is (client PUTs may still change that a little)
+	for (int i = 0; i < num_shards; i++) {
+		args.total_puts += hash_count(send_primary ? &(shards[i].primary_hash) : &(shards[i].secondary_hash));
+	}
+
+	for (int i = 0; i < num_shards; i++) {
+		hash_table *table = send_primary ? &(shards[i].primary_hash) : &(shards[i].secondary_hash);
+		// Client PUTs are not blocked while the set is sent; those to keys already sent are sent again. A key may be
+		// sent after a later PUT to it was forwarded, but the receiver only applies bulk PUTs that are newer
+		if (!hash_iterate_snapshot(table, send_table_iterator_f, &args)) {
+			exit(1);
+		}
+	}
+	if (!repl_flush(args.stream)) {
+		exit(1);
+	}
 
 	// 8/10. Send confirmation to M server when done sending the set
-	mserver_ctrl_request request = {0};
-	request.hdr.type = MSG_MSERVER_CTRL_REQ;
-	request.server_id = server_id;
-	request.type = send_primary ? UPDATED_SECONDARY : UPDATED_PRIMARY;
-	send_msg(mserver_fd_out, &request, sizeof(request));
+	send_mserver_request(mserver_fd_out, send_primary ? UPDATED_SECONDARY : UPDATED_PRIMARY);
 
-	state = KV_SERVER_ONLINE;
+	pthread_mutex_lock(&(state_lock));
+	set_state(KV_SERVER_ONLINE);
+	// No client request uses the ranges anymore
+	if (send_primary) {
+		primary_resync_ranges = NULL;
+	} else {
+		secondary_resync_ranges = NULL;
+	}
+	free(args.ranges);
+	pthread_mutex_unlock(&(state_lock));
 
 	return NULL;
 }
 
+// Compare the Merkle tree of a set with that of a recovering server (connected on fd) that stores the other copy,
+// starting from the root and going down the nodes whose digests differ; marks the ranges (leaves) that differ
+// nodes gets the digests of this server's tree, as compared. Returns true on success
+static bool compare_digests(int fd, int set_id, merkle_tree *tree, uint64_t nodes[MERKLE_NODES],
+                            bool ranges[MERKLE_LEAVES])
+{
+	merkle_build(tree, nodes);
+
+	// Nodes to compare on the current and on the next level of the tree
+	uint16_t *level = malloc(MERKLE_LEAVES * sizeof(uint16_t));
+	uint16_t *next_level = malloc(MERKLE_LEAVES * sizeof(uint16_t));
+	if ((level == NULL) || (next_level == NULL)) {
+		perror("malloc");
+		free(level);
+		free(next_level);
+		return false;
+	}
+
+	bool result = true;
+	int level_len = 1;
+	level[0] = 1;
+	int num_ranges = 0;
+	while (result && (level_len > 0)) {
+		int next_len = 0;
+		for (int i = 0; i < level_len; i += DIGEST_MAX_NODES) {
+			int count = ((size_t)(level_len - i) < DIGEST_MAX_NODES) ? (level_len - i) : (int)DIGEST_MAX_NODES;
+
+			char req_buffer[MAX_MSG_LEN] = {0};
+			digest_request *request = (digest_request*)req_buffer;
+			request->hdr.type = MSG_DIGEST_REQ;
+			request->set_id = set_id;
+			request->num_nodes = count;
+			memcpy(request->nodes, level + i, count * sizeof(uint16_t));
+
+			char resp_buffer[MAX_MSG_LEN];
+			digest_response *response = (digest_response*)resp_buffer;
+			if (!send_msg(fd, request, sizeof(*request) + count * sizeof(uint16_t)) ||
+			    !recv_msg(fd, resp_buffer, sizeof(resp_buffer), MSG_DIGEST_RESP) ||
+			    (response->num_nodes != count))
+			{
+				result = false;
+				break;
+			}
+
+			for (int j = 0; j < count; j++) {
+				int node = level[i + j];
+				if (response->digests[j] == nodes[node]) {
+					continue;
+				}
+				if (node >= MERKLE_LEAVES) {
+					ranges[node - MERKLE_LEAVES] = true;
+					num_ranges++;
+				} else {
+					next_level[next_len++] = 2 * node;
+					next_level[next_len++] = 2 * node + 1;
+				}
+			}
+		}
+
+		uint16_t *tmp = level;
+		level = next_level;
+		next_level = tmp;
+		level_len = next_len;
+	}
+
+	if (result) {
+		log_write("Delta resync of set %d: %d of %d ranges differ\n", set_id, num_ranges, MERKLE_LEAVES);
+	}
+	free(level);
+	free(next_level);
+	return result;
+}
+
 // Sends secondary set to a replacement key-value server as part of the recovery flow
-static int send_to_replacement(const char *host_name, uint16_t port)
+static int send_to_replacement(const char *host_name, uint16_t port, resync_mode resync)
 {
 	pthread_mutex_lock(&(state_lock));
 
 	pthread_t *replacement_thread = NULL;
+	resync_ranges *ranges = NULL;
 
 	int new_fd;
 	if ((new_fd = connect_to_server(host_name, port)) < 0) {
@@ -199,21 +536,41 @@ static int send_to_replacement(const char *host_name, uint16_t port)
 		goto send_replacement_failed;
 	}
 
+	// For a delta resync, find the key ranges that differ before the connection is used for replication
+	if (resync == RESYNC_DELTA) {
+		if ((ranges = calloc(1, sizeof(resync_ranges))) == NULL) {
+			perror("calloc");
+			close(new_fd);
+			goto send_replacement_failed;
+		}
+		bool compared = send_primary
+		              ? compare_digests(new_fd, server_id, &primary_merkle, ranges->compared, ranges->differ)
+		              : compare_digests(new_fd, primary_sid, &secondary_merkle, ranges->compared, ranges->differ);
+		if (!compared) {
+			fprintf(stderr, "send_to_replacement: error comparing digests\n");
+			close(new_fd);
+			goto send_replacement_failed;
+		}
+	}
+	if (send_primary) {
+		primary_resync_ranges = ranges;
+	} else {
+		secondary_resync_ranges = ranges;
+	}
+
 	// Connect to the new recovery server
+	// Once set_state() returns, all client PUTs are forwarded to it, so none is missed by the set transfer
+	if (!repl_open(send_primary ? &secondary_stream : &primary_stream, new_fd)) {
+		goto send_replacement_failed;
+	}
 	if (send_primary) {
 		// Sc: connect to new Saa as secondary
-		close_safe(&secondary_fd);
-		secondary_fd = new_fd;
-
 		// [UPDATE_SECONDARY] Sending primary: this primary is the recovering server's secondary set
-		state = KV_UPDATING_SECONDARY;
+		set_state(KV_UPDATING_SECONDARY);
 		replacement_thread = &send_replacement_secondary_thread;
 	} else {
-		close_safe(&primary_fd);
-		primary_fd = new_fd;
-
 		// [UPDATE_PRIMARY] Sending secondary: this secondary is the recovering server's primary set
-		state = KV_UPDATING_PRIMARY;
+		set_state(KV_UPDATING_PRIMARY);
 		replacement_thread = &send_replacement_primary_thread;
 	}
 
@@ -228,24 +585,109 @@ static int send_to_replacement(const char *host_name, uint16_t port)
 
 send_replacement_failed:
 	// Rollback
-	state = KV_SERVER_ONLINE;
+	set_state(KV_SERVER_ONLINE);
+	if (send_primary) {
+		primary_resync_ranges = NULL;
+	} else {
+		secondary_resync_ranges = NULL;
+	}
+	free(ranges);
 
 	// Send FAILED message to M server
-	mserver_ctrl_request request = {0};
-	request.hdr.type = MSG_MSERVER_CTRL_REQ;
-	request.server_id = server_id;
-	request.type = send_primary ? UPDATE_SECONDARY_FAILED : UPDATE_PRIMARY_FAILED;
-	send_msg(mserver_fd_out, &request, sizeof(request));
+	send_mserver_request(mserver_fd_out, send_primary ? UPDATE_SECONDARY_FAILED : UPDATE_PRIMARY_FAILED);
 
 	pthread_mutex_unlock(&(state_lock));
 	return -1;
 }
 
+// Apply a PUT replayed from the write-ahead log
+static void replay_put_f(const replication_put *put, void *arg)
+{
+	(void)arg;
+	apply_replicated_put(put, false);
+}
+
+// Load a key from the snapshot, using its value in place
+static void load_snapshot_f(const char key[KEY_SIZE], hash_value *value, size_t value_sz, uint64_t version, void *arg)
+{
+	(void)arg;
+
+	int primary_srv_id = key_server_id(key, num_servers);
+	kv_shard *shard = &(shards[key_shard_id(key, num_shards)]);
+	hash_table *table = (server_id == primary_srv_id) ? &(shard->primary_hash) : &(shard->secondary_hash);
+	raise_version((server_id == primary_srv_id) ? &primary_version : &secondary_version, version);
+
+	if (!hash_put_foreign(table, key, value, value_sz, version)) {
+		fprintf(stderr, "sid %d: Out of memory (%zu bytes used)\n", server_id, hash_memory_used(table));
+	}
+}
+
+// Take a snapshot of both sets if the log has grown since the last one, and free the space of the log before it
+static void take_snapshot()
+{
+	uint64_t offset = wal_position(&server_wal);
+	if (offset == snapshot_wal_offset) {
+		return;
+	}
+
+	hash_table *tables[2 * num_shards];
+	for (int i = 0; i < num_shards; i++) {
+		tables[2 * i] = &(shards[i].primary_hash);
+		tables[2 * i + 1] = &(shards[i].secondary_hash);
+	}
+	if (!snapshot_write(snapshot_file_name, offset, tables, 2 * num_shards, &snapshot_stop)) {
+		if (!snapshot_stop) {
+			log_write("Failed to write snapshot %s\n", snapshot_file_name);
+		}
+		return;
+	}
+	snapshot_wal_offset = offset;
+	log_write("%s Snapshot written to %s (log offset %" PRIu64 ")\n", current_time_str(), snapshot_file_name, offset);
+
+	// The log keeps growing if its file system can't free parts of files (only reported once)
+	static bool discard_failed = false;
+	if (!discard_failed && !wal_discard(&server_wal, offset)) {
+		discard_failed = true;
+	}
+}
+
+// Takes snapshots periodically
+static void *snapshot_task(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&(snapshot_lock));
+	while (!snapshot_stop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += snapshot_interval;
+		while (!snapshot_stop && (pthread_cond_timedwait(&snapshot_cond, &snapshot_lock, &deadline) != ETIMEDOUT));
+		if (snapshot_stop) {
+			break;
+		}
+
+		pthread_mutex_unlock(&(snapshot_lock));
+		take_snapshot();
+		pthread_mutex_lock(&(snapshot_lock));
+	}
+	pthread_mutex_unlock(&(snapshot_lock));
+	return NULL;
+}
+
 // Initialize and start the server
 static bool init_server()
 {
-	for (int i = 0; i < MAX_CLIENT_SESSIONS; i++) {
-		client_fd_table[i] = -1;
+	if ((num_client_threads = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+		num_client_threads = 1;
+	}
+
+	// Needed by cleanup()
+	if (!repl_init(&primary_stream)) {
+		return false;
+	}
+	if (!repl_init(&secondary_stream)) {
+		repl_cleanup(&primary_stream);
+		return false;
 	}
 
 	// Get the host name that server is running on
@@ -255,16 +697,18 @@ static bool init_server()
 	}
 	log_write("%s Server starts on host: %s\n", current_time_str(), my_host_name);
 
-	// Create sockets for incoming connections from clients and other servers
-	if (((my_clients_fd  = create_server(clients_port, MAX_CLIENT_SESSIONS, NULL)) < 0) ||
-	    ((my_servers_fd  = create_server(servers_port, 2, NULL)) < 0) ||
+	// Create sockets for incoming connections from other servers and mserver
+	// (client connections are accepted by the client event loop, started in run_server_loop())
+	if (((my_servers_fd  = create_server(servers_port, 2, NULL)) < 0) ||
 	    ((my_mservers_fd = create_server(mservers_port, 1, NULL)) < 0))
 	{
 		goto cleanup;
 	}
 
 	// Connect to mserver to "register" that we are live
-	if ((mserver_fd_out = connect_to_server(mserver_host_name, mserver_port)) < 0) {
+	if (((mserver_fd_out = connect_to_server(mserver_host_name, mserver_port)) < 0) ||
+	    ((mserver_heartbeat_fd = connect_udp(mserver_host_name, mserver_port)) < 0))
+	{
 		goto cleanup;
 	}
 
@@ -272,16 +716,69 @@ static bool init_server()
 	primary_sid = primary_server_id(server_id, num_servers);
 	secondary_sid = secondary_server_id(server_id, num_servers);
 
-	// Initialize key-value storage
-	if (!hash_init(&primary_hash, hash_size)) {
+	// Initialize key-value storage (the memory limit is split evenly between the shards)
+	num_shards = num_client_threads;
+	if ((shards = calloc(num_shards, sizeof(kv_shard))) == NULL) {
+		perror("calloc");
 		goto cleanup;
 	}
-	if (!hash_init(&secondary_hash, hash_size)) {
-		goto cleanup;
+	merkle_init(&primary_merkle);
+	merkle_init(&secondary_merkle);
+	for (int i = 0; i < num_shards; i++) {
+		if (!hash_init(&(shards[i].primary_hash), max(hash_size / num_shards, min_shard_hash_size)) ||
+		    !hash_init(&(shards[i].secondary_hash), max(hash_size / num_shards, min_shard_hash_size)))
+		{
+			goto cleanup;
+		}
+		hash_set_memory_limit(&(shards[i].primary_hash), (size_t)memory_limit * 1024 * 1024 / 2 / num_shards);
+		hash_set_memory_limit(&(shards[i].secondary_hash), (size_t)memory_limit * 1024 * 1024 / 2 / num_shards);
+		hash_set_merkle(&(shards[i].primary_hash), &primary_merkle);
+		hash_set_merkle(&(shards[i].secondary_hash), &secondary_merkle);
+	}
+
+	// Rebuild the sets from the snapshot (its values are only read from the disk when first used) and the part of
+	// the write-ahead log after it, and append to the log from now on; the versions of the sets go up to those of
+	// the last PUTs loaded, so a resync only needs to send what changed since this server stopped
+	if (durability != WAL_NONE) {
+		if (!snapshot_map(&server_snapshot, snapshot_file_name, &snapshot_wal_offset)) {
+			goto cleanup;
+		}
+		for (int i = 0; i < num_shards; i++) {
+			hash_set_foreign_memory(&(shards[i].primary_hash), server_snapshot.data, server_snapshot.length);
+			hash_set_foreign_memory(&(shards[i].secondary_hash), server_snapshot.data, server_snapshot.length);
+		}
+		ssize_t num_keys = snapshot_load(&server_snapshot, load_snapshot_f, NULL);
+		size_t num_records = 0;
+		if ((num_keys < 0) ||
+		    !wal_replay(wal_file_name, snapshot_wal_offset, replay_put_f, NULL, &num_records) ||
+		    !wal_open(&server_wal, wal_file_name))
+		{
+			goto cleanup;
+		}
+		wal_running = true;
+		log_write("Loaded %zd keys from %s and replayed %zu PUTs from %s (versions %" PRIu64 " and %" PRIu64 ")\n",
+		          num_keys, snapshot_file_name, num_records, wal_file_name, primary_version, secondary_version);
+
+		// If the log ends before the snapshot's offset (it was lost), the PUTs logged from now on would not be
+		// replayed on top of the snapshot; a new snapshot takes their place
+		if (wal_position(&server_wal) < snapshot_wal_offset) {
+			log_write("The log is shorter than snapshot %s expects; taking a new snapshot\n", snapshot_file_name);
+			take_snapshot();
+		}
+
+		if ((snapshot_interval > 0) && ((errno = pthread_create(&snapshot_thread, NULL, snapshot_task, NULL)) != 0)) {
+			perror("pthread_create");
+			goto cleanup;
+		}
 	}
 
 	state = KV_SERVER_ONLINE;
 
+	// Tell mserver that we are ready, and what versions of the sets we have
+	if (!send_mserver_request(mserver_fd_out, REGISTER)) {
+		goto cleanup;
+	}
+
 	// Create a separate thread that takes care of sending periodic heartbeat messages
 	if (pthread_create(&heartbeat_thread, NULL, heartbeat_task, NULL)) {
 		perror("init_server: heartbeat thread create\n");
@@ -296,48 +793,60 @@ cleanup:
 	return false;
 }
 
-// Hash iterator for freeing memory used by values; called during storage cleanup
-static void clean_iterator_f(const char key[KEY_SIZE], void *value, size_t value_sz, void *arg)
-{
-	(void)key;
-	(void)value_sz;
-	(void)arg;
-
-	assert(value != NULL);
-	free(value);
-}
-
 // Cleanup and release all the resources
 static void cleanup()
 {
+	// Stop serving clients before the storage goes away (client PUTs waiting for replication fail first)
+	repl_close(&primary_stream);
+	repl_close(&secondary_stream);
+	event_loop_stop(client_loop);
+	client_loop = NULL;
+	repl_cleanup(&primary_stream);
+	repl_cleanup(&secondary_stream);
+	if (snapshot_thread) {
+		// A snapshot being written is abandoned
+		pthread_mutex_lock(&(snapshot_lock));
+		snapshot_stop = true;
+		pthread_cond_signal(&(snapshot_cond));
+		pthread_mutex_unlock(&(snapshot_lock));
+		pthread_join(snapshot_thread, NULL);
+	}
+	if (wal_running) {
+		wal_running = false;
+		wal_close(&server_wal);
+	}
+
 	close_safe(&mserver_fd_out);
 	close_safe(&mserver_fd_in);
-	close_safe(&my_clients_fd);
 	close_safe(&my_servers_fd);
 	close_safe(&my_mservers_fd);
-	close_safe(&secondary_fd);
-	close_safe(&primary_fd);
 
-	for (int i = 0; i < MAX_CLIENT_SESSIONS; i++) {
-		close_safe(&(client_fd_table[i]));
-	}
+	// The log is closed, so no acks are waiting anymore
 	for (int i = 0; i < 4; i++) {
-		close_safe(&(server_fd_table[i]));
+		if (server_receivers[i] != NULL) {
+			release_receiver(server_receivers[i]);
+			server_receivers[i] = NULL;
+			server_fd_table[i] = -1;
+		}
 	}
 
-	hash_iterate(&primary_hash, clean_iterator_f, NULL);
-	hash_cleanup(&primary_hash);
-
-	hash_iterate(&secondary_hash, clean_iterator_f, NULL);
-	hash_cleanup(&secondary_hash);
+	if (shards != NULL) {
+		for (int i = 0; i < num_shards; i++) {
+			hash_cleanup(&(shards[i].primary_hash));
+			hash_cleanup(&(shards[i].secondary_hash));
+		}
+		free(shards);
+		shards = NULL;
+	}
+	// The tables may have referenced its values
+	snapshot_unmap(&server_snapshot);
 
 	// Cancel threads
-	if (client_thread) {
-		pthread_cancel(client_thread);
-	}
 	if (heartbeat_thread) {
 		pthread_cancel(heartbeat_thread);
+		pthread_join(heartbeat_thread, NULL);
 	}
+	close_safe(&mserver_heartbeat_fd);
 	if (send_replacement_primary_thread) {
 		pthread_cancel(send_replacement_primary_thread);
 	}
@@ -346,229 +855,757 @@ static void cleanup()
 	}
 }
 
-// Connection will be closed after calling this function regardless of result
-static void process_client_message(int fd)
+// Count an event that a client PUT waits for; the last one completes the PUT
+static void put_waiter_step(put_waiter *waiter, op_status status)
 {
-	// log_write("%s Receiving a client message\n", current_time_str());
+	if (status != SUCCESS) {
+		__atomic_store_n(&(waiter->status), SERVER_FAILURE, __ATOMIC_RELAXED);
+	}
+	if (__atomic_sub_fetch(&(waiter->pending), 1, __ATOMIC_ACQ_REL) == 0) {
+		waiter->done(waiter, __atomic_load_n(&(waiter->status), __ATOMIC_RELAXED));
+	}
+}
 
-	// Read and parse the message
-	char req_buffer[MAX_MSG_LEN] = {0};
-	if (!recv_msg(fd, req_buffer, MAX_MSG_LEN, MSG_OPERATION_REQ)) {
-		return;
+// Called by a replication stream thread when a client PUT is acknowledged (or fails)
+static void put_replicated(repl_waiter *repl, op_status status)
+{
+	if (status != SUCCESS) {
+		fprintf(stderr, "Server %d failed PUT forwarding (%s)\n", server_id, op_status_str[status]);
 	}
-	operation_request *request = (operation_request*)req_buffer;
+	put_waiter_step((put_waiter*)((char*)repl - offsetof(put_waiter, repl)), status);
+}
 
-	// Initialize the response
-	char resp_buffer[MAX_MSG_LEN] = {0};
-	operation_response *response = (operation_response*)resp_buffer;
-	response->hdr.type = MSG_OPERATION_RESP;
-	uint16_t value_sz = 0;
+// Called by the log's writer thread when a client PUT is durable (or fails)
+static void put_logged(wal_waiter *wal, op_status status)
+{
+	put_waiter_step((put_waiter*)((char*)wal - offsetof(put_waiter, wal)), status);
+}
+
+// Execute an operation on a key in the given server state and set its status; returns false if it completes once the
+// replica acknowledges the PUT and/or it is durable (waiter is then notified with the final status; it must not be
+// NULL for PUTs, and its done callback must be set)
+// The value of a GET is not copied: it is referenced by value (an empty zeroed reference for other operations), and
+// must be sent to the client, then released with hash_release_ref()
+static bool execute_key_operation(kv_shard *shard, kv_server_state cur_state, op_type type, const char key[KEY_SIZE],
+                                  const char *put_value, size_t put_value_sz, put_waiter *waiter,
+                                  op_status *status, hash_ref *value)
+{
+	memset(value, 0, sizeof(*value));
 
 	// Check that requested key is valid if this is supposed to be the primary server
-	int key_srv_id = key_server_id(request->key, num_servers);
+	int key_srv_id = key_server_id(key, num_servers);
 	int secondary_srv_id = secondary_server_id(key_srv_id, num_servers);
 
-	pthread_mutex_lock(&(state_lock));
+	// Explicitely ignore client requests while handling SWITCH_PRIMARY
+	if (cur_state == KV_SWITCHING_PRIMARY) {
+		*status = SERVER_FAILURE;
+		return true;
+	}
 
 	// When normal or updating secondary (Sc), we're targetting the primary set
 	// If this is Sb, then we can target either set
-	if ((state != KV_UPDATING_PRIMARY && key_srv_id != server_id) ||
-	    (state == KV_UPDATING_PRIMARY && key_srv_id != server_id && secondary_srv_id != server_id)) {
-		fprintf(stderr, "sid %d: Invalid client key %s sid %d\n", server_id, key_to_str(request->key), key_srv_id);
-		response->status = SERVER_FAILURE;
-		send_msg(fd, response, sizeof(*response));
-		return;
+	if ((cur_state != KV_UPDATING_PRIMARY && key_srv_id != server_id) ||
+	    (cur_state == KV_UPDATING_PRIMARY && key_srv_id != server_id && secondary_srv_id != server_id)) {
+		// The client's routing table is stale; it will fetch a new one and retry
+		fprintf(stderr, "sid %d: Invalid client key %s sid %d\n", server_id, key_to_str(key), key_srv_id);
+		*status = WRONG_SERVER;
+		return true;
 	}
 
 	// Targetting secondary set as a pseudo-primary set
-	bool secondary_as_primary = (state == KV_UPDATING_PRIMARY && secondary_srv_id == server_id);
+	bool secondary_as_primary = (cur_state == KV_UPDATING_PRIMARY && secondary_srv_id == server_id);
 
-	hash_table *table = secondary_as_primary ? &secondary_hash : &primary_hash;
+	hash_table *table = secondary_as_primary ? &(shard->secondary_hash) : &(shard->primary_hash);
 
 	// Process the request based on its type
-	switch (request->type) {
+	switch (type) {
 		case OP_NOOP: {
-			response->status = SUCCESS;
+			*status = SUCCESS;
 			break;
 		}
 
 		case OP_GET: {
-			void *data = NULL;
-			size_t size = 0;
-
-			// Get the value for requested key from the hash table
-			if (!hash_get(table, request->key, &data, &size)) {
-				fprintf(stderr, "Key %s not found\n", key_to_str(request->key));
-				response->status = KEY_NOT_FOUND;
+			// Reference the value for requested key in the hash table, so that it is sent to the client without
+			// copying it (lock-free, so GETs never wait for PUTs to the same key; a PUT meanwhile doesn't change it)
+			if (!hash_get_ref(table, key, value)) {
+				fprintf(stderr, "Key %s not found\n", key_to_str(key));
+				memset(value, 0, sizeof(*value));
+				*status = KEY_NOT_FOUND;
 				break;
 			}
 
-			// Copy the stored value into the response buffer
-			memcpy(response->value, data, size);
-			value_sz = size;
-
-			response->status = SUCCESS;
+			*status = SUCCESS;
 			break;
 		}
 
 		case OP_PUT: {
-			// Need to copy the value to dynamically allocated memory
-			size_t value_size = request->hdr.length - sizeof(*request);
-			void *value_copy = malloc(value_size);
-			if (value_copy == NULL) {
-				perror("malloc");
-				fprintf(stderr, "sid %d: Out of memory\n", server_id);
-				response->status = OUT_OF_SPACE;
+			assert(waiter != NULL);
+
+			// The hash table stores its own copy of the value
+			if (put_value_sz > MAX_VALUE_SIZE) {
+				fprintf(stderr, "sid %d: Value too large (%zu bytes)\n", server_id, put_value_sz);
+				*status = OUT_OF_SPACE;
 				break;
 			}
-			memcpy(value_copy, request->value, value_size);
 
-			void *old_value = NULL;
-			size_t old_value_sz = 0;
-
-			hash_lock(table, request->key);
-
-			// Put the <key, value> pair into the hash table
-			if (!hash_put(table, request->key, value_copy, value_size, &old_value, &old_value_sz))
+			// The request may be completed (and freed) by another thread as soon as the PUT is replicated
+			char put_key[KEY_SIZE];
+			memcpy(put_key, key, KEY_SIZE);
+			key = put_key;
+			*status = SUCCESS;
+			waiter->repl.done = put_replicated;
+			waiter->wal.done = put_logged;
+			waiter->pending = 3;// the ack, the log write, and this call
+			waiter->status = SUCCESS;
+
+			hash_lock(table, key);
+
+			// Put the <key, value> pair into the hash table, with a new version of the set
+			uint64_t version = __atomic_add_fetch(secondary_as_primary ? &secondary_version : &primary_version, 1,
+			                                      __ATOMIC_RELAXED);
+			if (!hash_put(table, key, put_value, put_value_sz, version, NULL, NULL))
 			{
-				hash_unlock(table, request->key);
-				fprintf(stderr, "sid %d: Out of memory\n", server_id);
-				free(value_copy);
-				response->status = OUT_OF_SPACE;
+				hash_unlock(table, key);
+				fprintf(stderr, "sid %d: Out of memory (%zu bytes used)\n", server_id, hash_memory_used(table));
+				*status = OUT_OF_SPACE;
 				break;
 			}
 
-			// Need to free the old value (if there was any)
-			if (old_value != NULL) {
-				free(old_value);
-			}
-
-			// Forward the PUT request to the secondary replica
-			// 7. If in recovery mode, PUT requests are sent synchronously to the new server too
-			int forward_fd = secondary_as_primary ? primary_fd : secondary_fd;
-			if (fd_is_valid(forward_fd) && send_msg(forward_fd, request, request->hdr.length)) {
-				char forward_resp_buffer[MAX_MSG_LEN] = {0};
-				operation_response *forward_server_resp = (operation_response *)forward_resp_buffer;
-				if (!recv_msg(forward_fd, forward_server_resp, sizeof(*forward_server_resp), MSG_OPERATION_RESP)) {
-					hash_unlock(table, request->key);
-					response->status = SERVER_FAILURE;
-					break;
+			// Log the PUT (while the key is locked, so that the replay applies the PUTs to a key in the same order);
+			// with WAL_SYNC durability, the client gets the response once it is durable (and the PUT fails if the
+			// log failed). With WAL_ASYNC, it only waits for that while the disk is falling behind, so that the log
+			// is pushed back on without blocking this thread
+			bool wait_logged = (durability == WAL_SYNC) || (wal_running && wal_backlogged(&server_wal));
+			int skipped = 1;
+			bool logging = wal_running && wal_append(&server_wal, key, put_value, put_value_sz, version,
+			                                         wait_logged ? &(waiter->wal) : NULL);
+			if (!wait_logged || !logging) {
+				skipped++;
+				if (durability == WAL_SYNC) {
+					__atomic_store_n(&(waiter->status), SERVER_FAILURE, __ATOMIC_RELAXED);
 				}
+			}
 
-				if (forward_server_resp->status != SUCCESS) {
-					fprintf(stderr, "Server %d failed PUT forwarding (%s)\n", server_id, op_status_str[forward_server_resp->status]);
-					hash_unlock(table, request->key);
-					response->status = SERVER_FAILURE;
-					break;
-				}
+			// Forward the PUT request to the secondary replica (while the key is locked, so that the replica applies
+			// the PUTs to a key in the same order); the client gets the response once the replica acknowledges it
+			// 7. If in recovery mode, PUT requests are forwarded to the new server too, unless the set transfer
+			// is going to send the key again (then the replica only gets the new value with the transfer)
+			// If the replica is not connected (it failed), the PUT is not replicated, and succeeds right away
+			repl_stream *stream = secondary_as_primary ? &primary_stream : &secondary_stream;
+			resync_ranges *ranges = secondary_as_primary ? secondary_resync_ranges : primary_resync_ranges;
+			bool replicating = !sent_by_transfer(table, ranges, key) &&
+			                   repl_put(stream, key, put_value, put_value_sz, version, &(waiter->repl));
+			if (!replicating) {
+				skipped++;
 			}
 
-			hash_unlock(table, request->key);
+			hash_unlock(table, key);
 
-			response->status = SUCCESS;
+			// If the ack or the log write is still to come, the last of them completes the PUT
+			if (__atomic_sub_fetch(&(waiter->pending), skipped, __ATOMIC_ACQ_REL) > 0) {
+				return false;
+			}
+			*status = __atomic_load_n(&(waiter->status), __ATOMIC_RELAXED);
 			break;
 		}
 
 		default: {
 			fprintf(stderr, "sid %d: Invalid client operation type\n", server_id);
-			return;
+			*status = SERVER_FAILURE;
+			break;
 		}
 	}
 
-	// Send reply to the client
-	pthread_mutex_unlock(&(state_lock));
-	send_msg(fd, response, sizeof(*response) + value_sz);
+	return true;
 }
 
-// Returns false if either the message was invalid or if this was the last message
-// (in both cases the connection will be closed)
-static bool process_server_message(int fd)
+// Execute a client request in the given server state; returns the length of the response, or 0 if it is sent once
+// the PUT completes (see execute_key_operation() for waiter and value)
+static size_t execute_operation(kv_shard *shard, kv_server_state cur_state, operation_request *request,
+                                operation_response *response, put_waiter *waiter, hash_ref *value)
 {
-	// log_write("%s Receiving a server message\n", current_time_str());
+	// Initialize the response (echoing the request id, so that pipelining clients can match it with the request)
+	memset(response, 0, sizeof(*response));
+	response->hdr.type = MSG_OPERATION_RESP;
+	response->hdr.req_id = request->hdr.req_id;
 
-	// Read and parse the message
-	char req_buffer[MAX_MSG_LEN] = {0};
-	if (!recv_msg(fd, req_buffer, MAX_MSG_LEN, MSG_OPERATION_REQ)) {
-		return false;
+	if (!execute_key_operation(shard, cur_state, request->type, request->key, request->value,
+	                           request->hdr.length - sizeof(*request), waiter, &(response->status), value))
+	{
+		return 0;
 	}
-	operation_request *request = (operation_request*)req_buffer;
+	return sizeof(*response);
+}
 
-	// Initialize the response
-	char resp_buffer[MAX_MSG_LEN] = {0};
-	operation_response *response = (operation_response*)resp_buffer;
-	response->hdr.type = MSG_OPERATION_RESP;
-	uint16_t value_sz = 0;
+// Execute a client request; must be called by the thread that owns the shard of the key
+// Returns the length of the response, or 0 if the response is deferred until the PUT completes (see
+// execute_operation() for value)
+static size_t execute_client_request(operation_request *request, operation_response *response, put_waiter *waiter,
+                                     hash_ref *value)
+{
+	kv_shard *shard = &(shards[key_shard_id(request->key, num_shards)]);
 
-	switch (request->type) {
-		// NOOP operation request is used to indicate the last message in an UPDATE sequence
-		case OP_NOOP: {
-			// log_write("Received the last server message, closing connection\n");
-			return false;
+	// Reading the state doesn't take any lock; the odd seq tells state transitions to wait for this request
+	__atomic_add_fetch(&(shard->seq), 1, __ATOMIC_SEQ_CST);
+	size_t length = execute_operation(shard, __atomic_load_n(&state, __ATOMIC_SEQ_CST), request, response, waiter,
+	                                  value);
+	__atomic_add_fetch(&(shard->seq), 1, __ATOMIC_RELEASE);
+
+	return length;
+}
+
+// Send a response to a client, followed by the referenced value (which is then released); the value is only copied
+// if the socket doesn't take all of it right away
+static bool send_response(connection *conn, operation_response *response, size_t length, hash_ref *value)
+{
+	bool result = conn_send_msg_value(conn, response, length, hash_ref_data(value), value->value_sz);
+	hash_release_ref(value);
+	return result;
+}
+
+// Runs on the connection's thread: send the response to the client
+static void client_reply_task_f(event_task *task)
+{
+	client_request *client_req = (client_request*)task;
+
+	send_response(client_req->conn, (operation_response*)(client_req->resp_buffer), client_req->resp_length,
+	              &(client_req->resp_value));
+	conn_release(client_req->conn);
+	free(client_req);
+}
+
+// Called by a replication stream or log thread when the PUT of a request completes (or fails)
+static void client_request_put_done(put_waiter *waiter, op_status status)
+{
+	client_request *client_req = (client_request*)((char*)waiter - offsetof(client_request, waiter));
+	operation_response *response = (operation_response*)(client_req->resp_buffer);
+
+	response->status = status;
+	client_req->resp_length = sizeof(*response);
+	client_req->task.run = client_reply_task_f;
+	event_loop_post(client_loop, client_req->conn_thread, &(client_req->task));
+}
+
+// Runs on the thread that owns the shard: execute the request and pass the response back (unless it is deferred)
+static void client_request_task_f(event_task *task)
+{
+	client_request *client_req = (client_request*)task;
+
+	size_t length = execute_client_request((operation_request*)(client_req->req_buffer),
+	                                       (operation_response*)(client_req->resp_buffer), &(client_req->waiter),
+	                                       &(client_req->resp_value));
+	if (length == 0) {
+		return;// completed by client_request_put_done()
+	}
+
+	client_req->resp_length = length;
+	if (client_req->conn_thread == client_req->shard_id) {
+		client_reply_task_f(task);
+	} else {
+		client_req->task.run = client_reply_task_f;
+		event_loop_post(client_loop, client_req->conn_thread, &(client_req->task));
+	}
+}
+
+static void free_client_multi(client_multi *multi)
+{
+	free(multi->slots);
+	free(multi->parts);
+	free(multi);
+}
+
+// Drop the value of a result of a multi-key request, and fail it
+static void fail_multi_slot(multi_slot *slot)
+{
+	hash_release_ref(&(slot->value));
+	memset(&(slot->value), 0, sizeof(slot->value));
+	slot->status = SERVER_FAILURE;
+}
+
+// Runs on the connection's thread: send the response to a multi-key request, with the values of the GETs copied into
+// it (the results that don't fit fail)
+static void client_multi_reply_task_f(event_task *task)
+{
+	client_multi *multi = (client_multi*)task;
+	int num_ops = multi->request->num_ops;
+
+	size_t length = sizeof(multi_response);
+	for (int i = 0; i < num_ops; i++) {
+		multi_slot *slot = &(multi->slots[i]);
+		if (length + sizeof(multi_result) + slot->value.value_sz > MAX_DATA_MSG_LEN) {
+			fail_multi_slot(slot);
 		}
+		length += sizeof(multi_result) + slot->value.value_sz;
+	}
 
-		case OP_PUT: {
-			// Need to copy the value to dynamically allocated memory
-			size_t value_size = request->hdr.length - sizeof(*request);
-			void *value_copy = malloc(value_size);
-			if (value_copy == NULL) {
-				perror("malloc");
-				fprintf(stderr, "sid %d: Out of memory\n", server_id);
-				response->status = OUT_OF_SPACE;
-				break;
-			}
-			memcpy(value_copy, request->value, value_size);
+	// Without the values, the response always fits into a small buffer
+	char small_buffer[sizeof(multi_response) + MULTI_MAX_OPS * sizeof(multi_result)];
+	multi_response *response = (length <= sizeof(small_buffer)) ? (multi_response*)small_buffer : malloc(length);
+	if (response == NULL) {
+		perror("malloc");
+		for (int i = 0; i < num_ops; i++) {
+			fail_multi_slot(&(multi->slots[i]));
+		}
+		length = sizeof(multi_response) + num_ops * sizeof(multi_result);
+		response = (multi_response*)small_buffer;
+	}
 
-			void *old_value = NULL;
-			size_t old_value_sz = 0;
+	memset(response, 0, sizeof(*response));
+	response->hdr.type = MSG_MULTI_RESP;
+	response->hdr.req_id = multi->request->hdr.req_id;
+	response->num_results = num_ops;
+
+	size_t pos = 0;
+	for (int i = 0; i < num_ops; i++) {
+		multi_slot *slot = &(multi->slots[i]);
+		multi_result *result = (multi_result*)(response->results + pos);
+		result->status = slot->status;
+		result->value_sz = slot->value.value_sz;
+		memcpy(result->value, hash_ref_data(&(slot->value)), slot->value.value_sz);
+		hash_release_ref(&(slot->value));
+		pos += sizeof(multi_result) + result->value_sz;
+	}
+	conn_send_msg(multi->conn, response, length);
 
-			int primary_srv_id = key_server_id(request->key, num_servers);
-			int secondary_srv_id = secondary_server_id(primary_srv_id, num_servers);
+	if ((char*)response != small_buffer) {
+		free(response);
+	}
+	conn_release(multi->conn);
+	free_client_multi(multi);
+}
 
-			// Somehow this server isn't the primary nor secondary server for the given key
-			if (server_id != primary_srv_id && server_id != secondary_srv_id) {
-				fprintf(stderr, "sid %d: Received server message but this server does not handle the key\n", server_id);
-				response->status = SERVER_FAILURE;
-				break;
-			}
+// Count completed operations of a multi-key request; the last one passes the request to the connection's thread
+static void client_multi_completed(client_multi *multi, int num_completed, int thread_index)
+{
+	if ((num_completed == 0) || (__atomic_sub_fetch(&(multi->pending), num_completed, __ATOMIC_ACQ_REL) > 0)) {
+		return;
+	}
 
-			// Normally, this is for putting it in the secondary replica (forwarded PUT)
-			// During recovery, we might need to update the new primary replica instead (Saa)
-			hash_table *table = (server_id == primary_srv_id) ? &primary_hash : &secondary_hash;
+	if (thread_index == multi->conn_thread) {
+		client_multi_reply_task_f(&(multi->task));
+	} else {
+		event_loop_post(client_loop, multi->conn_thread, &(multi->task));
+	}
+}
 
-			hash_lock(table, request->key);
+// Called by a replication stream or log thread when a PUT of a multi-key request completes (or fails)
+static void client_multi_put_done(put_waiter *waiter, op_status status)
+{
+	multi_slot *slot = (multi_slot*)waiter;
 
-			// Put the <key, value> pair into the hash table
-			if (!hash_put(table, request->key, value_copy, value_size, &old_value, &old_value_sz))
-			{
-				hash_unlock(table, request->key);
-				fprintf(stderr, "sid %d: Out of memory\n", server_id);
-				free(value_copy);
-				response->status = OUT_OF_SPACE;
-				break;
+	slot->status = status;
+	client_multi_completed(slot->multi, 1, -1);
+}
+
+// Runs on the thread that owns the shard: execute the operations of a multi-key request on the keys of the shard
+static void client_multi_part_task_f(event_task *task)
+{
+	multi_part *part = (multi_part*)task;
+	client_multi *multi = part->multi;
+	kv_shard *shard = &(shards[part->shard_id]);
+	int num_ops = multi->request->num_ops;
+	op_type type = multi->request->type;
+
+	// Start fetching the table metadata of all the keys before looking up the first one
+	if (type == OP_GET) {
+		for (int i = 0; i < num_ops; i++) {
+			if (multi->slots[i].shard_id == part->shard_id) {
+				hash_prefetch(&(shard->primary_hash), multi->slots[i].op->key);
 			}
+		}
+	}
 
-			hash_unlock(table, request->key);
+	// The PUTs are replicated in as few frames as possible
+	if (type == OP_PUT) {
+		repl_cork(&primary_stream);
+		repl_cork(&secondary_stream);
+	}
 
-			// Need to free the old value (if there was any)
-			if (old_value != NULL) {
-				free(old_value);
-			}
+	// Same as execute_client_request(), for all the operations at once
+	__atomic_add_fetch(&(shard->seq), 1, __ATOMIC_SEQ_CST);
+	kv_server_state cur_state = __atomic_load_n(&state, __ATOMIC_SEQ_CST);
+	int num_completed = 0;
+	for (int i = 0; i < num_ops; i++) {
+		multi_slot *slot = &(multi->slots[i]);
+		if ((slot->shard_id == part->shard_id) &&
+		    execute_key_operation(shard, cur_state, type, slot->op->key, slot->op->value, slot->op->value_sz,
+		                          &(slot->waiter), &(slot->status), &(slot->value)))
+		{
+			num_completed++;
+		}
+	}
+	__atomic_add_fetch(&(shard->seq), 1, __ATOMIC_RELEASE);
 
-			response->status = SUCCESS;
-			break;
+	if (type == OP_PUT) {
+		repl_uncork(&secondary_stream);
+		repl_uncork(&primary_stream);
+	}
+
+	client_multi_completed(multi, num_completed, part->shard_id);
+}
+
+// Split a multi-key request by shard, and pass each part to the thread that owns the shard
+// Returns false if the request could not be processed (so the connection will be closed)
+static bool process_multi_request(connection *conn, multi_request *request)
+{
+	client_multi *multi = malloc(sizeof(client_multi) + request->hdr.length);
+	if (multi == NULL) {
+		perror("malloc");
+		return false;
+	}
+	multi->slots = calloc(request->num_ops, sizeof(multi_slot));
+	multi->parts = calloc(num_shards, sizeof(multi_part));
+	if ((multi->slots == NULL) || (multi->parts == NULL)) {
+		perror("calloc");
+		free_client_multi(multi);
+		return false;
+	}
+	multi->task.run = client_multi_reply_task_f;
+	multi->conn = conn;
+	multi->conn_thread = conn_thread_index(conn);
+	multi->pending = request->num_ops;
+	memcpy(multi->req_buffer, request, request->hdr.length);
+	multi->request = (multi_request*)(multi->req_buffer);
+
+	size_t pos = 0;
+	int num_parts = 0;
+	for (int i = 0; i < request->num_ops; i++) {
+		multi_slot *slot = &(multi->slots[i]);
+		slot->waiter.done = client_multi_put_done;
+		slot->multi = multi;
+		slot->op = (const multi_op*)(multi->request->ops + pos);
+		slot->shard_id = key_shard_id(slot->op->key, num_shards);
+		pos += sizeof(multi_op) + slot->op->value_sz;
+
+		multi_part *part = &(multi->parts[slot->shard_id]);
+		if (part->multi == NULL) {
+			part->task.run = client_multi_part_task_f;
+			part->multi = multi;
+			part->shard_id = slot->shard_id;
+			num_parts++;
 		}
+	}
 
-		default: {
-			fprintf(stderr, "sid %d: Invalid server operation type\n", server_id);
-			response->status = SERVER_FAILURE;
-			break;
+	// The part of this thread's shard is executed last, right away. The response may be sent (and the request freed)
+	// as soon as the last part is passed on, so nothing is read from the request after that
+	conn_hold(conn);
+	multi_part *own_part = (multi->parts[multi->conn_thread].multi != NULL) ? &(multi->parts[multi->conn_thread]) : NULL;
+	if (own_part != NULL) {
+		num_parts--;
+	}
+	for (int i = 0; (i < num_shards) && (num_parts > 0); i++) {
+		if ((multi->parts[i].multi != NULL) && (i != multi->conn_thread)) {
+			num_parts--;
+			event_loop_post(client_loop, i, &(multi->parts[i].task));
+		}
+	}
+	if (own_part != NULL) {
+		client_multi_part_task_f(&(own_part->task));
+	}
+	return true;
+}
+
+// Called by the client event loop for every message received from a client
+// Returns false if the message was invalid (so the connection will be closed)
+// Client connections are persistent: a client can send any number of requests over one connection
+static bool process_client_message(connection *conn, void *msg)
+{
+	// log_write("%s Receiving a client message\n", current_time_str());
+
+	if (((msg_hdr*)msg)->type == MSG_MULTI_REQ) {
+		return process_multi_request(conn, msg);
+	}
+	if (((msg_hdr*)msg)->type != MSG_OPERATION_REQ) {
+		fprintf(stderr, "sid %d: Invalid client message type %s\n", server_id, msg_type_str[((msg_hdr*)msg)->type]);
+		return false;
+	}
+	operation_request *request = msg;
+
+	// Execute GETs right away if the key belongs to this thread's shard
+	int shard_id = key_shard_id(request->key, num_shards);
+	if ((shard_id == conn_thread_index(conn)) && (request->type != OP_PUT)) {
+		char resp_buffer[sizeof(operation_response)];
+		operation_response *response = (operation_response*)resp_buffer;
+		hash_ref value;
+		size_t resp_length = execute_client_request(request, response, NULL, &value);
+		return send_response(conn, response, resp_length, &value);
+	}
+
+	// Otherwise, the request is executed by the owner of the shard, and/or waits for the replica (responses may then
+	// be sent out of order; clients match them by request id)
+	client_request *client_req = malloc(sizeof(client_request) + request->hdr.length);
+	if (client_req == NULL) {
+		perror("malloc");
+		return false;
+	}
+	client_req->task.run = client_request_task_f;
+	client_req->waiter.done = client_request_put_done;
+	client_req->conn = conn;
+	client_req->conn_thread = conn_thread_index(conn);
+	client_req->shard_id = shard_id;
+	memset(&(client_req->resp_value), 0, sizeof(client_req->resp_value));
+	memcpy(client_req->req_buffer, request, request->hdr.length);
+
+	conn_hold(conn);
+	if (shard_id == client_req->conn_thread) {
+		client_request_task_f(&(client_req->task));
+	} else {
+		event_loop_post(client_loop, shard_id, &(client_req->task));
+	}
+	return true;
+}
+
+// Apply a PUT received on a replication stream (if only_newer, only if it is newer than the stored version; sets
+// sent by a delta resync are not empty); returns the status of the operation
+static op_status apply_replicated_put(const replication_put *put, bool only_newer)
+{
+	int primary_srv_id = key_server_id(put->key, num_servers);
+	int secondary_srv_id = secondary_server_id(primary_srv_id, num_servers);
+
+	// Somehow this server isn't the primary nor secondary server for the given key
+	if (server_id != primary_srv_id && server_id != secondary_srv_id) {
+		fprintf(stderr, "sid %d: Received server message but this server does not handle the key\n", server_id);
+		return SERVER_FAILURE;
+	}
+
+	// Normally, this is for putting it in the secondary replica (forwarded PUT)
+	// During recovery, we might need to update the new primary replica instead (Saa)
+	kv_shard *shard = &(shards[key_shard_id(put->key, num_shards)]);
+	hash_table *table = (server_id == primary_srv_id) ? &(shard->primary_hash) : &(shard->secondary_hash);
+	raise_version((server_id == primary_srv_id) ? &primary_version : &secondary_version, put->version);
+
+	hash_lock(table, put->key);
+
+	uint64_t version;
+	if (only_newer && hash_get_version(table, put->key, &version) && (version >= put->version)) {
+		hash_unlock(table, put->key);
+		return SUCCESS;
+	}
+
+	// Put the <key, value> pair into the hash table (it stores its own copy of the value)
+	if (!hash_put(table, put->key, put->value, put->value_sz, put->version, NULL, NULL)) {
+		hash_unlock(table, put->key);
+		fprintf(stderr, "sid %d: Out of memory (%zu bytes used)\n", server_id, hash_memory_used(table));
+		return OUT_OF_SPACE;
+	}
+
+	// Log the PUT too (see process_server_message() for when it is durable)
+	if (wal_running) {
+		wal_append(&server_wal, put->key, put->value, put->value_sz, put->version, NULL);
+	}
+
+	hash_unlock(table, put->key);
+	return SUCCESS;
+}
+
+// Size the tables that a bulk transfer of total_puts keys goes into (the first PUT tells which set it is), so that
+// they don't have to grow repeatedly while the keys are inserted
+static void presize_tables(const replication_put *first_put, uint64_t total_puts)
+{
+	bool primary = (key_server_id(first_put->key, num_servers) == server_id);
+	for (int i = 0; i < num_shards; i++) {
+		hash_table *table = primary ? &(shards[i].primary_hash) : &(shards[i].secondary_hash);
+		// Not fatal: the table just grows as usual
+		if (!hash_reserve(table, total_puts / num_shards + 1)) {
+			fprintf(stderr, "sid %d: Failed to size the table for %" PRIu64 " keys\n", server_id, total_puts);
 		}
 	}
+}
+
+// Reply to a digest request with the digests of the given nodes of a set's Merkle tree
+static bool process_digest_request(int fd, digest_request *request)
+{
+	merkle_tree *tree;
+	if (request->set_id == server_id) {
+		tree = &primary_merkle;
+	} else if (request->set_id == primary_sid) {
+		tree = &secondary_merkle;
+	} else {
+		fprintf(stderr, "sid %d: Digest request for set %hu that this server does not store\n",
+		        server_id, request->set_id);
+		return false;
+	}
+
+	static uint64_t nodes[MERKLE_NODES];
+	merkle_build(tree, nodes);
+
+	char resp_buffer[MAX_MSG_LEN] = {0};
+	digest_response *response = (digest_response*)resp_buffer;
+	response->hdr.type = MSG_DIGEST_RESP;
+	response->hdr.req_id = request->hdr.req_id;
+	response->num_nodes = request->num_nodes;
+	for (int i = 0; i < request->num_nodes; i++) {
+		if ((request->nodes[i] < 1) || (request->nodes[i] >= MERKLE_NODES)) {
+			fprintf(stderr, "sid %d: Invalid digest request node %hu\n", server_id, request->nodes[i]);
+			return false;
+		}
+		response->digests[i] = nodes[request->nodes[i]];
+	}
+
+	return send_msg(fd, response, sizeof(*response) + response->num_nodes * sizeof(uint64_t));
+}
+
+static repl_receiver *new_receiver(int fd)
+{
+	repl_receiver *receiver = calloc(1, sizeof(*receiver));
+	if (receiver == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	receiver->fd = fd;
+	receiver->next_seq = 1;
+	receiver->refs = 1;
+	return receiver;
+}
+
+static void release_receiver(repl_receiver *receiver)
+{
+	if (__atomic_sub_fetch(&(receiver->refs), 1, __ATOMIC_ACQ_REL) == 0) {
+		close_safe(&(receiver->fd));
+		free(receiver);
+	}
+}
+
+// Sends a deferred ack once its PUTs are durable; called from the log's writer thread, in the order the acks were
+// deferred
+static void ack_logged(wal_waiter *wal, op_status status)
+{
+	deferred_ack *deferred = (deferred_ack*)((char*)wal - offsetof(deferred_ack, wal));
+	repl_receiver *receiver = deferred->receiver;
+
+	replication_ack *ack = (replication_ack*)(deferred->buffer);
+	if (status != SUCCESS) {
+		ack->status = status;
+	}
+	// If the connection is broken, the main thread finds out when it next reads from it
+	send_msg(receiver->fd, ack, deferred->length);
+
+	__atomic_sub_fetch(&(receiver->deferred_acks), 1, __ATOMIC_RELEASE);
+	release_receiver(receiver);
+	free(deferred);
+}
 
-	send_msg(fd, response, sizeof(*response) + value_sz);
+// Send an ack once all PUTs logged so far are durable, without waiting for it; returns false on failure (so the
+// connection will be closed, failing the sender's stream)
+static bool defer_ack(repl_receiver *receiver, replication_ack *ack, size_t length)
+{
+	deferred_ack *deferred = malloc(sizeof(*deferred) + length);
+	if (deferred == NULL) {
+		perror("malloc");
+		return false;
+	}
+	deferred->wal.done = ack_logged;
+	deferred->receiver = receiver;
+	deferred->length = length;
+	memcpy(deferred->buffer, ack, length);
+
+	__atomic_add_fetch(&(receiver->refs), 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(receiver->deferred_acks), 1, __ATOMIC_RELAXED);
+	if (!wal_notify(&server_wal, &(deferred->wal))) {
+		// The log has failed, so the PUTs can't be acknowledged anymore
+		fprintf(stderr, "sid %d: Replicated PUTs can't be made durable\n", server_id);
+		__atomic_sub_fetch(&(receiver->deferred_acks), 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&(receiver->refs), 1, __ATOMIC_RELAXED);
+		free(deferred);
+		return false;
+	}
 	return true;
 }
 
+// Applies the PUTs of a replication or bulk request (in order) and acknowledges them, or replies to a digest request
+// Returns false if the message was invalid (so the connection will be closed)
+static bool process_server_message(repl_receiver *receiver)
+{
+	assert(receiver != NULL);
+	int fd = receiver->fd;
+
+	// log_write("%s Receiving a server message\n", current_time_str());
+
+	// Read and parse the message (bulk requests are too large for the stack, and requests with large values can be
+	// much larger still; the buffer grows to the largest one received so far)
+	static char *req_buffer = NULL;
+	static size_t req_buffer_size = 0;
+	if (!recv_msg_alloc(fd, &req_buffer, &req_buffer_size, -1)) {
+		return false;
+	}
+	if (((msg_hdr*)req_buffer)->type == MSG_DIGEST_REQ) {
+		return process_digest_request(fd, (digest_request*)req_buffer);
+	}
+
+	uint64_t first_seq;
+	int num_puts;
+	const char *puts;
+	msg_hdr *hdr = (msg_hdr*)req_buffer;
+	if (hdr->type == MSG_REPLICATION_REQ) {
+		replication_request *request = (replication_request*)req_buffer;
+		first_seq = request->first_seq;
+		num_puts = request->num_puts;
+		puts = request->puts;
+	} else if (hdr->type == MSG_BULK_REQ) {
+		bulk_request *request = (bulk_request*)req_buffer;
+		first_seq = request->first_seq;
+		num_puts = request->num_puts;
+		puts = request->puts;
+		if (!receiver->presized) {
+			presize_tables((const replication_put*)puts, request->total_puts);
+			receiver->presized = true;
+		}
+	} else {
+		fprintf(stderr, "sid %d: Invalid server message type %s\n", server_id, msg_type_str[hdr->type]);
+		return false;
+	}
+
+	// PUTs must arrive in order, with no gaps
+	if (first_seq != receiver->next_seq) {
+		fprintf(stderr, "sid %d: Unexpected replication sequence number %" PRIu64 " (expected %" PRIu64 ")\n",
+		        server_id, first_seq, receiver->next_seq);
+		return false;
+	}
+	receiver->next_seq += num_puts;
+
+	// The ack covers all PUTs received so far; it lists the PUTs of a replication request that failed, so that only
+	// their senders fail, and reports the first failure among those of a bulk request (which nobody waits for)
+	char ack_buffer[sizeof(replication_ack) + REPL_ACK_MAX_FAILURES * sizeof(replication_failure)];
+	replication_ack *ack = (replication_ack*)ack_buffer;
+	memset(ack, 0, sizeof(*ack));
+	ack->hdr.type = MSG_REPLICATION_ACK;
+	ack->hdr.req_id = hdr->req_id;
+	ack->seq = receiver->next_seq - 1;
+	ack->status = SUCCESS;
+
+	size_t pos = 0;
+	for (int i = 0; i < num_puts; i++) {
+		const replication_put *put = (const replication_put*)(puts + pos);
+		pos += sizeof(*put) + put->value_sz;
+
+		op_status status = apply_replicated_put(put, hdr->type == MSG_BULK_REQ);
+		if (status == SUCCESS) {
+			continue;
+		}
+		if ((hdr->type == MSG_REPLICATION_REQ) && (ack->num_failures < REPL_ACK_MAX_FAILURES)) {
+			ack->failures[ack->num_failures].seq = first_seq + i;
+			ack->failures[ack->num_failures].status = status;
+			ack->num_failures++;
+		} else if (ack->status == SUCCESS) {
+			ack->status = status;
+		}
+	}
+
+	// With WAL_SYNC durability, the PUTs are acknowledged once they are durable, so that a client PUT is on the disks
+	// of both copies when it completes (the PUTs of a set transfer are not waited for: if the server fails before
+	// they are durable, it just gets more of the set with the next resync). The ack is sent by the log's writer
+	// thread meanwhile, so this thread goes on serving the other connections. The same holds the sender back while
+	// the disk falls behind, and an ack also has to wait if an earlier one still does (acks are cumulative)
+	size_t ack_length = sizeof(*ack) + ack->num_failures * sizeof(replication_failure);
+	if (wal_running && (((durability == WAL_SYNC) && (hdr->type == MSG_REPLICATION_REQ)) ||
+	                    wal_backlogged(&server_wal) ||
+	                    (__atomic_load_n(&(receiver->deferred_acks), __ATOMIC_ACQUIRE) > 0)))
+	{
+		return defer_ack(receiver, ack, ack_length);
+	}
+	return send_msg(fd, ack, ack_length);
+}
+
 // Returns false if the message was invalid (so the connection will be closed)
 // Sets *shutdown_requested to true if received a SHUTDOWN message (so the server will terminate)
 static bool process_mserver_message(int fd, bool *shutdown_requested)
@@ -592,8 +1629,9 @@ static bool process_mserver_message(int fd, bool *shutdown_requested)
 	// Process the request based on its type
 	switch (request->type) {
 		case SET_SECONDARY: {
-			response.status = ((secondary_fd = connect_to_server(request->host_name, request->port)) < 0)
-			                ? CTRLREQ_FAILURE : CTRLREQ_SUCCESS;
+			int new_fd = connect_to_server(request->host_name, request->port);
+			response.status = ((new_fd >= 0) && repl_open(&secondary_stream, new_fd))
+			                ? CTRLREQ_SUCCESS : CTRLREQ_FAILURE;
 			break;
 		}
 
@@ -604,35 +1642,33 @@ static bool process_mserver_message(int fd, bool *shutdown_requested)
 
 		case UPDATE_PRIMARY: {
 			send_primary = false;
-			response.status = (send_to_replacement(request->host_name, request->port) < 0)
+			response.status = (send_to_replacement(request->host_name, request->port, request->resync) < 0)
 			                ? CTRLREQ_FAILURE : CTRLREQ_SUCCESS;
 			break;
 		}
 
 		case UPDATE_SECONDARY: {
 			send_primary = true;
-			response.status = (send_to_replacement(request->host_name, request->port) < 0)
+			response.status = (send_to_replacement(request->host_name, request->port, request->resync) < 0)
 			                ? CTRLREQ_FAILURE : CTRLREQ_SUCCESS;
 			break;
 		}
 
 		// Only Sb should get this
 		case SWITCH_PRIMARY: {
-			pthread_mutex_lock(&(state_lock));
-			state = KV_SWITCHING_PRIMARY;
-
 			// 14. Flush all remaining updates to new server
-			for (int i = 0; i < MAX_CLIENT_SESSIONS; i++) {
-				if (fd_is_valid(client_fd_table[i])) {
-					process_client_message(client_fd_table[i]);
-					close_safe(&(client_fd_table[i]));
-				}
-			}
+			// set_state() waits for the client requests in flight to be executed, and the flushes for their forwarded
+			// PUTs to be acknowledged, so after that there are no in-flight updates left; client connections stay open, and requests for the set X
+			// that arrive after the switch are rejected with WRONG_SERVER (the clients then fetch the new routing table)
+			pthread_mutex_lock(&(state_lock));
+			set_state(KV_SWITCHING_PRIMARY);
+			repl_flush(&primary_stream);
+			repl_flush(&secondary_stream);
 
 			// 15. Do the switch and send a confirmation message
 			response.status = CTRLREQ_SUCCESS;
 
-			state = KV_SERVER_ONLINE;
+			set_state(KV_SERVER_ONLINE);
 			pthread_mutex_unlock(&(state_lock));
 			break;
 		}
@@ -648,74 +1684,13 @@ static bool process_mserver_message(int fd, bool *shutdown_requested)
 	return true;
 }
 
-static void *process_client_task(void *args)
-{
-	// Usual preparation stuff for select()
-	fd_set rset, allset;
-	FD_ZERO(&allset);
-	FD_SET(my_clients_fd, &allset);;
-
-	int maxfd = my_clients_fd;
-
-	for (;;) {
-		rset = allset;
-
-		int num_ready_fds = select(maxfd + 1, &rset, NULL, NULL, NULL);
-		if (num_ready_fds < 0) {
-			perror("select");
-			return false;
-		}
-
-		if (num_ready_fds <= 0) {
-			continue;
-		}
-
-		// Incoming connection from a client
-		if (FD_ISSET(my_clients_fd, &rset)) {
-			int fd_idx = accept_connection(my_clients_fd, client_fd_table, MAX_CLIENT_SESSIONS);
-			if (fd_idx >= 0) {
-				FD_SET(client_fd_table[fd_idx], &allset);
-				maxfd = max(maxfd, client_fd_table[fd_idx]);
-			}
-
-			if (--num_ready_fds <= 0) {
-				continue;
-			}
-		}
-
-		// Check for any messages from connected clients
-		for (int i = 0; i < MAX_CLIENT_SESSIONS; i++) {
-			if ((client_fd_table[i] != -1) && FD_ISSET(client_fd_table[i], &rset)) {
-				// Explicitely ignore client requests while handling SWITCH_PRIMARY
-				if (state == KV_SWITCHING_PRIMARY) {
-					operation_response response = {0};
-					response.hdr.type = MSG_OPERATION_RESP;
-					response.status = SERVER_FAILURE;
-					send_msg(client_fd_table[i], &response, sizeof(response));
-				} else {
-					process_client_message(client_fd_table[i]);
-				}
-
-				// Close connection after processing (semantics are "one connection per request")
-				FD_CLR(client_fd_table[i], &allset);
-				close_safe(&(client_fd_table[i]));
-
-				if (--num_ready_fds <= 0) {
-					break;
-				}
-			}
-		}
-	}
-
-	return NULL;
-}
-
 // Returns false if stopped due to errors, true if shutdown was requested
 static bool run_server_loop()
 {
-	// Spawn a new thread to handle client requests
-	if (pthread_create(&client_thread, NULL, process_client_task, NULL)) {
-		perror("run_server_loop: client thread create\n");
+	// Start the event loop threads that handle client requests
+	if ((client_loop = event_loop_start(clients_port, num_client_threads, MAX_CLIENT_SESSIONS, client_backend,
+	                                    process_client_message)) == NULL)
+	{
 		return false;
 	}
 
@@ -759,7 +1734,9 @@ static bool run_server_loop()
 		// Incoming connection from a key-value server
 		if (FD_ISSET(my_servers_fd, &rset)) {
 			int fd_idx = accept_connection(my_servers_fd, server_fd_table, 4);
-			if (fd_idx >= 0) {
+			if ((fd_idx >= 0) && ((server_receivers[fd_idx] = new_receiver(server_fd_table[fd_idx])) == NULL)) {
+				close_safe(&(server_fd_table[fd_idx]));
+			} else if (fd_idx >= 0) {
 				FD_SET(server_fd_table[fd_idx], &allset);
 				maxfd = max(maxfd, server_fd_table[fd_idx]);
 			}
@@ -788,10 +1765,12 @@ static bool run_server_loop()
 		// Check for any messages from connected key-value servers
 		for (int i = 0; i < 4; i++) {
 			if ((server_fd_table[i] != -1) && FD_ISSET(server_fd_table[i], &rset)) {
-				if (!process_server_message(server_fd_table[i])) {
-					// Received an invalid message (or the last valid message), close the connection
+				if (!process_server_message(server_receivers[i])) {
+					// Received an invalid message (or the connection was closed), close it (once no acks wait)
 					FD_CLR(server_fd_table[i], &allset);
-					close_safe(&(server_fd_table[i]));
+					server_fd_table[i] = -1;
+					release_receiver(server_receivers[i]);
+					server_receivers[i] = NULL;
 				}
 
 				if (--num_ready_fds <= 0) {
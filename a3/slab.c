@@ -0,0 +1,375 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+
+// Object sizes of the size classes (multiples of 16, so that all objects are 16-byte aligned)
+static const size_t class_sizes[SLAB_NUM_CLASSES] = {
+	32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+
+// Objects cached by a thread for one pool
+typedef struct _slab_cache {
+	int count[SLAB_NUM_CLASSES];
+	void *objects[SLAB_NUM_CLASSES][SLAB_CACHE_SIZE];
+} slab_cache;
+
+// The calling thread's caches, indexed by pool id (NULL for the pools it hasn't used); allocated on first use
+static __thread slab_cache **thread_caches;
+static __thread size_t num_thread_caches;
+
+// Pool ids are never reused, so that a thread cache left over from a destroyed pool is never used (it is only
+// freed when the thread exits)
+static volatile unsigned int next_pool_id = 1;
+
+// Live pools, sorted by id, for returning the objects of a thread cache to the pool they came from (the pool may
+// have been destroyed meanwhile); a pool is removed before it is destroyed
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static slab_pool **live_pools;
+static size_t num_live_pools;
+static size_t max_live_pools;
+
+// Drains the caches of a thread when it exits
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static __thread bool cache_key_set;
+
+
+// Get size class index for an object size (must be <= SLAB_MAX_OBJECT_SIZE)
+static int class_of(size_t size)
+{
+	int c = 0;
+	while (class_sizes[c] < size) {
+		c++;
+	}
+	assert(c < SLAB_NUM_CLASSES);
+	return c;
+}
+
+// Find a live pool by id (pools_lock must be held); returns NULL if it has been destroyed
+static slab_pool *find_live_pool(unsigned int id)
+{
+	size_t lo = 0;
+	size_t hi = num_live_pools;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (live_pools[mid]->id < id) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return ((lo < num_live_pools) && (live_pools[lo]->id == id)) ? live_pools[lo] : NULL;
+}
+
+// Return all objects in a thread cache to the free lists of its pool (if it still exists)
+static void drain_cache(unsigned int pool_id, slab_cache *cache)
+{
+	pthread_mutex_lock(&pools_lock);
+	slab_pool *pool = find_live_pool(pool_id);
+	for (int c = 0; (pool != NULL) && (c < SLAB_NUM_CLASSES); c++) {
+		if (cache->count[c] == 0) {
+			continue;
+		}
+		slab_class *cls = &(pool->classes[c]);
+		pthread_mutex_lock(&(cls->lock));
+		while (cache->count[c] > 0) {
+			void *obj = cache->objects[c][--cache->count[c]];
+			*(void**)obj = cls->free_list;
+			cls->free_list = obj;
+		}
+		pthread_mutex_unlock(&(cls->lock));
+	}
+	pthread_mutex_unlock(&pools_lock);
+}
+
+static void drain_thread_caches(void *arg)
+{
+	(void)arg;
+	for (size_t i = 0; i < num_thread_caches; i++) {
+		if (thread_caches[i] != NULL) {
+			drain_cache(i, thread_caches[i]);
+			free(thread_caches[i]);
+		}
+	}
+	free(thread_caches);
+	thread_caches = NULL;
+	num_thread_caches = 0;
+	// Set again if another destructor allocates, so that the caches are drained once more
+	cache_key_set = false;
+}
+
+static void create_cache_key()
+{
+	if ((errno = pthread_key_create(&cache_key, drain_thread_caches)) != 0) {
+		perror("pthread_key_create");
+		abort();
+	}
+}
+
+// Create the calling thread's cache for a pool; returns NULL if out of memory
+static slab_cache *new_cache(slab_pool *pool)
+{
+	if (pool->id >= num_thread_caches) {
+		size_t num_caches = (num_thread_caches * 2 > pool->id) ? num_thread_caches * 2 : pool->id + 1;
+		slab_cache **caches = realloc(thread_caches, num_caches * sizeof(slab_cache*));
+		if (caches == NULL) {
+			perror("realloc");
+			return NULL;
+		}
+		memset(caches + num_thread_caches, 0, (num_caches - num_thread_caches) * sizeof(slab_cache*));
+		thread_caches = caches;
+		num_thread_caches = num_caches;
+	}
+
+	slab_cache *cache = calloc(1, sizeof(*cache));
+	if (cache == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	thread_caches[pool->id] = cache;
+
+	if (!cache_key_set) {
+		pthread_once(&cache_key_once, create_cache_key);
+		// The destructor is only called for a non-NULL value
+		if ((errno = pthread_setspecific(cache_key, cache)) != 0) {
+			perror("pthread_setspecific");
+		}
+		cache_key_set = true;
+	}
+	return cache;
+}
+
+// Get the calling thread's cache for a pool; returns NULL if out of memory
+static inline slab_cache *get_cache(slab_pool *pool)
+{
+	if ((pool->id < num_thread_caches) && (thread_caches[pool->id] != NULL)) {
+		return thread_caches[pool->id];
+	}
+	return new_cache(pool);
+}
+
+
+// Count memory obtained from the system against the limit; returns false if it would be exceeded
+static bool reserve(slab_pool *pool, size_t size)
+{
+	size_t reserved = __atomic_load_n(&(pool->reserved), __ATOMIC_RELAXED);
+	do {
+		if ((pool->limit != 0) && (reserved + size > pool->limit)) {
+			return false;
+		}
+	} while (!__atomic_compare_exchange_n(&(pool->reserved), &reserved, reserved + size, true,
+	                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return true;
+}
+
+static void unreserve(slab_pool *pool, size_t size)
+{
+	__atomic_fetch_sub(&(pool->reserved), size, __ATOMIC_RELAXED);
+}
+
+// Allocate a new chunk and carve it into objects of a size class (the class must be locked)
+static bool add_chunk(slab_pool *pool, int c)
+{
+	if (!reserve(pool, SLAB_CHUNK_SIZE)) {
+		return false;
+	}
+
+	char *chunk = malloc(SLAB_CHUNK_SIZE);
+	if (chunk == NULL) {
+		perror("malloc");
+		unreserve(pool, SLAB_CHUNK_SIZE);
+		return false;
+	}
+
+	pthread_mutex_lock(&(pool->chunks_lock));
+	if (pool->num_chunks == pool->max_chunks) {
+		size_t max_chunks = (pool->max_chunks == 0) ? 64 : pool->max_chunks * 2;
+		void **chunks = realloc(pool->chunks, max_chunks * sizeof(void*));
+		if (chunks == NULL) {
+			pthread_mutex_unlock(&(pool->chunks_lock));
+			perror("realloc");
+			free(chunk);
+			unreserve(pool, SLAB_CHUNK_SIZE);
+			return false;
+		}
+		pool->chunks = chunks;
+		pool->max_chunks = max_chunks;
+	}
+	pool->chunks[pool->num_chunks++] = chunk;
+	pthread_mutex_unlock(&(pool->chunks_lock));
+
+	slab_class *cls = &(pool->classes[c]);
+	size_t size = class_sizes[c];
+	for (size_t offset = 0; offset + size <= SLAB_CHUNK_SIZE; offset += size) {
+		*(void**)(chunk + offset) = cls->free_list;
+		cls->free_list = chunk + offset;
+	}
+	return true;
+}
+
+// Move half a cache worth of objects from the class free list into the cache; returns false if none
+static bool refill(slab_pool *pool, slab_cache *cache, int c)
+{
+	slab_class *cls = &(pool->classes[c]);
+
+	pthread_mutex_lock(&(cls->lock));
+	while (cache->count[c] < SLAB_CACHE_SIZE / 2) {
+		if ((cls->free_list == NULL) && !add_chunk(pool, c)) {
+			break;
+		}
+		void *obj = cls->free_list;
+		cls->free_list = *(void**)obj;
+		cache->objects[c][cache->count[c]++] = obj;
+	}
+	pthread_mutex_unlock(&(cls->lock));
+
+	return cache->count[c] > 0;
+}
+
+// Move half of the cached objects back to the class free list
+static void flush(slab_pool *pool, slab_cache *cache, int c)
+{
+	slab_class *cls = &(pool->classes[c]);
+
+	pthread_mutex_lock(&(cls->lock));
+	while (cache->count[c] > SLAB_CACHE_SIZE / 2) {
+		void *obj = cache->objects[c][--cache->count[c]];
+		*(void**)obj = cls->free_list;
+		cls->free_list = obj;
+	}
+	pthread_mutex_unlock(&(cls->lock));
+}
+
+
+// Initialize a pool with given memory limit (0 for unlimited); returns true on success
+bool slab_init(slab_pool *pool, size_t limit)
+{
+	assert(pool != NULL);
+
+	memset(pool, 0, sizeof(*pool));
+	pool->id = __atomic_fetch_add(&next_pool_id, 1, __ATOMIC_RELAXED);
+	pool->limit = limit;
+
+	for (int c = 0; c < SLAB_NUM_CLASSES; c++) {
+		pthread_mutex_init(&(pool->classes[c].lock), NULL);
+	}
+	pthread_mutex_init(&(pool->chunks_lock), NULL);
+
+	// Ids are increasing, so the new pool goes at the end of the sorted list
+	pthread_mutex_lock(&pools_lock);
+	if (num_live_pools == max_live_pools) {
+		size_t max_pools = (max_live_pools == 0) ? 16 : max_live_pools * 2;
+		slab_pool **pools = realloc(live_pools, max_pools * sizeof(slab_pool*));
+		if (pools == NULL) {
+			pthread_mutex_unlock(&pools_lock);
+			perror("realloc");
+			for (int c = 0; c < SLAB_NUM_CLASSES; c++) {
+				pthread_mutex_destroy(&(pool->classes[c].lock));
+			}
+			pthread_mutex_destroy(&(pool->chunks_lock));
+			return false;
+		}
+		live_pools = pools;
+		max_live_pools = max_pools;
+	}
+	live_pools[num_live_pools++] = pool;
+	pthread_mutex_unlock(&pools_lock);
+	return true;
+}
+
+// Free all memory used by a pool (objects of up to SLAB_MAX_OBJECT_SIZE bytes that were not freed are
+// released too, larger ones must have been freed)
+void slab_cleanup(slab_pool *pool)
+{
+	assert(pool != NULL);
+
+	// Thread caches still holding objects of the pool drop them from now on
+	pthread_mutex_lock(&pools_lock);
+	slab_pool **entry = &(live_pools[0]);
+	while (*entry != pool) {
+		entry++;
+	}
+	memmove(entry, entry + 1, (live_pools + num_live_pools - (entry + 1)) * sizeof(slab_pool*));
+	num_live_pools--;
+	pthread_mutex_unlock(&pools_lock);
+
+	for (size_t i = 0; i < pool->num_chunks; i++) {
+		free(pool->chunks[i]);
+	}
+	free(pool->chunks);
+
+	for (int c = 0; c < SLAB_NUM_CLASSES; c++) {
+		pthread_mutex_destroy(&(pool->classes[c].lock));
+	}
+	pthread_mutex_destroy(&(pool->chunks_lock));
+	memset(pool, 0, sizeof(*pool));
+}
+
+
+// Allocate an object of given size; returns NULL if out of memory or if the limit would be exceeded
+void *slab_alloc(slab_pool *pool, size_t size)
+{
+	assert(pool != NULL);
+
+	if (size > SLAB_MAX_OBJECT_SIZE) {
+		if (!reserve(pool, size)) {
+			return NULL;
+		}
+		void *obj = malloc(size);
+		if (obj == NULL) {
+			perror("malloc");
+			unreserve(pool, size);
+			return NULL;
+		}
+		__atomic_fetch_add(&(pool->used), size, __ATOMIC_RELAXED);
+		return obj;
+	}
+
+	int c = class_of(size);
+	slab_cache *cache = get_cache(pool);
+	if ((cache == NULL) || ((cache->count[c] == 0) && !refill(pool, cache, c))) {
+		return NULL;
+	}
+	__atomic_fetch_add(&(pool->used), class_sizes[c], __ATOMIC_RELAXED);
+	return cache->objects[c][--cache->count[c]];
+}
+
+// Free an object allocated with given size
+void slab_free(slab_pool *pool, void *ptr, size_t size)
+{
+	assert(pool != NULL);
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	if (size > SLAB_MAX_OBJECT_SIZE) {
+		free(ptr);
+		unreserve(pool, size);
+		__atomic_fetch_sub(&(pool->used), size, __ATOMIC_RELAXED);
+		return;
+	}
+
+	int c = class_of(size);
+	__atomic_fetch_sub(&(pool->used), class_sizes[c], __ATOMIC_RELAXED);
+	slab_cache *cache = get_cache(pool);
+	if (cache == NULL) {
+		// Without a cache, the object goes straight back to the free list
+		slab_class *cls = &(pool->classes[c]);
+		pthread_mutex_lock(&(cls->lock));
+		*(void**)ptr = cls->free_list;
+		cls->free_list = ptr;
+		pthread_mutex_unlock(&(cls->lock));
+		return;
+	}
+	if (cache->count[c] == SLAB_CACHE_SIZE) {
+		flush(pool, cache, c);
+	}
+	cache->objects[c][cache->count[c]++] = ptr;
+}
@@ -0,0 +1,60 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+
+// Size-classed slab allocator with per-thread caches and memory accounting.
+// Objects of up to SLAB_MAX_OBJECT_SIZE bytes are carved out of SLAB_CHUNK_SIZE chunks, one size class per
+// chunk; freed objects go back to a per-thread cache first, and only batches of them move between the
+// caches and the (locked) per-class free lists. A thread has a cache for each pool it uses (found by pool id,
+// so a thread can use any number of pools without the caches evicting each other); the cached objects go back
+// to the free lists of their pool when the thread exits. Chunks are never returned to the system. Larger
+// objects are allocated directly. All memory obtained from the system is counted against an optional limit.
+
+#define SLAB_NUM_CLASSES 13
+#define SLAB_MAX_OBJECT_SIZE 2048
+#define SLAB_CHUNK_SIZE (64 * 1024)
+
+// Number of objects per size class cached by each thread
+#define SLAB_CACHE_SIZE 32
+
+typedef struct _slab_class {
+	pthread_mutex_t lock;
+	void *free_list;// objects linked through their first word
+} slab_class;
+
+typedef struct _slab_pool {
+	unsigned int id;
+	slab_class classes[SLAB_NUM_CLASSES];
+
+	// All chunks, for freeing them on cleanup
+	pthread_mutex_t chunks_lock;
+	void **chunks;
+	size_t num_chunks;
+	size_t max_chunks;
+
+	size_t limit;// in bytes; 0 if unlimited
+	volatile size_t reserved;// bytes obtained from the system
+	volatile size_t used;// bytes allocated to callers
+} slab_pool;
+
+
+// Initialize a pool with given memory limit (0 for unlimited); returns true on success
+bool slab_init(slab_pool *pool, size_t limit);
+
+// Free all memory used by a pool (objects of up to SLAB_MAX_OBJECT_SIZE bytes that were not freed are
+// released too, larger ones must have been freed)
+void slab_cleanup(slab_pool *pool);
+
+
+// Allocate an object of given size; returns NULL if out of memory or if the limit would be exceeded
+void *slab_alloc(slab_pool *pool, size_t size);
+
+// Free an object allocated with given size
+void slab_free(slab_pool *pool, void *ptr, size_t size);
+
+
+#endif// _SLAB_H_
@@ -0,0 +1,260 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "util.h"
+
+
+// Size of the stdio buffer of the file being written
+#define SNAPSHOT_WRITE_BUFFER (1024 * 1024)
+
+// Values are aligned so that their reference counts can be updated atomically where they are mapped
+#define SNAPSHOT_ALIGN 8
+
+typedef struct _write_args {
+	FILE *file;
+	uint64_t heap_end;// offset of the next value
+	snapshot_entry *index;
+	size_t num_entries;
+	size_t max_entries;
+	const volatile bool *cancel;
+	bool failed;
+} write_args;
+
+static void write_entry_f(const char key[KEY_SIZE], void *value, size_t value_sz, uint64_t version, void *arg)
+{
+	write_args *args = arg;
+	if (args->failed || *(args->cancel)) {
+		return;
+	}
+
+	if (args->num_entries == args->max_entries) {
+		size_t max_entries = (args->max_entries == 0) ? 4096 : args->max_entries * 2;
+		snapshot_entry *index = realloc(args->index, max_entries * sizeof(snapshot_entry));
+		if (index == NULL) {
+			perror("realloc");
+			args->failed = true;
+			return;
+		}
+		args->index = index;
+		args->max_entries = max_entries;
+	}
+
+	snapshot_entry *entry = &(args->index[args->num_entries++]);
+	memset(entry, 0, sizeof(*entry));
+	memcpy(entry->key, key, KEY_SIZE);
+	entry->version = version;
+	entry->value_offset = args->heap_end;
+	entry->value_sz = value_sz;
+
+	// The value is saved the way the table would store it, with the table's reference
+	hash_value header = {0};
+	header.refs = 1;
+	static const char padding[SNAPSHOT_ALIGN] = {0};
+	size_t length = sizeof(header) + value_sz;
+	size_t padding_length = (SNAPSHOT_ALIGN - length % SNAPSHOT_ALIGN) % SNAPSHOT_ALIGN;
+	if ((fwrite(&header, sizeof(header), 1, args->file) != 1) ||
+	    (fwrite(value, 1, value_sz, args->file) != value_sz) ||
+	    (fwrite(padding, 1, padding_length, args->file) != padding_length))
+	{
+		log_perror("fwrite");
+		args->failed = true;
+		return;
+	}
+	args->heap_end += length + padding_length;
+}
+
+// Make a rename in the directory of path durable
+static bool sync_dir(const char *path)
+{
+	char dir_path[PATH_MAX];
+	strncpy(dir_path, path, sizeof(dir_path) - 1);
+	dir_path[sizeof(dir_path) - 1] = '\0';
+
+	int fd = open(dirname(dir_path), O_RDONLY);
+	if (fd < 0) {
+		log_perror("open");
+		return false;
+	}
+	bool result = (fsync(fd) == 0);
+	if (!result) {
+		log_perror("fsync");
+	}
+	close(fd);
+	return result;
+}
+
+bool snapshot_write(const char *path, uint64_t wal_offset, hash_table **tables, int num_tables,
+                    const volatile bool *cancel)
+{
+	assert(path != NULL);
+	assert(tables != NULL);
+	assert(cancel != NULL);
+
+	char tmp_path[PATH_MAX];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	write_args args = {0};
+	args.cancel = cancel;
+	args.heap_end = sizeof(snapshot_header);
+	if ((args.file = fopen(tmp_path, "w")) == NULL) {
+		log_perror("fopen");
+		return false;
+	}
+	setvbuf(args.file, NULL, _IOFBF, SNAPSHOT_WRITE_BUFFER);
+
+	// The header is filled in once the index is written
+	snapshot_header header = {0};
+	if (fwrite(&header, sizeof(header), 1, args.file) != 1) {
+		log_perror("fwrite");
+		args.failed = true;
+	}
+
+	for (int i = 0; (i < num_tables) && !args.failed; i++) {
+		if (!hash_iterate_copy(tables[i], write_entry_f, &args)) {
+			args.failed = true;
+		}
+	}
+	if (args.failed || *cancel) {
+		goto fail;
+	}
+
+	header.magic = SNAPSHOT_MAGIC;
+	header.wal_offset = wal_offset;
+	header.num_entries = args.num_entries;
+	header.index_offset = args.heap_end;
+	if ((fwrite(args.index, sizeof(snapshot_entry), args.num_entries, args.file) != args.num_entries) ||
+	    (fseek(args.file, 0, SEEK_SET) < 0) || (fwrite(&header, sizeof(header), 1, args.file) != 1) ||
+	    (fflush(args.file) != 0))
+	{
+		log_perror("fwrite");
+		goto fail;
+	}
+	if (fsync(fileno(args.file)) < 0) {
+		log_perror("fsync");
+		goto fail;
+	}
+	if (fclose(args.file) != 0) {
+		args.file = NULL;
+		log_perror("fclose");
+		goto fail;
+	}
+	args.file = NULL;
+
+	if (rename(tmp_path, path) < 0) {
+		log_perror("rename");
+		goto fail;
+	}
+	free(args.index);
+	return sync_dir(path);
+
+fail:
+	if (args.file != NULL) {
+		fclose(args.file);
+	}
+	unlink(tmp_path);
+	free(args.index);
+	return false;
+}
+
+bool snapshot_map(snapshot *snap, const char *path, uint64_t *wal_offset)
+{
+	assert(snap != NULL);
+	assert(path != NULL);
+	assert(wal_offset != NULL);
+
+	memset(snap, 0, sizeof(*snap));
+	*wal_offset = 0;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT) {
+			return true;
+		}
+		log_perror("open");
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		log_perror("fstat");
+		close(fd);
+		return false;
+	}
+	if ((size_t)st.st_size < sizeof(snapshot_header)) {
+		fprintf(stderr, "Snapshot %s is truncated\n", path);
+		close(fd);
+		return false;
+	}
+
+	// Writable, so that the tables can update the reference counts of the values; the changes are never written back
+	char *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		log_perror("mmap");
+		return false;
+	}
+
+	snapshot_header *header = (snapshot_header*)data;
+	if ((header->magic != SNAPSHOT_MAGIC) || (header->index_offset < sizeof(snapshot_header)) ||
+	    (header->index_offset > (size_t)st.st_size) ||
+	    (header->num_entries > ((size_t)st.st_size - header->index_offset) / sizeof(snapshot_entry)))
+	{
+		fprintf(stderr, "Snapshot %s is invalid\n", path);
+		munmap(data, st.st_size);
+		return false;
+	}
+
+	snap->data = data;
+	snap->length = st.st_size;
+	*wal_offset = header->wal_offset;
+	return true;
+}
+
+ssize_t snapshot_load(snapshot *snap, void (*load_f)(const char key[KEY_SIZE], hash_value *value, size_t value_sz,
+                                                     uint64_t version, void *arg), void *arg)
+{
+	assert(snap != NULL);
+	assert(load_f != NULL);
+
+	if (snap->data == NULL) {
+		return 0;
+	}
+
+	snapshot_header *header = (snapshot_header*)(snap->data);
+	snapshot_entry *index = (snapshot_entry*)(snap->data + header->index_offset);
+
+	for (size_t i = 0; i < header->num_entries; i++) {
+		snapshot_entry *entry = &(index[i]);
+		if ((entry->value_offset < sizeof(snapshot_header)) || (entry->value_offset % SNAPSHOT_ALIGN != 0) ||
+		    (entry->value_sz > MAX_VALUE_SIZE) ||
+		    (entry->value_offset + sizeof(hash_value) + entry->value_sz > header->index_offset))
+		{
+			fprintf(stderr, "Invalid snapshot entry %zu\n", i);
+			return -1;
+		}
+		load_f(entry->key, (hash_value*)(snap->data + entry->value_offset), entry->value_sz, entry->version, arg);
+	}
+	return header->num_entries;
+}
+
+void snapshot_unmap(snapshot *snap)
+{
+	assert(snap != NULL);
+
+	if (snap->data != NULL) {
+		munmap(snap->data, snap->length);
+		snap->data = NULL;
+		snap->length = 0;
+	}
+}
@@ -0,0 +1,67 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "defs.h"
+#include "hash.h"
+
+
+// Snapshot of a server's key sets, complementing its write-ahead log (see wal.h): a file that is mapped into memory
+// and used in place on restart, instead of replaying every PUT ever logged. The values are stored one after the other
+// in a heap right after the header, each one laid out as an out of line value of a hash table (see hash_value), so
+// that the tables can reference them where they are mapped (see hash_put_foreign()) and pages are only read from the
+// disk when their values are first used. An index with one entry per key (holding offsets into the file rather than
+// pointers) follows the heap. The log is replayed on top of a snapshot from the offset recorded in it.
+// A snapshot is written from a copy of each table shard in turn, so it doesn't block writers for long; each key is
+// saved as it was at some point after the log offset was taken, and replaying the log from there brings it up to
+// date. The file is replaced only once the new snapshot is complete and durable.
+
+#define SNAPSHOT_MAGIC 0x31504e53564b3341ULL// "A3KVSNP1"
+
+typedef struct _snapshot_header {
+	uint64_t magic;
+	uint64_t wal_offset;// the log is replayed from there
+	uint64_t num_entries;
+	uint64_t index_offset;// from the start of the file; the heap is between the header and the index
+} snapshot_header;
+
+typedef struct _snapshot_entry {
+	char key[KEY_SIZE];
+	uint64_t version;
+	uint64_t value_offset;// from the start of the file, of a hash_value (aligned to 8 bytes)
+	uint32_t value_sz;
+	uint32_t reserved;
+} snapshot_entry;
+
+// A mapped snapshot file
+typedef struct _snapshot {
+	char *data;// NULL if there is no snapshot
+	size_t length;
+} snapshot;
+
+
+// Write a snapshot of the given tables into the file at path (through a temporary file that replaces it once it is
+// durable), recording the log offset to replay from; the snapshot is abandoned if *cancel becomes true
+// Returns false on failure (the previous snapshot, if any, is then left alone)
+bool snapshot_write(const char *path, uint64_t wal_offset, hash_table **tables, int num_tables,
+                    const volatile bool *cancel);
+
+// Map the snapshot in the file at path (if it exists; the mapping is private, and pages are only read when used);
+// wal_offset gets the log offset to replay from (0 if there is no snapshot). Returns false if the file could not be
+// read or is invalid
+bool snapshot_map(snapshot *snap, const char *path, uint64_t *wal_offset);
+
+// Call load_f for each key of a mapped snapshot, with its value in place; returns the number of keys, or -1 if the
+// index is invalid
+ssize_t snapshot_load(snapshot *snap, void (*load_f)(const char key[KEY_SIZE], hash_value *value, size_t value_sz,
+                                                     uint64_t version, void *arg), void *arg);
+
+// Unmap a snapshot; the tables that reference its values must have been cleaned up
+void snapshot_unmap(snapshot *snap);
+
+
+#endif// _SNAPSHOT_H_
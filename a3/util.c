@@ -3,22 +3,42 @@
 #define _GNU_SOURCE
 
 #include <assert.h>
+#include <endian.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+// The io_uring backend of the event loop only needs the kernel headers (no liburing)
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include "util.h"
@@ -100,6 +120,16 @@ char *current_time_str()
 }
 
 
+// Disable Nagle's algorithm on a connected socket: connections are persistent and carry pipelined requests, so
+// small messages must not be held back waiting for the acknowledgement of previous ones
+static void set_nodelay(int fd)
+{
+	int opt_val = 1;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&opt_val, sizeof(opt_val)) < 0) {
+		log_perror("setsockopt");
+	}
+}
+
 // Connect to a TCP server given its host name and port number; returns a connected socket fd
 int connect_to_server(const char *host_name, uint16_t port)
 {
@@ -130,6 +160,7 @@ int connect_to_server(const char *host_name, uint16_t port)
 		close(fd);
 		return -1;
 	}
+	set_nodelay(fd);
 	return fd;
 }
 
@@ -159,20 +190,39 @@ ssize_t read_whole(int fd, void *buffer, size_t length)
 
 // Helper functions for converting messages to/from host/network byte order and validating them
 
+// Messages that carry values are allowed to be longer than the others
+static size_t max_msg_length(msg_type type)
+{
+	switch (type) {
+		case MSG_OPERATION_REQ:
+		case MSG_OPERATION_RESP:
+		case MSG_REPLICATION_REQ:
+		case MSG_BULK_REQ:
+		case MSG_MULTI_REQ:
+		case MSG_MULTI_RESP:
+			return MAX_DATA_MSG_LEN;
+		default:
+			return MAX_MSG_LEN;
+	}
+}
+
 static void hton_msg_hdr(msg_hdr *hdr)
 {
 	assert(hdr != NULL);
 	hdr->magic = HDR_MAGIC;
 	assert(hdr->type < MSG_TYPE_MAX);
-	assert(hdr->length <= MAX_MSG_LEN);
-	hdr->length = htons(hdr->length);
+	assert(hdr->length <= max_msg_length(hdr->type));
+	hdr->length = htonl(hdr->length);
+	hdr->req_id = htonl(hdr->req_id);
 }
 
 static bool ntoh_msg_hdr(msg_hdr *hdr)
 {
 	assert(hdr != NULL);
-	hdr->length = ntohs(hdr->length);
-	return (hdr->magic == HDR_MAGIC) && (hdr->type < MSG_TYPE_MAX) && (hdr->length <= MAX_MSG_LEN);
+	hdr->length = ntohl(hdr->length);
+	hdr->req_id = ntohl(hdr->req_id);
+	return (hdr->magic == HDR_MAGIC) && (hdr->type < MSG_TYPE_MAX) &&
+	       (hdr->length >= sizeof(msg_hdr)) && (hdr->length <= max_msg_length(hdr->type));
 }
 
 static void hton_locate_request(locate_request *msg)
@@ -261,6 +311,8 @@ static void hton_mserver_ctrl_request(mserver_ctrl_request *msg)
 	assert(msg->hdr.length == sizeof(mserver_ctrl_request));
 	assert(msg->type < MSERVER_CTRLREQ_TYPE_MAX);
 	msg->server_id = htons(msg->server_id);
+	msg->primary_version = htobe64(msg->primary_version);
+	msg->secondary_version = htobe64(msg->secondary_version);
 }
 
 static bool ntoh_mserver_ctrl_request(mserver_ctrl_request *msg)
@@ -268,6 +320,8 @@ static bool ntoh_mserver_ctrl_request(mserver_ctrl_request *msg)
 	assert(msg != NULL);
 	assert(msg->hdr.type == MSG_MSERVER_CTRL_REQ);
 	msg->server_id = ntohs(msg->server_id);
+	msg->primary_version = be64toh(msg->primary_version);
+	msg->secondary_version = be64toh(msg->secondary_version);
 	return (msg->hdr.length == sizeof(mserver_ctrl_request)) && (msg->type < MSERVER_CTRLREQ_TYPE_MAX);
 }
 
@@ -277,6 +331,7 @@ static void hton_server_ctrl_request(server_ctrl_request *msg)
 	assert(msg->hdr.type == MSG_SERVER_CTRL_REQ);
 	assert(msg->hdr.length >= sizeof(server_ctrl_request));
 	assert(msg->type < SERVER_CTRLREQ_TYPE_MAX);
+	assert(msg->resync < RESYNC_MODE_MAX);
 	if ((msg->type == SET_SECONDARY) || (msg->type == UPDATE_PRIMARY) || (msg->type == UPDATE_SECONDARY)) {
 		assert(msg->hdr.length > sizeof(server_ctrl_request));
 		msg->port = htons(msg->port);
@@ -291,7 +346,9 @@ static bool ntoh_server_ctrl_request(server_ctrl_request *msg)
 {
 	assert(msg != NULL);
 	assert(msg->hdr.type == MSG_SERVER_CTRL_REQ);
-	if ((msg->hdr.length < sizeof(server_ctrl_request)) || (msg->type >= SERVER_CTRLREQ_TYPE_MAX)) {
+	if ((msg->hdr.length < sizeof(server_ctrl_request)) || (msg->type >= SERVER_CTRLREQ_TYPE_MAX) ||
+	    (msg->resync >= RESYNC_MODE_MAX))
+	{
 		return false;
 	}
 	if ((msg->type == SET_SECONDARY) || (msg->type == UPDATE_PRIMARY) || (msg->type == UPDATE_SECONDARY)) {
@@ -323,10 +380,363 @@ static bool ntoh_server_ctrl_response(server_ctrl_response *msg)
 	return (msg->hdr.length == sizeof(server_ctrl_response)) && (msg->status < SERVER_CTRLREQ_STATUS_MAX);
 }
 
+static void hton_routing_request(routing_request *msg)
+{
+	assert(msg != NULL);
+	assert(msg->hdr.type == MSG_ROUTING_REQ);
+	assert(msg->hdr.length == sizeof(routing_request));
+}
+
+static bool ntoh_routing_request(routing_request *msg)
+{
+	assert(msg != NULL);
+	assert(msg->hdr.type == MSG_ROUTING_REQ);
+	return msg->hdr.length == sizeof(routing_request);
+}
+
+static void hton_routing_response(routing_response *msg)
+{
+	assert(msg != NULL);
+	assert(msg->hdr.type == MSG_ROUTING_RESP);
+	assert(msg->hdr.length == sizeof(routing_response) + msg->num_servers * sizeof(routing_entry));
+	for (int i = 0; i < msg->num_servers; i++) {
+		routing_entry *entry = &(msg->servers[i]);
+		assert(entry->serving_sid < msg->num_servers);
+		assert(entry->host_name[ROUTING_HOST_NAME_LEN - 1] == '\0');
+		entry->port = htons(entry->port);
+		entry->serving_sid = htons(entry->serving_sid);
+	}
+	msg->epoch = htonl(msg->epoch);
+	msg->num_servers = htons(msg->num_servers);
+}
+
+static bool ntoh_routing_response(routing_response *msg)
+{
+	assert(msg != NULL);
+	assert(msg->hdr.type == MSG_ROUTING_RESP);
+	if (msg->hdr.length < sizeof(routing_response)) {
+		return false;
+	}
+	msg->epoch = ntohl(msg->epoch);
+	msg->num_servers = ntohs(msg->num_servers);
+	if (msg->hdr.length != sizeof(routing_response) + msg->num_servers * sizeof(routing_entry)) {
+		return false;
+	}
+	for (int i = 0; i < msg->num_servers; i++) {
+		routing_entry *entry = &(msg->servers[i]);
+		entry->port = ntohs(entry->port);
+		entry->serving_sid = ntohs(entry->serving_sid);
+		// Null-terminate the string
+		entry->host_name[ROUTING_HOST_NAME_LEN - 1] = '\0';
+		if (entry->serving_sid >= msg->num_servers) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Convert num_puts replication_put records filling length bytes
+static void hton_replication_puts(char *puts, int num_puts, size_t length)
+{
+	size_t pos = 0;
+	for (int i = 0; i < num_puts; i++) {
+		replication_put *put = (replication_put*)(puts + pos);
+		pos += sizeof(replication_put) + put->value_sz;
+		put->version = htobe64(put->version);
+		put->value_sz = htonl(put->value_sz);
+	}
+	assert(pos == length);
+	(void)length;
+}
+
+// Every record must fit into the message, and they must fill it exactly
+static bool ntoh_replication_puts(char *puts, int num_puts, size_t length)
+{
+	if (num_puts == 0) {
+		return false;
+	}
+
+	size_t pos = 0;
+	for (int i = 0; i < num_puts; i++) {
+		if (length - pos < sizeof(replication_put)) {
+			return false;
+		}
+		replication_put *put = (replication_put*)(puts + pos);
+		put->version = be64toh(put->version);
+		put->value_sz = ntohl(put->value_sz);
+		pos += sizeof(replication_put);
+		if ((put->version == 0) || (put->value_sz == 0) || (length - pos < put->value_sz)) {
+			return false;
+		}
+		pos += put->value_sz;
+	}
+	return pos == length;
+}
+
+static void hton_replication_request(replication_request *msg)
+{
+	assert(msg != NULL);
+	assert(msg->hdr.type == MSG_REPLICATION_REQ);
+	assert(msg->num_puts > 0);
+	hton_replication_puts(msg->puts, msg->num_puts, msg->hdr.length - sizeof(replication_request));
+	msg->first_seq = htobe64(msg->first_seq);
+	msg->num_puts = htons(msg->num_puts);
+}
+
+static bool ntoh_replication_request(replication_request *msg)
+{
+	assert(msg != NULL);
+	assert(msg->hdr.type == MSG_REPLICATION_REQ);
+	if (msg->hdr.length < sizeof(replication_request)) {
+		return false;
+	}
+	msg->first_seq = be64toh(msg->first_seq);
+	msg->num_puts = ntohs(msg->num_puts);
+	return ntoh_replication_puts(msg->puts, msg->num_puts, msg->hdr.length - sizeof(replication_request));
+}
+
+static void hton_replication_ack(replication_ack *msg)
+{
+	assert(msg != NULL);
+	assert(msg->hdr.type == MSG_REPLICATION_ACK);
+	assert(msg->num_failures <= REPL_ACK_MAX_FAILURES);
+	assert(msg->hdr.length == sizeof(replication_ack) + msg->num_failures * sizeof(replication_failure));
+	assert(msg->status < OP_STATUS_MAX);
+	for (int i = 0; i < msg->num_failures; i++) {
+		msg->failures[i].seq = htobe64(msg->failures[i].seq);
+	}
+	msg->seq = htobe64(msg->seq);
+	msg->num_failures = htons(msg->num_failures);
+}
+
+static bool ntoh_replication_ack(replication_ack *msg)
+{
+	assert(msg != NULL);
+	assert(msg->hdr.type == MSG_REPLICATION_ACK);
+	if (msg->hdr.length < sizeof(replication_ack)) {
+		return false;
+	}
+	msg->seq = be64toh(msg->seq);
+	msg->num_failures = ntohs(msg->num_failures);
+	if ((msg->status >= OP_STATUS_MAX) || (msg->num_failures > REPL_ACK_MAX_FAILURES) ||
+	    (msg->hdr.length != sizeof(replication_ack) + msg->num_failures * sizeof(replication_failure)))
+	{
+		return false;
+	}
+	for (int i = 0; i < msg->num_failures; i++) {
+		msg->failures[i].seq = be64toh(msg->failures[i].seq);
+		if (msg->failures[i].status >= OP_STATUS_MAX) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void hton_digest_request(digest_request *msg)
+{
+	assert(msg != NULL);
+	assert(msg->hdr.type == MSG_DIGEST_REQ);
+	assert((msg->num_nodes > 0) && (msg->num_nodes <= DIGEST_MAX_NODES));
+	assert(msg->hdr.length == sizeof(digest_request) + msg->num_nodes * sizeof(uint16_t));
+	for (int i = 0; i < msg->num_nodes; i++) {
+		msg->nodes[i] = htons(msg->nodes[i]);
+	}
+	msg->set_id = htons(msg->set_id);
+	msg->num_nodes = htons(msg->num_nodes);
+}
+
+static bool ntoh_digest_request(digest_request *msg)
+{
+	assert(msg != NULL);
+	assert(msg->hdr.type == MSG_DIGEST_REQ);
+	if (msg->hdr.length < sizeof(digest_request)) {
+		return false;
+	}
+	msg->set_id = ntohs(msg->set_id);
+	msg->num_nodes = ntohs(msg->num_nodes);
+	if ((msg->num_nodes == 0) || (msg->num_nodes > DIGEST_MAX_NODES) ||
+	    (msg->hdr.length != sizeof(digest_request) + msg->num_nodes * sizeof(uint16_t)))
+	{
+		return false;
+	}
+	for (int i = 0; i < msg->num_nodes; i++) {
+		msg->nodes[i] = ntohs(msg->nodes[i]);
+	}
+	return true;
+}
+
+static void hton_digest_response(digest_response *msg)
+{
+	assert(msg != NULL);
+	assert(msg->hdr.type == MSG_DIGEST_RESP);
+	assert(msg->num_nodes <= DIGEST_MAX_NODES);
+	assert(msg->hdr.length == sizeof(digest_response) + msg->num_nodes * sizeof(uint64_t));
+	for (int i = 0; i < msg->num_nodes; i++) {
+		msg->digests[i] = htobe64(msg->digests[i]);
+	}
+	msg->num_nodes = htons(msg->num_nodes);
+}
+
+static bool ntoh_digest_response(digest_response *msg)
+{
+	assert(msg != NULL);
+	assert(msg->hdr.type == MSG_DIGEST_RESP);
+	if (msg->hdr.length < sizeof(digest_response)) {
+		return false;
+	}
+	msg->num_nodes = ntohs(msg->num_nodes);
+	if ((msg->num_nodes > DIGEST_MAX_NODES) ||
+	    (msg->hdr.length != sizeof(digest_response) + msg->num_nodes * sizeof(uint64_t)))
+	{
+		return false;
+	}
+	for (int i = 0; i < msg->num_nodes; i++) {
+		msg->digests[i] = be64toh(msg->digests[i]);
+	}
+	return true;
+}
+
+static void hton_bulk_request(bulk_request *msg)
+{
+	assert(msg != NULL);
+	assert(msg->hdr.type == MSG_BULK_REQ);
+	assert(msg->num_puts > 0);
+	assert(msg->total_puts >= msg->num_puts);
+	hton_replication_puts(msg->puts, msg->num_puts, msg->hdr.length - sizeof(bulk_request));
+	msg->first_seq = htobe64(msg->first_seq);
+	msg->total_puts = htobe64(msg->total_puts);
+	msg->num_puts = htons(msg->num_puts);
+}
+
+static bool ntoh_bulk_request(bulk_request *msg)
+{
+	assert(msg != NULL);
+	assert(msg->hdr.type == MSG_BULK_REQ);
+	if (msg->hdr.length < sizeof(bulk_request)) {
+		return false;
+	}
+	msg->first_seq = be64toh(msg->first_seq);
+	msg->total_puts = be64toh(msg->total_puts);
+	msg->num_puts = ntohs(msg->num_puts);
+	return (msg->total_puts >= msg->num_puts) &&
+	       ntoh_replication_puts(msg->puts, msg->num_puts, msg->hdr.length - sizeof(bulk_request));
+}
+
+// Convert num_ops multi_op records filling length bytes
+static void hton_multi_ops(char *ops, int num_ops, size_t length, op_type type)
+{
+	size_t pos = 0;
+	for (int i = 0; i < num_ops; i++) {
+		multi_op *op = (multi_op*)(ops + pos);
+		assert((type == OP_PUT) ? ((op->value_sz > 0) && (op->value_sz <= MAX_VALUE_SIZE)) : (op->value_sz == 0));
+		pos += sizeof(multi_op) + op->value_sz;
+		op->value_sz = htonl(op->value_sz);
+	}
+	assert(pos == length);
+	(void)length;
+	(void)type;
+}
+
+// Every record must fit into the message, and they must fill it exactly; only PUTs have (non-empty) values
+static bool ntoh_multi_ops(char *ops, int num_ops, size_t length, op_type type)
+{
+	size_t pos = 0;
+	for (int i = 0; i < num_ops; i++) {
+		if (length - pos < sizeof(multi_op)) {
+			return false;
+		}
+		multi_op *op = (multi_op*)(ops + pos);
+		op->value_sz = ntohl(op->value_sz);
+		pos += sizeof(multi_op);
+		if ((type == OP_PUT) ? ((op->value_sz == 0) || (op->value_sz > MAX_VALUE_SIZE)) : (op->value_sz != 0)) {
+			return false;
+		}
+		if (length - pos < op->value_sz) {
+			return false;
+		}
+		pos += op->value_sz;
+	}
+	return pos == length;
+}
+
+static void hton_multi_request(multi_request *msg)
+{
+	assert(msg != NULL);
+	assert(msg->hdr.type == MSG_MULTI_REQ);
+	assert((msg->type == OP_GET) || (msg->type == OP_PUT));
+	assert((msg->num_ops > 0) && (msg->num_ops <= MULTI_MAX_OPS));
+	hton_multi_ops(msg->ops, msg->num_ops, msg->hdr.length - sizeof(multi_request), msg->type);
+	msg->num_ops = htons(msg->num_ops);
+}
+
+static bool ntoh_multi_request(multi_request *msg)
+{
+	assert(msg != NULL);
+	assert(msg->hdr.type == MSG_MULTI_REQ);
+	if ((msg->hdr.length < sizeof(multi_request)) || ((msg->type != OP_GET) && (msg->type != OP_PUT))) {
+		return false;
+	}
+	msg->num_ops = ntohs(msg->num_ops);
+	return (msg->num_ops > 0) && (msg->num_ops <= MULTI_MAX_OPS) &&
+	       ntoh_multi_ops(msg->ops, msg->num_ops, msg->hdr.length - sizeof(multi_request), msg->type);
+}
+
+static void hton_multi_response(multi_response *msg)
+{
+	assert(msg != NULL);
+	assert(msg->hdr.type == MSG_MULTI_RESP);
+	assert(msg->num_results <= MULTI_MAX_OPS);
+
+	size_t pos = 0;
+	for (int i = 0; i < msg->num_results; i++) {
+		multi_result *result = (multi_result*)(msg->results + pos);
+		assert(result->status < OP_STATUS_MAX);
+		pos += sizeof(multi_result) + result->value_sz;
+		result->value_sz = htonl(result->value_sz);
+	}
+	assert(pos == msg->hdr.length - sizeof(multi_response));
+	msg->num_results = htons(msg->num_results);
+}
+
+static bool ntoh_multi_response(multi_response *msg)
+{
+	assert(msg != NULL);
+	assert(msg->hdr.type == MSG_MULTI_RESP);
+	if (msg->hdr.length < sizeof(multi_response)) {
+		return false;
+	}
+	msg->num_results = ntohs(msg->num_results);
+	if (msg->num_results > MULTI_MAX_OPS) {
+		return false;
+	}
+
+	// Every record must fit into the message, and they must fill it exactly
+	size_t length = msg->hdr.length - sizeof(multi_response);
+	size_t pos = 0;
+	for (int i = 0; i < msg->num_results; i++) {
+		if (length - pos < sizeof(multi_result)) {
+			return false;
+		}
+		multi_result *result = (multi_result*)(msg->results + pos);
+		result->value_sz = ntohl(result->value_sz);
+		pos += sizeof(multi_result);
+		if ((result->status >= OP_STATUS_MAX) || (length - pos < result->value_sz)) {
+			return false;
+		}
+		pos += result->value_sz;
+	}
+	return pos == length;
+}
+
 
 // Write message contents to log, based on its type
 // The 'received' argument must be true if this message was received current program
-void log_msg(const void *msg, bool received)
+// Values are only logged up to this length
+#define LOG_VALUE_LEN 64
+
+// The value of an operation message (if any) is either in the message buffer or, for a message being sent, in a
+// separate one (value != NULL)
+static void log_msg_value(const void *msg, bool received, const char *value, size_t value_sz)
 {
 	assert(msg != NULL);
 
@@ -353,8 +763,14 @@ void log_msg(const void *msg, bool received)
 			const operation_request *m = msg;
 			snprintf(subtype, sizeof(subtype), ", subtype = %s", op_type_str[m->type]);
 			if (m->type == OP_PUT) {
-				// Assume that value is a null-terminated string
-				snprintf(contents, sizeof(contents), ", key = %s, value = %s", key_to_str(m->key), m->value);
+				if (value == NULL) {
+					value = m->value;
+					value_sz = hdr->length - sizeof(operation_request);
+				}
+				// Assume that value is a string (possibly null-terminated)
+				snprintf(contents, sizeof(contents), ", key = %s, value = %.*s%s", key_to_str(m->key),
+				         (int)((value_sz < LOG_VALUE_LEN) ? value_sz : LOG_VALUE_LEN), value,
+				         (value_sz > LOG_VALUE_LEN) ? "..." : "");
 			} else {
 				snprintf(contents, sizeof(contents), ", key = %s", key_to_str(m->key));
 			}
@@ -363,9 +779,15 @@ void log_msg(const void *msg, bool received)
 
 		case MSG_OPERATION_RESP: {
 			const operation_response *m = msg;
-			if (hdr->length > sizeof(operation_response)) {
-				// Assume that value is a null-terminated string
-				snprintf(contents, sizeof(contents), ", status = %s, value = %s", op_status_str[m->status], m->value);
+			if (value == NULL) {
+				value = m->value;
+				value_sz = hdr->length - sizeof(operation_response);
+			}
+			if (value_sz > 0) {
+				// Assume that value is a string (possibly null-terminated)
+				snprintf(contents, sizeof(contents), ", status = %s, value = %.*s%s", op_status_str[m->status],
+				         (int)((value_sz < LOG_VALUE_LEN) ? value_sz : LOG_VALUE_LEN), value,
+				         (value_sz > LOG_VALUE_LEN) ? "..." : "");
 			} else {
 				snprintf(contents, sizeof(contents), ", status = %s", op_status_str[m->status]);
 			}
@@ -375,15 +797,19 @@ void log_msg(const void *msg, bool received)
 		case MSG_MSERVER_CTRL_REQ: {
 			const mserver_ctrl_request *m = msg;
 			snprintf(subtype, sizeof(subtype), ", subtype = %s", mserver_ctrlreq_type_str[m->type]);
-			snprintf(contents, sizeof(contents), ", sid = %d", m->server_id);
+			snprintf(contents, sizeof(contents), ", sid = %d, versions = %" PRIu64 "/%" PRIu64,
+			         m->server_id, m->primary_version, m->secondary_version);
 			break;
 		}
 
 		case MSG_SERVER_CTRL_REQ: {
 			const server_ctrl_request *m = msg;
 			snprintf(subtype, sizeof(subtype), ", subtype = %s", server_ctrlreq_type_str[m->type]);
-			if ((m->type == SET_SECONDARY) || (m->type == UPDATE_PRIMARY) || (m->type == UPDATE_SECONDARY)) {
+			if (m->type == SET_SECONDARY) {
 				snprintf(contents, sizeof(contents), ", host = %s, port = %hu", m->host_name, m->port);
+			} else if ((m->type == UPDATE_PRIMARY) || (m->type == UPDATE_SECONDARY)) {
+				snprintf(contents, sizeof(contents), ", host = %s, port = %hu, resync = %s",
+				         m->host_name, m->port, resync_mode_str[m->resync]);
 			}
 			break;
 		}
@@ -394,27 +820,86 @@ void log_msg(const void *msg, bool received)
 			break;
 		}
 
+		case MSG_ROUTING_REQ: break;
+
+		case MSG_ROUTING_RESP: {
+			const routing_response *m = msg;
+			snprintf(contents, sizeof(contents), ", epoch = %u, servers = %hu", m->epoch, m->num_servers);
+			break;
+		}
+
+		case MSG_REPLICATION_REQ: {
+			const replication_request *m = msg;
+			snprintf(contents, sizeof(contents), ", seq = %" PRIu64 ", puts = %hu", m->first_seq, m->num_puts);
+			break;
+		}
+
+		case MSG_REPLICATION_ACK: {
+			const replication_ack *m = msg;
+			snprintf(contents, sizeof(contents), ", seq = %" PRIu64 ", status = %s, failures = %hu", m->seq,
+			         op_status_str[m->status], m->num_failures);
+			break;
+		}
+
+		case MSG_DIGEST_REQ: {
+			const digest_request *m = msg;
+			snprintf(contents, sizeof(contents), ", set = %hu, nodes = %hu", m->set_id, m->num_nodes);
+			break;
+		}
+
+		case MSG_DIGEST_RESP: {
+			const digest_response *m = msg;
+			snprintf(contents, sizeof(contents), ", nodes = %hu", m->num_nodes);
+			break;
+		}
+
+		case MSG_BULK_REQ: {
+			const bulk_request *m = msg;
+			snprintf(contents, sizeof(contents), ", seq = %" PRIu64 ", puts = %hu, total = %" PRIu64,
+			         m->first_seq, m->num_puts, m->total_puts);
+			break;
+		}
+
+		case MSG_MULTI_REQ: {
+			const multi_request *m = msg;
+			snprintf(subtype, sizeof(subtype), ", subtype = %s", op_type_str[m->type]);
+			snprintf(contents, sizeof(contents), ", ops = %hu", m->num_ops);
+			break;
+		}
+
+		case MSG_MULTI_RESP: {
+			const multi_response *m = msg;
+			snprintf(contents, sizeof(contents), ", results = %hu", m->num_results);
+			break;
+		}
+
 		default:// impossible
 			assert(false);
 			break;
 	}
 
-	log_write("%s message: type = %s, length = %d%s%s\n", received ? "Received" : "Sending",
-	          msg_type_str[hdr->type], hdr->length, subtype, contents);
+	log_write("%s message: type = %s, length = %u, id = %u%s%s\n", received ? "Received" : "Sending",
+	          msg_type_str[hdr->type], hdr->length, hdr->req_id, subtype, contents);
 }
 
-// Write a message to a TCP socket
-// Returns true on success. Takes care of the byte order and validates the message
-// Note that this function modifies message contents, so e.g. it cannot be re-send again using this function
-bool send_msg(int fd, void *buffer, size_t length)
+void log_msg(const void *msg, bool received)
+{
+	log_msg_value(msg, received, NULL, 0);
+}
+
+// Prepare a message for sending: fill in the length, log it, convert it to network byte order and validate it
+// The message may end with a value (of an operation message) that is sent from a separate buffer (if value != NULL)
+static void hton_msg(void *buffer, size_t length, const void *value, size_t value_sz)
 {
 	assert(buffer != NULL);
 	assert(length >= sizeof(msg_hdr));
 
 	msg_hdr *hdr = buffer;
-	hdr->length = length;
+	assert(length + value_sz <= max_msg_length(hdr->type));
+	assert((value == NULL) || (hdr->type == MSG_OPERATION_REQ) || (hdr->type == MSG_OPERATION_RESP));
+	hdr->length = length + value_sz;
 
-	log_msg(buffer, false);
+	log_msg_value(buffer, false, value, value_sz);
 
 	// "hton" and validate the message body, based on its type
 	switch (hdr->type) {
@@ -431,59 +916,36 @@ bool send_msg(int fd, void *buffer, size_t length)
 		case MSG_SERVER_CTRL_REQ : hton_server_ctrl_request (buffer); break;
 		case MSG_SERVER_CTRL_RESP: hton_server_ctrl_response(buffer); break;
 
+		case MSG_ROUTING_REQ : hton_routing_request (buffer); break;
+		case MSG_ROUTING_RESP: hton_routing_response(buffer); break;
+
+		case MSG_REPLICATION_REQ: hton_replication_request(buffer); break;
+		case MSG_REPLICATION_ACK: hton_replication_ack    (buffer); break;
+
+		case MSG_BULK_REQ: hton_bulk_request(buffer); break;
+
+		case MSG_DIGEST_REQ : hton_digest_request (buffer); break;
+		case MSG_DIGEST_RESP: hton_digest_response(buffer); break;
+
+		case MSG_MULTI_REQ : hton_multi_request (buffer); break;
+		case MSG_MULTI_RESP: hton_multi_response(buffer); break;
+
 		default:// impossible
 			assert(false);
-			return false;
+			break;
 	}
 
 	// "hton" and validate the message header
 	hton_msg_hdr(hdr);
-
-	// Write the message to the socket
-	ssize_t bytes = send(fd, buffer, length, MSG_NOSIGNAL);
-	if (bytes < 0) {
-		log_perror("send");
-		return false;
-	}
-	assert((size_t)bytes == length);
-	return true;
 }
 
-// Read a single message from TCP socket
-// Returns true on success. Takes care of the byte order and validates the message
-// expected_type == -1 means any type
-bool recv_msg(int fd, void *buffer, size_t length, msg_type expected_type)
+// Convert a received message (with the header already converted) to host byte order and validate it
+// Returns true if the message is valid
+static bool ntoh_msg(void *buffer)
 {
 	assert(buffer != NULL);
-	assert(length >= sizeof(msg_hdr));
 
-	// Read and validate the message header
-	if (read_whole(fd, buffer, sizeof(msg_hdr)) <= 0) {
-		return false;
-	}
 	msg_hdr *hdr = buffer;
-	if (!ntoh_msg_hdr(hdr)) {
-		fprintf(stderr, "Invalid message header\n");
-		return false;
-	}
-
-	// Check expected message type
-	if ((expected_type != (msg_type)-1) && (hdr->type != expected_type)) {
-		fprintf(stderr, "Wrong message type: %s (expected %s)\n",
-		        msg_type_str[hdr->type], msg_type_str[expected_type]);
-		return false;
-	}
-
-	// Check that the buffer is large enough
-	if (length < hdr->length) {
-		fprintf(stderr, "Buffer too small: need %d bytes, have %zu bytes\n", hdr->length, length);
-		return false;
-	}
-	// Read the rest of the message
-	if ((read_whole(fd, buffer + sizeof(msg_hdr), hdr->length - sizeof(msg_hdr))) < 0) {
-		return false;
-	}
-
 	bool result = false;
 	// "ntoh" and validate the message body, based on its type
 	switch (hdr->type) {
@@ -500,6 +962,20 @@ bool recv_msg(int fd, void *buffer, size_t length, msg_type expected_type)
 		case MSG_SERVER_CTRL_REQ : result = ntoh_server_ctrl_request (buffer); break;
 		case MSG_SERVER_CTRL_RESP: result = ntoh_server_ctrl_response(buffer); break;
 
+		case MSG_ROUTING_REQ : result = ntoh_routing_request (buffer); break;
+		case MSG_ROUTING_RESP: result = ntoh_routing_response(buffer); break;
+
+		case MSG_REPLICATION_REQ: result = ntoh_replication_request(buffer); break;
+		case MSG_REPLICATION_ACK: result = ntoh_replication_ack    (buffer); break;
+
+		case MSG_BULK_REQ: result = ntoh_bulk_request(buffer); break;
+
+		case MSG_DIGEST_REQ : result = ntoh_digest_request (buffer); break;
+		case MSG_DIGEST_RESP: result = ntoh_digest_response(buffer); break;
+
+		case MSG_MULTI_REQ : result = ntoh_multi_request (buffer); break;
+		case MSG_MULTI_RESP: result = ntoh_multi_response(buffer); break;
+
 		default:// impossible
 			assert(false);
 			return false;
@@ -514,13 +990,146 @@ bool recv_msg(int fd, void *buffer, size_t length, msg_type expected_type)
 	return true;
 }
 
-
-// If fd is valid (!= -1), closes it, sets it to -1, and returns true; otherwise, returns false
-bool close_safe(int *fd)
+// Write all the data of an I/O vector to a socket (advancing the vector past the data written)
+// A large message may take several calls, each one writing as much as the socket buffer takes
+static bool send_iov(int fd, struct iovec *iov, int iovcnt)
 {
-	assert(fd != NULL);
-
-	if (*fd == -1) {
+	struct msghdr msg = {0};
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	while (msg.msg_iovlen > 0) {
+		ssize_t bytes = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_perror("send");
+			return false;
+		}
+
+		// Skip the buffers written entirely, and the written part of the next one
+		while ((msg.msg_iovlen > 0) && ((size_t)bytes >= msg.msg_iov->iov_len)) {
+			bytes -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + bytes;
+			msg.msg_iov->iov_len -= bytes;
+		}
+	}
+	return true;
+}
+
+// Write a message to a TCP socket
+// Returns true on success. Takes care of the byte order and validates the message
+// Note that this function modifies message contents, so e.g. it cannot be re-send again using this function
+bool send_msg(int fd, void *buffer, size_t length)
+{
+	return send_msg_value(fd, buffer, length, NULL, 0);
+}
+
+// Same as send_msg(), but the message ends with a value taken from a separate buffer (both are written with one
+// writev() call, without copying the value)
+bool send_msg_value(int fd, void *buffer, size_t length, const void *value, size_t value_sz)
+{
+	assert(buffer != NULL);
+	assert(length >= sizeof(msg_hdr));
+
+	hton_msg(buffer, length, value, value_sz);
+
+	struct iovec iov[2] = {{buffer, length}, {(void*)value, value_sz}};
+	return send_iov(fd, iov, (value_sz > 0) ? 2 : 1);
+}
+
+// Read and validate a message header from a TCP socket
+static bool recv_msg_hdr(int fd, msg_hdr *hdr, msg_type expected_type)
+{
+	if (read_whole(fd, hdr, sizeof(msg_hdr)) <= 0) {
+		return false;
+	}
+	if (!ntoh_msg_hdr(hdr)) {
+		fprintf(stderr, "Invalid message header\n");
+		return false;
+	}
+
+	// Check expected message type
+	if ((expected_type != (msg_type)-1) && (hdr->type != expected_type)) {
+		fprintf(stderr, "Wrong message type: %s (expected %s)\n",
+		        msg_type_str[hdr->type], msg_type_str[expected_type]);
+		return false;
+	}
+	return true;
+}
+
+// Read a single message from TCP socket
+// Returns true on success. Takes care of the byte order and validates the message
+// expected_type == -1 means any type
+bool recv_msg(int fd, void *buffer, size_t length, msg_type expected_type)
+{
+	assert(buffer != NULL);
+	assert(length >= sizeof(msg_hdr));
+
+	// Read and validate the message header
+	msg_hdr *hdr = buffer;
+	if (!recv_msg_hdr(fd, hdr, expected_type)) {
+		return false;
+	}
+
+	// Check that the buffer is large enough
+	if (length < hdr->length) {
+		fprintf(stderr, "Buffer too small: need %u bytes, have %zu bytes\n", hdr->length, length);
+		return false;
+	}
+	// Read the rest of the message
+	if ((read_whole(fd, buffer + sizeof(msg_hdr), hdr->length - sizeof(msg_hdr))) < 0) {
+		return false;
+	}
+
+	return ntoh_msg(buffer);
+}
+
+// Same as recv_msg(), but the message is read into a heap buffer (*buffer, of *size bytes, possibly NULL) that is
+// grown to fit it, so it can be as long as the message type allows; the rest of the message is read directly into
+// the buffer once the header tells its length. The message is followed by a '\0' in the buffer (so that a string
+// value at the end of it is always terminated)
+bool recv_msg_alloc(int fd, char **buffer, size_t *size, msg_type expected_type)
+{
+	assert(buffer != NULL);
+	assert(size != NULL);
+
+	msg_hdr hdr;
+	if (!recv_msg_hdr(fd, &hdr, expected_type)) {
+		return false;
+	}
+
+	if (*size < hdr.length + 1) {
+		char *new_buffer = realloc(*buffer, hdr.length + 1);
+		if (new_buffer == NULL) {
+			log_perror("realloc");
+			return false;
+		}
+		*buffer = new_buffer;
+		*size = hdr.length + 1;
+	}
+	memcpy(*buffer, &hdr, sizeof(hdr));
+	(*buffer)[hdr.length] = '\0';
+
+	// Read the rest of the message
+	if ((read_whole(fd, *buffer + sizeof(msg_hdr), hdr.length - sizeof(msg_hdr))) < 0) {
+		return false;
+	}
+
+	return ntoh_msg(*buffer);
+}
+
+
+// If fd is valid (!= -1), closes it, sets it to -1, and returns true; otherwise, returns false
+bool close_safe(int *fd)
+{
+	assert(fd != NULL);
+
+	if (*fd == -1) {
 		return false;
 	}
 
@@ -642,6 +1251,7 @@ int accept_connection(int fd, int *fd_table, int fd_table_size)
 	}
 
 	// We accepted a new connection
+	set_nodelay(connect_fd);
 	char info_str[HOST_NAME_MAX + 40] = "";
 	get_peer_info(connect_fd, info_str, sizeof(info_str));
 	log_write("%s New connection from %s\n", current_time_str(), info_str);
@@ -686,112 +1296,1348 @@ int get_peer_info(int fd, char *str, size_t length)
 }
 
 
-typedef struct _waitpid_args {
-	pid_t pid;
-	int *status;
-} waitpid_args;
+// UDP functions
 
-static void *waitpid_timeout_thread_f(void *arg)
+// Create a UDP socket "connected" to a host and port, so that messages can be sent to it with send_msg()
+int connect_udp(const char *host_name, uint16_t port)
 {
-	assert(arg != NULL);
+	assert(host_name != NULL);
 
-	// Make the thread cancellable at any point in time
-	int rc = pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-	if (rc != 0) {
-		errno = rc;
-		log_perror("pthread_setcanceltype");
-		return (void*)-1;
+	// Resolve the host name
+	struct hostent *h = gethostbyname(host_name);
+	if ((h == NULL) || (h->h_addr == NULL)) {
+		errno = h_errno;
+		log_perror("gethostbyname");
+		return -1;
 	}
 
-	waitpid_args *args = arg;
-	return (void*)(size_t)waitpid(args->pid, args->status, 0);
+	// Create a socket fd (IPv4, UDP)
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		log_perror("socket");
+		return -1;
+	}
+
+	// Set the default destination of the datagrams
+	struct sockaddr_in addr = {0};
+	addr.sin_family = AF_INET;
+	addr.sin_addr = *(struct in_addr*)h->h_addr;
+	addr.sin_port = htons(port);
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		log_perror("connect");
+		close(fd);
+		return -1;
+	}
+	return fd;
 }
 
-// Wait for a child process to terminate, with a timeout (in seconds)
-pid_t waitpid_timeout(pid_t pid, int *status, int timeout)
+// Create a non-blocking UDP socket bound to a given port; returns the socket fd
+int create_udp_server(uint16_t port)
 {
-	if (timeout <= 0) {
-		return waitpid(pid, status, WNOHANG);
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		log_perror("socket");
+		return -1;
 	}
 
-	waitpid_args args = {0};
-	args.pid = pid;
-	args.status = status;
+	struct sockaddr_in addr = {0};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		log_perror("bind");
+		close(fd);
+		return -1;
+	}
+
+	log_write("Listening on UDP port %hu\n", port);
+	return fd;
+}
+
+// Read a single message (that must fill a whole datagram) from a UDP socket
+// Returns true on success. Takes care of the byte order and validates the message
+// Returns false without an error message if the socket is non-blocking and there are no datagrams to read
+bool recv_datagram(int fd, void *buffer, size_t length, msg_type expected_type)
+{
+	assert(buffer != NULL);
+	assert(length >= sizeof(msg_hdr));
+
+	ssize_t bytes = recv(fd, buffer, length, MSG_TRUNC);
+	if (bytes < 0) {
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+			log_perror("recv");
+		}
+		return false;
+	}
+	if ((size_t)bytes < sizeof(msg_hdr)) {
+		fprintf(stderr, "Invalid message header\n");
+		return false;
+	}
+
+	msg_hdr *hdr = buffer;
+	if (!ntoh_msg_hdr(hdr)) {
+		fprintf(stderr, "Invalid message header\n");
+		return false;
+	}
+	if ((size_t)bytes != hdr->length) {
+		fprintf(stderr, "Datagram size %zd doesn't match the message length %u\n", bytes, hdr->length);
+		return false;
+	}
+
+	// Check expected message type
+	if ((expected_type != (msg_type)-1) && (hdr->type != expected_type)) {
+		fprintf(stderr, "Wrong message type: %s (expected %s)\n",
+		        msg_type_str[hdr->type], msg_type_str[expected_type]);
+		return false;
+	}
+
+	return ntoh_msg(buffer);
+}
+
 
+
+// Event loop
+
+// Buffered state of a client connection; only ever accessed by the thread that accepted it
+struct _connection {
+	int fd;
+	event_thread *thread;
+	int refs;// conn_hold() calls not yet matched by conn_release(); the state is kept until they are
+	bool closing;// the connection failed or was closed on the other end; freed once unreferenced
+
+	// Received bytes not yet processed (at most one incomplete message after processing)
+	// The buffer has MAX_MSG_LEN bytes, unless it is grown to receive a longer message (see process_input())
+	char *in;
+	size_t in_len;
+	size_t in_size;
+
+	// Bytes not yet written because the socket buffer was full (epoll), or being written (io_uring)
+	char *out;
+	size_t out_pos;
+	size_t out_len;
+	size_t out_size;
+
+#ifdef HAVE_IO_URING
+	// io_uring backend: the kernel reads out while a send is in flight, so messages sent meanwhile are queued in next
+	char *next;
+	size_t next_len;
+	size_t next_size;
+	bool sending;// a send is in flight
+	bool receiving;// a recv is armed
+	bool fixed;// fd is in the ring's registered file table (at index fd)
+#endif
+};
+
+#ifdef HAVE_IO_URING
+
+// io_uring ring of one event loop thread (set up with raw system calls, no liburing needed)
+typedef struct _uring {
+	int fd;
+	void *rings;
+	size_t rings_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sqe_tail;// local tail, published on the next io_uring_enter()
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	// Receive buffers provided to the kernel; a recv picks one when data arrives, so idle connections hold none
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_size;
+	char *bufs;
+	uint16_t buf_tail;
+
+	// Size of the registered (sparse) file table; 0 if files can't be registered
+	int num_files;
+
+	// Cleared if the kernel doesn't support multishot requests; single-shot ones are then re-armed every time
+	bool multishot_accept;
+	bool multishot_recv;
+} uring;
+
+#define URING_SQ_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+#define URING_NUM_BUFS 256// a power of 2
+#define URING_BUF_SIZE 4096
+#define URING_BUF_GROUP 0
+#define URING_MAX_FILES 65536
+
+// Request types, stored in the low bits of user_data (the rest is a pointer to the thread/connection/loop)
+enum {
+	URING_ACCEPT,
+	URING_RECV,
+	URING_SEND,
+	URING_WAKE,
+	URING_TAG_MASK = 3
+};
+
+#endif// HAVE_IO_URING
+
+struct _event_thread {
+	event_loop *loop;
 	pthread_t thread;
-	if (pthread_create(&thread, NULL, waitpid_timeout_thread_f, &args) != 0) {
-		log_perror("pthread_create");
+	int index;
+	int epoll_fd;
+	int listen_fd;
+
+	// Tasks posted by other threads (a lock-free stack, most recent first); the eventfd is signalled when the stack
+	// becomes non-empty, and when the loop is stopped
+	event_task *volatile tasks;
+	int wake_fd;
+	uint64_t wake_value;// read buffer for the io_uring backend
+#ifdef HAVE_IO_URING
+	uring *ring;// NULL with the epoll backend
+#endif
+};
+
+struct _event_loop {
+	message_handler *handler;
+	event_backend backend;
+	int max_sessions;
+	volatile int num_sessions;
+	volatile bool stopping;
+	int num_threads;
+	event_thread threads[];
+};
+
+static size_t size_min(size_t a, size_t b)
+{
+	return (a < b) ? a : b;
+}
+
+static size_t size_max(size_t a, size_t b)
+{
+	return (a > b) ? a : b;
+}
+
+// Maximum number of events handled per epoll_wait() call
+#define EVENT_BATCH_SIZE 64
+
+// Create a non-blocking listening socket that shares the port with the other threads' sockets (SO_REUSEPORT), so that
+// the kernel spreads incoming connections across the threads
+// Event loop sockets are close-on-exec, so that child processes (servers spawned by mserver) don't keep them open
+static int create_reuseport_server(uint16_t port, int max_sessions)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		log_perror("socket");
 		return -1;
 	}
 
-	struct timespec ts;
-	if (clock_gettime(CLOCK_REALTIME_COARSE, &ts) < 0) {
-		log_perror("clock_gettime");
+	int opt_val = 1;
+	if ((setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void*)&opt_val, sizeof(opt_val)) < 0) ||
+	    (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void*)&opt_val, sizeof(opt_val)) < 0))
+	{
+		log_perror("setsockopt");
+		close(fd);
 		return -1;
 	}
-	ts.tv_sec += timeout;
 
-	void *result;
-	int rc = pthread_timedjoin_np(thread, &result, &ts);
-	if (rc == 0) {
-		return (pid_t)(size_t)result;
-	} else if (rc == ETIMEDOUT) {
-		rc = pthread_cancel(thread);
-		if (rc != 0) {
-			errno = rc;
-			log_perror("pthread_cancel");
-			return -1;
-		}
-		pthread_join(thread, NULL);
-		return 0;
-	} else {
-		errno = rc;
-		log_perror("pthread_timedjoin_np");
+	struct sockaddr_in addr = {0};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		log_perror("bind");
+		close(fd);
 		return -1;
 	}
-}
 
-// Wait for a child process to terminate, killing it if the timeout (in seconds) expires
-// Returns false if had to kill the process
-bool wait_or_kill(pid_t pid, int timeout)
-{
-	if (waitpid_timeout(pid, NULL, timeout) > 0) {
-		log_write("Child process %d is already dead\n", pid);
-		return true;
+	if (listen(fd, max_sessions) < 0) {
+		log_perror("listen");
+		close(fd);
+		return -1;
 	}
-
-	log_write("Killing child process %d\n", pid);
-	kill(pid, SIGKILL);
-	waitpid(pid, NULL, 0);
-	return false;
+	return fd;
 }
 
-// If pid is valid (> 0), waits for it to terminate with a timeout (in seconds) and kills it if the timeout expires,
-// sets it to 0, and returns true; otherwise, returns false
-bool kill_safe(pid_t *pid, int timeout)
+// Set up the state for an accepted connection; returns NULL (and closes fd) if it is rejected
+static connection *new_connection(event_thread *t, int fd)
 {
-	assert(pid != NULL);
-
-	if (*pid <= 0) {
-		return false;
+	if (__atomic_add_fetch(&(t->loop->num_sessions), 1, __ATOMIC_RELAXED) > t->loop->max_sessions) {
+		__atomic_fetch_sub(&(t->loop->num_sessions), 1, __ATOMIC_RELAXED);
+		log_write("%s Too many connections, rejecting an incoming connection\n", current_time_str());
+		close(fd);
+		return NULL;
 	}
 
-	wait_or_kill(*pid, timeout);
-	*pid = 0;
-	return true;
+	set_nodelay(fd);
+	char info_str[HOST_NAME_MAX + 40] = "";
+	get_peer_info(fd, info_str, sizeof(info_str));
+	log_write("%s New connection from %s\n", current_time_str(), info_str);
+
+	connection *conn = calloc(1, sizeof(connection));
+	if ((conn == NULL) || ((conn->in = malloc(MAX_MSG_LEN)) == NULL)) {
+		log_perror("malloc");
+		free(conn);
+		close(fd);
+		__atomic_fetch_sub(&(t->loop->num_sessions), 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	conn->in_size = MAX_MSG_LEN;
+	conn->fd = fd;
+	conn->thread = t;
+	return conn;
 }
 
+#ifdef HAVE_IO_URING
+static bool uring_register_file(uring *ring, int index, int fd);
+#endif
 
-// Get primary key server id for a key
-int key_server_id(const char key[KEY_SIZE], int num_servers)
+// Free the connection state once it is closed, unreferenced and (io_uring) no longer used by requests in flight
+static void release_connection(connection *conn)
 {
-	assert(key != NULL);
-	assert(num_servers > 0);
+	assert(conn != NULL);
+
+	if (!conn->closing || (conn->refs > 0)) {
+		return;
+	}
+#ifdef HAVE_IO_URING
+	if (conn->receiving || conn->sending) {
+		return;
+	}
+	if (conn->fixed) {
+		uring_register_file(conn->thread->ring, conn->fd, -1);
+	}
+	free(conn->next);
+#endif
+
+	close(conn->fd);
+	__atomic_fetch_sub(&(conn->thread->loop->num_sessions), 1, __ATOMIC_RELAXED);
+	free(conn->in);
+	free(conn->out);
+	free(conn);
+}
+
+// Close a connection; with io_uring, shutting the socket down completes the requests in flight, and the connection
+// is freed after the last one
+static void close_connection(connection *conn)
+{
+	assert(conn != NULL);
+
+	if (!conn->closing) {
+		conn->closing = true;
+		if (conn->thread->epoll_fd >= 0) {
+			epoll_ctl(conn->thread->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+		}
+		shutdown(conn->fd, SHUT_RDWR);
+	}
+	release_connection(conn);
+}
+
+// Append bytes to a growing buffer; returns false if out of memory
+static bool append_output(char **buffer, size_t *buffer_len, size_t *buffer_size, const void *data, size_t length)
+{
+	if (length == 0) {
+		return true;
+	}
+	if (*buffer_len + length > *buffer_size) {
+		size_t size = size_max(*buffer_size * 2, *buffer_len + length);
+		char *new_buffer = realloc(*buffer, size);
+		if (new_buffer == NULL) {
+			log_perror("realloc");
+			return false;
+		}
+		*buffer = new_buffer;
+		*buffer_size = size;
+	}
+	memcpy(*buffer + *buffer_len, data, length);
+	*buffer_len += length;
+	return true;
+}
+
+// Pass every complete message in the input buffer to the handler, and keep the incomplete rest (if any)
+// The buffer is then sized for the incomplete message: grown to its length if it is longer than MAX_MSG_LEN (so
+// that the rest of it is read directly into place), and shrunk back afterwards
+// Returns false if the connection must be closed
+static bool process_input(connection *conn)
+{
+	size_t pos = 0;
+	size_t next_length = MAX_MSG_LEN;
+	while (conn->in_len - pos >= sizeof(msg_hdr)) {
+		msg_hdr hdr;
+		memcpy(&hdr, conn->in + pos, sizeof(hdr));
+		if (!ntoh_msg_hdr(&hdr)) {
+			fprintf(stderr, "Invalid message header\n");
+			return false;
+		}
+		if (conn->in_len - pos < hdr.length) {
+			next_length = size_max(next_length, hdr.length);
+			break;
+		}
+
+		void *msg = conn->in + pos;
+		memcpy(msg, &hdr, sizeof(hdr));
+		if (!ntoh_msg(msg) || !conn->thread->loop->handler(conn, msg)) {
+			return false;
+		}
+		pos += hdr.length;
+	}
+
+	memmove(conn->in, conn->in + pos, conn->in_len - pos);
+	conn->in_len -= pos;
+
+	if (conn->in_size != next_length) {
+		char *in = realloc(conn->in, next_length);
+		if (in == NULL) {
+			log_perror("realloc");
+			return false;
+		}
+		conn->in = in;
+		conn->in_size = next_length;
+	}
+	return true;
+}
+
+// Run the tasks posted to a thread, in the order they were posted
+static void run_tasks(event_thread *t)
+{
+	event_task *stack = __atomic_exchange_n(&(t->tasks), NULL, __ATOMIC_ACQUIRE);
+
+	event_task *queue = NULL;
+	while (stack != NULL) {
+		event_task *next = stack->next;
+		stack->next = queue;
+		queue = stack;
+		stack = next;
+	}
+
+	while (queue != NULL) {
+		event_task *task = queue;
+		queue = queue->next;
+		task->run(task);
+	}
+}
+
+
+// epoll backend
+
+// Accept all pending connections on a thread's listening socket
+static void epoll_accept(event_thread *t)
+{
+	for (;;) {
+		int fd = accept4(t->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				log_perror("accept");
+			}
+			return;
+		}
+
+		connection *conn = new_connection(t, fd);
+		if (conn == NULL) {
+			continue;
+		}
+
+		// Edge-triggered: events are only reported on changes, so every event is handled until EAGAIN
+		struct epoll_event ev = {0};
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = conn;
+		if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			log_perror("epoll_ctl");
+			close_connection(conn);
+		}
+	}
+}
+
+// Write as much of the queued output as the socket takes; returns false if the connection failed
+static bool epoll_flush_output(connection *conn)
+{
+	while (conn->out_pos < conn->out_len) {
+		ssize_t bytes = send(conn->fd, conn->out + conn->out_pos, conn->out_len - conn->out_pos, MSG_NOSIGNAL);
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				return true;// the rest is written on the next EPOLLOUT event
+			}
+			log_perror("send");
+			return false;
+		}
+		conn->out_pos += bytes;
+	}
+
+	conn->out_pos = conn->out_len = 0;
+	return true;
+}
+
+// Read all available data and process the received messages; returns false if the connection must be closed
+static bool epoll_read_input(connection *conn)
+{
+	for (;;) {
+		ssize_t bytes = read(conn->fd, conn->in + conn->in_len, conn->in_size - conn->in_len);
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				return true;
+			}
+			log_perror("read");
+			return false;
+		}
+		if (bytes == 0) {// EOF (the socket was closed on the other end)
+			return false;
+		}
+		conn->in_len += bytes;
+
+		if (!process_input(conn)) {
+			return false;
+		}
+	}
+}
+
+// If nothing is queued, the message is written directly from the buffers (with one writev() call), and only what
+// the socket doesn't take is queued
+static bool epoll_send(connection *conn, const void *buffer, size_t length, const void *value, size_t value_sz)
+{
+	size_t written = 0;
+	if (conn->out_pos == conn->out_len) {
+		struct iovec iov[2] = {{(void*)buffer, length}, {(void*)value, value_sz}};
+		struct msghdr msg = {0};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = (value_sz > 0) ? 2 : 1;
+
+		ssize_t bytes;
+		while ((bytes = sendmsg(conn->fd, &msg, MSG_NOSIGNAL)) < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				bytes = 0;// the rest is written on the next EPOLLOUT event
+				break;
+			}
+			if (errno != EINTR) {
+				log_perror("send");
+				return false;
+			}
+		}
+		written = bytes;
+	}
+
+	if (written < length) {
+		if (!append_output(&(conn->out), &(conn->out_len), &(conn->out_size), (const char*)buffer + written,
+		                   length - written))
+		{
+			return false;
+		}
+		written = length;
+	}
+	return append_output(&(conn->out), &(conn->out_len), &(conn->out_size), (const char*)value + (written - length),
+	                     value_sz - (written - length));
+}
+
+static void epoll_run(event_thread *t)
+{
+	struct epoll_event events[EVENT_BATCH_SIZE];
+	while (!t->loop->stopping) {
+		int num_events = epoll_wait(t->epoll_fd, events, EVENT_BATCH_SIZE, -1);
+		if (num_events < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_perror("epoll_wait");
+			return;
+		}
+
+		for (int i = 0; i < num_events; i++) {
+			// The listening socket is registered with the thread itself as the data, the wake eventfd with the loop
+			if (events[i].data.ptr == t) {
+				epoll_accept(t);
+				continue;
+			}
+			if (events[i].data.ptr == t->loop) {
+				// Reset the eventfd before taking the tasks, so that tasks posted after that signal it again
+				if (read(t->wake_fd, &(t->wake_value), sizeof(t->wake_value)) < 0) {
+					log_perror("read");
+				}
+				run_tasks(t);
+				continue;
+			}
+
+			connection *conn = events[i].data.ptr;
+			bool ok = true;
+			if (events[i].events & EPOLLOUT) {
+				ok = epoll_flush_output(conn);
+			}
+			if (ok && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+				ok = epoll_read_input(conn);
+			}
+			if (!ok) {
+				close_connection(conn);
+			}
+		}
+	}
+}
+
+static bool epoll_init(event_thread *t)
+{
+	if ((t->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		log_perror("epoll_create1");
+		return false;
+	}
+
+	struct epoll_event ev = {0};
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = t;
+	if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, t->listen_fd, &ev) < 0) {
+		log_perror("epoll_ctl");
+		return false;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = t->loop;
+	if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, t->wake_fd, &ev) < 0) {
+		log_perror("epoll_ctl");
+		return false;
+	}
+	return true;
+}
+
+
+#ifdef HAVE_IO_URING
+
+// io_uring backend
+//
+// Each thread has its own ring. The listening socket has a multishot accept armed, and every connection a multishot
+// recv that takes its buffer from a ring of provided buffers, so a steady stream of requests costs no system calls
+// besides the io_uring_enter() that submits the responses and waits for more completions. Accepted sockets are
+// registered with the ring (fixed files), and at most one send per connection is in flight, which keeps responses
+// in order without linking requests.
+
+static void uring_free(uring *ring)
+{
+	if (ring == NULL) {
+		return;
+	}
+	if (ring->buf_ring != NULL) {
+		munmap(ring->buf_ring, ring->buf_ring_size);
+	}
+	free(ring->bufs);
+	if (ring->sqes != NULL) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->rings != NULL) {
+		munmap(ring->rings, ring->rings_size);
+	}
+	if (ring->fd >= 0) {
+		close(ring->fd);
+	}
+	free(ring);
+}
+
+// Give a receive buffer (back) to the kernel
+static void uring_provide_buf(uring *ring, int bid)
+{
+	struct io_uring_buf *buf = &(ring->buf_ring->bufs[ring->buf_tail & (URING_NUM_BUFS - 1)]);
+	buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	__atomic_store_n(&(ring->buf_ring->tail), ++ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+// Create a ring with provided receive buffers and a sparse registered file table; returns NULL if not supported
+static uring *uring_create()
+{
+	uring *ring = calloc(1, sizeof(uring));
+	if (ring == NULL) {
+		log_perror("calloc");
+		return NULL;
+	}
+	ring->fd = -1;
+	ring->multishot_accept = ring->multishot_recv = true;
+
+	struct io_uring_params params = {0};
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_CQ_ENTRIES;
+	if ((ring->fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &params)) < 0) {
+		log_perror("io_uring_setup");
+		goto failed;
+	}
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+		log_write("io_uring: kernel too old\n");
+		goto failed;
+	}
+
+	// Map the submission and completion rings (one mapping) and the submission queue entries
+	ring->rings_size = size_max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+	                       params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+	ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+	                   IORING_OFF_SQ_RING);
+	if (ring->rings == MAP_FAILED) {
+		ring->rings = NULL;
+		log_perror("mmap");
+		goto failed;
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+	                  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		log_perror("mmap");
+		goto failed;
+	}
+
+	char *rings = ring->rings;
+	ring->sq_head = (unsigned*)(rings + params.sq_off.head);
+	ring->sq_tail = (unsigned*)(rings + params.sq_off.tail);
+	ring->sq_mask = *(unsigned*)(rings + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->sqe_tail = *(ring->sq_tail);
+	ring->cq_head = (unsigned*)(rings + params.cq_off.head);
+	ring->cq_tail = (unsigned*)(rings + params.cq_off.tail);
+	ring->cq_mask = *(unsigned*)(rings + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+
+	// Submission queue entries are always used in ring order
+	unsigned *sq_array = (unsigned*)(rings + params.sq_off.array);
+	for (unsigned i = 0; i < params.sq_entries; i++) {
+		sq_array[i] = i;
+	}
+
+	// Register the provided buffer ring
+	ring->buf_ring_size = URING_NUM_BUFS * sizeof(struct io_uring_buf);
+	ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->buf_ring == MAP_FAILED) {
+		ring->buf_ring = NULL;
+		log_perror("mmap");
+		goto failed;
+	}
+	if ((ring->bufs = malloc((size_t)URING_NUM_BUFS * URING_BUF_SIZE)) == NULL) {
+		log_perror("malloc");
+		goto failed;
+	}
+
+	struct io_uring_buf_reg buf_reg = {0};
+	buf_reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+	buf_reg.ring_entries = URING_NUM_BUFS;
+	buf_reg.bgid = URING_BUF_GROUP;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &buf_reg, 1) < 0) {
+		log_perror("io_uring_register(PBUF_RING)");
+		goto failed;
+	}
+	for (int i = 0; i < URING_NUM_BUFS; i++) {
+		uring_provide_buf(ring, i);
+	}
+
+	// Register a sparse file table, indexed by fd; connections are served through plain fds if this fails
+	struct rlimit limit;
+	ring->num_files = (getrlimit(RLIMIT_NOFILE, &limit) == 0) ? (int)size_min(limit.rlim_cur, URING_MAX_FILES) : 0;
+
+	struct io_uring_rsrc_register files_reg = {0};
+	files_reg.nr = ring->num_files;
+	files_reg.flags = IORING_RSRC_REGISTER_SPARSE;
+	if ((ring->num_files > 0) &&
+	    (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES2, &files_reg, sizeof(files_reg)) < 0))
+	{
+		log_perror("io_uring_register(FILES2)");
+		ring->num_files = 0;
+	}
+
+	return ring;
+
+failed:
+	uring_free(ring);
+	return NULL;
+}
+
+// Submit the queued requests and wait for at least min_complete completions
+static void uring_enter(uring *ring, unsigned min_complete)
+{
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	unsigned to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	if (syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+	            (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0)
+	{
+		if (errno != EINTR) {
+			log_perror("io_uring_enter");
+		}
+	}
+}
+
+// Get a cleared submission queue entry (submitting the queued ones first if the queue is full)
+static struct io_uring_sqe *uring_get_sqe(uring *ring)
+{
+	while (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+		uring_enter(ring, 0);
+	}
+
+	struct io_uring_sqe *sqe = &(ring->sqes[ring->sqe_tail & ring->sq_mask]);
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sqe_tail++;
+	return sqe;
+}
+
+static uint64_t uring_user_data(void *ptr, int tag)
+{
+	assert(((uintptr_t)ptr & URING_TAG_MASK) == 0);
+	return (uint64_t)(uintptr_t)ptr | tag;
+}
+
+static void uring_arm_accept(event_thread *t)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(t->ring);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = t->listen_fd;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->ioprio = t->ring->multishot_accept ? IORING_ACCEPT_MULTISHOT : 0;
+	sqe->user_data = uring_user_data(t, URING_ACCEPT);
+}
+
+// Read the thread's eventfd (which also resets it)
+static void uring_arm_wake(event_thread *t)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(t->ring);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = t->wake_fd;
+	sqe->addr = (uint64_t)(uintptr_t)&(t->wake_value);
+	sqe->len = sizeof(t->wake_value);
+	sqe->user_data = uring_user_data(t, URING_WAKE);
+}
+
+static void uring_arm_recv(connection *conn)
+{
+	uring *ring = conn->thread->ring;
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->fd;
+	sqe->flags = IOSQE_BUFFER_SELECT | (conn->fixed ? IOSQE_FIXED_FILE : 0);
+	sqe->buf_group = URING_BUF_GROUP;
+	sqe->ioprio = ring->multishot_recv ? IORING_RECV_MULTISHOT : 0;
+	sqe->user_data = uring_user_data(conn, URING_RECV);
+	conn->receiving = true;
+}
+
+static void uring_arm_send(connection *conn)
+{
+	assert(!conn->sending);
+	assert(conn->out_pos < conn->out_len);
+
+	struct io_uring_sqe *sqe = uring_get_sqe(conn->thread->ring);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = conn->fd;
+	sqe->flags = conn->fixed ? IOSQE_FIXED_FILE : 0;
+	sqe->addr = (uint64_t)(uintptr_t)(conn->out + conn->out_pos);
+	sqe->len = conn->out_len - conn->out_pos;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = uring_user_data(conn, URING_SEND);
+	conn->sending = true;
+}
+
+// Add or remove (fd == -1) a file in the ring's registered file table
+static bool uring_register_file(uring *ring, int index, int fd)
+{
+	struct io_uring_files_update update = {0};
+	update.offset = index;
+	update.fds = (uint64_t)(uintptr_t)&fd;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) < 0) {
+		log_perror("io_uring_register(FILES_UPDATE)");
+		return false;
+	}
+	return true;
+}
+
+// The kernel reads the data while the send is in flight, so the message (and its value) is always copied
+static bool uring_send(connection *conn, const void *buffer, size_t length, const void *value, size_t value_sz)
+{
+	if (conn->sending) {
+		return append_output(&(conn->next), &(conn->next_len), &(conn->next_size), buffer, length) &&
+		       append_output(&(conn->next), &(conn->next_len), &(conn->next_size), value, value_sz);
+	}
+
+	if (!append_output(&(conn->out), &(conn->out_len), &(conn->out_size), buffer, length) ||
+	    !append_output(&(conn->out), &(conn->out_len), &(conn->out_size), value, value_sz))
+	{
+		return false;
+	}
+	uring_arm_send(conn);
+	return true;
+}
+
+static void uring_handle_accept(event_thread *t, const struct io_uring_cqe *cqe)
+{
+	uring *ring = t->ring;
+
+	if (cqe->res >= 0) {
+		connection *conn = new_connection(t, cqe->res);
+		if (conn != NULL) {
+			conn->fixed = (conn->fd < ring->num_files) && uring_register_file(ring, conn->fd, conn->fd);
+			uring_arm_recv(conn);
+		}
+	} else if ((cqe->res == -EINVAL) && ring->multishot_accept) {
+		log_write("io_uring: multishot accept not supported\n");
+		ring->multishot_accept = false;
+	} else {
+		errno = -cqe->res;
+		log_perror("accept");
+	}
+
+	if (!(cqe->flags & IORING_CQE_F_MORE) && !t->loop->stopping) {
+		uring_arm_accept(t);
+	}
+}
+
+static void uring_handle_recv(connection *conn, const struct io_uring_cqe *cqe)
+{
+	uring *ring = conn->thread->ring;
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		conn->receiving = false;
+	}
+
+	bool ok = true;
+	if (cqe->res > 0) {
+		assert(cqe->flags & IORING_CQE_F_BUFFER);
+		int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		const char *data = ring->bufs + (size_t)bid * URING_BUF_SIZE;
+		size_t length = cqe->res;
+
+		// Data beyond a whole message waits in the input buffer, so process it in pieces that fit
+		while (ok && !conn->closing && (length > 0)) {
+			size_t bytes = size_min(length, conn->in_size - conn->in_len);
+			memcpy(conn->in + conn->in_len, data, bytes);
+			conn->in_len += bytes;
+			data += bytes;
+			length -= bytes;
+			ok = process_input(conn);
+		}
+		uring_provide_buf(ring, bid);
+	} else if (cqe->res == -ENOBUFS) {
+		// All receive buffers are in use; they are given back as soon as their data is processed
+	} else if ((cqe->res == -EINVAL) && ring->multishot_recv) {
+		log_write("io_uring: multishot recv not supported\n");
+		ring->multishot_recv = false;
+	} else {
+		// EOF (the socket was closed on the other end) or an error
+		if ((cqe->res < 0) && (cqe->res != -ECONNRESET) && !conn->closing) {
+			errno = -cqe->res;
+			log_perror("recv");
+		}
+		ok = false;
+	}
+
+	if (!ok || conn->closing) {
+		close_connection(conn);
+	} else if (!conn->receiving) {
+		uring_arm_recv(conn);
+	}
+}
+
+static void uring_handle_send(connection *conn, const struct io_uring_cqe *cqe)
+{
+	conn->sending = false;
+
+	if (cqe->res < 0) {
+		if (!conn->closing) {
+			errno = -cqe->res;
+			log_perror("send");
+		}
+		close_connection(conn);
+		return;
+	}
+
+	conn->out_pos += cqe->res;
+	if (conn->out_pos == conn->out_len) {
+		// Everything written; continue with the messages queued meanwhile
+		char *out = conn->out;
+		size_t out_size = conn->out_size;
+		conn->out = conn->next;
+		conn->out_size = conn->next_size;
+		conn->out_len = conn->next_len;
+		conn->out_pos = 0;
+		conn->next = out;
+		conn->next_size = out_size;
+		conn->next_len = 0;
+	}
+
+	if (conn->closing) {
+		release_connection(conn);
+	} else if (conn->out_pos < conn->out_len) {
+		uring_arm_send(conn);
+	}
+}
+
+static void uring_run(event_thread *t)
+{
+	uring *ring = t->ring;
+	uring_arm_accept(t);
+	uring_arm_wake(t);
+
+	while (!t->loop->stopping) {
+		uring_enter(ring, 1);
+
+		unsigned head = *(ring->cq_head);
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+			__atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+
+			void *ptr = (void*)(uintptr_t)(cqe.user_data & ~(uint64_t)URING_TAG_MASK);
+			switch (cqe.user_data & URING_TAG_MASK) {
+				case URING_ACCEPT: uring_handle_accept(ptr, &cqe); break;
+				case URING_RECV  : uring_handle_recv  (ptr, &cqe); break;
+				case URING_SEND  : uring_handle_send  (ptr, &cqe); break;
+				case URING_WAKE  : run_tasks(t); uring_arm_wake(t); break;
+			}
+		}
+	}
+}
+
+#endif// HAVE_IO_URING
+
+
+static void wake_thread(event_thread *t)
+{
+	uint64_t value = 1;
+	if (write(t->wake_fd, &value, sizeof(value)) < 0) {
+		log_perror("write");
+	}
+}
+
+// Pin the i-th event loop thread to the i-th CPU the process may run on (if there are fewer, they are reused)
+static void pin_thread(pthread_t thread, int i)
+{
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		log_perror("sched_getaffinity");
+		return;
+	}
+
+	int num_cpus = CPU_COUNT(&allowed);
+	int n = i % num_cpus;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &allowed) && (n-- == 0)) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			int rc = pthread_setaffinity_np(thread, sizeof(set), &set);
+			if (rc != 0) {
+				errno = rc;
+				log_perror("pthread_setaffinity_np");
+			}
+			return;
+		}
+	}
+}
+
+static void *event_thread_f(void *arg)
+{
+	assert(arg != NULL);
+	event_thread *t = arg;
+
+#ifdef HAVE_IO_URING
+	if (t->ring != NULL) {
+		uring_run(t);
+		return NULL;
+	}
+#endif
+	epoll_run(t);
+	return NULL;
+}
+
+// Start an event loop serving connections to a TCP port with num_threads threads; returns NULL on failure
+event_loop *event_loop_start(uint16_t port, int num_threads, int max_sessions, event_backend backend,
+                             message_handler *handler)
+{
+	assert(port != 0);
+	assert(num_threads > 0);
+	assert(handler != NULL);
+
+	event_loop *loop = calloc(1, sizeof(event_loop) + num_threads * sizeof(event_thread));
+	if (loop == NULL) {
+		log_perror("calloc");
+		return NULL;
+	}
+	loop->handler = handler;
+	loop->backend = backend;
+	loop->max_sessions = max_sessions;
+	loop->num_threads = num_threads;
+	for (int i = 0; i < num_threads; i++) {
+		loop->threads[i].loop = loop;
+		loop->threads[i].index = i;
+		loop->threads[i].epoll_fd = -1;
+		loop->threads[i].listen_fd = -1;
+		loop->threads[i].wake_fd = -1;
+	}
+
+	// Allow as many open connections as the hard limit permits
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	for (int i = 0; i < num_threads; i++) {
+		event_thread *t = &(loop->threads[i]);
+		if ((t->listen_fd = create_reuseport_server(port, max_sessions)) < 0) {
+			goto failed;
+		}
+		if ((t->wake_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+			log_perror("eventfd");
+			goto failed;
+		}
+
+#ifdef HAVE_IO_URING
+		if ((loop->backend == EVENT_BACKEND_IO_URING) && ((t->ring = uring_create()) == NULL)) {
+			// Fall back to epoll (before any thread has been started with io_uring)
+			assert(i == 0);
+			log_write("io_uring is not available, using epoll\n");
+			loop->backend = EVENT_BACKEND_EPOLL;
+		}
+#else
+		if (loop->backend == EVENT_BACKEND_IO_URING) {
+			log_write("Built without io_uring support, using epoll\n");
+			loop->backend = EVENT_BACKEND_EPOLL;
+		}
+#endif
+		if ((loop->backend == EVENT_BACKEND_EPOLL) && !epoll_init(t)) {
+			goto failed;
+		}
+
+		int rc = pthread_create(&(t->thread), NULL, event_thread_f, t);
+		if (rc != 0) {
+			errno = rc;
+			log_perror("pthread_create");
+			t->thread = 0;
+			goto failed;
+		}
+		pin_thread(t->thread, i);
+	}
+
+	log_write("Listening on TCP port %hu with %d threads (%s)\n", port, num_threads,
+	          (loop->backend == EVENT_BACKEND_IO_URING) ? "io_uring" : "epoll");
+	return loop;
+
+failed:
+	event_loop_stop(loop);
+	return NULL;
+}
+
+// Stop the event loop threads and close the listening sockets
+void event_loop_stop(event_loop *loop)
+{
+	if (loop == NULL) {
+		return;
+	}
+
+	// Wake up all threads; tasks still queued are dropped
+	loop->stopping = true;
+	for (int i = 0; i < loop->num_threads; i++) {
+		wake_thread(&(loop->threads[i]));
+	}
+
+	for (int i = 0; i < loop->num_threads; i++) {
+		event_thread *t = &(loop->threads[i]);
+		if (t->thread) {
+			pthread_join(t->thread, NULL);
+		}
+		// Connections are only referenced from the epoll sets/rings; their fds are released when the process exits
+		close_safe(&(t->epoll_fd));
+		close_safe(&(t->listen_fd));
+		close_safe(&(t->wake_fd));
+#ifdef HAVE_IO_URING
+		uring_free(t->ring);
+#endif
+	}
+	free(loop);
+}
+
+// Post a task to be run by an event loop thread; can be called from any thread
+void event_loop_post(event_loop *loop, int thread_index, event_task *task)
+{
+	assert(loop != NULL);
+	assert((thread_index >= 0) && (thread_index < loop->num_threads));
+	assert(task != NULL);
+
+	event_thread *t = &(loop->threads[thread_index]);
+	event_task *head = __atomic_load_n(&(t->tasks), __ATOMIC_RELAXED);
+	do {
+		task->next = head;
+	} while (!__atomic_compare_exchange_n(&(t->tasks), &head, task, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	// Only the task that made the stack non-empty wakes the thread up; it takes the whole stack at once
+	if (head == NULL) {
+		wake_thread(t);
+	}
+}
+
+// Get the index of the event loop thread that serves a connection (from 0 to num_threads - 1)
+int conn_thread_index(const connection *conn)
+{
+	assert(conn != NULL);
+	return conn->thread->index;
+}
+
+// Keep the state of a connection alive until the matching conn_release(), even if the connection is closed meanwhile
+void conn_hold(connection *conn)
+{
+	assert(conn != NULL);
+	conn->refs++;
+}
+
+void conn_release(connection *conn)
+{
+	assert(conn != NULL);
+	assert(conn->refs > 0);
+
+	conn->refs--;
+	release_connection(conn);
+}
+
+// Send a message on an event loop connection
+// Same as send_msg(), except that it never blocks: whatever the socket doesn't take right away is written once it
+// becomes writable; must only be called from the connection's thread
+bool conn_send_msg(connection *conn, void *buffer, size_t length)
+{
+	return conn_send_msg_value(conn, buffer, length, NULL, 0);
+}
+
+// Same as conn_send_msg(), but the message ends with a value taken from a separate buffer (like send_msg_value())
+bool conn_send_msg_value(connection *conn, void *buffer, size_t length, const void *value, size_t value_sz)
+{
+	assert(conn != NULL);
+	assert(buffer != NULL);
+
+	if (conn->closing) {
+		return false;
+	}
+
+	hton_msg(buffer, length, value, value_sz);
+
+#ifdef HAVE_IO_URING
+	if (conn->thread->ring != NULL) {
+		return uring_send(conn, buffer, length, value, value_sz);
+	}
+#endif
+	return epoll_send(conn, buffer, length, value, value_sz);
+}
+
+
+typedef struct _waitpid_args {
+	pid_t pid;
+	int *status;
+} waitpid_args;
+
+static void *waitpid_timeout_thread_f(void *arg)
+{
+	assert(arg != NULL);
+
+	// Make the thread cancellable at any point in time
+	int rc = pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+	if (rc != 0) {
+		errno = rc;
+		log_perror("pthread_setcanceltype");
+		return (void*)-1;
+	}
+
+	waitpid_args *args = arg;
+	return (void*)(size_t)waitpid(args->pid, args->status, 0);
+}
+
+// Wait for a child process to terminate, with a timeout (in seconds)
+pid_t waitpid_timeout(pid_t pid, int *status, int timeout)
+{
+	if (timeout <= 0) {
+		return waitpid(pid, status, WNOHANG);
+	}
+
+	waitpid_args args = {0};
+	args.pid = pid;
+	args.status = status;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, waitpid_timeout_thread_f, &args) != 0) {
+		log_perror("pthread_create");
+		return -1;
+	}
+
+	struct timespec ts;
+	if (clock_gettime(CLOCK_REALTIME_COARSE, &ts) < 0) {
+		log_perror("clock_gettime");
+		return -1;
+	}
+	ts.tv_sec += timeout;
+
+	void *result;
+	int rc = pthread_timedjoin_np(thread, &result, &ts);
+	if (rc == 0) {
+		return (pid_t)(size_t)result;
+	} else if (rc == ETIMEDOUT) {
+		rc = pthread_cancel(thread);
+		if (rc != 0) {
+			errno = rc;
+			log_perror("pthread_cancel");
+			return -1;
+		}
+		pthread_join(thread, NULL);
+		return 0;
+	} else {
+		errno = rc;
+		log_perror("pthread_timedjoin_np");
+		return -1;
+	}
+}
+
+// Wait for a child process to terminate, killing it if the timeout (in seconds) expires
+// Returns false if had to kill the process
+bool wait_or_kill(pid_t pid, int timeout)
+{
+	if (waitpid_timeout(pid, NULL, timeout) > 0) {
+		log_write("Child process %d is already dead\n", pid);
+		return true;
+	}
+
+	log_write("Killing child process %d\n", pid);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return false;
+}
+
+// If pid is valid (> 0), waits for it to terminate with a timeout (in seconds) and kills it if the timeout expires,
+// sets it to 0, and returns true; otherwise, returns false
+bool kill_safe(pid_t *pid, int timeout)
+{
+	assert(pid != NULL);
+
+	if (*pid <= 0) {
+		return false;
+	}
+
+	wait_or_kill(*pid, timeout);
+	*pid = 0;
+	return true;
+}
+
+
+// Get primary key server id for a key
+int key_server_id(const char key[KEY_SIZE], int num_servers)
+{
+	assert(key != NULL);
+	assert(num_servers > 0);
 
 	int byte = (unsigned char)(key[KEY_SIZE - 1]);
 	return byte % num_servers;
 }
 
+// Get the shard (within a server) that a key belongs to
+int key_shard_id(const char key[KEY_SIZE], int num_shards)
+{
+	assert(key != NULL);
+	assert(num_shards > 0);
+
+	uint32_t bytes;
+	memcpy(&bytes, key + 8, sizeof(bytes));
+	return bytes % num_shards;
+}
+
 // Get secondary server id for given primary server id
 int secondary_server_id(int server_id, int num_servers)
 {
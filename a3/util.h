@@ -55,11 +55,21 @@ void log_msg(const void *msg, bool received);
 // Note that this function modifies message contents, so e.g. it cannot be re-send again using this function
 bool send_msg(int fd, void *buffer, size_t length);
 
+// Same as send_msg(), but the message ends with a value taken from a separate buffer (both are written with one
+// writev() call, without copying the value)
+bool send_msg_value(int fd, void *buffer, size_t length, const void *value, size_t value_sz);
+
 // Read a single message from TCP socket
 // Returns true on success. Takes care of the byte order and validates the message
 // expected_type == -1 means any type
 bool recv_msg(int fd, void *buffer, size_t length, msg_type expected_type);
 
+// Same as recv_msg(), but the message is read into a heap buffer (*buffer, of *size bytes, possibly NULL) that is
+// grown to fit it, so it can be as long as the message type allows; the rest of the message is read directly into
+// the buffer once the header tells its length. The message is followed by a '\0' in the buffer (so that a string
+// value at the end of it is always terminated)
+bool recv_msg_alloc(int fd, char **buffer, size_t *size, msg_type expected_type);
+
 
 // TCP server functions
 
@@ -90,6 +100,89 @@ int accept_connection(int fd, int *fd_table, int fd_table_size);
 int get_peer_info(int fd, char *str, size_t length);
 
 
+// UDP functions (for messages that fit into a datagram and can be lost, e.g. heartbeats)
+
+// Create a UDP socket "connected" to a host and port, so that messages can be sent to it with send_msg()
+int connect_udp(const char *host_name, uint16_t port);
+
+// Create a non-blocking UDP socket bound to a given port; returns the socket fd
+int create_udp_server(uint16_t port);
+
+// Read a single message (that must fill a whole datagram) from a UDP socket
+// Returns true on success. Takes care of the byte order and validates the message
+// Returns false without an error message if the socket is non-blocking and there are no datagrams to read
+bool recv_datagram(int fd, void *buffer, size_t length, msg_type expected_type);
+
+
+// Event loop functions
+//
+// An event loop serves all connections to a TCP port with a pool of threads. Each thread has its own epoll set and
+// its own listening socket bound to the port (SO_REUSEPORT), so the kernel spreads new connections across the
+// threads, and a connection is only ever handled by the thread that accepted it. Sockets are non-blocking and
+// edge-triggered; incoming data is buffered until a whole message is available (the buffer is grown for a long
+// message once its header is received, and the rest of it is read directly into place), and output that doesn't
+// fit into the socket buffer is queued.
+//
+// With the io_uring backend (if supported by the kernel; otherwise the loop falls back to epoll), each thread has an
+// io_uring instead of an epoll set, with a multishot accept on the listening socket and a multishot recv into
+// kernel-selected provided buffers on each connection (registered as a fixed file), so a busy connection costs no
+// system calls besides the one that submits the responses and waits for the next completions.
+//
+// Threads are pinned to CPUs. Work can be handed from one thread to another by posting a task to it: tasks are
+// pushed onto a lock-free stack and the target thread is woken up through an eventfd, so threads that partition
+// their data between them can exchange requests without sharing any locks.
+
+typedef enum {
+	EVENT_BACKEND_EPOLL,
+	EVENT_BACKEND_IO_URING
+} event_backend;
+
+typedef struct _connection connection;
+typedef struct _event_thread event_thread;
+
+// A task posted to an event loop thread; usually embedded into a larger structure
+typedef struct _event_task event_task;
+struct _event_task {
+	event_task *next;
+	void (*run)(event_task *task);
+};
+typedef struct _event_loop event_loop;
+
+// Called for every message received on a connection, already validated and in host byte order
+// Returns false if the connection must be closed
+typedef bool message_handler(connection *conn, void *msg);
+
+// Start an event loop serving connections to a TCP port with num_threads threads; returns NULL on failure
+event_loop *event_loop_start(uint16_t port, int num_threads, int max_sessions, event_backend backend,
+                             message_handler *handler);
+
+// Stop the event loop threads and close the listening sockets
+void event_loop_stop(event_loop *loop);
+
+// Send a message on an event loop connection
+// Same as send_msg(), except that whatever the socket doesn't take right away is queued and written when it becomes
+// writable, so the calling thread never blocks; must only be called from the connection's thread (in the message
+// handler or in a task posted to that thread); fails if the connection has been closed
+bool conn_send_msg(connection *conn, void *buffer, size_t length);
+
+// Same as conn_send_msg(), but the message ends with a value taken from a separate buffer (like send_msg_value());
+// with epoll, the value is only copied if the socket doesn't take it right away. The value buffer can be reused as
+// soon as the call returns
+bool conn_send_msg_value(connection *conn, void *buffer, size_t length, const void *value, size_t value_sz);
+
+// Post a task to be run by an event loop thread (tasks posted by one thread run in order); can be called from any
+// thread; the task must not be posted again until it has run
+void event_loop_post(event_loop *loop, int thread_index, event_task *task);
+
+// Get the index of the event loop thread that serves a connection (from 0 to num_threads - 1)
+int conn_thread_index(const connection *conn);
+
+// Keep the state of a connection alive (e.g. while another thread handles one of its requests) until the matching
+// conn_release(), even if the connection is closed meanwhile; both must be called from the connection's thread
+void conn_hold(connection *conn);
+void conn_release(connection *conn);
+
+
 // Process management functions
 
 // Wait for a child process to terminate, with a timeout (in seconds)
@@ -117,6 +210,10 @@ bool kill_safe(pid_t *pid, int timeout);
 // Get primary key server id for a key
 int key_server_id(const char key[KEY_SIZE], int num_servers);
 
+// Get the shard (within a server) that a key belongs to; uses different key bytes than key_server_id(), so that
+// the keys of one server are spread evenly across its shards
+int key_shard_id(const char key[KEY_SIZE], int num_shards);
+
 // Get secondary server id for given primary server id
 int secondary_server_id(int server_id, int num_servers);
 
@@ -0,0 +1,442 @@
+// For fallocate()
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "wal.h"
+
+
+// Checksum of a part of a record, continuing from h (0 for the first part): 8 bytes at a time, with an FNV-style
+// multiply and an xorshift; catches torn writes and corruption, not deliberate changes
+static uint64_t checksum(uint64_t h, const void *data, size_t length)
+{
+	const uint64_t prime = 0x100000001b3ULL;
+	const char *p = data;
+
+	h ^= 0xcbf29ce484222325ULL ^ length;
+	for (; length >= sizeof(uint64_t); p += sizeof(uint64_t), length -= sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		h = (h ^ word) * prime;
+		h ^= h >> 29;
+	}
+	for (; length > 0; p++, length--) {
+		h = (h ^ (uint8_t)*p) * prime;
+	}
+	return h ^ (h >> 32);
+}
+
+// Checksum of a record; the header and the value are checksummed separately, since they are not contiguous when the
+// record is appended
+static uint64_t record_checksum(const replication_put *put, const void *value)
+{
+	return checksum(checksum(0, put, sizeof(*put)), value, put->value_sz);
+}
+
+bool wal_replay(const char *path, uint64_t offset, void (*replay_f)(const replication_put *put, void *arg),
+                void *arg, size_t *num_records)
+{
+	assert(path != NULL);
+	assert(replay_f != NULL);
+
+	if (num_records != NULL) {
+		*num_records = 0;
+	}
+
+	int fd = open(path, O_RDWR);
+	if (fd < 0) {
+		if (errno == ENOENT) {
+			return true;
+		}
+		log_perror("open");
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		log_perror("fstat");
+		close(fd);
+		return false;
+	}
+	size_t length = st.st_size;
+	if (offset >= length) {
+		close(fd);
+		return true;
+	}
+
+	// The records are applied straight from the mapped file (which starts on a page boundary)
+	size_t map_offset = offset & ~((uint64_t)sysconf(_SC_PAGESIZE) - 1);
+	char *map = mmap(NULL, length - map_offset, PROT_READ, MAP_PRIVATE, fd, map_offset);
+	if (map == MAP_FAILED) {
+		log_perror("mmap");
+		close(fd);
+		return false;
+	}
+	madvise(map, length - map_offset, MADV_SEQUENTIAL);
+
+	size_t pos = offset;
+	size_t count = 0;
+	while (pos + sizeof(wal_record) <= length) {
+		const wal_record *record = (const wal_record*)(map + (pos - map_offset));
+		size_t value_sz = record->put.value_sz;
+		if ((value_sz > MAX_VALUE_SIZE) || (pos + sizeof(wal_record) + value_sz > length) ||
+		    (record_checksum(&(record->put), record->put.value) != record->checksum))
+		{
+			break;
+		}
+
+		replay_f(&(record->put), arg);
+		pos += sizeof(wal_record) + value_sz;
+		count++;
+	}
+	munmap(map, length - map_offset);
+
+	// Whatever follows the last valid record was being written when the server stopped; new records go after it
+	bool result = true;
+	if (pos < length) {
+		log_write("Write-ahead log %s: dropping %zu bytes of a torn record at the end\n", path, length - pos);
+		if (ftruncate(fd, pos) < 0) {
+			log_perror("ftruncate");
+			result = false;
+		}
+	}
+	close(fd);
+
+	if (num_records != NULL) {
+		*num_records = count;
+	}
+	return result;
+}
+
+
+// Take the waiters of the records up to lsn (all of them if lsn == UINT64_MAX); must be called with the lock held
+static wal_waiter *take_waiters(wal *log, uint64_t lsn)
+{
+	wal_waiter *head = log->waiters_head;
+	wal_waiter *last = NULL;
+	for (wal_waiter *w = head; (w != NULL) && (w->lsn <= lsn); w = w->next) {
+		last = w;
+	}
+	if (last == NULL) {
+		return NULL;
+	}
+
+	log->waiters_head = last->next;
+	if (log->waiters_head == NULL) {
+		log->waiters_tail = NULL;
+	}
+	last->next = NULL;
+	return head;
+}
+
+// Notify a list of waiters; must be called without the lock held (the callbacks may append new records)
+static void notify_waiters(wal_waiter *waiters, op_status status)
+{
+	while (waiters != NULL) {
+		wal_waiter *next = waiters->next;
+		waiters->done(waiters, status);
+		waiters = next;
+	}
+}
+
+// Check if the first waiter can be notified without writing anything; must be called with the lock held
+static bool durable_waiters(wal *log)
+{
+	return (log->waiters_head != NULL) && (log->waiters_head->lsn <= log->synced_lsn);
+}
+
+// Write a buffer to the file and make it durable
+static bool write_durable(int fd, const char *buffer, size_t length)
+{
+	while (length > 0) {
+		ssize_t bytes = write(fd, buffer, length);
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_perror("write");
+			return false;
+		}
+		buffer += bytes;
+		length -= bytes;
+	}
+
+	if (fdatasync(fd) < 0) {
+		log_perror("fdatasync");
+		return false;
+	}
+	return true;
+}
+
+// Writes the queued records, taking all of them at once, and commits them with one sync
+static void *writer_thread_f(void *arg)
+{
+	wal *log = arg;
+
+	// The buffer that was written last, reused as the queue next time
+	char *spare = NULL;
+	size_t spare_size = 0;
+
+	pthread_mutex_lock(&(log->lock));
+	for (;;) {
+		// The records queued before the log is closed are still written
+		while (log->running && (log->queue_len == 0) && !durable_waiters(log)) {
+			pthread_cond_wait(&(log->cond), &(log->lock));
+		}
+		if (log->queue_len == 0) {
+			// Waiters added by wal_notify() for records that are already durable
+			wal_waiter *waiters = take_waiters(log, log->synced_lsn);
+			if (waiters == NULL) {
+				break;
+			}
+			pthread_mutex_unlock(&(log->lock));
+
+			notify_waiters(waiters, SUCCESS);
+			pthread_mutex_lock(&(log->lock));
+			continue;
+		}
+
+		// Swap the buffers; records appended from now on go into the next commit
+		char *records = log->queue;
+		size_t length = log->queue_len;
+		size_t size = log->queue_size;
+		log->queue = spare;
+		log->queue_size = spare_size;
+		log->queue_len = 0;
+		spare = records;
+		spare_size = size;
+		uint64_t last_lsn = log->next_lsn - 1;
+		pthread_cond_broadcast(&(log->cond));
+		pthread_mutex_unlock(&(log->lock));
+
+		bool ok = write_durable(log->fd, records, length);
+
+		pthread_mutex_lock(&(log->lock));
+		if (!ok) {
+			log_write("Write-ahead log failed; PUTs are not logged anymore\n");
+			log->running = false;
+			log->queue_len = 0;
+			wal_waiter *waiters = take_waiters(log, UINT64_MAX);
+			pthread_cond_broadcast(&(log->cond));
+			pthread_mutex_unlock(&(log->lock));
+
+			notify_waiters(waiters, SERVER_FAILURE);
+			pthread_mutex_lock(&(log->lock));
+			break;
+		}
+
+		log->synced_lsn = last_lsn;
+		wal_waiter *waiters = take_waiters(log, last_lsn);
+		pthread_cond_broadcast(&(log->cond));
+		pthread_mutex_unlock(&(log->lock));
+
+		notify_waiters(waiters, SUCCESS);
+		pthread_mutex_lock(&(log->lock));
+	}
+	pthread_mutex_unlock(&(log->lock));
+
+	free(spare);
+	return NULL;
+}
+
+bool wal_open(wal *log, const char *path)
+{
+	assert(log != NULL);
+	assert(path != NULL);
+
+	memset(log, 0, sizeof(*log));
+	log->next_lsn = 1;
+
+	if ((log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+		log_perror("open");
+		return false;
+	}
+	struct stat st;
+	if (fstat(log->fd, &st) < 0) {
+		log_perror("fstat");
+		goto fail_mutex;
+	}
+	log->end_offset = st.st_size;
+
+	if ((errno = pthread_mutex_init(&(log->lock), NULL)) != 0) {
+		perror("pthread_mutex_init");
+		goto fail_mutex;
+	}
+	if ((errno = pthread_cond_init(&(log->cond), NULL)) != 0) {
+		perror("pthread_cond_init");
+		goto fail_cond;
+	}
+
+	log->running = true;
+	if ((errno = pthread_create(&(log->writer), NULL, writer_thread_f, log)) != 0) {
+		perror("pthread_create");
+		goto fail_thread;
+	}
+	return true;
+
+fail_thread:
+	pthread_cond_destroy(&(log->cond));
+fail_cond:
+	pthread_mutex_destroy(&(log->lock));
+fail_mutex:
+	close_safe(&(log->fd));
+	return false;
+}
+
+void wal_close(wal *log)
+{
+	assert(log != NULL);
+
+	pthread_mutex_lock(&(log->lock));
+	log->running = false;
+	pthread_cond_broadcast(&(log->cond));
+	pthread_mutex_unlock(&(log->lock));
+
+	pthread_join(log->writer, NULL);
+
+	// Nothing can be appended anymore, so there are no waiters left (unless writing failed, and they were notified)
+	assert(log->waiters_head == NULL);
+	close_safe(&(log->fd));
+	free(log->queue);
+	log->queue = NULL;
+	pthread_cond_destroy(&(log->cond));
+	pthread_mutex_destroy(&(log->lock));
+}
+
+// Make room for length more bytes in the queue; must be called with the lock held
+static bool reserve_queue(wal *log, size_t length)
+{
+	if (log->queue_len + length <= log->queue_size) {
+		return true;
+	}
+
+	size_t size = (log->queue_size * 2 > log->queue_len + length) ? log->queue_size * 2 : log->queue_len + length;
+	char *queue = realloc(log->queue, size);
+	if (queue == NULL) {
+		perror("realloc");
+		return false;
+	}
+	log->queue = queue;
+	log->queue_size = size;
+	return true;
+}
+
+bool wal_append(wal *log, const char key[KEY_SIZE], const void *value, size_t value_sz, uint64_t version,
+                wal_waiter *waiter)
+{
+	assert(log != NULL);
+	assert(key != NULL);
+	assert(value != NULL);
+	assert(value_sz <= MAX_VALUE_SIZE);
+
+	// The checksum is computed before taking the lock, so that appenders only contend for the copy
+	wal_record record = {0};
+	memcpy(record.put.key, key, KEY_SIZE);
+	record.put.version = version;
+	record.put.value_sz = value_sz;
+	record.checksum = record_checksum(&(record.put), value);
+	size_t record_length = sizeof(record) + value_sz;
+
+	pthread_mutex_lock(&(log->lock));
+	if (!log->running || !reserve_queue(log, record_length)) {
+		pthread_mutex_unlock(&(log->lock));
+		return false;
+	}
+
+	bool was_empty = (log->queue_len == 0);
+	memcpy(log->queue + log->queue_len, &record, sizeof(record));
+	memcpy(log->queue + log->queue_len + sizeof(record), value, value_sz);
+	log->queue_len += record_length;
+	log->end_offset += record_length;
+
+	uint64_t lsn = log->next_lsn++;
+	if (waiter != NULL) {
+		waiter->lsn = lsn;
+		waiter->next = NULL;
+		if (log->waiters_tail != NULL) {
+			log->waiters_tail->next = waiter;
+		} else {
+			log->waiters_head = waiter;
+		}
+		log->waiters_tail = waiter;
+	}
+
+	// Wake the writer up if it is waiting for something to write
+	if (was_empty) {
+		pthread_cond_broadcast(&(log->cond));
+	}
+	pthread_mutex_unlock(&(log->lock));
+	return true;
+}
+
+bool wal_backlogged(wal *log)
+{
+	assert(log != NULL);
+
+	// Only a hint, so the lock isn't taken
+	return __atomic_load_n(&(log->queue_len), __ATOMIC_RELAXED) >= WAL_MAX_QUEUE;
+}
+
+bool wal_notify(wal *log, wal_waiter *waiter)
+{
+	assert(log != NULL);
+	assert(waiter != NULL);
+
+	pthread_mutex_lock(&(log->lock));
+	if (!log->running) {
+		pthread_mutex_unlock(&(log->lock));
+		return false;
+	}
+
+	// Queued behind the waiters of the records appended so far, so that the writer notifies them in order (even if
+	// the records are already durable)
+	waiter->lsn = log->next_lsn - 1;
+	waiter->next = NULL;
+	if (log->waiters_tail != NULL) {
+		log->waiters_tail->next = waiter;
+	} else {
+		log->waiters_head = waiter;
+	}
+	log->waiters_tail = waiter;
+	pthread_cond_broadcast(&(log->cond));
+	pthread_mutex_unlock(&(log->lock));
+	return true;
+}
+
+uint64_t wal_position(wal *log)
+{
+	assert(log != NULL);
+
+	pthread_mutex_lock(&(log->lock));
+	uint64_t offset = log->end_offset;
+	pthread_mutex_unlock(&(log->lock));
+	return offset;
+}
+
+// Only whole file system blocks are freed; the rest of the space is freed by the next call
+bool wal_discard(wal *log, uint64_t offset)
+{
+	assert(log != NULL);
+
+	struct stat st;
+	if (fstat(log->fd, &st) < 0) {
+		log_perror("fstat");
+		return false;
+	}
+	offset -= offset % st.st_blksize;
+	if ((offset > 0) && (fallocate(log->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, offset) < 0)) {
+		log_perror("fallocate");
+		return false;
+	}
+	return true;
+}
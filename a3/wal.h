@@ -0,0 +1,111 @@
+#ifndef _WAL_H_
+#define _WAL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "defs.h"
+
+
+// Write-ahead log: an append-only file of the PUTs applied by a server, replayed on startup to rebuild its key sets.
+// PUTs are numbered in the order they are appended and queued in memory; a separate thread writes all the queued
+// records at once and makes them durable with a single fdatasync(), so the PUTs appended while a sync is in progress
+// are committed together by the next one (group commit). Records are checksummed, so a record torn by a crash in the
+// middle of a write is detected (and cut off) by the replay. Appending never waits (appenders hold key locks); a slow
+// disk is pushed back on by holding back the responses instead (see wal_backlogged() and wal_notify()), so the queue
+// stays about bounded. If writing fails, the waiters fail, and PUTs appended later are not logged.
+
+// Size of the records queued but not yet written (in bytes) above which the log is backlogged
+#define WAL_MAX_QUEUE (64 * 1024 * 1024)
+
+// When the response to a client PUT is sent: without logging it, once it is queued (so only the PUTs of the last
+// group commit or so are lost by a crash), or once it is durable
+typedef enum {
+	WAL_NONE,
+	WAL_ASYNC,
+	WAL_SYNC,
+
+	WAL_DURABILITY_MAX
+} wal_durability;
+
+__attribute__((unused))
+static const char *wal_durability_str[WAL_DURABILITY_MAX] = {
+	"none",
+	"async",
+	"sync",
+};
+
+// Log record: a PUT in the format of the replication stream, with a checksum of the rest of the record
+typedef struct _wal_record {
+	uint64_t checksum;
+	replication_put put;
+} __attribute__((packed)) wal_record;
+
+// Notified when a PUT is durable (or fails); usually embedded into a larger structure
+typedef struct _wal_waiter wal_waiter;
+struct _wal_waiter {
+	wal_waiter *next;
+	uint64_t lsn;
+	// Called from the writer thread; status is SUCCESS or SERVER_FAILURE
+	void (*done)(wal_waiter *waiter, op_status status);
+};
+
+typedef struct _wal {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;// signalled when records are added or become durable, and when the log is closed or fails
+	int fd;
+	bool running;// records are being appended (not closed, and no write failed)
+
+	uint64_t next_lsn;// assigned to the next record
+	uint64_t synced_lsn;// all records up to this one are durable
+	uint64_t end_offset;// in the file, of the next record
+
+	// Records waiting to be written
+	char *queue;
+	size_t queue_len;
+	size_t queue_size;
+
+	// Waiters of the records that are not durable yet, in sequence number order
+	wal_waiter *waiters_head;
+	wal_waiter *waiters_tail;
+
+	pthread_t writer;
+} wal;
+
+
+// Read the log in the given file (if it exists) from the record at offset on, calling replay_f for each PUT in the
+// order they were appended, and cut off a torn record at the end; num_records (if not NULL) gets the number of PUTs
+// replayed. Returns false if the file could not be read
+bool wal_replay(const char *path, uint64_t offset, void (*replay_f)(const replication_put *put, void *arg),
+                void *arg, size_t *num_records);
+
+// Open the log in the given file (creating it if needed) for appending PUTs; returns true on success
+bool wal_open(wal *log, const char *path);
+
+// Write out the PUTs appended so far, and close the log
+void wal_close(wal *log);
+
+// Append a PUT (with the version assigned to it), without waiting even if the log is backlogged; waiter (if not NULL)
+// is notified when it is durable. Returns false if the log is not running (the PUT is not logged, and the waiter is
+// never notified)
+bool wal_append(wal *log, const char key[KEY_SIZE], const void *value, size_t value_sz, uint64_t version,
+                wal_waiter *waiter);
+
+// Returns true if the records waiting to be written exceed WAL_MAX_QUEUE, i.e. the disk is falling behind
+bool wal_backlogged(wal *log);
+
+// Notify waiter once all PUTs appended so far are durable (right away if they already are, but always from the writer
+// thread, after the waiters of those PUTs). Returns false if the log is not running (the waiter is never notified)
+bool wal_notify(wal *log, wal_waiter *waiter);
+
+// Get the offset in the file of the next PUT to be appended (the PUTs appended so far are before it)
+uint64_t wal_position(wal *log);
+
+// Free the disk space of the PUTs before offset (e.g. once a snapshot covers them); the file keeps its length (the
+// space is punched out of it), so that offsets stay valid. Returns false if the file system doesn't support it
+bool wal_discard(wal *log, uint64_t offset);
+
+
+#endif// _WAL_H_